@@ -209,6 +209,39 @@ int mambo_get_thread_id(mambo_context *ctx) {
   return ctx->thread_data->tid;
 }
 
+/* Number of executions of a basic block or of a trace, counted at its entry. The
+   counts are per code cache, they're reset when the fragment is flushed */
+int mambo_get_exec_count(mambo_context *ctx, int fragment_id, uint32_t *count) {
+#ifdef DBM_PROFILE
+  if (ctx->thread_data == NULL) {
+    return MAMBO_INVALID_THREAD;
+  }
+  if (fragment_id < 0 || fragment_id >= TRACE_ID_BASE + TRACE_FRAGMENT_NO * CC_MAX_REGIONS) {
+    return MAMBO_INVALID_FRAGMENT;
+  }
+  *count = ctx->thread_data->cc->profile_count[fragment_id];
+  return MAMBO_SUCCESS;
+#else
+  return MAMBO_NOT_SUPPORTED;
+#endif
+}
+
+// Number of times the side exit at the end of a trace fragment was taken
+int mambo_get_trace_exit_count(mambo_context *ctx, int fragment_id, uint32_t *count) {
+#ifdef DBM_PROFILE
+  if (ctx->thread_data == NULL) {
+    return MAMBO_INVALID_THREAD;
+  }
+  if (fragment_id < TRACE_ID_BASE || fragment_id >= TRACE_ID_BASE + TRACE_FRAGMENT_NO * CC_MAX_REGIONS) {
+    return MAMBO_INVALID_FRAGMENT;
+  }
+  *count = ctx->thread_data->cc->profile_exit_count[fragment_id - TRACE_ID_BASE];
+  return MAMBO_SUCCESS;
+#else
+  return MAMBO_NOT_SUPPORTED;
+#endif
+}
+
 mambo_cond mambo_get_cond(mambo_context *ctx) {
   return ctx->cond;
 }
@@ -83,6 +83,8 @@ enum mambo_plugin_error {
   MAMBO_CB_ALREADY_SET = -2,
   MAMBO_INVALID_CB = -3,
   MAMBO_INVALID_THREAD = -4,
+  MAMBO_INVALID_FRAGMENT = -5,
+  MAMBO_NOT_SUPPORTED = -6,
 };
 
 /* Public functions */
@@ -135,6 +137,10 @@ bool mambo_is_store(mambo_context *ctx);
 bool mambo_is_load_or_store(mambo_context *ctx);
 int mambo_get_ld_st_size(mambo_context *ctx);
 
+/* Execution counts, DBM_PROFILE only */
+int mambo_get_exec_count(mambo_context *ctx, int fragment_id, uint32_t *count);
+int mambo_get_trace_exit_count(mambo_context *ctx, int fragment_id, uint32_t *count);
+
 mambo_branch_type mambo_get_branch_type(mambo_context *ctx);
 
 #endif
@@ -20,12 +20,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <pthread.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 #include "dbm.h"
 #include "common.h"
@@ -40,23 +42,40 @@
 
 /* Hash table */
 
-// Breaks linear probing, don't use
-void hash_delete(hash_table *table, uintptr_t key) {
-  assert(false);
+/* Backward-shift deletion: the following entries of the probe run are moved
+   into the hole if their home slot is at or before it, so no lookup can stop
+   early at an empty slot. The table doesn't wrap around, so the run ends at
+   the first empty slot, at the latest at the reserved last one. Each moved
+   entry is written to its new slot before its old slot is cleared. */
+bool hash_delete(hash_table *table, uintptr_t key) {
   int index = GET_INDEX(key);
-  int end = index - 1;
-  bool found = false;
+  int hole;
   uintptr_t c_key;
-  
-  do {
-    c_key = table->entries[index].key;
-    if (c_key == key) {
-      table->entries[index].key = 0;
-      found = true;
-    } else {
-      index = (index + 1) & table->size;
+
+  while (HASH_KEY(table, index) != key) {
+    if (HASH_KEY(table, index) == 0 || index >= (table->size - 1)) {
+      return false;
+    }
+    index++;
+  }
+
+  HASH_KEY(table, index) = 0;
+  table->count--;
+
+  hole = index;
+  for (index = hole + 1; index < (table->size - 1); index++) {
+    c_key = HASH_KEY(table, index);
+    if (c_key == 0) break;
+    if (GET_INDEX(c_key) <= hole) {
+      HASH_VALUE(table, hole) = HASH_VALUE(table, index);
+      __sync_synchronize();
+      HASH_KEY(table, hole) = c_key;
+      HASH_KEY(table, index) = 0;
+      hole = index;
     }
-  } while(!found && index != end && c_key != 0);
+  }
+
+  return true;
 }
 
 /* To simplify the inline hash lookup code, we avoid looping around for linear probing.
@@ -69,9 +88,9 @@ uintptr_t hash_lookup(hash_table *table, uintptr_t key) {
   uintptr_t c_key;
   
   do {
-    c_key = table->entries[index].key;
+    c_key = HASH_KEY(table, index);
     if (c_key == key) {
-      entry = table->entries[index].value;
+      entry = HASH_VALUE(table, index);
       found = true;
     } else {
       index++;
@@ -81,40 +100,166 @@ uintptr_t hash_lookup(hash_table *table, uintptr_t key) {
   return entry;
 }
 
-bool hash_add(hash_table *table, uintptr_t key, uintptr_t value) {
+static hash_storage *hash_alloc_entries(int size) {
+  hash_storage *entries = dbm_mmap(DBM_MAP_HASH, NULL, HASH_MEM_SIZE(size),
+                                   PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS);
+  if (entries == MAP_FAILED) {
+    fprintf(stderr, "Hash table allocation failed\n");
+    while(1);
+  }
+  return entries;
+}
+
+static void hash_free_entries(hash_storage *entries, int size) {
+  if (entries != NULL) {
+    int ret = munmap(entries, METADATA_SZ_ROUND(HASH_MEM_SIZE(size)));
+    assert(ret == 0);
+  }
+}
+
+/* The replaced array can still be in use by a lookup interrupted by a signal,
+   so it's only unmapped on the next resize */
+static void hash_retire_entries(hash_table *table) {
+  hash_free_entries(table->old_entries, table->old_size);
+  table->old_entries = table->entries;
+  table->old_size = table->size;
+}
+
+// Returns false if the probe sequence runs into the end of the table
+static bool hash_insert(hash_table *table, uintptr_t key, uintptr_t value) {
   int index = GET_INDEX(key);
-  int prev_index;
-  bool done = false;
-  
+
+  while (HASH_KEY(table, index) != 0 && HASH_KEY(table, index) != key) {
+    index++;
+    if (index >= table->size - 1) {
+      return false;
+    }
+    table->collisions++;
+  }
+
+  if (HASH_KEY(table, index) == 0) {
+    table->count++;
+  }
+  // Lookups from the code cache don't take any locks, publish the key last
+  HASH_VALUE(table, index) = value;
+  __sync_synchronize();
+  HASH_KEY(table, index) = key;
+
+  return true;
+}
+
+/* Rehashes all entries into a table with at least twice as many slots. The new
+   array is fully populated before it's published, entries first: the old mask
+   is always a valid index in the larger array. The lookups in the code cache and
+   in the dispatcher load the mask first, and the address of the entries load
+   depends on it, so the new mask is never used with the old array. */
+static void hash_grow(hash_table *table) {
+  hash_table new_table;
+  uintptr_t mask = table->mask;
+  bool done;
+
   do {
-    if (table->entries[index].key == 0 || table->entries[index].key == key) {
-      if (table->entries[index].key == 0) {
-        table->count++;
-      }
-      table->entries[index].key = key;
-      table->entries[index].value = value;
-      done = true;
-    } else {
-      prev_index = index;
-      index++;
-      if (index >= table->size -1) {
-        fprintf(stderr, "Hash table index overflow\n");
-        while(1);
+    mask = (mask << 1) | 1;
+    new_table.mask = mask;
+    new_table.size = HASH_SIZE(mask);
+    new_table.collisions = 0;
+    new_table.count = 0;
+    new_table.entries = hash_alloc_entries(new_table.size);
+
+    done = true;
+    for (int i = 0; i < table->size && done; i++) {
+      if (HASH_KEY(table, i) != 0) {
+        done = hash_insert(&new_table, HASH_KEY(table, i), HASH_VALUE(table, i));
       }
-      table->collisions++;
     }
-  } while(!done && index < (table->size - 1));
-  
-  return done;
+    if (!done) {
+      hash_free_entries(new_table.entries, new_table.size);
+    }
+  } while (!done);
+
+  debug("Hash table %p grown to %d entries\n", table, new_table.size);
+
+  hash_retire_entries(table);
+  table->entries = new_table.entries;
+  __sync_synchronize();
+  table->mask = new_table.mask;
+  table->size = new_table.size;
+  table->collisions = new_table.collisions;
+  table->count = new_table.count;
+}
+
+bool hash_add(hash_table *table, uintptr_t key, uintptr_t value) {
+  if ((table->count + 1) * CODE_CACHE_HASH_LOAD > HASH_SLOTS(table->mask)) {
+    hash_grow(table);
+  }
+  while (!hash_insert(table, key, value)) {
+    hash_grow(table);
+  }
+
+  return true;
+}
+
+/* Removes all entries with values in [start, end), then reinserts the remaining
+   entries which might have become unreachable by linear probing */
+void hash_delete_range(hash_table *table, uintptr_t start, uintptr_t end) {
+  uintptr_t key, value;
+
+  for (int i = 0; i < table->size; i++) {
+    if (HASH_KEY(table, i) != 0 &&
+        HASH_VALUE(table, i) >= start && HASH_VALUE(table, i) < end) {
+      HASH_KEY(table, i) = 0;
+      table->count--;
+    }
+  }
+
+  /* An entry can always be reinserted at or before its current slot,
+     so this never needs to grow the table */
+  for (int i = 0; i < table->size; i++) {
+    key = HASH_KEY(table, i);
+    if (key != 0 && GET_INDEX(key) != i) {
+      value = HASH_VALUE(table, i);
+      HASH_KEY(table, i) = 0;
+      table->count--;
+      bool ret = hash_insert(table, key, value);
+      assert(ret);
+    }
+  }
 }
 
+/* size includes the CODE_CACHE_HASH_OVERP overprovisioned slots. The entries
+   array is reused if it already has the requested size. */
 void hash_init(hash_table *table, int size) {
+  assert(size > CODE_CACHE_HASH_OVERP);
+  uintptr_t mask = size - CODE_CACHE_HASH_OVERP;
+  assert((mask & (mask + 1)) == 0);
+#ifdef DBM_HASH_BUCKETS
+  // Allocate the same amount of memory as for hash_entry slots
+  mask = (mask + 1) / HASH_BUCKET_SLOTS - 1;
+  size = HASH_SIZE(mask);
+#endif
+
+  if (table->entries == NULL || table->size != size) {
+    if (table->entries != NULL) {
+      hash_retire_entries(table);
+    }
+    table->entries = hash_alloc_entries(size);
+  } else {
+    for (int i = size-1; i >= 0; i--) {
+      HASH_KEY(table, i) = 0;
+    }
+  }
+
+  table->mask = mask;
   table->size = size;
   table->collisions = 0;
   table->count = 0;
-  for (int i = size-1; i >= 0; i--) {
-    table->entries[i].key = 0;
-  }
+}
+
+void hash_free(hash_table *table) {
+  hash_free_entries(table->entries, table->size);
+  hash_free_entries(table->old_entries, table->old_size);
+  table->entries = NULL;
+  table->old_entries = NULL;
 }
 
 
@@ -122,68 +267,148 @@ void hash_init(hash_table *table, int size) {
 void linked_list_init(ll *list, int size) {
   assert(size >= 1);
   list->size = size;
-  list->free_list = &list->pool[0];
-  
-  for (int i = 0; i < size-1; i++) {
-    list->pool[i].next = &list->pool[i+1];
-  }
-  
-  list->pool[size-1].next = NULL;
+  list->used = 0;
+  list->free_list = NULL;
 }
 
 ll_entry *linked_list_alloc(ll *list) {
-  if (list->free_list == NULL) return NULL;
-  
   ll_entry *entry = list->free_list;
-  list->free_list = entry->next;
+
+  if (entry != NULL) {
+    list->free_list = entry->next;
+  } else if (list->used < list->size) {
+    entry = &list->pool[list->used++];
+  } else {
+    return NULL;
+  }
   entry->next = NULL;
   
   return entry;
 }
 
+void linked_list_free(ll *list, ll_entry *entry) {
+  entry->next = list->free_list;
+  list->free_list = entry;
+}
+
 /* Interval map */
 /* Private interval_map functions; obtain lock before calling */
 void interval_map_print(interval_map *imap) {
+  interval_map_array *array = imap->array;
   fprintf(stderr, "imap %p:\n", imap);
-  for (ssize_t i = 0; i < imap->entry_count; i++) {
+  for (ssize_t i = 0; i < array->count; i++) {
     fprintf(stderr, "  %"PRIxPTR" - %"PRIxPTR"\n",
-            imap->entries[i].start, imap->entries[i].end);
+            array->entries[i].start, array->entries[i].end);
   }
 }
 
-int interval_map_delete_entry(interval_map *imap, ssize_t index) {
-  if (index < 0 || index >= imap->entry_count) {
-    return -1;
+static interval_map_array *interval_map_alloc(ssize_t size) {
+  interval_map_array *array = malloc(sizeof(interval_map_array) + sizeof(interval_map_entry) * size);
+  if (array != NULL) {
+    array->size = size;
+    array->count = 0;
+    array->retired = NULL;
   }
+  return array;
+}
+
+// Index of the first entry which ends after addr, or count
+static ssize_t interval_map_lower_bound(interval_map_array *array, ssize_t count, uintptr_t addr) {
+  ssize_t low = 0, high = count;
 
-  if (imap->entry_count >= 2) {
-    imap->entries[index] = imap->entries[imap->entry_count - 1];
+  while (low < high) {
+    ssize_t mid = low + (high - low) / 2;
+    if (array->entries[mid].end > addr) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
   }
-  imap->entry_count--;
-  return 0;
+
+  return low;
 }
 
-int interval_map_add_entry(interval_map *imap, uintptr_t start, uintptr_t end) {
-  if (imap->entry_count >= imap->mem_size || start >= end) {
-    return -1;
+/* The arrays replaced by interval_map_replace could still be read by
+   interval_map_search. The store of the new array and the load of readers are
+   ordered by a barrier, as are the increment of readers and the load of the
+   array in the search, so any search which starts after the check below reads
+   the new array. Each array is twice the size of the previous one, so the ones
+   kept while searches are in progress use less memory than the current one. */
+static void interval_map_free_retired(interval_map *imap) {
+  __sync_synchronize();
+  if (imap->readers != 0) return;
+
+  while (imap->retired != NULL) {
+    interval_map_array *array = imap->retired;
+    imap->retired = array->retired;
+    free(array);
   }
-  ssize_t index = imap->entry_count++;
+}
+
+/* Replaces the entries [first, last) with new_count entries. If the array is
+   full, it's copied to one twice as large and the old one is retired. */
+static int interval_map_replace(interval_map *imap, ssize_t first, ssize_t last,
+                                interval_map_entry *entries, ssize_t new_count) {
+  interval_map_array *array = imap->array;
+  ssize_t count = array->count + new_count - (last - first);
+
+  if (count > array->size) {
+    interval_map_array *grown = interval_map_alloc(array->size * 2);
+    if (grown == NULL) return -1;
+
+    for (ssize_t i = 0; i < first; i++) {
+      grown->entries[i] = array->entries[i];
+    }
+    for (ssize_t i = last; i < array->count; i++) {
+      grown->entries[i + count - array->count] = array->entries[i];
+    }
+    array->retired = imap->retired;
+    imap->retired = array;
+    array = grown;
+  } else {
+    memmove(&array->entries[first + new_count], &array->entries[last],
+            sizeof(interval_map_entry) * (array->count - last));
+  }
+
+  for (ssize_t i = 0; i < new_count; i++) {
+    array->entries[first + i] = entries[i];
+  }
+  array->count = count;
+
+  __sync_synchronize();
+  imap->array = array;
+  interval_map_free_retired(imap);
+
+  return 0;
+}
 
-  imap->entries[index].start = start;
-  imap->entries[index].end = end;
+// Writers make the sequence number odd while they're modifying the map
+static int interval_map_lock(interval_map *imap) {
+  int ret = pthread_mutex_lock(&imap->mutex);
+  if (ret != 0) return -1;
+  imap->seq++;
+  __sync_synchronize();
+  return 0;
+}
 
+static int interval_map_unlock(interval_map *imap) {
+  __sync_synchronize();
+  imap->seq++;
+  int ret = pthread_mutex_unlock(&imap->mutex);
+  if (ret != 0) return -1;
   return 0;
 }
 
 /* Public interval_map functions */
 int interval_map_init(interval_map *imap, ssize_t size) {
   assert(size > 0);
-  interval_map_entry *entries = malloc(sizeof(interval_map_entry) * size);
-  if (entries == NULL) return -1;
+  interval_map_array *array = interval_map_alloc(size);
+  if (array == NULL) return -1;
 
-  imap->mem_size = size;
-  imap->entry_count = 0;
-  imap->entries = entries;
+  imap->array = array;
+  imap->seq = 0;
+  imap->readers = 0;
+  imap->retired = NULL;
   int ret = pthread_mutex_init(&imap->mutex, NULL);
   if (ret != 0 && ret != EBUSY) {
     return -1;
@@ -192,96 +417,101 @@ int interval_map_init(interval_map *imap, ssize_t size) {
   return 0;
 }
 
+// Overlapping and adjacent entries are merged
 int interval_map_add(interval_map *imap, uintptr_t start, uintptr_t end) {
+  interval_map_array *array;
+  interval_map_entry entry;
+  ssize_t first, last;
   int ret;
-  ssize_t overlap_ind = -1;
 
   if (start >= end) return -1;
 
-  ret = pthread_mutex_lock(&imap->mutex);
+  ret = interval_map_lock(imap);
   if (ret != 0) return -1;
 
-  // Check for overlapping regions
-  for (ssize_t i = imap->entry_count -1; i >= 0; i--) {
-    if ((start < imap->entries[i].end) && (end > imap->entries[i].start)) {
-      if (overlap_ind == -1) {
-        overlap_ind = i;
-      } else {
-        start = min(imap->entries[i].start, start);
-        end = max(imap->entries[i].end, end);
-        ret = interval_map_delete_entry(imap, i);
-        assert(ret == 0);
-      }
-      imap->entries[overlap_ind].start = min(imap->entries[overlap_ind].start, start);
-      imap->entries[overlap_ind].end = max(imap->entries[overlap_ind].end, end);
-    }
+  array = imap->array;
+  first = interval_map_lower_bound(array, array->count, start);
+  if (first > 0 && array->entries[first - 1].end == start) {
+    first--;
   }
-
-  // No overlapping region found
-  if (overlap_ind == -1) {
-    ret = interval_map_add_entry(imap, start, end);
-    assert(ret == 0);
+  entry.start = start;
+  entry.end = end;
+  for (last = first; last < array->count && array->entries[last].start <= end; last++) {
+    entry.start = min(entry.start, array->entries[last].start);
+    entry.end = max(entry.end, array->entries[last].end);
   }
+  ret = interval_map_replace(imap, first, last, &entry, 1);
+  assert(ret == 0);
 
 #ifdef DEBUG
   fprintf(stderr, "imap added: %"PRIxPTR" %"PRIxPTR"\n", start, end);
   interval_map_print(imap);
 #endif
 
-  ret = pthread_mutex_unlock(&imap->mutex);
-  if (ret != 0) return -1;
-
-  return 0;
+  return interval_map_unlock(imap);
 }
 
+/* Returns the number of entries overlapping [start, end). Doesn't take the lock,
+   the search is repeated if the map was modified in the meantime. readers keeps
+   the arrays it could be reading from being freed. */
 ssize_t interval_map_search(interval_map *imap, uintptr_t start, uintptr_t end) {
-  int ret;
-  ssize_t status = 0;
+  interval_map_array *array;
+  ssize_t status, count, i;
+  uint32_t seq;
 
   if (start >= end) return -1;
 
-  ret = pthread_mutex_lock(&imap->mutex);
-  if (ret != 0) return -1;
-
-  for (ssize_t i = imap->entry_count - 1; i >= 0; i--) {
-    if ((start < imap->entries[i].end) && (end > imap->entries[i].start)) {
+  __sync_fetch_and_add(&imap->readers, 1);
+  do {
+    seq = imap->seq;
+    __sync_synchronize();
+    array = imap->array;
+    count = min(array->count, array->size);
+
+    status = 0;
+    for (i = interval_map_lower_bound(array, count, start);
+         i < count && array->entries[i].start < end; i++) {
       status++;
     }
-  }
-
-  ret = pthread_mutex_unlock(&imap->mutex);
-  if (ret != 0) return -1;
+    __sync_synchronize();
+  } while ((seq & 1) || imap->seq != seq);
+  __sync_fetch_and_sub(&imap->readers, 1);
 
   return status;
 }
 
 ssize_t interval_map_delete(interval_map *imap, uintptr_t start, uintptr_t end) {
-  ssize_t status = 0;
+  interval_map_array *array;
+  interval_map_entry remainder[2];
+  ssize_t status = 0, first, last;
+  int count = 0;
 
   if (start >= end) return -1;
 
-  int ret = pthread_mutex_lock(&imap->mutex);
+  int ret = interval_map_lock(imap);
   if (ret != 0) return -1;
 
-  for (ssize_t i = imap->entry_count - 1; i >= 0; i--) {
-    if ((start < imap->entries[i].end) && (end > imap->entries[i].start)) {
-      status++;
+  array = imap->array;
+  first = interval_map_lower_bound(array, array->count, start);
+  for (last = first; last < array->count && array->entries[last].start < end; last++) {
+    status++;
+  }
 
-      if (start <= imap->entries[i].start && end >= imap->entries[i].end) {
-        ret = interval_map_delete_entry(imap, i);
-        assert(ret == 0);
-      } else if (start == imap->entries[i].start && end < imap->entries[i].end) {
-        imap->entries[i].start = end;
-      } else if (end == imap->entries[i].end && start > imap->entries[i].start) {
-        imap->entries[i].end = start;
-      } else {
-        uintptr_t tmp = imap->entries[i].end;
-        imap->entries[i].end = start;
-        ret = interval_map_add_entry(imap, end, tmp);
-        assert(ret == 0);
-      }
-    } // if hit
-  } // for
+  if (status > 0) {
+    // The first and last overlapping entries can extend beyond [start, end)
+    if (array->entries[first].start < start) {
+      remainder[count].start = array->entries[first].start;
+      remainder[count].end = start;
+      count++;
+    }
+    if (array->entries[last - 1].end > end) {
+      remainder[count].start = end;
+      remainder[count].end = array->entries[last - 1].end;
+      count++;
+    }
+    ret = interval_map_replace(imap, first, last, remainder, count);
+    assert(ret == 0);
+  }
 
 #ifdef DEBUG
   if (status > 0) {
@@ -290,7 +520,7 @@ ssize_t interval_map_delete(interval_map *imap, uintptr_t start, uintptr_t end)
   }
 #endif
 
-  ret = pthread_mutex_unlock(&imap->mutex);
+  ret = interval_map_unlock(imap);
   if (ret != 0) return -1;
 
   return status;
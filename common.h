@@ -23,26 +23,87 @@
 
 #include <stdlib.h>
 
-#define CODE_CACHE_HASH_SIZE 0x7FFFF//14071
+#define CODE_CACHE_HASH_SIZE 0xFFFF
 #define CODE_CACHE_HASH_OVERP 10
+// The table is grown once more than 1/CODE_CACHE_HASH_LOAD of the slots are in use
+#define CODE_CACHE_HASH_LOAD 2
 
-/* Warning, size MUST be (a power of 2) */
-#ifdef __arm__
-#define GET_INDEX(key) ((key) & (table->size - CODE_CACHE_HASH_OVERP))
-#endif
-#ifdef __aarch64__
-#define GET_INDEX(key) ((key >> 2) & (table->size - CODE_CACHE_HASH_OVERP))
-#endif
 typedef struct {
   uintptr_t key;
   uintptr_t value;
 } hash_entry;
 
+#ifdef DBM_HASH_BUCKETS
+/* The table is an array of cache line sized buckets, each holding HASH_BUCKET_SLOTS
+   keys followed by their values. The mask selects the home bucket of a key. The last
+   key of each bucket is always 0, so the generated lookups only scan the home bucket
+   and stop at its end without a bounds check. Keys which don't fit in their home
+   bucket are stored in the following buckets and are only found by hash_lookup.
+
+   Slot i is the (i % HASH_BUCKET_KEYS)-th key of bucket i / HASH_BUCKET_KEYS, so the
+   C functions see the keys as a single linearly probed array.
+
+   At the same load factor, this uses about twice the memory of hash_entry pairs and
+   about 2.5% of the hits miss their home bucket and go through the dispatcher. In
+   the memory of the linear table, about 13% miss it, see test/hash_bench.c. */
+#define HASH_BUCKET_SIZE 64
+#define HASH_BUCKET_SLOTS (HASH_BUCKET_SIZE / (2 * sizeof(uintptr_t)))
+#define HASH_BUCKET_KEYS (HASH_BUCKET_SLOTS - 1)
+typedef struct {
+  uintptr_t keys[HASH_BUCKET_SLOTS];
+  uintptr_t values[HASH_BUCKET_SLOTS];
+} hash_bucket;
+typedef hash_bucket hash_storage;
+
+#define GET_INDEX(key) ((((key) >> 2) & table->mask) * HASH_BUCKET_KEYS)
+#define HASH_KEY(table, i) ((table)->entries[(i) / HASH_BUCKET_KEYS].keys[(i) % HASH_BUCKET_KEYS])
+#define HASH_VALUE(table, i) ((table)->entries[(i) / HASH_BUCKET_KEYS].values[(i) % HASH_BUCKET_KEYS])
+// Number of home slots of a table with the given mask
+#define HASH_SLOTS(mask) (((mask) + 1) * HASH_BUCKET_KEYS)
+#define HASH_MEM_SIZE(size) ((size) / HASH_BUCKET_KEYS * sizeof(hash_bucket))
+
+/* Parameters of the generated lookups: the home bucket of key is at
+   entries + (((key >> HASH_INDEX_SHIFT) & mask) << HASH_SCALE_SHIFT), consecutive
+   keys are HASH_KEY_STRIDE bytes apart and values are HASH_VALUE_OFFSET bytes
+   after their key */
+#define HASH_INDEX_SHIFT 2
+#define HASH_SCALE_SHIFT 6
+#define HASH_KEY_STRIDE sizeof(uintptr_t)
+#define HASH_VALUE_OFFSET (HASH_BUCKET_SLOTS * sizeof(uintptr_t))
+#else
+/* Warning, the mask MUST be (a power of 2) - 1 */
+#ifdef __arm__
+#define GET_INDEX(key) ((key) & table->mask)
+#define HASH_INDEX_SHIFT 0
+#define HASH_SCALE_SHIFT 3
+#endif
+#ifdef __aarch64__
+#define GET_INDEX(key) ((key >> 2) & table->mask)
+#define HASH_INDEX_SHIFT 2
+#define HASH_SCALE_SHIFT 4
+#endif
+typedef hash_entry hash_storage;
+
+#define HASH_KEY(table, i) ((table)->entries[i].key)
+#define HASH_VALUE(table, i) ((table)->entries[i].value)
+#define HASH_SLOTS(mask) ((mask) + 1)
+#define HASH_MEM_SIZE(size) ((size) * sizeof(hash_entry))
+
+#define HASH_KEY_STRIDE sizeof(hash_entry)
+#define HASH_VALUE_OFFSET sizeof(uintptr_t)
+#endif
+// Including the overprovisioned slots
+#define HASH_SIZE(mask) HASH_SLOTS((mask) + CODE_CACHE_HASH_OVERP)
+
+/* entries and mask are read by the inline hash lookup, keep them first */
 typedef struct {
+  hash_storage *entries;
+  uintptr_t mask;
   int size;
   int collisions;
   int count;
-  hash_entry entries[CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP];
+  hash_storage *old_entries;
+  int old_size;
 } hash_table;
 
 struct ll_entry_s {
@@ -51,9 +112,12 @@ struct ll_entry_s {
 };
 typedef struct ll_entry_s ll_entry;
 
+/* Entries in pool[used, size) have never been allocated; the pool is handed
+   out lazily so that its pages are only touched when needed */
 typedef struct {
   ll_entry *free_list;
   int size;
+  int used;
   ll_entry pool[];
 } ll;
 
@@ -62,25 +126,41 @@ typedef struct {
   uintptr_t end;
 } interval_map_entry;
 
+typedef struct interval_map_array_s {
+  ssize_t size;
+  ssize_t count;
+  // The next older replaced array which hasn't been freed yet
+  struct interval_map_array_s *retired;
+  interval_map_entry entries[];
+} interval_map_array;
+
+/* The entries are sorted, disjoint and not adjacent. Writers hold the mutex and
+   update the array in place, or replace it with a larger copy when it's full.
+   Readers don't take the lock and retry if seq was odd or has changed. The
+   replaced arrays are freed once no search is in progress, see readers. */
 typedef struct {
-  ssize_t mem_size;
-  ssize_t entry_count;
+  interval_map_array *volatile array;
+  volatile uint32_t seq;
+  volatile uint32_t readers;
+  interval_map_array *retired;
   pthread_mutex_t mutex;
-  interval_map_entry *entries;
 } interval_map;
 
 bool hash_add(hash_table *table, uintptr_t key, uintptr_t value);
-void hash_delete(hash_table *table, uintptr_t key);
+bool hash_delete(hash_table *table, uintptr_t key);
+void hash_delete_range(hash_table *table, uintptr_t start, uintptr_t end);
 uintptr_t hash_lookup(hash_table *table, uintptr_t key);
 void hash_init(hash_table *table, int size);
+void hash_free(hash_table *table);
 
 void linked_list_init(ll *list, int size);
 ll_entry *linked_list_alloc(ll *list);
+void linked_list_free(ll *list, ll_entry *entry);
 
 int interval_map_init(interval_map *imap, ssize_t size);
-int interval_map_add(interval_map *imap, uintptr_t start, size_t len);
-ssize_t interval_map_search(interval_map *imap, uintptr_t start, size_t len);
-ssize_t interval_map_delete(interval_map *imap, uintptr_t start, size_t len);
+int interval_map_add(interval_map *imap, uintptr_t start, uintptr_t end);
+ssize_t interval_map_search(interval_map *imap, uintptr_t start, uintptr_t end);
+ssize_t interval_map_delete(interval_map *imap, uintptr_t start, uintptr_t end);
 
 uint32_t next_reg_in_list(uint32_t reglist, uint32_t start);
 uint32_t last_reg_in_list(uint32_t reglist, uint32_t start);
@@ -20,10 +20,13 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <time.h>
 #include <asm/unistd.h>
 #include <pthread.h>
 
@@ -35,6 +38,7 @@
 #include "dbm.h"
 #include "common.h"
 #include "scanner_common.h"
+#include "util.h"
 
 #include "elf_loader/elf_loader.h"
 
@@ -64,33 +68,788 @@
 #define dispatcher_wrapper_offset     ((uintptr_t)dispatcher_trampoline - (uintptr_t)&start_of_dispatcher_s)
 #define syscall_wrapper_offset        ((uintptr_t)syscall_wrapper - (uintptr_t)&start_of_dispatcher_s)
 #define trace_head_incr_offset        ((uintptr_t)trace_head_incr - (uintptr_t)&start_of_dispatcher_s)
+#define th_tp_offset_offset           ((uintptr_t)&th_tp_offset - (uintptr_t)&start_of_dispatcher_s)
+#define disp_fast_data_offset         ((uintptr_t)&disp_fast_data - (uintptr_t)&start_of_dispatcher_s)
 
 dbm_global global_data;
 __thread dbm_thread *current_thread;
 
-void flush_code_cache(dbm_thread *thread_data) {
+#ifdef DBM_SHARED_CC
+static uintptr_t read_thread_pointer() {
+  uintptr_t tp;
+#ifdef __arm__
+  __asm__ volatile("mrc p15, 0, %0, c13, c0, 3" : "=r" (tp));
+#elif __aarch64__
+  __asm__ volatile("mrs %0, tpidr_el0" : "=r" (tp));
+#endif
+  return tp;
+}
+
+/* The offset of current_thread from MAMBO's thread pointer, which is the same
+   in all threads. The TLS of the application is emulated, so the thread pointer
+   register is never changed by translated code. */
+uintptr_t current_thread_tp_offset() {
+  return (uintptr_t)&current_thread - read_thread_pointer();
+}
+#endif
+
+void install_trampolines(dbm_thread *thread_data, dbm_code_cache *region) {
+  dbm_thread **dispatcher_thread_data;
+
+  // Copy the trampolines to the start of the region
+  memcpy(&region->blocks[0], &start_of_dispatcher_s, trampolines_size_bytes);
+
+  dispatcher_thread_data = (dbm_thread **)((uintptr_t)&region->blocks[0]
+                                           + dispatcher_thread_data_offset);
+  uint32_t **dispatcher_is_pending = (uint32_t **)((uintptr_t)&region->blocks[0]
+                                           + th_is_pending_ptr_offset);
+#ifdef DBM_SHARED_CC
+  /* The trampolines are used by all threads, they find the dbm_thread
+     structure through the thread pointer */
+  *dispatcher_thread_data = NULL;
+  *(uintptr_t *)((uintptr_t)&region->blocks[0] + th_tp_offset_offset) = current_thread_tp_offset();
+  *dispatcher_is_pending = (uint32_t *)offsetof(dbm_thread, is_signal_pending);
+#else
+  *dispatcher_thread_data = thread_data;
+  *dispatcher_is_pending = &thread_data->is_signal_pending;
+#endif
+
+#ifdef DBM_FAST_DISPATCH
+  // Used by dispatcher_trampoline to look up the target without calling into C
+  uintptr_t *fast_data = (uintptr_t *)((uintptr_t)&region->blocks[0] + disp_fast_data_offset);
+  fast_data[0] = (uintptr_t)&thread_data->cc->entry_address;
+  fast_data[1] = (uintptr_t)&thread_data->cc->code_cache_meta[0].no_linking;
+  fast_data[2] = sizeof(dbm_code_cache_meta);
+  fast_data[3] = (uintptr_t)&thread_data->cc->cc_evict_pending;
+#ifdef DBM_SHARED_CC
+  // Nothing is queued for shared code caches, see cc_check_invalidations
+  fast_data[4] = (uintptr_t)&global_data.inval_epoch;
+#else
+  fast_data[4] = (uintptr_t)&thread_data->inval_epoch;
+#endif
+  fast_data[5] = (uintptr_t)&global_data.inval_epoch;
+#endif
+
+  debug("*thread_data in dispatcher at: %p\n", dispatcher_thread_data);
+
+#ifdef DBM_TRACES
+  #ifdef __arm__
+  uint16_t *write_p = (uint16_t *)((uintptr_t)region + trace_head_incr_offset + 4 - 1);
+  copy_to_reg_32bit(&write_p, r1, (uint32_t)thread_data->cc->exec_count);
+  #endif
+  #ifdef __aarch64__
+  uint32_t *write_p = (uint32_t *)((uintptr_t)region + trace_head_incr_offset + 4);
+  a64_copy_to_reg_64bits(&write_p, x2, (uintptr_t)thread_data->cc->exec_count);
+  #endif
+#endif // DBM_TRACES
+
+  __clear_cache((char *)&region->blocks[0], (char *)&region->blocks[trampolines_size_bbs]);
+}
+
+#ifdef DBM_TRACES
+void cc_select_trace_region(dbm_thread *thread_data, int region) {
+  thread_data->cc->trace_cache_next = thread_data->cc->code_cache[region].traces;
+  thread_data->cc->trace_id = TRACE_ID_BASE + region * TRACE_FRAGMENT_NO;
+  thread_data->active_trace.id = thread_data->cc->trace_id;
+  thread_data->cc->cc_regions[region].trace_id = thread_data->cc->trace_id;
+}
+#endif
+
+/* Makes region the target of new allocations, mapping it if it hasn't been used yet */
+void cc_select_region(dbm_thread *thread_data, int region) {
+  dbm_code_cache *cc = &thread_data->cc->code_cache[region];
+  assert(region >= 0 && region < CC_MAX_REGIONS);
+
+  if (region >= thread_data->cc->cc_region_count) {
+    assert(region == thread_data->cc->cc_region_count);
+    void *map = dbm_mmap(DBM_MAP_CODE_CACHE, cc, sizeof(dbm_code_cache), PROT_EXEC | PROT_READ | PROT_WRITE,
+                         CC_MMAP_OPTS | MAP_FIXED);
+    if (map != cc) {
+      fprintf(stderr, "Allocating code cache region %d failed\n", region);
+      while(1);
+    }
+    install_trampolines(thread_data, cc);
+    thread_data->cc->cc_region_count++;
+    info("Code cache region %d: %p\n", region, cc);
+  }
+
+  thread_data->cc->cc_regions[thread_data->cc->cc_region].free_block = thread_data->cc->free_block;
+  thread_data->cc->cc_regions[thread_data->cc->cc_region].bb_cache_next = thread_data->cc->bb_cache_next;
+  thread_data->cc->cc_region = region;
+  thread_data->cc->free_block = bb_id_first(region);
+  thread_data->cc->bb_cache_next = (uint8_t *)&cc->blocks[trampolines_size_bbs];
+  thread_data->cc->cc_regions[region].trace_id = TRACE_ID_BASE + region * TRACE_FRAGMENT_NO;
+#ifdef __arm__
+  thread_data->cc->cc_regions[region].veneer_next = trace_cache_end(cc);
+  for (int i = 0; i < CC_VENEER_CACHE; i++) {
+    thread_data->cc->cc_regions[region].veneers[i] = 0;
+  }
+#endif
+#ifdef DBM_COMPACT_EXITS
+  thread_data->cc->cc_regions[region].stub_next = (uint8_t *)&cc->blocks[CODE_CACHE_SIZE];
+#endif
+
+  /* The fragment metadata is initialised by allocate_bb() and scan_trace(),
+     so that the pages of unused ids are never touched */
+
+#ifdef DBM_TRACES
+  /* A trace being built is completed in its original region,
+     which is adjacent to the new one */
+  if (!cc_trace_in_progress(thread_data)) {
+    cc_select_trace_region(thread_data, region);
+  }
+  thread_data->cc->trace_head_incr_addr = (uintptr_t)cc + trace_head_incr_offset;
+#endif
+
+  thread_data->cc->dispatcher_addr = (uintptr_t)cc + dispatcher_wrapper_offset;
+  thread_data->cc->syscall_wrapper_addr = (uintptr_t)cc + syscall_wrapper_offset;
+}
+
+static int cc_region_bb_end(dbm_thread *thread_data, int region) {
+  return (region == thread_data->cc->cc_region) ? thread_data->cc->free_block
+                                            : thread_data->cc->cc_regions[region].free_block;
+}
+
+static uintptr_t cc_region_bb_cache_end(dbm_thread *thread_data, int region) {
+  return (uintptr_t)((region == thread_data->cc->cc_region) ? thread_data->cc->bb_cache_next
+                                                        : thread_data->cc->cc_regions[region].bb_cache_next);
+}
+
+static bool cc_region_is_empty(dbm_thread *thread_data, int region) {
+  return cc_region_bb_end(thread_data, region) == bb_id_first(region)
+         && thread_data->cc->cc_regions[region].trace_id == TRACE_ID_BASE + region * TRACE_FRAGMENT_NO;
+}
+
+// Unlinks and frees the links to fragment_id from [start, end)
+static void cc_drop_links_from(dbm_thread *thread_data, int fragment_id, uintptr_t start, uintptr_t end) {
+  ll_entry **link = &thread_data->cc->code_cache_meta[fragment_id].linked_from;
+  ll_entry *entry;
+  uintptr_t site;
+
+  while (*link != NULL) {
+    site = (*link)->data & ~3;
+    if (site >= start && site < end) {
+      entry = *link;
+      *link = entry->next;
+      linked_list_free(thread_data->cc->cc_links, entry);
+    } else {
+      link = &(*link)->next;
+    }
+  }
+}
+
+typedef struct {
+  uintptr_t spc;
+  ll_entry *links;
+} cc_relink;
+
+#ifdef DBM_RANGE_INVALIDATION
+// Removes the fragments with IDs in [first, end) from the source page index
+static void cc_source_index_drop(dbm_thread *thread_data, int first, int end) {
+  hash_table *table = &thread_data->cc->source_pages;
+  ll_entry *head, **link, *entry;
+
+  for (int i = 0; i < table->size; i++) {
+    if (HASH_KEY(table, i) == 0) continue;
+
+    head = (ll_entry *)HASH_VALUE(table, i);
+    link = &head;
+    while (*link != NULL) {
+      if ((*link)->data >= first && (*link)->data < end) {
+        entry = *link;
+        *link = entry->next;
+        linked_list_free(thread_data->cc->source_index, entry);
+      } else {
+        link = &(*link)->next;
+      }
+    }
+    HASH_VALUE(table, i) = (uintptr_t)head;
+  }
+
+  // Pages without any fragments left
+  hash_delete_range(table, 0, 1);
+}
+#endif
+
+/* Discards all the fragments in a region and makes it the target of new allocations.
+   Links to the evicted fragments from the other regions are redirected to stubs. */
+static void cc_evict_region(dbm_thread *thread_data, int region) {
+  uintptr_t start = (uintptr_t)&thread_data->cc->code_cache[region];
+  uintptr_t end = start + sizeof(dbm_code_cache);
+  int ranges[2][2];
+  int relink_count = 0;
+  cc_relink *relink;
+  size_t relink_size;
+  uintptr_t tpc;
+
+  assert(region != thread_data->cc->cc_region);
+  info("code cache region %d full, evicting region %d\n", thread_data->cc->cc_region, region);
+
+  relink_size = sizeof(cc_relink) * (BB_FRAGMENTS_PER_REGION + TRACE_FRAGMENT_NO);
+  relink = mmap(NULL, relink_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(relink != MAP_FAILED);
+
+  /* Drop all links originating in the evicted region and
+     save the links into it from the other regions */
+  for (int r = 0; r < thread_data->cc->cc_region_count; r++) {
+    ranges[0][0] = bb_id_first(r);
+    ranges[0][1] = cc_region_bb_end(thread_data, r);
+    ranges[1][0] = TRACE_ID_BASE + r * TRACE_FRAGMENT_NO;
+    ranges[1][1] = thread_data->cc->cc_regions[r].trace_id;
+
+    for (int i = 0; i < 2; i++) {
+      for (int id = ranges[i][0]; id < ranges[i][1]; id++) {
+        cc_drop_links_from(thread_data, id, start, end);
+        if (r == region && thread_data->cc->code_cache_meta[id].linked_from != NULL) {
+          relink[relink_count].spc = (uintptr_t)thread_data->cc->code_cache_meta[id].source_addr;
+          relink[relink_count].links = thread_data->cc->code_cache_meta[id].linked_from;
+          relink_count++;
+        }
+      }
+    }
+  }
+
+  hash_delete_range(&thread_data->cc->entry_address, start, end);
+#ifdef DBM_RANGE_INVALIDATION
+  cc_source_index_drop(thread_data, region * BB_FRAGMENTS_PER_REGION, (region + 1) * BB_FRAGMENTS_PER_REGION);
+  cc_source_index_drop(thread_data, TRACE_ID_BASE + region * TRACE_FRAGMENT_NO,
+                       TRACE_ID_BASE + (region + 1) * TRACE_FRAGMENT_NO);
+#endif
+#ifdef DBM_SMC_WRITE_PROTECT
+  hash_delete_range(&thread_data->cc->smc_fragments, region * BB_FRAGMENTS_PER_REGION,
+                    (region + 1) * BB_FRAGMENTS_PER_REGION);
+#endif
+#ifdef DBM_TRACES
+  hash_delete_range(&thread_data->cc->trace_entry_address, start, end);
+  // The trace being built could link to the evicted fragments
+  if (thread_data->active_trace.active) {
+    atomic_increment_u32(&global_data.trace_stats.aborted, 1);
+  }
+  thread_data->active_trace.active = false;
+#endif
+
+  thread_data->cc->cc_evict_pending = false;
+  thread_data->was_flushed = true;
+#ifdef DBM_RAS
+  ras_reset(thread_data);
+#endif
+  cc_select_region(thread_data, region);
+
+  for (int i = 0; i < relink_count; i++) {
+    tpc = hash_lookup(&thread_data->cc->entry_address, relink[i].spc);
+    if (tpc == UINT_MAX) {
+      lookup_or_stub(thread_data, relink[i].spc);
+      tpc = hash_lookup(&thread_data->cc->entry_address, relink[i].spc);
+    }
+
+    cc_move_links(thread_data, relink[i].links, tpc);
+  }
+
+  munmap(relink, relink_size);
+}
+
+#ifdef DBM_TRACES
+/* Discards the traces in a region when its trace cache is full, without evicting
+   any basic blocks. The links to the traces and their hash table entries are
+   moved back to the trace heads, which are re-enabled so that hot code forms new
+   traces. Must only be called from create_trace, before a trace is started. */
+void cc_flush_traces(dbm_thread *thread_data, int region) {
+  dbm_code_cache *cc = &thread_data->cc->code_cache[region];
+  uintptr_t start = (uintptr_t)cc->traces;
+  uintptr_t end = (uintptr_t)trace_cache_end(cc);
+  int first = TRACE_ID_BASE + region * TRACE_FRAGMENT_NO;
+  int last = thread_data->cc->cc_regions[region].trace_id;
+
+  info("trace cache of region %d full, flushing its traces\n", region);
+  atomic_increment_u32(&global_data.trace_stats.flushes, 1);
+
+  // Drop all links originating in the traces
+  for (int r = 0; r < thread_data->cc->cc_region_count; r++) {
+    for (int id = bb_id_first(r); id < cc_region_bb_end(thread_data, r); id++) {
+      cc_drop_links_from(thread_data, id, start, end);
+    }
+    for (int id = TRACE_ID_BASE + r * TRACE_FRAGMENT_NO; id < thread_data->cc->cc_regions[r].trace_id; id++) {
+      cc_drop_links_from(thread_data, id, start, end);
+    }
+  }
+
+  for (int id = first; id < last; id++) {
+    dbm_code_cache_meta *trace_meta = &thread_data->cc->code_cache_meta[id];
+    int bb = trace_meta->trace_source_bb;
+    uintptr_t spc = (uintptr_t)trace_meta->source_addr;
+    ll_entry *links = trace_meta->linked_from;
+    trace_meta->linked_from = NULL;
+
+    bool is_current = hash_lookup(&thread_data->cc->entry_address, spc) == (trace_meta->tpc | (spc & THUMB));
+    if (bb >= 0 && is_current
+        && addr_to_bb_id(thread_data, thread_data->cc->code_cache_meta[bb].tpc) == bb
+        && (uintptr_t)thread_data->cc->code_cache_meta[bb].source_addr == spc
+        && thread_data->cc->code_cache_meta[bb].trace_head == NO_TRACE_HEAD) {
+      uintptr_t tpc = thread_data->cc->code_cache_meta[bb].tpc | (spc & THUMB);
+      hash_add(&thread_data->cc->entry_address, spc, tpc);
+      cc_move_links(thread_data, links, tpc);
+      trace_head_set(thread_data, bb, true);
+      thread_data->cc->exec_count[bb] = (uint8_t)global_data.traces.threshold;
+    } else if (links != NULL) {
+      // The trace head was evicted or the trace superseded, like in cc_evict_region
+      if (is_current) {
+        hash_delete(&thread_data->cc->entry_address, spc);
+      }
+      lookup_or_stub(thread_data, spc);
+      cc_move_links(thread_data, links, hash_lookup(&thread_data->cc->entry_address, spc));
+    }
+  }
+
+  hash_delete_range(&thread_data->cc->entry_address, start, end);
+  hash_delete_range(&thread_data->cc->trace_entry_address, start, end);
+#ifdef DBM_RANGE_INVALIDATION
+  cc_source_index_drop(thread_data, first, TRACE_ID_BASE + (region + 1) * TRACE_FRAGMENT_NO);
+#endif
+#ifdef DBM_RAS
+  ras_reset(thread_data);
+#endif
+  cc_select_trace_region(thread_data, region);
+}
+#endif
+
+#ifdef DBM_RANGE_INVALIDATION
+/* Records that fragment_id is translated from the instruction at addr. An
+   instruction crossing a page boundary is recorded in both pages. */
+void cc_source_index_add(dbm_thread *thread_data, int fragment_id, uintptr_t addr) {
+  ll_entry *head, *entry;
+
+#ifdef DBM_SMC_WRITE_PROTECT
+  smc_fragment_extend(thread_data, fragment_id, addr);
+#endif
+  for (uintptr_t page = align_lower(addr, PAGE_SIZE); page <= align_lower(addr + 3, PAGE_SIZE);
+       page += PAGE_SIZE) {
+    head = (ll_entry *)hash_lookup(&thread_data->cc->source_pages, page);
+    if (head == (ll_entry *)UINT_MAX) {
+      head = NULL;
+    }
+    // The fragment being scanned is always at the head of the lists of its pages
+    if (head != NULL && head->data == fragment_id) continue;
+#ifdef DBM_SMC_WRITE_PROTECT
+    smc_page_translated(thread_data, fragment_id, page);
+#endif
+
+    entry = linked_list_alloc(thread_data->cc->source_index);
+    if (entry == NULL) {
+      fprintf(stderr, "Source page index full\n");
+      while(1);
+    }
+    entry->data = fragment_id;
+    entry->next = head;
+    hash_add(&thread_data->cc->source_pages, page, (uintptr_t)entry);
+  }
+}
+
+/* Makes a fragment unreachable: its hash table entries are removed and the links
+   to it are saved in relink. A trace is discarded as a whole. */
+static void cc_invalidate_fragment(dbm_thread *thread_data, int id, cc_relink *relink, int *relink_count) {
+  dbm_code_cache_meta *meta = &thread_data->cc->code_cache_meta[id];
+
+#ifdef DBM_TRACES
+  if (id >= TRACE_ID_BASE) {
+    int first = TRACE_ID_BASE + trace_id_region(id) * TRACE_FRAGMENT_NO;
+    while (id > first && meta->trace_source_bb < 0) {
+      id--;
+      meta = &thread_data->cc->code_cache_meta[id];
+    }
+  }
+#endif
+
+  uintptr_t spc = (uintptr_t)meta->source_addr;
+  uintptr_t tpc = meta->tpc | (spc & THUMB);
+
+  if (hash_lookup(&thread_data->cc->entry_address, spc) == tpc) {
+    hash_delete(&thread_data->cc->entry_address, spc);
+  }
+#ifdef DBM_TRACES
+  if (id >= TRACE_ID_BASE && hash_lookup(&thread_data->cc->trace_entry_address, spc) == tpc) {
+    hash_delete(&thread_data->cc->trace_entry_address, spc);
+  }
+#endif
+#ifdef DBM_SMC_WRITE_PROTECT
+  if (hash_lookup(&thread_data->cc->smc_fragments, spc) == id) {
+    hash_delete(&thread_data->cc->smc_fragments, spc);
+  }
+#endif
+
+  if (meta->linked_from != NULL) {
+    relink[*relink_count].spc = spc;
+    relink[*relink_count].links = meta->linked_from;
+    meta->linked_from = NULL;
+    (*relink_count)++;
+  }
+}
+
+// Invalidates the fragments in the list of a page, relink is allocated on first use
+static void cc_invalidate_page(dbm_thread *thread_data, ll_entry *entry, cc_relink **relink,
+                               size_t relink_size, int *relink_count) {
+  ll_entry *next;
+
+  // Most ranges (e.g. data being unmapped) contain no translated code
+  if (*relink == NULL) {
+    *relink = mmap(NULL, relink_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(*relink != MAP_FAILED);
+  }
+
+  while (entry != NULL) {
+    next = entry->next;
+    cc_invalidate_fragment(thread_data, entry->data, *relink, relink_count);
+    linked_list_free(thread_data->cc->source_index, entry);
+    entry = next;
+  }
+}
+
+/* Discards the fragments translated from [start, end) instead of flushing the
+   code cache. The links to them are redirected to stubs, so the code is scanned
+   again when it's reached. Their space is reclaimed when the region is evicted. */
+void cc_invalidate_range(dbm_thread *thread_data, uintptr_t start, uintptr_t end) {
+  hash_table *pages = &thread_data->cc->source_pages;
+  int relink_count = 0;
+  cc_relink *relink = NULL;
+  size_t relink_size = sizeof(cc_relink) * (BB_FRAGMENT_NO + TRACE_FRAGMENT_NO * CC_MAX_REGIONS);
+  uintptr_t first = align_lower(start, PAGE_SIZE);
+  uintptr_t tpc, page;
+  ll_entry *entry;
+
+  if (pages->count == 0 || end <= first) return;
+
+  if ((end - first) / PAGE_SIZE > (uintptr_t)pages->size) {
+    // Large ranges (e.g. unmapped libraries) are matched against the indexed pages
+    for (int i = 0; i < pages->size; i++) {
+      page = HASH_KEY(pages, i);
+      if (page == 0 || page < first || page >= end) continue;
+      cc_invalidate_page(thread_data, (ll_entry *)HASH_VALUE(pages, i), &relink, relink_size, &relink_count);
+      HASH_VALUE(pages, i) = 0;
+    }
+    hash_delete_range(pages, 0, 1);
+  } else {
+    for (page = first; page < end; page += PAGE_SIZE) {
+      entry = (ll_entry *)hash_lookup(pages, page);
+      if (entry == (ll_entry *)UINT_MAX) continue;
+      hash_delete(pages, page);
+      cc_invalidate_page(thread_data, entry, &relink, relink_size, &relink_count);
+    }
+  }
+
+  if (relink != NULL) {
+    debug("Invalidated 0x%lx - 0x%lx, %d fragments relinked\n", start, end, relink_count);
+#ifdef DBM_TRACES
+    if (thread_data->active_trace.active) {
+      atomic_increment_u32(&global_data.trace_stats.aborted, 1);
+    }
+    thread_data->active_trace.active = false;
+#endif
+#ifdef DBM_RAS
+    ras_reset(thread_data);
+#endif
+
+    // Allocating the stubs could flush the code cache, which discards the links
+    thread_data->was_flushed = false;
+    for (int i = 0; i < relink_count && !thread_data->was_flushed; i++) {
+      lookup_or_stub(thread_data, relink[i].spc);
+      if (!thread_data->was_flushed) {
+        tpc = hash_lookup(&thread_data->cc->entry_address, relink[i].spc);
+        cc_move_links(thread_data, relink[i].links, tpc);
+      }
+    }
+    // The fragment which made the system call might have been discarded
+    thread_data->was_flushed = true;
+
+    munmap(relink, relink_size);
+  }
+}
+#endif
+
+static void cc_invalidate_local(dbm_thread *thread_data, uintptr_t start, uintptr_t end) {
+#ifdef DBM_RANGE_INVALIDATION
+  cc_invalidate_range(thread_data, start, end);
+#else
+  flush_code_cache(thread_data);
+#endif
+}
+
+/* Invalidates the translations of [start, end) in the code cache of the calling
+   thread and publishes the range for the other threads, which apply it on their
+   next entry to the dispatcher or to the syscall handler. Until then, they can
+   still execute stale code which doesn't exit the code cache. */
+void cc_invalidate(dbm_thread *thread_data, uintptr_t start, uintptr_t end) {
+  cc_check_invalidations(thread_data);
+  cc_invalidate_local(thread_data, start, end);
+
+  /* A shared code cache is invalidated once by the caller, flushes wait
+     for the other threads to stop */
+#ifndef DBM_SHARED_CC
+  int ret = pthread_mutex_lock(&global_data.inval_mutex);
+  assert(ret == 0);
+
+  uint32_t epoch = global_data.inval_epoch;
+  global_data.inval_queue[epoch % INVAL_QUEUE_SIZE].start = start;
+  global_data.inval_queue[epoch % INVAL_QUEUE_SIZE].end = end;
+  __sync_synchronize();
+  global_data.inval_epoch = epoch + 1;
+  // Already applied, unless another thread has published a range since the check
+  if (thread_data->inval_epoch == epoch) {
+    thread_data->inval_epoch = epoch + 1;
+  }
+
+  ret = pthread_mutex_unlock(&global_data.inval_mutex);
+  assert(ret == 0);
+#endif
+}
+
+// Applies the ranges published by the other threads, see cc_check_invalidations
+void cc_apply_invalidations(dbm_thread *thread_data) {
+  interval_map_entry ranges[INVAL_QUEUE_SIZE];
+  uint32_t epoch, count;
+
+  int ret = pthread_mutex_lock(&global_data.inval_mutex);
+  assert(ret == 0);
+
+  epoch = global_data.inval_epoch;
+  count = epoch - thread_data->inval_epoch;
+  if (count <= INVAL_QUEUE_SIZE) {
+    for (uint32_t i = 0; i < count; i++) {
+      ranges[i] = global_data.inval_queue[(thread_data->inval_epoch + i) % INVAL_QUEUE_SIZE];
+    }
+  }
+  thread_data->inval_epoch = epoch;
+
+  ret = pthread_mutex_unlock(&global_data.inval_mutex);
+  assert(ret == 0);
+
+  if (count > INVAL_QUEUE_SIZE) {
+    flush_code_cache(thread_data);
+    return;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    cc_invalidate_local(thread_data, ranges[i].start, ranges[i].end);
+  }
+}
+
+static void cc_flush(dbm_thread *thread_data) {
+#ifdef DBM_PERSISTENT_CC
+  pcc_invalidate(thread_data);
+#endif
   thread_data->was_flushed = true;
-  thread_data->free_block = trampolines_size_bbs;
-  hash_init(&thread_data->entry_address, CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+  thread_data->cc->cc_evict_pending = false;
+#ifdef DBM_SHARED_CC
+  thread_data->cc->flush_pending = false;
+#endif
+  hash_init(&thread_data->cc->entry_address, CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP);
 #ifdef DBM_TRACES
-  thread_data->trace_cache_next = thread_data->code_cache->traces;
-  thread_data->trace_id = CODE_CACHE_SIZE;
-  thread_data->active_trace.id = CODE_CACHE_SIZE;
+  hash_init(&thread_data->cc->trace_entry_address, CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+  if (thread_data->active_trace.active) {
+    atomic_increment_u32(&global_data.trace_stats.aborted, 1);
+  }
+  thread_data->active_trace.active = false;
+#ifdef DBM_SHARED_CC
+  thread_data->cc->trace_builder = NULL;
+#endif
+#endif
+
+  linked_list_init(thread_data->cc->cc_links, MAX_CC_LINKS);
+#ifdef DBM_RANGE_INVALIDATION
+  hash_init(&thread_data->cc->source_pages, CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+  linked_list_init(thread_data->cc->source_index, MAX_SOURCE_INDEX);
+#endif
+#ifdef DBM_SMC_WRITE_PROTECT
+  hash_init(&thread_data->cc->smc_fragments, SMC_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+#endif
+#ifdef DBM_RAS
+  ras_reset(thread_data);
+#endif
+
+  cc_select_region(thread_data, 0);
+  for (int r = 1; r < thread_data->cc->cc_region_count; r++) {
+    thread_data->cc->cc_regions[r].free_block = bb_id_first(r);
+    thread_data->cc->cc_regions[r].bb_cache_next = (uint8_t *)&thread_data->cc->code_cache[r].blocks[trampolines_size_bbs];
+    thread_data->cc->cc_regions[r].trace_id = TRACE_ID_BASE + r * TRACE_FRAGMENT_NO;
+#ifdef DBM_COMPACT_EXITS
+    thread_data->cc->cc_regions[r].stub_next = (uint8_t *)&thread_data->cc->code_cache[r].blocks[CODE_CACHE_SIZE];
+#endif
+  }
+#ifdef DBM_TRACES
+  cc_select_trace_region(thread_data, 0);
+#endif
+}
+
+#ifdef DBM_SHARED_CC
+static bool cc_has_other_threads(dbm_thread *thread_data) {
+  for (dbm_thread *it = global_data.threads; it != NULL; it = it->next_thread) {
+    if (it != thread_data && it->cc == thread_data->cc) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  hash_init(&thread_data->trace_entry_address, CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+// Threads which could be executing translated code
+static bool cc_thread_is_running(dbm_thread *thread_data, dbm_thread *it) {
+  return it != thread_data && it->cc == thread_data->cc
+         && it->status == THREAD_RUNNING && !it->cc_stopped;
+}
+
+/* Resets the state of a thread which was stopped while another one evicted from
+   the shared code cache */
+static void cc_thread_resume(dbm_thread *thread_data) {
+  thread_data->stop_gen = thread_data->cc->stop_gen;
+  thread_data->was_flushed = true;
+#ifdef DBM_TRACES
+  if (thread_data->active_trace.active) {
+    atomic_increment_u32(&global_data.trace_stats.aborted, 1);
+  }
+  thread_data->active_trace.active = false;
 #endif
+}
+
+/* Called with the lock held by syscall_handler_post, before the system call
+   returns to the slot which might have been redirected by cc_restart_world */
+void cc_syscall_resume(dbm_thread *thread_data) {
+  thread_data->syscall_tpc = NULL;
+  if (thread_data->stop_gen != thread_data->cc->stop_gen) {
+    cc_thread_resume(thread_data);
+  }
+}
+
+/* Waits until all the other threads using the shared code cache have stopped, either
+   here or in a system call. cc_evict_pending makes them enter the dispatcher and the
+   ones executing translated code are signalled, see signal_dispatcher. The lock is
+   released while waiting. Returns false if another thread has evicted in the
+   meantime, otherwise the caller modifies the code cache and calls cc_restart_world. */
+static bool cc_stop_world(dbm_thread *thread_data) {
+  dbm_cc_state *cc = thread_data->cc;
+  pid_t pid = getpid();
+  struct timespec deadline;
+  bool stopped;
+  int ret;
+
+  cc->cc_evict_pending = true;
+  thread_data->cc_stopped = true;
+  while (thread_data->stop_gen == cc->stop_gen) {
+    stopped = true;
+    for (dbm_thread *it = global_data.threads; it != NULL; it = it->next_thread) {
+      if (cc_thread_is_running(thread_data, it)) {
+        stopped = false;
+        atomic_increment_int(&it->stop_kicks, 1);
+        syscall(__NR_tgkill, pid, it->tid, UNLINK_SIGNAL);
+      }
+    }
+    if (stopped) break;
+
+    if (global_data.exit_group) {
+      cc_unlock(thread_data);
+      thread_abort(thread_data);
+    }
+
+    ret = clock_gettime(CLOCK_REALTIME, &deadline);
+    assert(ret == 0);
+    deadline.tv_nsec += CC_STOP_KICK_NS;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    ret = pthread_cond_timedwait(&cc->stop_cond, &cc->lock, &deadline);
+    assert(ret == 0 || ret == ETIMEDOUT);
+  }
+  thread_data->cc_stopped = false;
+
+  if (thread_data->stop_gen != cc->stop_gen) {
+    cc_thread_resume(thread_data);
+    return false;
+  }
+  return true;
+}
 
-  for (int i = 0; i < CODE_CACHE_SIZE; i++) {
-    thread_data->code_cache_meta[i].exit_branch_type = unknown;
-    thread_data->code_cache_meta[i].linked_from = NULL;
-    thread_data->code_cache_meta[i].branch_cache_status = 0;
-    thread_data->code_cache_meta[i].actual_id = 0;
+/* Lets the threads stopped by cc_stop_world continue. The system calls in progress
+   return through stubs, because the fragments which made them might be gone. */
+static void cc_restart_world(dbm_thread *thread_data) {
+  dbm_cc_state *cc = thread_data->cc;
+
+  cc->stop_gen++;
+  thread_data->stop_gen = cc->stop_gen;
 #ifdef DBM_TRACES
-    thread_data->exec_count[i] = 0;
+  cc->trace_builder = NULL;
 #endif
+  for (dbm_thread *it = global_data.threads; it != NULL; it = it->next_thread) {
+    if (it->cc == cc && it->syscall_tpc != NULL) {
+      *it->syscall_tpc = lookup_or_stub(thread_data, it->syscall_spc);
+    }
   }
 
-  linked_list_init(thread_data->cc_links, MAX_CC_LINKS);
+  int ret = pthread_cond_broadcast(&cc->stop_cond);
+  assert(ret == 0);
+}
+
+/* Flushes the code cache if requested, otherwise evicts the next region, once the
+   other threads have stopped, unless one of them did it */
+static void cc_shared_evict(dbm_thread *thread_data) {
+  if (!cc_stop_world(thread_data)) return;
+
+  int next = (thread_data->cc->cc_region + 1) % CC_MAX_REGIONS;
+  if (thread_data->cc->flush_pending) {
+    cc_flush(thread_data);
+  } else if (next < thread_data->cc->cc_region_count && !cc_region_is_empty(thread_data, next)) {
+    cc_evict_region(thread_data, next);
+  } else {
+    thread_data->cc->cc_evict_pending = false;
+    cc_select_region(thread_data, next);
+  }
+  cc_restart_world(thread_data);
+}
+#endif
+
+/* Called when the current region is full. Regions are reused in FIFO order, so once
+   all of them have been mapped, the oldest one is evicted. The fragment which called
+   into MAMBO might be evicted, so this is only done on entry to the dispatcher and to
+   create_trace (can_evict). Otherwise, the eviction is deferred and the reserved basic
+   blocks are used in the meantime. */
+void cc_next_region(dbm_thread *thread_data, bool can_evict) {
+  int next = (thread_data->cc->cc_region + 1) % CC_MAX_REGIONS;
+
+#ifdef DBM_SHARED_CC
+  // Queued by flush_code_cache, which also sets cc_evict_pending
+  if (thread_data->cc->flush_pending) {
+    if (can_evict) {
+      cc_shared_evict(thread_data);
+    }
+    return;
+  }
+#endif
+
+  if (next < thread_data->cc->cc_region_count && !cc_region_is_empty(thread_data, next)) {
+    if (can_evict) {
+#ifdef DBM_SHARED_CC
+      // Other threads could be executing the fragments in any region
+      cc_shared_evict(thread_data);
+#else
+      cc_evict_region(thread_data, next);
+#endif
+    } else {
+      thread_data->cc->cc_evict_pending = true;
+    }
+  } else {
+    info("code cache region %d full, switching to region %d\n", thread_data->cc->cc_region, next);
+    cc_select_region(thread_data, next);
+  }
+}
+
+/* With a shared code cache, the flush is queued and applied once all the threads
+   using it have stopped on entry to the dispatcher or in a system call */
+void flush_code_cache(dbm_thread *thread_data) {
+#ifdef DBM_SHARED_CC
+  if (cc_has_other_threads(thread_data)) {
+    thread_data->cc->flush_pending = true;
+    while (thread_data->cc->flush_pending) {
+      cc_shared_evict(thread_data);
+    }
+    return;
+  }
+#endif
+  cc_flush(thread_data);
 }
 
 void mambo_deliver_callbacks(unsigned cb_id, dbm_thread *thread_data, inst_set inst_type,
@@ -115,14 +874,40 @@ void mambo_deliver_callbacks(unsigned cb_id, dbm_thread *thread_data, inst_set i
 }
 
 uintptr_t cc_lookup(dbm_thread *thread_data, uintptr_t target) {
-  uintptr_t addr = hash_lookup(&thread_data->entry_address, target);
+  uintptr_t addr = hash_lookup(&thread_data->cc->entry_address, target);
   return adjust_cc_entry(addr);
 }
 
+/* Stubs are too small to be scanned in place. Once the target has been scanned,
+   the links to the stub are moved to it and the stub is replaced by a branch. */
+static void replace_stub(dbm_thread *thread_data, int stub_id) {
+  dbm_code_cache_meta *stub_meta = &thread_data->cc->code_cache_meta[stub_id];
+  uintptr_t tpc = hash_lookup(&thread_data->cc->entry_address, (uintptr_t)stub_meta->source_addr);
+  ll_entry *links = stub_meta->linked_from;
+
+  stub_meta->linked_from = NULL;
+  cc_move_links(thread_data, links, tpc);
+
+#ifdef __arm__
+  uintptr_t write_p = adjust_cc_entry(stub_meta->tpc | (tpc & THUMB));
+  if (tpc & THUMB) {
+    thumb_b32_helper((uint16_t *)write_p, adjust_cc_entry(tpc));
+    record_cc_link(thread_data, write_p | THUMB, tpc);
+  } else {
+    arm_b32_helper((uint32_t *)write_p, adjust_cc_entry(tpc), AL);
+    record_cc_link(thread_data, write_p, tpc);
+  }
+#elif __aarch64__
+  uint32_t *write_p = (uint32_t *)stub_meta->tpc + 1;
+  a64_cc_branch(thread_data, write_p, tpc + 4);
+#endif
+  __clear_cache((char *)write_p, (char *)write_p + 4);
+}
+
 uintptr_t lookup_or_scan(dbm_thread *thread_data, uintptr_t target, bool *cached) {
   uintptr_t block_address;
   bool from_cache = true;
-  uintptr_t basic_block;
+  int basic_block;
   
   debug("Thread_data: %p\n", thread_data);
   
@@ -132,9 +917,15 @@ uintptr_t lookup_or_scan(dbm_thread *thread_data, uintptr_t target, bool *cached
     from_cache = false;
     block_address = scan(thread_data, (uint16_t *)target, ALLOCATE_BB);
   } else {
-    basic_block = ((uintptr_t)block_address - (uintptr_t)(thread_data->code_cache)) >> 8;
-    if (thread_data->code_cache_meta[basic_block].exit_branch_type == stub) {
-      block_address = scan(thread_data, (uint16_t *)target, basic_block);
+    basic_block = addr_to_bb_id(thread_data, block_address);
+    if (basic_block >= 0 && thread_data->cc->code_cache_meta[basic_block].exit_branch_type == stub
+#ifdef DBM_SMC_WRITE_PROTECT
+        // The stub is the entry of a translation checked by the dispatcher
+        && !smc_is_checked(thread_data, target)
+#endif
+       ) {
+      block_address = scan(thread_data, (uint16_t *)target, ALLOCATE_BB);
+      replace_stub(thread_data, basic_block);
     }
   }
   
@@ -145,21 +936,73 @@ uintptr_t lookup_or_scan(dbm_thread *thread_data, uintptr_t target, bool *cached
   return block_address;
 }
 
+/* Allocates a fragment ID and reserves BASIC_BLOCK_SIZE words for it. The unused
+   space is returned by bb_trim() once the size of the basic block is known. */
 int allocate_bb(dbm_thread *thread_data) {
   unsigned int basic_block;
-  bool flushed = false;
+  dbm_code_cache *cc = &thread_data->cc->code_cache[thread_data->cc->cc_region];
+  int id_limit = (thread_data->cc->cc_region + 1) * BB_FRAGMENTS_PER_REGION - CODE_CACHE_OVERP;
+  uint8_t *space_limit = (uint8_t *)&cc->blocks[CODE_CACHE_SIZE - CODE_CACHE_OVERP];
+#ifdef DBM_COMPACT_EXITS
+  // The exit stubs are allocated downwards from the end of the basic block area
+  space_limit = thread_data->cc->cc_regions[thread_data->cc->cc_region].stub_next
+                - CODE_CACHE_OVERP * sizeof(dbm_block);
+#endif
 
   // Reserve CODE_CACHE_OVERP basic blocks to be able to scan large blocks
-  if(thread_data->free_block >= (CODE_CACHE_SIZE - CODE_CACHE_OVERP)) {
-    fprintf(stderr, "code cache full, flushing it\n");
-    flush_code_cache(thread_data);
-    flushed = true;
+  if (thread_data->cc->free_block >= (id_limit - CC_EVICT_RESERVE) ||
+      thread_data->cc->bb_cache_next >= (space_limit - CC_EVICT_RESERVE * sizeof(dbm_block))) {
+    if (thread_data->cc->free_block < id_limit && thread_data->cc->bb_cache_next < space_limit) {
+      cc_next_region(thread_data, false);
+    } else {
+      fprintf(stderr, "code cache full, flushing it\n");
+      flush_code_cache(thread_data);
+    }
   }
   
-  basic_block = thread_data->free_block++;
+  basic_block = thread_data->cc->free_block++;
+  thread_data->cc->code_cache_meta[basic_block].exit_branch_type = unknown;
+  thread_data->cc->code_cache_meta[basic_block].linked_from = NULL;
+  thread_data->cc->code_cache_meta[basic_block].branch_cache_status = 0;
+  thread_data->cc->code_cache_meta[basic_block].no_linking = false;
+  thread_data->cc->code_cache_meta[basic_block].actual_id = 0;
+#ifdef DBM_SMC_WRITE_PROTECT
+  thread_data->cc->code_cache_meta[basic_block].smc_checked = false;
+  thread_data->cc->code_cache_meta[basic_block].smc_size = 0;
+#endif
+#ifdef DBM_IBTC
+  thread_data->cc->code_cache_meta[basic_block].ibtc = NULL;
+#endif
+#if defined(__aarch64__) && defined(DBM_TB_DIRECT)
+  thread_data->cc->code_cache_meta[basic_block].jt_slots = NULL;
+#endif
+#ifdef DBM_TRACES
+  thread_data->cc->code_cache_meta[basic_block].call_exit = false;
+  thread_data->cc->code_cache_meta[basic_block].trace_head = NO_TRACE_HEAD;
+  thread_data->cc->code_cache_meta[basic_block].trace_source_bb = -1;
+  // The counter is decremented before being checked, 256 is stored as 0
+  thread_data->cc->exec_count[basic_block] = (uint8_t)global_data.traces.threshold;
+#endif
+#ifdef DBM_PROFILE
+  thread_data->cc->profile_count[basic_block] = 0;
+#endif
+  thread_data->cc->code_cache_meta[basic_block].tpc = (uintptr_t)thread_data->cc->bb_cache_next;
+  thread_data->cc->bb_cache_next += sizeof(dbm_block);
+
   return basic_block;
 }
 
+/* Frees the space after end in the last allocated block, if it belongs to basic_block */
+static void bb_trim(dbm_thread *thread_data, int basic_block, uintptr_t end) {
+  int last = thread_data->cc->free_block - 1;
+
+  if (last < bb_id_first(thread_data->cc->cc_region)) return;
+  if (last != basic_block && thread_data->cc->code_cache_meta[last].actual_id != basic_block) return;
+  if (end <= thread_data->cc->code_cache_meta[last].tpc || end > (uintptr_t)thread_data->cc->bb_cache_next) return;
+
+  thread_data->cc->bb_cache_next = (uint8_t *)align_higher(end, BB_ALIGN);
+}
+
 /* Stub BBs only contain a call to the dispatcher
    Stub BBs are used when a basic block can be optimised by directly linking
    to a target, but it's not clear if the target will ever be reached, e.g.:
@@ -168,28 +1011,31 @@ uintptr_t stub_bb(dbm_thread *thread_data, uintptr_t target) {
   unsigned int basic_block;
   uintptr_t block_address;
   uintptr_t thumb = target & THUMB;
+  size_t stub_size;
   
   basic_block = allocate_bb(thread_data);
-  block_address = (uintptr_t)&thread_data->code_cache->blocks[basic_block];
+  block_address = (uintptr_t)bb_addr(thread_data, basic_block);
   
   debug("Stub BB: 0x%x\n", block_address + thumb);
   
-  thread_data->code_cache_meta[basic_block].exit_branch_type = stub;
-  if (!hash_add(&thread_data->entry_address, target, block_address + thumb)) {
+  thread_data->cc->code_cache_meta[basic_block].exit_branch_type = stub;
+  thread_data->cc->code_cache_meta[basic_block].source_addr = (uint16_t *)target;
+  if (!hash_add(&thread_data->cc->entry_address, target, block_address + thumb)) {
     fprintf(stderr, "Failed to add hash table entry for newly created stub basic block\n");
     while(1);
   }
 
 #ifdef __arm__
   if (thumb) {
-    thumb_encode_stub_bb(thread_data, basic_block, target);
+    stub_size = thumb_encode_stub_bb(thread_data, basic_block, target);
   } else {
-    arm_encode_stub_bb(thread_data, basic_block, target);
+    stub_size = arm_encode_stub_bb(thread_data, basic_block, target);
   }
 #endif
 #ifdef __aarch64__
-  assert(0); // TODO
+  stub_size = a64_encode_stub_bb(thread_data, basic_block, target);
 #endif
+  bb_trim(thread_data, basic_block, block_address + stub_size);
   
   return adjust_cc_entry(block_address + thumb);
 }
@@ -234,9 +1080,19 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
   uintptr_t block_address;
   size_t block_size;
   bool stub = false;
+  bool checked = false;
 
   debug("scan(%p)\n", address);
 
+#ifdef DBM_SMC_WRITE_PROTECT
+  /* Code from a checked page is linked to through a stub, including by the
+     block itself, see smc_add_checked */
+  if (basic_block == ALLOCATE_BB && smc_page_checked((uintptr_t)address)) {
+    lookup_or_stub(thread_data, (uintptr_t)address);
+    checked = true;
+  }
+#endif
+
   // Alocate a basic block
   if (basic_block == ALLOCATE_BB) {
     basic_block = allocate_bb(thread_data);
@@ -244,17 +1100,17 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
     stub = true;
   }
 
-  block_address = (uintptr_t)&thread_data->code_cache->blocks[basic_block];
-  thread_data->code_cache_meta[basic_block].source_addr = address;
-  thread_data->code_cache_meta[basic_block].tpc = block_address;
+  block_address = (uintptr_t)bb_addr(thread_data, basic_block);
+  thread_data->cc->code_cache_meta[basic_block].source_addr = address;
+  thread_data->cc->code_cache_meta[basic_block].tpc = block_address;
   //fprintf(stderr, "scan(%p): 0x%x (bb %d)\n", address, block_address, basic_block);
 
   // Add entry into the code cache hash table
   // It must be added before scan_ is called, otherwise a call for scan
   // from scan_x could result in duplicate BBS or an infinite recursive call
   block_address |= thumb;
-  if (!stub) {
-    if (!hash_add(&thread_data->entry_address, (uintptr_t)address, block_address)) {
+  if (!stub && !checked) {
+    if (!hash_add(&thread_data->cc->entry_address, (uintptr_t)address, block_address)) {
       fprintf(stderr, "Failed to add hash table entry for newly created basic block\n");
       while(1);
     }
@@ -286,16 +1142,26 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
 
   // Flush modified instructions from caches
   // End address is exclusive
-  if (thread_data->free_block < basic_block) {
-    /* The code cache has been flushed. Play it safe, because we don't know how
-       much space has been used in each of the two areas. */
-    __clear_cache((char *)block_address, &thread_data->code_cache->traces);
-    __clear_cache(&thread_data->code_cache->blocks[trampolines_size_bbs],
-                  &thread_data->code_cache->blocks[thread_data->free_block]);
+  if (thread_data->cc->free_block < basic_block ||
+      bb_id_region(thread_data->cc->free_block) != bb_id_region(basic_block)) {
+    /* The code cache has been flushed or the block has overflowed into a new
+       region. Play it safe, because we don't know how much space has been used
+       in each of the two areas. */
+    dbm_code_cache *cc = &thread_data->cc->code_cache[bb_id_region(basic_block)];
+    __clear_cache((char *)(block_address & (~THUMB)), (char *)&cc->traces);
+    cc = &thread_data->cc->code_cache[thread_data->cc->cc_region];
+    __clear_cache((char *)&cc->blocks[trampolines_size_bbs], (char *)thread_data->cc->bb_cache_next);
   } else {
     __clear_cache((char *)block_address, (char *)(block_address + block_size + 1));
+    bb_trim(thread_data, basic_block, (block_address & (~THUMB)) + block_size);
   }
 
+#ifdef DBM_SMC_WRITE_PROTECT
+  if (thread_data->cc->code_cache_meta[basic_block].smc_checked) {
+    return smc_add_checked(thread_data, basic_block);
+  }
+#endif
+
   return adjust_cc_entry(block_address);
 }
 
@@ -362,8 +1228,74 @@ int unregister_thread(dbm_thread *thread_data, bool caller_has_lock) {
   return status;
 }
 
+#ifdef DBM_PROFILE
+/* Writes the non-zero execution counts of the code cache of a thread: the basic
+   blocks and trace entries with their source addresses, followed for each trace by
+   the side exits taken from its fragments and their source targets */
+static void profile_dump_cc(dbm_thread *thread_data, FILE *out) {
+  dbm_cc_state *cc = thread_data->cc;
+
+  fprintf(out, "# thread %d\n", thread_data->tid);
+  for (int r = 0; r < cc->cc_region_count; r++) {
+    for (int id = bb_id_first(r); id < cc_region_bb_end(thread_data, r); id++) {
+      if (cc->profile_count[id] != 0) {
+        fprintf(out, "bb %d %p %u\n", id, cc->code_cache_meta[id].source_addr, cc->profile_count[id]);
+      }
+    }
+  }
+
+#ifdef DBM_TRACES
+  for (int r = 0; r < cc->cc_region_count; r++) {
+    for (int id = TRACE_ID_BASE + r * TRACE_FRAGMENT_NO; id < cc->cc_regions[r].trace_id; id++) {
+      dbm_code_cache_meta *meta = &cc->code_cache_meta[id];
+      if (meta->trace_source_bb >= 0) {
+        fprintf(out, "trace %d %p %u\n", id, meta->source_addr, cc->profile_count[id]);
+      }
+      uint32_t exits = cc->profile_exit_count[id - TRACE_ID_BASE];
+      if (exits != 0) {
+        uintptr_t target = (meta->branch_cache_status & FALLTHROUGH_LINKED) ? meta->branch_skipped_addr
+                                                                            : meta->branch_taken_addr;
+        fprintf(out, "  exit %d %p %u\n", id, (void *)target, exits);
+      }
+    }
+  }
+#endif
+}
+
+static void profile_dump(dbm_thread *thread_data) {
+  char *path = getenv(PROFILE_ENV);
+  FILE *out = (path != NULL) ? fopen(path, "w") : stderr;
+  if (out == NULL) {
+    fprintf(stderr, "MAMBO: failed to open the profile file %s\n", path);
+    return;
+  }
+
+#ifdef DBM_SHARED_CC
+  profile_dump_cc(thread_data, out);
+#else
+  lock_thread_list();
+  for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
+    profile_dump_cc(thread, out);
+  }
+  unlock_thread_list();
+#endif
+
+  if (out != stderr) {
+    fclose(out);
+  }
+}
+#endif
+
 void dbm_exit(dbm_thread *thread_data, uint32_t code) {
   fprintf(stderr, "We're done; exiting with status: %d\n", code);
+  trace_print_stats();
+#ifdef DBM_PROFILE
+  profile_dump(thread_data);
+#endif
+
+#ifdef DBM_PERSISTENT_CC
+  pcc_save(thread_data);
+#endif
 
 #ifdef PLUGINS_NEW
   lock_thread_list();
@@ -404,8 +1336,58 @@ void thread_abort(dbm_thread *thread_data) {
   pthread_exit(NULL);
 }
 
+static const char *dbm_map_names[DBM_MAP_NO] = {
+  "thread data", "code cache metadata", "code cache links", "code cache", "hash tables",
+  "source index"
+};
+
+/* If huge pages are enabled by setting MAMBO_HUGEPAGES, MAP_HUGETLB is tried first,
+   which requires pages reserved in hugetlbfs, followed by transparent huge pages.
+   The type of pages obtained is reported once for each type of mapping. */
+void *dbm_mmap(dbm_map map, void *addr, size_t length, int prot, int flags) {
+  static bool reported[DBM_MAP_NO];
+  char *pages = "base pages";
+  void *ret = MAP_FAILED;
+
+  assert(map < DBM_MAP_NO);
+  length = CC_SZ_ROUND(length);
+
+  if (global_data.huge_pages) {
+    ret = mmap(addr, length, prot, flags | MAP_HUGETLB, -1, 0);
+    pages = "hugetlb pages";
+  }
+
+  if (ret == MAP_FAILED) {
+    // Transparent huge pages are only used for aligned areas
+    bool align = global_data.huge_pages && addr == NULL;
+    size_t map_length = align ? length + HUGE_PAGE_SIZE : length;
+
+    ret = mmap(addr, map_length, prot, flags, -1, 0);
+    pages = "base pages";
+    if (ret != MAP_FAILED && align) {
+      uintptr_t start = ROUND_UP((uintptr_t)ret, HUGE_PAGE_SIZE);
+      if (start > (uintptr_t)ret) {
+        munmap(ret, start - (uintptr_t)ret);
+      }
+      munmap((void *)(start + length), (uintptr_t)ret + map_length - (start + length));
+      ret = (void *)start;
+    }
+    if (ret != MAP_FAILED && global_data.huge_pages && madvise(ret, length, MADV_HUGEPAGE) == 0) {
+      pages = "transparent huge pages";
+    }
+  }
+
+  // Don't report reservations, which are remapped later
+  if (ret != MAP_FAILED && global_data.huge_pages && prot != PROT_NONE && !reported[map]) {
+    reported[map] = true;
+    fprintf(stderr, "MAMBO: %s backed by %s\n", dbm_map_names[map], pages);
+  }
+
+  return ret;
+}
+
 bool allocate_thread_data(dbm_thread **thread_data) {
-  dbm_thread *data = mmap(NULL, sizeof(dbm_thread), PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
+  dbm_thread *data = pcc_mmap(DBM_MAP_THREAD, sizeof(dbm_thread), PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS);
   if (data != MAP_FAILED) {
     *thread_data = data;
     return true;
@@ -413,15 +1395,47 @@ bool allocate_thread_data(dbm_thread **thread_data) {
   return false;
 }
 
-int free_thread_data(dbm_thread *thread_data) {
-  if (munmap(thread_data->code_cache, CC_SZ_ROUND(sizeof(dbm_code_cache))) != 0) {
+static void free_cc_state(dbm_cc_state *cc) {
+  hash_free(&cc->entry_address);
+#ifdef DBM_TRACES
+  hash_free(&cc->trace_entry_address);
+#endif
+  if (munmap(cc->code_cache, CC_SZ_ROUND(sizeof(dbm_code_cache) * CC_MAX_REGIONS)) != 0) {
     fprintf(stderr, "Error freeing code cache on exit()\n");
     while(1);
   }
-  if (munmap(thread_data->cc_links, METADATA_SZ_ROUND(sizeof(ll) + sizeof(ll_entry) * MAX_CC_LINKS)) != 0) {
+  if (munmap(cc->cc_links, METADATA_SZ_ROUND(sizeof(ll) + sizeof(ll_entry) * MAX_CC_LINKS)) != 0) {
     fprintf(stderr, "Error freeing CC link struct on exit()\n");
     while(1);
   }
+#ifdef DBM_RANGE_INVALIDATION
+  hash_free(&cc->source_pages);
+  if (munmap(cc->source_index, METADATA_SZ_ROUND(sizeof(ll) + sizeof(ll_entry) * MAX_SOURCE_INDEX)) != 0) {
+    fprintf(stderr, "Error freeing the source page index on exit()\n");
+    while(1);
+  }
+#endif
+#ifdef DBM_SMC_WRITE_PROTECT
+  hash_free(&cc->smc_fragments);
+#endif
+  if (munmap(cc, METADATA_SZ_ROUND(sizeof(dbm_cc_state))) != 0) {
+    fprintf(stderr, "Error freeing code cache state on exit()\n");
+    while(1);
+  }
+}
+
+int free_thread_data(dbm_thread *thread_data) {
+#ifdef DBM_SHARED_CC
+  #ifdef DBM_TRACES
+  cc_lock(thread_data);
+  if (thread_data->cc->trace_builder == thread_data) {
+    thread_data->cc->trace_builder = NULL;
+  }
+  cc_unlock(thread_data);
+  #endif
+#else
+  free_cc_state(thread_data->cc);
+#endif
   if (munmap(thread_data, METADATA_SZ_ROUND(sizeof(dbm_thread))) != 0) {
     fprintf(stderr, "Error freeing thread private structure on exit()\n");
     while(1);
@@ -429,59 +1443,76 @@ int free_thread_data(dbm_thread *thread_data) {
   return 0;
 }
 
+void cc_lock(dbm_thread *thread_data) {
+#ifdef DBM_SHARED_CC
+  int ret = pthread_mutex_lock(&thread_data->cc->lock);
+  assert(ret == 0);
+#endif
+}
+
+void cc_unlock(dbm_thread *thread_data) {
+#ifdef DBM_SHARED_CC
+  int ret = pthread_mutex_unlock(&thread_data->cc->lock);
+  assert(ret == 0);
+#endif
+}
+
 void init_thread(dbm_thread *thread_data) {
-  dbm_thread **dispatcher_thread_data;
+  // The new code cache doesn't contain any of the previously invalidated code
+  thread_data->inval_epoch = global_data.inval_epoch;
+
+#ifdef DBM_SHARED_CC
+  if (global_data.shared_cc != NULL) {
+    thread_data->cc = global_data.shared_cc;
+    thread_data->stop_gen = thread_data->cc->stop_gen;
+    thread_data->status = THREAD_RUNNING;
+    return;
+  }
+#endif
 
-  // Initialize code cache
-  thread_data->code_cache = mmap(NULL, sizeof(dbm_code_cache), PROT_EXEC | PROT_READ | PROT_WRITE, CC_MMAP_OPTS, -1, 0);
-  if (thread_data->code_cache == MAP_FAILED) {
-    fprintf(stderr, "Allocating code cache space failed\n");
+  thread_data->cc = pcc_mmap(DBM_MAP_CC_STATE, sizeof(dbm_cc_state), PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS);
+  if (thread_data->cc == MAP_FAILED) {
+    fprintf(stderr, "Allocating code cache state failed\n");
     while(1);
   }
-  info("Code cache: %p\n", thread_data->code_cache);
+#ifdef DBM_SHARED_CC
+  int ret = pthread_mutex_init(&thread_data->cc->lock, NULL);
+  assert(ret == 0);
+  ret = pthread_cond_init(&thread_data->cc->stop_cond, NULL);
+  assert(ret == 0);
+  global_data.shared_cc = thread_data->cc;
+#endif
 
-  thread_data->cc_links = mmap(NULL, sizeof(ll) + sizeof(ll_entry) * MAX_CC_LINKS, PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
-  assert(thread_data->cc_links != MAP_FAILED);
+  /* Reserve the address space for all code cache regions, so that they're
+     within direct branch range. Regions are mapped when first used. */
+  thread_data->cc->code_cache = pcc_mmap(DBM_MAP_CODE_CACHE, sizeof(dbm_code_cache) * CC_MAX_REGIONS, PROT_NONE,
+                                         CC_MMAP_OPTS | MAP_NORESERVE);
+  if (thread_data->cc->code_cache == MAP_FAILED) {
+    fprintf(stderr, "Allocating code cache space failed\n");
+    while(1);
+  }
+  thread_data->cc->cc_region_count = 0;
+  info("Code cache: %p\n", thread_data->cc->code_cache);
+
+  thread_data->cc->cc_links = pcc_mmap(DBM_MAP_CC_LINKS, sizeof(ll) + sizeof(ll_entry) * MAX_CC_LINKS, PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS);
+  assert(thread_data->cc->cc_links != MAP_FAILED);
+#ifdef DBM_RANGE_INVALIDATION
+  thread_data->cc->source_index = dbm_mmap(DBM_MAP_SOURCE_INDEX, NULL, sizeof(ll) + sizeof(ll_entry) * MAX_SOURCE_INDEX,
+                                           PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS);
+  assert(thread_data->cc->source_index != MAP_FAILED);
+#endif
 
-  // Initialize the hash table and basic block allocator, mark all BBs as unknown type
+  /* Initialize the hash table and basic block allocator, map the first region
+     and copy the trampolines to it */
   flush_code_cache(thread_data);
 
-  // Copy the trampolines to the code cache
-  memcpy(&thread_data->code_cache->blocks[0], &start_of_dispatcher_s, trampolines_size_bytes);
-
-  dispatcher_thread_data = (dbm_thread **)((uintptr_t)&thread_data->code_cache->blocks[0]
-                                           + dispatcher_thread_data_offset);
-  *dispatcher_thread_data = thread_data;
-
-  uint32_t **dispatcher_is_pending = (uint32_t **)((uintptr_t)&thread_data->code_cache->blocks[0]
-                                           + th_is_pending_ptr_offset);
-  *dispatcher_is_pending = &thread_data->is_signal_pending;
-
-  debug("*thread_data in dispatcher at: %p\n", dispatcher_thread_data);
-
 #ifdef DBM_TRACES
-  thread_data->trace_head_incr_addr = (uintptr_t)&thread_data->code_cache[0] + trace_head_incr_offset;
-
-  #ifdef __arm__
-  uint16_t *write_p = (uint16_t *)(thread_data->trace_head_incr_addr + 4 - 1);
-  copy_to_reg_32bit(&write_p, r1, (uint32_t)thread_data->exec_count);
-  #endif
-  #ifdef __aarch64__
-  uint32_t *write_p = (uint32_t *)(thread_data->trace_head_incr_addr + 4);
-  a64_copy_to_reg_64bits(&write_p, x2, (uintptr_t)thread_data->exec_count);
-  #endif
-
-  info("Traces start at: %p\n", &thread_data->code_cache->traces);
-#endif // DBM_TRACES
-
-  __clear_cache((char *)&thread_data->code_cache->blocks[0], (char *)&thread_data->code_cache->blocks[thread_data->free_block]);
- 
-  thread_data->dispatcher_addr = (uintptr_t)&thread_data->code_cache[0] + dispatcher_wrapper_offset;
-  thread_data->syscall_wrapper_addr = (uintptr_t)&thread_data->code_cache[0] + syscall_wrapper_offset;
+  info("Traces start at: %p\n", &thread_data->cc->code_cache->traces);
+#endif
 
   thread_data->status = THREAD_RUNNING;
                         
-  debug("Syscall wrapper addr: 0x%x\n", thread_data->syscall_wrapper_addr);
+  debug("Syscall wrapper addr: 0x%x\n", thread_data->cc->syscall_wrapper_addr);
 }
 
 void free_all_other_threads(dbm_thread *thread_data) {
@@ -502,8 +1533,19 @@ void reset_process(dbm_thread *thread_data) {
 
   int ret = pthread_mutex_init(&global_data.thread_list_mutex, NULL);
   assert(ret == 0);
+  ret = pthread_mutex_init(&global_data.inval_mutex, NULL);
+  assert(ret == 0);
+#ifdef DBM_SMC_WRITE_PROTECT
+  ret = pthread_mutex_init(&global_data.smc_mutex, NULL);
+  assert(ret == 0);
+#endif
 
   current_thread = thread_data;
+#ifdef DBM_SHARED_CC
+  // The lock might have been held by another thread of the parent process
+  ret = pthread_mutex_init(&thread_data->cc->lock, NULL);
+  assert(ret == 0);
+#endif
   free_all_other_threads(thread_data);
 
   /*
@@ -521,50 +1563,76 @@ void reset_process(dbm_thread *thread_data) {
 }
 
 bool is_bb(dbm_thread *thread_data, uintptr_t addr) {
-  uintptr_t min = (uintptr_t)thread_data->code_cache->blocks;
-  uintptr_t max = (uintptr_t)thread_data->code_cache->traces;
+  int region = cc_region_index(thread_data, addr);
+  if (region < 0) return false;
+
+  uintptr_t min = (uintptr_t)thread_data->cc->code_cache[region].blocks;
+  uintptr_t max = (uintptr_t)thread_data->cc->code_cache[region].traces;
 
   return addr >= min && addr < max;
 }
 
+/* The basic blocks in a region are allocated in increasing order of their
+   addresses, so the one containing addr is found by binary search */
 int addr_to_bb_id(dbm_thread *thread_data, uintptr_t addr) {
-  uintptr_t min = (uintptr_t)thread_data->code_cache->blocks;
-  uintptr_t max = (uintptr_t)thread_data->code_cache->traces;
+  int region = cc_region_index(thread_data, addr);
+  if (region < 0) return -1;
+
+  int first = bb_id_first(region);
+  int last = cc_region_bb_end(thread_data, region) - 1;
+  int pivot;
 
-  if (addr < min || addr > max) {
+  if (last < first || addr < thread_data->cc->code_cache_meta[first].tpc ||
+      addr >= cc_region_bb_cache_end(thread_data, region)) {
     return -1;
   }
 
-  return (addr - (uintptr_t)thread_data->code_cache->blocks) / sizeof(dbm_block);
+  while (first < last) {
+    pivot = (first + last + 1) / 2;
+    if (addr < thread_data->cc->code_cache_meta[pivot].tpc) {
+      last = pivot - 1;
+    } else {
+      first = pivot;
+    }
+  }
+
+  return first;
 }
 
+/* Returns -1 for addresses which aren't part of a fragment, e.g. trampolines */
 int addr_to_fragment_id(dbm_thread *thread_data, uintptr_t addr) {
-  uintptr_t start = (uintptr_t )thread_data->code_cache->blocks;
-  assert(addr >= start && addr < (start + MAX_BRANCH_RANGE));
+  int region = cc_region_index(thread_data, addr);
+  if (region < 0) return -1;
 
   int id = addr_to_bb_id(thread_data, addr);
   if (id >= 0) {
-    if (thread_data->code_cache_meta[id].actual_id != 0) {
-      id = thread_data->code_cache_meta[id].actual_id;
+    if (thread_data->cc->code_cache_meta[id].actual_id != 0) {
+      id = thread_data->cc->code_cache_meta[id].actual_id;
     }
     return id;
   }
 
 #ifdef DBM_TRACES
-  int first = CODE_CACHE_SIZE;
-  int last = thread_data->active_trace.id - 1;
+  int first = TRACE_ID_BASE + region * TRACE_FRAGMENT_NO;
+  int last = thread_data->cc->cc_regions[region].trace_id - 1;
   int pivot;
 
-  if (addr >= thread_data->code_cache_meta[last].tpc) {
-    assert((void *)addr < (((void *)&thread_data->code_cache) + sizeof(dbm_code_cache)));
+  if (last < first || addr < thread_data->cc->code_cache_meta[first].tpc) {
+    return -1;
+  }
+
+  if (addr >= thread_data->cc->code_cache_meta[last].tpc) {
+    if (addr >= (uintptr_t)trace_cache_end(&thread_data->cc->code_cache[region])) {
+      return -1;
+    }
     return last;
   }
 
   while (first <= last) {
     pivot = (first + last) / 2;
-    if (addr < thread_data->code_cache_meta[pivot].tpc) {
+    if (addr < thread_data->cc->code_cache_meta[pivot].tpc) {
       last = pivot - 1;
-    } else if (addr >= thread_data->code_cache_meta[pivot+1].tpc) {
+    } else if (addr >= thread_data->cc->code_cache_meta[pivot+1].tpc) {
       first = pivot + 1;
     } else {
       return pivot;
@@ -575,21 +1643,149 @@ int addr_to_fragment_id(dbm_thread *thread_data, uintptr_t addr) {
   return -1;
 }
 
-// TODO: handle links to traces
+#ifdef __arm__
+/* Returns the address of a veneer in the region containing from, which jumps to target.
+   Veneers are shared by all branches in a region with the same target. */
+uintptr_t cc_veneer(dbm_thread *thread_data, uintptr_t from, uintptr_t target, bool is_thumb) {
+  int region = cc_region_index(thread_data, from);
+  if (region < 0) {
+    fprintf(stderr, "Branch out of range from outside the code cache: %x\n", from);
+    while(1);
+  }
+  dbm_cc_region *r = &thread_data->cc->cc_regions[region];
+
+  if (is_thumb) {
+    target |= THUMB;
+  }
+
+  int index = (target >> 1) % CC_VENEER_CACHE;
+  uintptr_t veneer = r->veneers[index];
+  if (veneer != 0 && *(uint32_t *)(veneer + 4) == target) {
+    return veneer;
+  }
+
+  veneer = (uintptr_t)r->veneer_next;
+  if ((veneer + 8) > (uintptr_t)thread_data->cc->code_cache[region].traces + TRACE_CACHE_SIZE) {
+    fprintf(stderr, "Code cache veneer space exhausted in region %d\n", region);
+    while(1);
+  }
+  r->veneer_next += 8;
+
+  // LDR PC, [PC, #...]; .word target
+  if (is_thumb) {
+    uint16_t *write_p = (uint16_t *)veneer;
+    thumb_ldrl32(&write_p, pc, 0, 1);
+  } else {
+    uint32_t *write_p = (uint32_t *)veneer;
+    arm_ldr(&write_p, IMM_LDR, pc, pc, 4, 1, 0, 0);
+  }
+  *(uint32_t *)(veneer + 4) = target;
+  __clear_cache((char *)veneer, (char *)veneer + 8);
+
+  r->veneers[index] = veneer;
+  record_cc_link(thread_data, (veneer + 4) | FULLADDR, target);
+
+  return veneer;
+}
+#endif
+
+#ifdef DBM_COMPACT_EXITS
+/* Returns the space for the two dispatcher calls of a compact exit of the basic block
+   being scanned, see a64_compact_exit. allocate_bb() keeps CODE_CACHE_OVERP basic
+   blocks free below the stubs. */
+uint32_t *cc_exit_stubs(dbm_thread *thread_data) {
+  dbm_cc_region *r = &thread_data->cc->cc_regions[thread_data->cc->cc_region];
+
+  r->stub_next -= A64_EXIT_STUB_WORDS * 2 * sizeof(uint32_t);
+  if (r->stub_next < thread_data->cc->bb_cache_next) {
+    fprintf(stderr, "Code cache exit stub space exhausted in region %d\n", thread_data->cc->cc_region);
+    while(1);
+  }
+
+  return (uint32_t *)r->stub_next;
+}
+#endif
+
 void record_cc_link(dbm_thread *thread_data, uintptr_t linked_from, uintptr_t linked_to_addr) {
-  int linked_to = addr_to_bb_id(thread_data, linked_to_addr);
+  int linked_to = addr_to_fragment_id(thread_data, linked_to_addr);
 
   debug("Linked 0x%x (%d) from 0x%x\n", linked_to_addr, linked_to, linked_from);
 
   if (linked_to < 0) return;
 
-  ll_entry *entry = linked_list_alloc(thread_data->cc_links);
+  ll_entry *entry = linked_list_alloc(thread_data->cc->cc_links);
   assert(entry != NULL);
 
   entry->data = linked_from;
-  entry->next = thread_data->code_cache_meta[linked_to].linked_from;
-  thread_data->code_cache_meta[linked_to].linked_from = entry;
+  entry->next = thread_data->cc->code_cache_meta[linked_to].linked_from;
+  thread_data->cc->code_cache_meta[linked_to].linked_from = entry;
+}
+
+// Retargets all the links in the list to tpc, then records them again
+void cc_move_links(dbm_thread *thread_data, ll_entry *links, uintptr_t tpc) {
+  ll_entry *next;
+  uintptr_t linked_from;
+
+  while (links != NULL) {
+    next = links->next;
+    linked_from = links->data;
+    linked_list_free(thread_data->cc->cc_links, links);
+
+    cc_link_retarget(thread_data, linked_from, tpc);
+    record_cc_link(thread_data, linked_from, tpc);
+    links = next;
+  }
+}
+
+/* Updates a link recorded by record_cc_link to branch to the fragment with
+   the entry address tpc */
+void cc_link_retarget(dbm_thread *thread_data, uintptr_t linked_from, uintptr_t tpc) {
+  uintptr_t orig_branch = linked_from;
+
+  debug("Link from: 0x%lx, update to: 0x%lx\n", linked_from, tpc);
+#ifdef __arm__
+  uintptr_t tpc_direct = adjust_cc_entry(tpc);
+  orig_branch &= 0xFFFFFFFE;
+  if (linked_from & THUMB) {
+    thumb_adjust_b_bl_target(thread_data, (uint16_t *)orig_branch, tpc_direct);
+  } else if ((linked_from & 3) == FULLADDR) {
+    orig_branch &= ~FULLADDR;
+    *(uint32_t *)orig_branch = tpc_direct;
+  } else {
+    arm_adjust_b_bl_target((uint32_t *)orig_branch, tpc_direct);
+  }
+#elif __aarch64__
+  if ((linked_from & 3) == FULLADDR) {
+    orig_branch &= ~FULLADDR;
+    *(uint64_t *)orig_branch = tpc;
+#ifdef DBM_COMPACT_EXITS
+  } else if ((linked_from & 3) == CONDBRANCH) {
+    orig_branch &= ~CONDBRANCH;
+    a64_compact_exit_link_taken((uint32_t *)orig_branch, tpc + 4);
+    __clear_cache((void *)orig_branch, (void *)orig_branch + 12);
+    return;
+#endif
+  } else {
+    a64_b_helper((uint32_t *)orig_branch, tpc + 4);
+  }
+#endif
+  __clear_cache((void *)orig_branch, (void *)orig_branch + 4);
+}
+
+#ifdef DBM_RAS
+void ras_reset(dbm_thread *thread_data) {
+  memset(&thread_data->ras, 0, sizeof(thread_data->ras));
+}
+
+// Updates the predictions pointing to a fragment which is being replaced
+void ras_retarget(dbm_thread *thread_data, uintptr_t old_tpc, uintptr_t new_tpc) {
+  for (int i = 0; i < RAS_SIZE; i++) {
+    if (thread_data->ras.entries[i].tpc == old_tpc) {
+      thread_data->ras.entries[i].tpc = new_tpc;
+    }
+  }
 }
+#endif
 
 void main(int argc, char **argv, char **envp) {
   Elf *elf = NULL;
@@ -605,16 +1801,24 @@ void main(int argc, char **argv, char **envp) {
 
   global_data.argc = argc;
   global_data.argv = argv;
+  global_data.huge_pages = getenv(HUGE_PAGES_ENV) != NULL;
+  trace_config_init();
 
   int ret = pthread_mutex_init(&global_data.thread_list_mutex, NULL);
   assert(ret == 0);
 
   ret = interval_map_init(&global_data.exec_allocs, 512);
   assert(ret == 0);
+#ifdef DBM_SMC_WRITE_PROTECT
+  smc_init();
+#endif
 
   ret = pthread_mutex_init(&global_data.signal_handlers_mutex, NULL);
   assert(ret == 0);
 
+  ret = pthread_mutex_init(&global_data.inval_mutex, NULL);
+  assert(ret == 0);
+
   install_system_sig_handlers();
 
   global_data.brk = 0;
@@ -634,7 +1838,18 @@ void main(int argc, char **argv, char **envp) {
   if (ehdr->e_type == ET_DYN) entry_address += DYN_OBJ_OFFSET;
   uintptr_t block_address;
   debug("entry address: 0x%x\n", entry_address);
-  
+
+#ifdef DBM_PERSISTENT_CC
+  uintptr_t load_address = UINTPTR_MAX;
+  ELF_PHDR *phdrs = ELF_GETPHDR(elf);
+  for (int i = 0; i < phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD) {
+      load_address = min(load_address, phdrs[i].p_vaddr);
+    }
+  }
+  pcc_init(argv[1], load_address);
+#endif
+
   dbm_thread *thread_data;
   if (!allocate_thread_data(&thread_data)) {
     fprintf(stderr, "Failed to allocate initial thread data\n");
@@ -645,11 +1860,14 @@ void main(int argc, char **argv, char **envp) {
   thread_data->tid = syscall(__NR_gettid);
   register_thread(thread_data, false);
 
-  block_address = scan(thread_data, (uint16_t *)entry_address, ALLOCATE_BB);
+#ifdef DBM_PERSISTENT_CC
+  pcc_restore(thread_data);
+#endif
+
+  block_address = lookup_or_scan(thread_data, entry_address, NULL);
   debug("Address of first basic block is: 0x%x\n", block_address);
   
   arg_diff = has_interp ? 1 : 2;
   
   elf_run(block_address, entry_address, (has_interp ? "" : argv[1]), phdr, phnum, argc-arg_diff, &argv[arg_diff], envp);
 }
-
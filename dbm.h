@@ -45,10 +45,37 @@
 #endif
 #define TRACE_FRAGMENT_NO 60000
 #define CODE_CACHE_OVERP 30
+#define CC_EVICT_RESERVE 256 // basic blocks usable while an eviction is pending
+#define CC_STOP_KICK_NS (1000 * 1000) // interval of the signals sent by cc_stop_world
 #define MAX_BRANCH_RANGE (16*1024*1024)
 #define TRACE_CACHE_SIZE (MAX_BRANCH_RANGE - (CODE_CACHE_SIZE*BASIC_BLOCK_SIZE * 4))
 #define TRACE_LIMIT_OFFSET (1024)
 
+/* The code cache is made up of up to CC_MAX_REGIONS regions of MAX_BRANCH_RANGE
+   bytes, reserved contiguously and mapped on demand. Each region has its own
+   copy of the trampolines. On AArch64, direct branches reach any region. On
+   AArch32, out of range branches go through veneers placed at the end of the
+   region containing the branch. */
+#ifdef __arm__
+  #define CC_MAX_REGIONS 2
+  #define CC_VENEER_SIZE (256*1024)
+  #define CC_VENEER_CACHE 1024
+#elif __aarch64__
+  #define CC_MAX_REGIONS 8
+  #define CC_VENEER_SIZE 0
+  #if (CC_MAX_REGIONS * MAX_BRANCH_RANGE) > (128*1024*1024)
+    #error "Code cache regions out of range for direct branches"
+  #endif
+#endif
+
+/* Basic blocks are packed by a bump pointer allocator, with BASIC_BLOCK_SIZE words
+   reserved while scanning. CODE_CACHE_SIZE is the size of the basic block area in
+   units of dbm_block, and more fragment IDs than that are available per region. */
+#define BB_FRAGMENTS_PER_REGION (CODE_CACHE_SIZE * 2)
+#define BB_FRAGMENT_NO (BB_FRAGMENTS_PER_REGION * CC_MAX_REGIONS)
+#define BB_ALIGN 4 // must be a power of 2
+#define TRACE_ID_BASE  BB_FRAGMENT_NO
+
 #define TRACE_ALIGN 4 // must be a power of 2
 #define TRACE_ALIGN_MASK (TRACE_ALIGN-1)
 
@@ -56,17 +83,112 @@
 
 #define MAX_TB_INDEX  152
 #define TB_CACHE_SIZE 32
+/* Limits of the translated tables of TBB/TBH instructions preceded by a bounds
+   check, which are sized from it, see thumb_tb_entries */
+#define TB_MAX_INDEX 256
+#define TB_MAX_CACHE_SIZE 64
+
+// Targets cached inline at each indirect branch exit, see ibtc_add
+#define IBTC_SLOTS 2
+
+// Targets linked directly by an A64 jump table and size of its offset map, see a64_jump_table
+#define A64_JT_SLOTS 16
+#define A64_JT_MAP 256
+
+/* Conditional exits of AArch64 basic blocks are three branches, which are linked in
+   place, and their dispatcher calls are placed in a stub area at the end of the
+   basic block area of the region, see a64_compact_exit */
+#if defined(DBM_COMPACT_EXITS) && !defined(__aarch64__)
+  #undef DBM_COMPACT_EXITS
+#endif
+#define A64_EXIT_STUB_WORDS 8 // size of each of the two dispatcher calls of an exit
+
+/* Fragments are indexed by the source pages they were translated from, so that
+   only the affected fragments are discarded by munmap, mprotect and cacheflush,
+   see cc_invalidate_range. The index isn't saved by the persistent code cache. */
+#define MAX_SOURCE_INDEX ((BB_FRAGMENT_NO + TRACE_FRAGMENT_NO * CC_MAX_REGIONS) * 2)
+#if defined(DBM_RANGE_INVALIDATION) && defined(DBM_PERSISTENT_CC)
+  #error "DBM_RANGE_INVALIDATION can't be used with DBM_PERSISTENT_CC"
+#endif
+
+/* Ranges invalidated by a thread are queued for the threads with private code
+   caches, see cc_invalidate. A thread more than INVAL_QUEUE_SIZE behind flushes. */
+#define INVAL_QUEUE_SIZE 64
+
+/* Self-modifying code detection, see smc.c. Pages of writable and executable
+   mappings are write-protected once code has been translated from them. After
+   SMC_WRITE_LIMIT writes, a page is left writable and the basic blocks translated
+   from it are checked against a checksum of their source code on every entry. */
+#define SMC_WRITE_LIMIT 8
+#define SMC_HASH_SIZE 0xFFF
+#define SMC_PENDING_SIZE 64 // pages written since the last entry to the dispatcher
+#if defined(DBM_SMC_WRITE_PROTECT) && !defined(DBM_RANGE_INVALIDATION)
+  #error "DBM_SMC_WRITE_PROTECT requires DBM_RANGE_INVALIDATION"
+#endif
+#if defined(DBM_SMC_WRITE_PROTECT) && defined(DBM_SHARED_CC)
+  #error "DBM_SMC_WRITE_PROTECT can't be used with DBM_SHARED_CC"
+#endif
+
+/* Asynchronous signals are delivered when translated code checks signal_poll,
+   before backward direct branches and indirect branch lookups, instead of by
+   unlinking the interrupted fragment with traps. Every loop in the code cache
+   contains one of these checks or returns through the dispatcher. */
+#if defined(DBM_SIGNAL_POLLING) && !defined(__aarch64__)
+  #undef DBM_SIGNAL_POLLING
+#endif
+// The generated code embeds the address of the thread's pending flag
+#if defined(DBM_SIGNAL_POLLING) && defined(DBM_SHARED_CC)
+  #error "DBM_SIGNAL_POLLING can't be used with DBM_SHARED_CC"
+#endif
 
+/* Defaults of the trace selection options, see trace_config_init. MAX_TRACE_FRAGMENTS
+   is also the largest trace length which can be configured. */
 #define MAX_BACK_INLINE 5
 #define MAX_TRACE_FRAGMENTS 20
+#define TRACE_THRESHOLD 256 // 1 - 256, executions of a trace head before recording a trace
+
+// Trace heads selected for recording, see trace_head_selected
+#define TRACE_HEAD_ANY      (1 << 0) // any block eligible as a trace head
+#define TRACE_HEAD_BACKWARD (1 << 1) // targets of backward direct branches
+#define TRACE_HEAD_EXIT     (1 << 2) // targets of trace exits
+#define TRACE_HEAD_CALL     (1 << 3) // targets of direct calls
+
+// Traces continue through indirect branches with a dominant target, see trace_end_indirect
+#if defined(DBM_TRACE_INDIRECT) && !(defined(DBM_TRACES) && defined(DBM_IBTC))
+  #error "DBM_TRACE_INDIRECT requires DBM_TRACES and DBM_IBTC"
+#endif
 
-#define RAS_SIZE (4096*5)
+/* Shadow return address stack, see return_addr_stack. The index of the top entry
+   is kept in the upper RAS_BITS bits of top, so it wraps around without masking
+   and the byte offset of the entry is top >> RAS_TOP_SHIFT */
+#ifdef __arm__
+  #define RAS_BITS 8
+  #define RAS_ENTRY_BITS 3 // log2(sizeof(cc_addr_pair))
+#elif __aarch64__
+  #define RAS_BITS 10
+  #define RAS_ENTRY_BITS 4
+#endif
+#define RAS_SIZE (1 << RAS_BITS)
+#define RAS_TOP_INC (1U << (32 - RAS_BITS))
+#define RAS_TOP_SHIFT (32 - RAS_BITS - RAS_ENTRY_BITS)
+#ifdef DBM_RAS
+  #ifndef DBM_INLINE_HASH
+    #error "DBM_RAS requires DBM_INLINE_HASH"
+  #endif
+  // The generated code embeds the address of the thread's stack
+  #ifdef DBM_SHARED_CC
+    #error "DBM_RAS can't be used with DBM_SHARED_CC"
+  #endif
+#endif
 #define TBB_TARGET_REACHED_SIZE 30
 
-#define MAX_CC_LINKS 100000
+#define MAX_CC_LINKS (100000 * CC_MAX_REGIONS)
 
 #define THUMB 0x1
 #define FULLADDR 0x2
+#ifdef __aarch64__
+  #define CONDBRANCH 0x1 // B.cond, CB(N)Z or TB(N)Z of a compact exit
+#endif
 
 #define MAX_PLUGIN_NO (10)
 
@@ -145,7 +267,49 @@ typedef struct {
   uintptr_t branch_cache_status;
   uint32_t rn;
   uint32_t free_b;
+#ifdef DBM_TB_DIRECT
+#ifdef __arm__
+  // Size of the index table and number of target slots of a translated TBB/TBH
+  uint16_t tb_entries;
+  uint16_t tb_slots;
+#elif __aarch64__
+  // Target slots of a BR recognised as a jump table, or NULL, see a64_jump_table
+  uint32_t *jt_slots;
+  uintptr_t jt_base;
+  uint32_t jt_free;
+#endif
+#endif
+#ifdef DBM_COMPACT_EXITS
+  // The dispatcher calls of the taken and of the skipped path of a compact exit
+  uint32_t *exit_stubs;
+#endif
+#ifdef DBM_SMC_WRITE_PROTECT
+  // Translated from a page which is no longer write-protected, see smc_add_checked
+  bool smc_checked;
+  // Size in bytes and checksum of the source code, see smc_fragment_extend
+  uint32_t smc_size;
+  uint32_t smc_checksum;
+#endif
   ll_entry *linked_from;
+  // Set by the dispatcher if the exit is never linked, see dispatcher_trampoline
+  bool no_linking;
+#ifdef DBM_TRACES
+  // The exit is a direct call to branch_taken_addr
+  bool call_exit;
+  uint8_t trace_head;
+  // For the first fragment of a trace, the basic block it replaces, otherwise -1
+  int trace_source_bb;
+#endif
+#ifdef DBM_TRACE_PEEPHOLE
+  // The fragment copies an application instruction which reads or writes the flags
+  bool app_flags;
+#endif
+#ifdef DBM_IBTC
+  // Inline target cache of an indirect exit, free_b counts its filled slots
+  void *ibtc;
+  // The target cached in the first slot
+  uintptr_t ibtc_spc;
+#endif
 } dbm_code_cache_meta;
 
 typedef struct {
@@ -156,11 +320,50 @@ typedef struct {
   pid_t *ctid;
 } sys_clone_args;
 
+typedef struct {
+  uintptr_t tpc;
+  uintptr_t spc;
+} cc_addr_pair;
+
+/* Calls push the return address and the address of its translation, returns
+   pop the top entry and branch directly to the translation if the address
+   matches, falling back to the inline hash lookup otherwise */
+typedef struct {
+  uint32_t top;
+  cc_addr_pair entries[RAS_SIZE];
+} return_addr_stack;
+
 struct trace_exits {
   uintptr_t from;
   uintptr_t to;
 };
 
+typedef struct {
+  int free_block;
+  uint8_t *bb_cache_next;
+  int trace_id;
+#ifdef __arm__
+  uint8_t *veneer_next;
+  uintptr_t veneers[CC_VENEER_CACHE];
+#endif
+#ifdef DBM_COMPACT_EXITS
+  // Allocated downwards from the end of the basic block area
+  uint8_t *stub_next;
+#endif
+} dbm_cc_region;
+
+enum trace_head_state {
+  NO_TRACE_HEAD = 0,
+  TRACE_HEAD_COUNTING,
+  TRACE_HEAD_DISABLED
+};
+
+enum trace_end {
+  TRACE_END_INDIRECT,
+  TRACE_END_TRACE,
+  TRACE_END_LENGTH
+};
+
 #define MAX_TRACE_REC_EXITS (MAX_TRACE_FRAGMENTS+1)
 typedef struct {
   int id;
@@ -170,6 +373,8 @@ typedef struct {
   bool active;
   int free_exit_rec;
   struct trace_exits exits[MAX_TRACE_REC_EXITS];
+  // The target along which the trace continues after its last fragment's indirect branch, or 0
+  uintptr_t indirect_target;
 } trace_in_prog;
 
 enum dbm_thread_status {
@@ -179,34 +384,81 @@ enum dbm_thread_status {
 };
 
 typedef struct dbm_thread_s dbm_thread;
-struct dbm_thread_s {
-  dbm_thread *next_thread;
-  enum dbm_thread_status status;
 
+/* Code cache and translation state. Each thread has its own, unless
+   DBM_SHARED_CC is enabled, in which case all threads use the same one */
+typedef struct {
   int free_block;
-  bool was_flushed;
+  uint8_t *bb_cache_next;
   uintptr_t dispatcher_addr;
   uintptr_t syscall_wrapper_addr;
 
   dbm_code_cache *code_cache;
-  dbm_code_cache_meta code_cache_meta[CODE_CACHE_SIZE + TRACE_FRAGMENT_NO];
+  int cc_region;
+  int cc_region_count;
+  bool cc_evict_pending;
+  dbm_cc_region cc_regions[CC_MAX_REGIONS];
+  dbm_code_cache_meta code_cache_meta[BB_FRAGMENT_NO + TRACE_FRAGMENT_NO * CC_MAX_REGIONS];
   hash_table entry_address;
 #ifdef DBM_TRACES
   hash_table trace_entry_address;
 
-  uint8_t   exec_count[CODE_CACHE_SIZE];
+  uint8_t   exec_count[BB_FRAGMENT_NO];
   uintptr_t trace_head_incr_addr;
   uint8_t  *trace_cache_next;
   int       trace_id;
-  int       trace_fragment_count;
-  trace_in_prog active_trace;
 #endif
 
   ll *cc_links;
+#ifdef DBM_RANGE_INVALIDATION
+  // Source page -> list of the IDs of the fragments translated from it
+  hash_table source_pages;
+  ll *source_index;
+#endif
+#ifdef DBM_SMC_WRITE_PROTECT
+  // Source address -> ID of its basic block translated from a checked page
+  hash_table smc_fragments;
+#endif
+
+#ifdef DBM_PROFILE
+  /* Executions of each basic block and trace (counted at its entry), indexed by
+     fragment id, and of the side exit of each trace fragment, indexed by fragment
+     id - TRACE_ID_BASE. See profile_dump */
+  uint32_t profile_count[BB_FRAGMENT_NO + TRACE_FRAGMENT_NO * CC_MAX_REGIONS];
+  uint32_t profile_exit_count[TRACE_FRAGMENT_NO * CC_MAX_REGIONS];
+#endif
 
+#ifdef DBM_SHARED_CC
+  // Serialises all changes to the code cache and to this structure
+  pthread_mutex_t lock;
+  /* Regions are only evicted once all the other threads have stopped, see
+     cc_stop_world. stop_gen counts the evictions. */
+  pthread_cond_t stop_cond;
+  uint32_t stop_gen;
+  // Set by flush_code_cache until the flush has been done by one of the threads
+  bool flush_pending;
+  #ifdef DBM_TRACES
+  // Only one trace is recorded at a time
+  dbm_thread *trace_builder;
+  #endif
+#endif
+} dbm_cc_state;
+
+struct dbm_thread_s {
+  // The TLS emulation code generated for DBM_SHARED_CC uses an unscaled 9-bit offset
   uintptr_t tls;
   uintptr_t child_tls;
 
+  dbm_thread *next_thread;
+  enum dbm_thread_status status;
+
+  dbm_cc_state *cc;
+  bool was_flushed;
+#ifdef DBM_TRACES
+  int       trace_fragment_count;
+  trace_in_prog active_trace;
+#endif
+
 #ifdef PLUGINS_NEW
   void *plugin_priv[MAX_PLUGIN_NO];
 #endif
@@ -216,6 +468,34 @@ struct dbm_thread_s {
   bool clone_vm;
   int pending_signals[_NSIG];
   uint32_t is_signal_pending;
+#ifdef DBM_SIGNAL_POLLING
+  /* Checked by translated code, set when a signal arrives and cleared by
+     deliver_signals, so that signals blocked after arriving don't keep
+     diverting the checks to the dispatcher */
+  volatile uint32_t signal_poll;
+#endif
+  // Invalidations published by the other threads before this one are applied
+  uint32_t inval_epoch;
+#ifdef DBM_SMC_WRITE_PROTECT
+  // Pages made writable by the SIGSEGV handler, see smc_apply_pending
+  uintptr_t smc_pending[SMC_PENDING_SIZE];
+  volatile uint32_t smc_pending_count;
+#endif
+#ifdef DBM_SHARED_CC
+  // Waiting in cc_stop_world, the thread doesn't hold any code cache address
+  bool cc_stopped;
+  // The last cc->stop_gen this thread has seen
+  uint32_t stop_gen;
+  // Signals sent by cc_stop_world which haven't been handled yet
+  int stop_kicks;
+  /* The slot of the address in the code cache to which the system call in progress
+     returns, and its source address. It's redirected if the code cache is evicted. */
+  uintptr_t *syscall_tpc;
+  uintptr_t syscall_spc;
+#endif
+#ifdef DBM_RAS
+  return_addr_stack ras;
+#endif
 };
 
 typedef enum {
@@ -226,6 +506,26 @@ typedef enum {
 
 #include "api/plugin_support.h"
 
+typedef struct {
+  int threshold;
+  int max_fragments;
+  int max_back_inline;
+  int heads;
+  bool stats;
+} trace_options;
+
+typedef struct {
+  uint32_t hot_heads;
+  uint32_t rejected_heads;
+  uint32_t started;
+  uint32_t ended[TRACE_END_LENGTH + 1];
+  uint32_t aborted;
+  uint32_t fragments;
+  uint32_t flushes;
+  uint32_t peephole_pairs;
+  uint32_t indirect_extended;
+} trace_statistics;
+
 typedef struct {
   int argc;
   char **argv;
@@ -239,18 +539,32 @@ typedef struct {
   dbm_thread *threads;
   pthread_mutex_t thread_list_mutex;
 
+  // Ranges invalidated by system calls, global_data.inval_epoch - 1 is the latest
+  pthread_mutex_t inval_mutex;
+  volatile uint32_t inval_epoch;
+  interval_map_entry inval_queue[INVAL_QUEUE_SIZE];
+#ifdef DBM_SMC_WRITE_PROTECT
+  // Writable and executable mappings and the state of their translated pages
+  interval_map wx_allocs;
+  hash_table smc_pages;
+  pthread_mutex_t smc_mutex;
+#endif
+#ifdef DBM_SHARED_CC
+  dbm_cc_state *shared_cc;
+#endif
+
   volatile int exit_group;
+  bool huge_pages;
+  trace_options traces;
+#ifdef DBM_TRACES
+  trace_statistics trace_stats;
+#endif
 #ifdef PLUGINS_NEW
   int free_plugin;
   mambo_plugin plugins[MAX_PLUGIN_NO];
 #endif
 } dbm_global;
 
-typedef struct {
-  uintptr_t tpc;
-  uintptr_t spc;
-} cc_addr_pair;
-
 void dbm_exit(dbm_thread *thread_data, uint32_t code);
 void thread_abort(dbm_thread *thread_data);
 
@@ -282,20 +596,101 @@ uint32_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_b
 size_t   scan_a64(dbm_thread *thread_data, uint32_t *read_address, int basic_block, cc_type type, uint32_t *write_p);
 int allocate_bb(dbm_thread *thread_data);
 void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_index, dbm_thread *thread_data);
+void trace_config_init(void);
+void trace_print_stats(void);
+void trace_head_set(dbm_thread *thread_data, int bb, bool enable);
+void cc_flush_traces(dbm_thread *thread_data, int region);
 void flush_code_cache(dbm_thread *thread_data);
+#ifdef DBM_RANGE_INVALIDATION
+void cc_source_index_add(dbm_thread *thread_data, int fragment_id, uintptr_t addr);
+void cc_invalidate_range(dbm_thread *thread_data, uintptr_t start, uintptr_t end);
+#endif
+void cc_invalidate(dbm_thread *thread_data, uintptr_t start, uintptr_t end);
+void cc_apply_invalidations(dbm_thread *thread_data);
+#ifdef DBM_SMC_WRITE_PROTECT
+void smc_init();
+void smc_fragment_extend(dbm_thread *thread_data, int fragment_id, uintptr_t addr);
+void smc_page_translated(dbm_thread *thread_data, int fragment_id, uintptr_t page);
+bool smc_page_checked(uintptr_t addr);
+bool smc_is_checked(dbm_thread *thread_data, uintptr_t spc);
+bool smc_write_fault(dbm_thread *thread_data, uintptr_t addr);
+void smc_apply_pending(dbm_thread *thread_data);
+void smc_syscall_write(dbm_thread *thread_data, uintptr_t addr, size_t len);
+void smc_mapping_changed(uintptr_t start, uintptr_t end, int prot);
+uintptr_t smc_add_checked(dbm_thread *thread_data, int basic_block);
+uintptr_t smc_lookup_or_scan(dbm_thread *thread_data, uintptr_t target);
+#endif
+void cc_select_region(dbm_thread *thread_data, int region);
+void cc_select_trace_region(dbm_thread *thread_data, int region);
+void cc_next_region(dbm_thread *thread_data, bool can_evict);
+void cc_lock(dbm_thread *thread_data);
+void cc_unlock(dbm_thread *thread_data);
+#ifdef DBM_SHARED_CC
+uintptr_t current_thread_tp_offset();
+void cc_syscall_resume(dbm_thread *thread_data);
+#endif
+void install_trampolines(dbm_thread *thread_data, dbm_code_cache *region);
+
+/* MAMBO's own large mappings, which can be backed by huge pages. The ones before
+   DBM_MAP_HASH are placed at fixed addresses by the persistent code cache. */
+typedef enum {
+  DBM_MAP_THREAD = 0,
+  DBM_MAP_CC_STATE,
+  DBM_MAP_CC_LINKS,
+  DBM_MAP_CODE_CACHE,
+  DBM_MAP_HASH,
+  DBM_MAP_SOURCE_INDEX,
+  DBM_MAP_NO
+} dbm_map;
+
+void *dbm_mmap(dbm_map map, void *addr, size_t length, int prot, int flags);
+
+#ifdef DBM_PERSISTENT_CC
+void pcc_init(char *app_path, uintptr_t load_address);
+void *pcc_mmap(dbm_map map, size_t length, int prot, int flags);
+bool pcc_restore(dbm_thread *thread_data);
+void pcc_save(dbm_thread *thread_data);
+void pcc_invalidate(dbm_thread *thread_data);
+void pcc_exec_mapping(dbm_thread *thread_data, uintptr_t start, uintptr_t end);
+#else
+  #define pcc_mmap(map, length, prot, flags) dbm_mmap((map), NULL, (length), (prot), (flags))
+#endif
 #ifdef __aarch64__
 void generate_trace_exit(dbm_thread *thread_data, uint32_t **o_write_p, int fragment_id, bool is_taken);
 #endif
 void insert_cond_exit_branch(dbm_code_cache_meta *bb_meta, void **o_write_p, int cond);
 void sigret_dispatcher_call(dbm_thread *thread_data, ucontext_t *cont, uintptr_t target);
 
-void thumb_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target);
-void arm_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target);
+size_t thumb_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target);
+size_t arm_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target);
+size_t a64_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint64_t target);
 
 int addr_to_bb_id(dbm_thread *thread_data, uintptr_t addr);
 int addr_to_fragment_id(dbm_thread *thread_data, uintptr_t addr);
 void record_cc_link(dbm_thread *thread_data, uintptr_t linked_from, uintptr_t linked_to_addr);
+void cc_link_retarget(dbm_thread *thread_data, uintptr_t linked_from, uintptr_t tpc);
+void cc_move_links(dbm_thread *thread_data, ll_entry *links, uintptr_t tpc);
+#ifdef DBM_RAS
+void ras_reset(dbm_thread *thread_data);
+void ras_retarget(dbm_thread *thread_data, uintptr_t old_tpc, uintptr_t new_tpc);
+#endif
 bool is_bb(dbm_thread *thread_data, uintptr_t addr);
+#ifdef __arm__
+uintptr_t cc_veneer(dbm_thread *thread_data, uintptr_t from, uintptr_t target, bool is_thumb);
+#endif
+#ifdef DBM_COMPACT_EXITS
+uint32_t *cc_exit_stubs(dbm_thread *thread_data);
+void a64_compact_exit_link_taken(uint32_t *exit_p, uintptr_t target);
+
+// Trace fragments keep the exits with inline dispatcher calls, which traces.c rewrites
+inline static bool is_compact_exit(int fragment_id) {
+  #ifdef DBM_TRACES
+  return fragment_id < TRACE_ID_BASE;
+  #else
+  return true;
+  #endif
+}
+#endif
 void install_system_sig_handlers();
 
 inline static uintptr_t adjust_cc_entry(uintptr_t addr) {
@@ -307,11 +702,57 @@ inline static uintptr_t adjust_cc_entry(uintptr_t addr) {
   return addr;
 }
 
+inline static dbm_block *bb_addr(dbm_thread *thread_data, int bb_id) {
+  return (dbm_block *)thread_data->cc->code_cache_meta[bb_id].tpc;
+}
+
+inline static int cc_region_index(dbm_thread *thread_data, uintptr_t addr) {
+  if (addr < (uintptr_t)thread_data->cc->code_cache) return -1;
+  uintptr_t region = (addr - (uintptr_t)thread_data->cc->code_cache) / sizeof(dbm_code_cache);
+  return (region < thread_data->cc->cc_region_count) ? region : -1;
+}
+
+inline static uint8_t *trace_cache_end(dbm_code_cache *region) {
+  return region->traces + TRACE_CACHE_SIZE - CC_VENEER_SIZE;
+}
+
+#ifdef DBM_TRACES
+// Checks if any thread using this code cache is recording a trace
+inline static bool cc_trace_in_progress(dbm_thread *thread_data) {
+#ifdef DBM_SHARED_CC
+  return thread_data->cc->trace_builder != NULL;
+#else
+  return thread_data->active_trace.active;
+#endif
+}
+#endif
+
+#define trace_id_region(id) (((id) - TRACE_ID_BASE) / TRACE_FRAGMENT_NO)
+#define bb_id_region(id) ((id) / BB_FRAGMENTS_PER_REGION)
+// The IDs overlapping the trampolines are never allocated, so that 0 isn't a valid ID
+#define bb_id_first(region) ((region) * BB_FRAGMENTS_PER_REGION + trampolines_size_bbs)
+
 extern dbm_global global_data;
 extern dbm_thread *disp_thread_data;
 extern uint32_t *th_is_pending_ptr;
+extern uintptr_t th_tp_offset;
+extern uintptr_t disp_fast_data;
 extern __thread dbm_thread *current_thread;
 
+// Called on entry to the dispatcher and to the syscall handler
+inline static void cc_check_invalidations(dbm_thread *thread_data) {
+#ifdef DBM_SMC_WRITE_PROTECT
+  if (thread_data->smc_pending_count != 0) {
+    smc_apply_pending(thread_data);
+  }
+#endif
+#ifndef DBM_SHARED_CC
+  if (thread_data->inval_epoch != global_data.inval_epoch) {
+    cc_apply_invalidations(thread_data);
+  }
+#endif
+}
+
 #ifdef PLUGINS_NEW
 void set_mambo_context(mambo_context *ctx, dbm_thread *thread_data, inst_set inst_type,
                        cc_type fragment_type, int fragment_id, int inst, mambo_cond cond,
@@ -328,29 +769,30 @@ void mambo_deliver_callbacks(unsigned cb_id, dbm_thread *thread_data, inst_set i
 
 #define ALLOCATE_BB 0
 
-#ifdef CC_HUGETLB
-  #define CC_PAGE_SIZE (2*1024*1024)
-  #define CC_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB)
-#else
-  #define CC_PAGE_SIZE 4096
-  #define CC_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS)
-#endif
+// Huge pages are enabled at runtime, see dbm_mmap()
+#define CC_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS)
+#define METADATA_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS)
+#define HUGE_PAGE_SIZE (2*1024*1024)
+#define HUGE_PAGES_ENV "MAMBO_HUGEPAGES"
 
-#ifdef METADATA_HUGETLB
-  #define METADATA_PAGE_SIZE (2*1024*1024)
-  #define METADATA_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB)
-#else
-  #define METADATA_PAGE_SIZE 4096
-  #define METADATA_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS)
-#endif
+// Trace selection options, see trace_config_init()
+#define TRACE_THRESHOLD_ENV "MAMBO_TRACE_THRESHOLD"
+#define TRACE_LENGTH_ENV "MAMBO_TRACE_LENGTH"
+#define TRACE_HEADS_ENV "MAMBO_TRACE_HEADS"
+#define TRACE_STATS_ENV "MAMBO_TRACE_STATS"
+#define BACK_INLINE_ENV "MAMBO_BACK_INLINE"
+
+// Execution counts are written to this file at exit, or to stderr, see profile_dump()
+#define PROFILE_ENV "MAMBO_PROFILE"
 
 #define ROUND_UP(input, multiple_of) \
   ((((input) / (multiple_of)) * (multiple_of)) + (((input) % (multiple_of)) ? (multiple_of) : 0))
 
-#define CC_SZ_ROUND(input) ROUND_UP(input, CC_PAGE_SIZE)
-#define METADATA_SZ_ROUND(input) ROUND_UP(input, CC_PAGE_SIZE)
-
 #define PAGE_SIZE 4096
+#define MAP_PAGE_SIZE (global_data.huge_pages ? HUGE_PAGE_SIZE : PAGE_SIZE)
+
+#define CC_SZ_ROUND(input) ROUND_UP(input, MAP_PAGE_SIZE)
+#define METADATA_SZ_ROUND(input) ROUND_UP(input, MAP_PAGE_SIZE)
 
 #define trampolines_size_bytes         ((uintptr_t)&end_of_dispatcher_s - (uintptr_t)&start_of_dispatcher_s)
 #define trampolines_size_bbs           ((trampolines_size_bytes / sizeof(dbm_block)) \
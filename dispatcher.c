@@ -82,6 +82,260 @@ void insert_cond_exit_branch(dbm_code_cache_meta *bb_meta, void **o_write_p, int
   *o_write_p = write_p;
 }
 
+#ifdef DBM_COMPACT_EXITS
+// Links one path of a compact exit, see a64_compact_exit
+static void link_compact_exit(dbm_thread *thread_data, dbm_code_cache_meta *bb_meta,
+                              bool is_taken, uintptr_t block_address) {
+  uint32_t *branch_addr = bb_meta->exit_branch_addr;
+
+  if (is_taken) {
+    a64_compact_exit_link_taken(branch_addr, block_address + 4);
+    record_cc_link(thread_data, (uintptr_t)branch_addr | CONDBRANCH, block_address);
+    bb_meta->branch_cache_status |= BRANCH_LINKED;
+  } else {
+    a64_cc_branch(thread_data, branch_addr + 1, block_address + 4);
+    bb_meta->branch_cache_status |= FALLTHROUGH_LINKED;
+  }
+
+  if ((bb_meta->branch_cache_status & (BRANCH_LINKED | FALLTHROUGH_LINKED))
+      == (BRANCH_LINKED | FALLTHROUGH_LINKED)) {
+    bb_meta->branch_cache_status |= BOTH_LINKED;
+  }
+}
+#endif
+
+#ifdef DBM_SHARED_CC
+static bool is_exit_linked(dbm_code_cache_meta *bb_meta, uintptr_t target) {
+  if (bb_meta->branch_cache_status & BOTH_LINKED) {
+    return true;
+  }
+  if (target == bb_meta->branch_taken_addr) {
+    return (bb_meta->branch_cache_status & BRANCH_LINKED) != 0;
+  }
+  return (bb_meta->branch_cache_status & FALLTHROUGH_LINKED) != 0;
+}
+#endif
+
+#ifdef DBM_IBTC
+static size_t ibtc_slot_size(dbm_code_cache_meta *bb_meta) {
+#ifdef __arm__
+  return (bb_meta->exit_branch_type == uncond_reg_thumb) ? THUMB_IBTC_SLOT_SIZE : ARM_IBTC_SLOT_SIZE;
+#elif __aarch64__
+  return A64_IBTC_SLOT_SIZE;
+#endif
+}
+
+/* Sets the guard of an inline target cache slot to a NOP if target is NULL,
+   otherwise to a branch to target. The caller must clear the cache. */
+void ibtc_set_guard(dbm_code_cache_meta *bb_meta, int slot, void *target) {
+  void *write_p = bb_meta->ibtc + slot * ibtc_slot_size(bb_meta);
+#ifdef __arm__
+  if (bb_meta->exit_branch_type == uncond_reg_thumb) {
+    if (target == NULL) {
+      thumb_nop16((uint16_t **)&write_p);
+    } else {
+      thumb_b16((uint16_t **)&write_p, (((uint32_t)target - (uint32_t)write_p - 4) >> 1) & 0x7FF);
+    }
+  } else {
+    if (target == NULL) {
+      arm_nop((uint32_t **)&write_p);
+    } else {
+      arm_b32_helper((uint32_t *)write_p, (uint32_t)target, AL);
+    }
+  }
+#elif __aarch64__
+  if (target == NULL) {
+    *(uint32_t *)write_p = NOP;
+  } else {
+    a64_b_helper((uint32_t *)write_p, (uint64_t)target);
+  }
+#endif
+}
+
+/* Caches a new target of an indirect branch exit in the first free slot of its
+   inline target cache. A target which can't be cached closes the cache, i.e. the
+   slot's guard branches directly to the hash table lookup. If link is false, the
+   slot branches to tpc without recording a link, which is used for the next
+   fragment of a trace. Returns false if the target couldn't be cached. */
+static bool ibtc_add_slot(dbm_thread *thread_data, int fragment_id, uintptr_t target,
+                          uintptr_t tpc, bool link) {
+  dbm_code_cache_meta *bb_meta = &thread_data->cc->code_cache_meta[fragment_id];
+  size_t slot_size;
+  void *slot;
+  bool cacheable;
+
+  if (bb_meta->ibtc == NULL) {
+    bb_meta->no_linking = true;
+    return false;
+  }
+  if (bb_meta->no_linking) {
+    return false;
+  }
+
+  slot_size = ibtc_slot_size(bb_meta);
+  slot = bb_meta->ibtc + bb_meta->free_b * slot_size;
+
+#ifdef __arm__
+  if (bb_meta->exit_branch_type == uncond_reg_thumb) {
+    uint16_t *write_p = slot + 2;
+    cacheable = (tpc & THUMB) != 0;
+    if (cacheable) {
+      // MOVW+MOVT r6, #spc
+      copy_to_reg_32bit(&write_p, r6, target);
+      // CMP.W, BNE, POP
+      write_p += 4;
+      if (link) {
+        thumb_cc_branch(thread_data, write_p, tpc);
+      } else {
+        thumb_b32_helper(write_p, tpc);
+      }
+    }
+  } else {
+    uint32_t *write_p = slot + 4;
+    cacheable = (tpc & THUMB) == 0;
+    if (cacheable) {
+      // MOVW+MOVT r6, #spc
+      arm_copy_to_reg_32bit(&write_p, r6, target);
+      // CMP, BNE, POP
+      write_p += 3;
+      if (link) {
+        arm_cc_branch(thread_data, write_p, tpc, AL);
+      } else {
+        arm_b32_helper(write_p, tpc, AL);
+      }
+    }
+  }
+#elif __aarch64__
+  uint32_t *write_p = slot + 4;
+  cacheable = (target >> 48) == 0;
+  if (cacheable) {
+    // MOVZ+MOVK+MOVK X0, #spc
+    for (int i = 0; i < 3; i++) {
+      a64_MOV_wide(&write_p, 1, (i == 0) ? 2 : 3, i, (target >> (i * 16)) & 0xFFFF, x0);
+      write_p++;
+    }
+    // SUB, CBNZ, LDR, LDP
+    write_p += 4;
+    if (link) {
+      a64_cc_branch(thread_data, write_p, tpc + 4);
+    } else {
+      a64_b_helper(write_p, tpc);
+    }
+  }
+#endif
+
+  if (cacheable) {
+    if (bb_meta->free_b == 0) {
+      bb_meta->ibtc_spc = target;
+    }
+    __clear_cache(slot, slot + slot_size);
+    ibtc_set_guard(bb_meta, bb_meta->free_b++, NULL);
+  } else {
+    ibtc_set_guard(bb_meta, bb_meta->free_b, bb_meta->ibtc + IBTC_SLOTS * slot_size);
+  }
+  __clear_cache(slot, slot + 4);
+
+  if (!cacheable || bb_meta->free_b == IBTC_SLOTS) {
+    bb_meta->no_linking = true;
+  }
+
+  return cacheable;
+}
+
+void ibtc_add(dbm_thread *thread_data, int fragment_id, uintptr_t target, uintptr_t block_address) {
+  ibtc_add_slot(thread_data, fragment_id, target, block_address, true);
+}
+
+#ifdef DBM_TRACES
+bool ibtc_add_fragment(dbm_thread *thread_data, int fragment_id, uintptr_t target, uintptr_t tpc) {
+  return ibtc_add_slot(thread_data, fragment_id, target, tpc, false);
+}
+#endif
+
+/* Bypasses the filled slots, so that an unlinked indirect exit always
+   reaches its trapped branch, see unlink_indirect_branch */
+void ibtc_unlink(dbm_code_cache_meta *bb_meta) {
+  size_t slot_size;
+
+  if (bb_meta->ibtc == NULL) {
+    return;
+  }
+
+  slot_size = ibtc_slot_size(bb_meta);
+  for (int i = 0; i < bb_meta->free_b; i++) {
+    ibtc_set_guard(bb_meta, i, bb_meta->ibtc + IBTC_SLOTS * slot_size);
+  }
+  __clear_cache(bb_meta->ibtc, bb_meta->ibtc + IBTC_SLOTS * slot_size);
+}
+
+void ibtc_relink(dbm_code_cache_meta *bb_meta) {
+  if (bb_meta->ibtc == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < bb_meta->free_b; i++) {
+    ibtc_set_guard(bb_meta, i, NULL);
+  }
+  __clear_cache(bb_meta->ibtc, bb_meta->ibtc + IBTC_SLOTS * ibtc_slot_size(bb_meta));
+}
+#endif
+
+#if defined(__aarch64__) && defined(DBM_TB_DIRECT)
+/* Links a target of a jump table (see a64_jump_table) from its next free slot and
+   selects the slot in the offset map. Returns false if the target is out of the map
+   or all the slots are used, then it's left to the inline target cache. */
+bool jump_table_add(dbm_thread *thread_data, int fragment_id, uintptr_t target, uintptr_t tpc) {
+  dbm_code_cache_meta *bb_meta = &thread_data->cc->code_cache_meta[fragment_id];
+  uintptr_t offset = target - bb_meta->jt_base;
+  uint8_t *map;
+  uint32_t *slot;
+
+  if (bb_meta->jt_slots == NULL || (offset & 3) != 0 || (offset >> 2) >= A64_JT_MAP) {
+    return false;
+  }
+
+  map = (uint8_t *)(bb_meta->jt_slots + (A64_JT_SLOTS + 1) * 2);
+  if (map[offset >> 2] != 0) {
+    return true;
+  }
+  if (bb_meta->jt_free > A64_JT_SLOTS) {
+    return false;
+  }
+
+  slot = bb_meta->jt_slots + bb_meta->jt_free * 2;
+  uint32_t *write_p = slot;
+  a64_pop_pair_reg(x0, x1);
+  a64_cc_branch(thread_data, write_p, tpc + 4);
+  __clear_cache(slot, slot + 2);
+
+  // The slot becomes reachable once it's selected in the map
+  map[offset >> 2] = bb_meta->jt_free++;
+
+  return true;
+}
+
+/* A jump table is unlinked by replacing its BR with a branch to slot 0, which
+   continues to the inline target cache and the hash lookup */
+void jump_table_unlink(dbm_code_cache_meta *bb_meta) {
+  if (bb_meta->jt_slots == NULL) {
+    return;
+  }
+
+  uint32_t *write_p = bb_meta->jt_slots - 1;
+  a64_b_helper(write_p, (uint64_t)bb_meta->jt_slots);
+  __clear_cache(write_p, write_p + 1);
+}
+
+void jump_table_relink(dbm_code_cache_meta *bb_meta) {
+  if (bb_meta->jt_slots == NULL) {
+    return;
+  }
+
+  uint32_t *write_p = bb_meta->jt_slots - 1;
+  a64_BR(&write_p, x0);
+  __clear_cache(write_p, write_p + 1);
+}
+#endif
 
 void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, dbm_thread *thread_data) {
   uintptr_t block_address;
@@ -101,6 +355,10 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
   bool cc_flushed;
 #ifdef __arm__
   uint16_t *branch_addr;
+#ifdef DBM_TB_DIRECT
+  int tb_entries, tb_slots, tb_size;
+  uint16_t tb_offset;
+#endif
 #endif // __arm__
 #ifdef __aarch64__
   uint32_t *branch_addr;
@@ -111,20 +369,37 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
      because when scanning a stub basic block the source block and its
      meta-information get overwritten */
   debug("Source block index: %d\n", source_index);
-  source_branch_type = thread_data->code_cache_meta[source_index].exit_branch_type;
+  cc_lock(thread_data);
+  thread_data->was_flushed = false;
+  if (thread_data->cc->cc_evict_pending) {
+    cc_next_region(thread_data, true);
+  }
+  cc_check_invalidations(thread_data);
+  source_branch_type = thread_data->cc->code_cache_meta[source_index].exit_branch_type;
 
 #ifdef DBM_TRACES
   // Handle trace exits separately
-  if (source_index >= CODE_CACHE_SIZE) {
+  if (source_index >= TRACE_ID_BASE
 #ifdef __arm__
-    if (source_branch_type != tbb && source_branch_type != tbh)
+      && source_branch_type != tbb && source_branch_type != tbh
 #endif
-      return trace_dispatcher(target, next_addr, source_index, thread_data);
+     ) {
+    trace_dispatcher(target, next_addr, source_index, thread_data);
+    cc_unlock(thread_data);
+    return;
   }
 #endif
 
   debug("Reached the dispatcher, target: 0x%x, ret: %p, src: %d thr: %p\n", target, next_addr, source_index, thread_data);
-  thread_data->was_flushed = false;
+#ifdef DBM_SMC_WRITE_PROTECT
+  // Code from pages which are written often is checked on every entry and never linked
+  block_address = smc_lookup_or_scan(thread_data, target);
+  if (block_address != UINT_MAX) {
+    *next_addr = block_address;
+    cc_unlock(thread_data);
+    return;
+  }
+#endif
   block_address = lookup_or_scan(thread_data, target, &cached);
   if (cached) {
     debug("Found block from %d for 0x%x in cache at 0x%x\n", source_index, target, block_address);
@@ -136,9 +411,18 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
 
   // Bypass any linking
   if (source_index == 0 || thread_data->was_flushed) {
+    cc_unlock(thread_data);
     return;
   }
 
+#ifdef DBM_SHARED_CC
+  // Another thread might have linked this exit while this one was waiting for the lock
+  if (is_exit_linked(&thread_data->cc->code_cache_meta[source_index], target)) {
+    cc_unlock(thread_data);
+    return;
+  }
+#endif
+
   switch (source_branch_type) {
 #ifdef __arm__
 #ifdef DBM_TB_DIRECT
@@ -147,53 +431,68 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
       /* the index is invalid only when the inline hash lookup is called for a new BB,
          no linking is required */
   #ifdef FAST_BT
-      if (thread_data->code_cache_meta[source_index].rn >= TB_CACHE_SIZE) {
+      if (thread_data->cc->code_cache_meta[source_index].rn >= TB_CACHE_SIZE) {
         break;
       }
     #else
-      if (thread_data->code_cache_meta[source_index].rn >= MAX_TB_INDEX) {
+      if (thread_data->cc->code_cache_meta[source_index].rn >= thread_data->cc->code_cache_meta[source_index].tb_entries) {
         break;
       }
     #endif
-      //thread_data->code_cache_meta[source_index].count++;
-      branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
+      //thread_data->cc->code_cache_meta[source_index].count++;
+      branch_addr = thread_data->cc->code_cache_meta[source_index].exit_branch_addr;
     #ifdef FAST_BT
       branch_table = (uint32_t *)(((uint32_t)branch_addr + 20 + 2) & 0xFFFFFFFC);
-      branch_table[thread_data->code_cache_meta[source_index].rn] = block_address;
+      branch_table[thread_data->cc->code_cache_meta[source_index].rn] = block_address;
     #else
       branch_addr += 7;
-      table = (uint8_t *)branch_addr;
-      if (thread_data->code_cache_meta[source_index].free_b == TB_CACHE_SIZE) {
+      tb_entries = thread_data->cc->code_cache_meta[source_index].tb_entries;
+      tb_slots = thread_data->cc->code_cache_meta[source_index].tb_slots;
+      tb_size = tb_table_size(tb_entries, tb_slots);
+      if (thread_data->cc->code_cache_meta[source_index].free_b == tb_slots) {
         // if the list of linked blocks is full, link this index to the inline hash lookup
       #ifdef DBM_D_INLINE_HASH
-        table[thread_data->code_cache_meta[source_index].rn] = MAX_TB_INDEX / 2 + TB_CACHE_SIZE * 2 + 1;
+        tb_offset = tb_size + tb_slots * 2 + 1;
       #else
-        table[thread_data->code_cache_meta[source_index].rn] = MAX_TB_INDEX / 2 + TB_CACHE_SIZE * 2;
+        tb_offset = tb_size + tb_slots * 2;
       #endif
       } else {
         // allocate a branch slot and link it
-        cache_index = thread_data->code_cache_meta[source_index].free_b++;
-        table[thread_data->code_cache_meta[source_index].rn] = MAX_TB_INDEX / 2 + cache_index * 2;
+        cache_index = thread_data->cc->code_cache_meta[source_index].free_b++;
+        tb_offset = tb_size + cache_index * 2;
         
         // insert the branch to the target BB
-        branch_addr += MAX_TB_INDEX / 2 + cache_index * 2;
-        thumb_cc_branch(thread_data, branch_addr, (uint32_t)block_address);
-        __clear_cache(branch_addr, branch_addr + 5);
+        thumb_cc_branch(thread_data, branch_addr + tb_offset, (uint32_t)block_address);
+        __clear_cache(branch_addr + tb_offset, branch_addr + tb_offset + 5);
+      }
+
+      if (tb_halfword_table(tb_entries, tb_slots)) {
+        branch_addr[thread_data->cc->code_cache_meta[source_index].rn] = tb_offset;
+      } else {
+        table = (uint8_t *)branch_addr;
+        table[thread_data->cc->code_cache_meta[source_index].rn] = tb_offset;
       }
     #endif
       
       // invalidate the saved rm value - required to detect calls from the inline hash lookup
-      thread_data->code_cache_meta[source_index].rn = INT_MAX;
+      thread_data->cc->code_cache_meta[source_index].rn = INT_MAX;
 
       break;
   #endif // DBM_TB_DIRECT
+  #ifdef DBM_IBTC
+    case uncond_reg_thumb:
+    case uncond_reg_arm:
+      ibtc_add(thread_data, source_index, target, block_address);
+      break;
+  #endif
   #ifdef DBM_LINK_UNCOND_IMM
     case uncond_imm_thumb:
     case uncond_b_to_bl_thumb:
-      branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
+      branch_addr = thread_data->cc->code_cache_meta[source_index].exit_branch_addr;
       if (block_address & 0x1) {
         if (source_branch_type == uncond_b_to_bl_thumb) {
           thumb_b32_helper(branch_addr, (uint32_t)block_address);
+          record_cc_link(thread_data, (uint32_t)branch_addr|THUMB, block_address);
         } else {
           thumb_cc_branch(thread_data, branch_addr, (uint32_t)block_address);
         }
@@ -208,42 +507,43 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
           branch_addr += 2;
         }
         *(uint32_t *)branch_addr = block_address;
+        record_cc_link(thread_data, (uint32_t)branch_addr|FULLADDR, block_address);
         __clear_cache((char *)branch_addr-7, (char *)branch_addr);
       }
       break;
 
     case uncond_imm_arm:
-      branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
-      arm_b32_helper((uint32_t *)branch_addr, (uint32_t)block_address, AL);
+      branch_addr = thread_data->cc->code_cache_meta[source_index].exit_branch_addr;
+      arm_cc_branch(thread_data, (uint32_t *)branch_addr, (uint32_t)block_address, AL);
       __clear_cache(branch_addr, (char *)branch_addr+5);
       break;
   #endif
   #ifdef DBM_LINK_COND_IMM
     case cond_imm_arm:
-      branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
-      is_taken = target == thread_data->code_cache_meta[source_index].branch_taken_addr;
+      branch_addr = thread_data->cc->code_cache_meta[source_index].exit_branch_addr;
+      is_taken = target == thread_data->cc->code_cache_meta[source_index].branch_taken_addr;
 
-      if (thread_data->code_cache_meta[source_index].branch_cache_status == 0) {
+      if (thread_data->cc->code_cache_meta[source_index].branch_cache_status == 0) {
         if (is_taken) {
-          other_target = thread_data->code_cache_meta[source_index].branch_skipped_addr;
+          other_target = thread_data->cc->code_cache_meta[source_index].branch_skipped_addr;
         } else {
-          other_target = thread_data->code_cache_meta[source_index].branch_taken_addr;
+          other_target = thread_data->cc->code_cache_meta[source_index].branch_taken_addr;
         }
         other_target = cc_lookup(thread_data, other_target);
         other_target_in_cache = (other_target != UINT_MAX);
 
-        cond = thread_data->code_cache_meta[source_index].branch_condition;
+        cond = thread_data->cc->code_cache_meta[source_index].branch_condition;
         if (!is_taken) {
           cond = invert_cond(cond);
         }
 
-        thread_data->code_cache_meta[source_index].branch_cache_status =
+        thread_data->cc->code_cache_meta[source_index].branch_cache_status =
                      (is_taken ? BRANCH_LINKED : FALLTHROUGH_LINKED);
       } else {
         branch_addr += 2;
         other_target_in_cache = false;
         cond = AL;
-        thread_data->code_cache_meta[source_index].branch_cache_status |= BOTH_LINKED;
+        thread_data->cc->code_cache_meta[source_index].branch_cache_status |= BOTH_LINKED;
       }
       arm_cc_branch(thread_data, (uint32_t *)branch_addr, (uint32_t)block_address, cond);
       branch_addr += 2;
@@ -251,37 +551,37 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
       if (other_target_in_cache) {
         arm_cc_branch(thread_data, (uint32_t *)branch_addr, (uint32_t)other_target, AL);
         branch_addr += 2;
-        thread_data->code_cache_meta[source_index].branch_cache_status |= BOTH_LINKED;
+        thread_data->cc->code_cache_meta[source_index].branch_cache_status |= BOTH_LINKED;
       }
 
-      __clear_cache(thread_data->code_cache_meta[source_index].exit_branch_addr, branch_addr);
+      __clear_cache(thread_data->cc->code_cache_meta[source_index].exit_branch_addr, branch_addr);
       break;
 
     case cond_imm_thumb:
       if (block_address & 0x1) {
-        branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
+        branch_addr = thread_data->cc->code_cache_meta[source_index].exit_branch_addr;
         debug("Target is: 0x%x, b taken addr: 0x%x, b skipped addr: 0x%x\n",
-               target, thread_data->code_cache_meta[source_index].branch_taken_addr,
-               thread_data->code_cache_meta[source_index].branch_skipped_addr);
+               target, thread_data->cc->code_cache_meta[source_index].branch_taken_addr,
+               thread_data->cc->code_cache_meta[source_index].branch_skipped_addr);
         debug("Overwriting branches at %p\n", branch_addr);
-        if (target == thread_data->code_cache_meta[source_index].branch_taken_addr) {
-          other_target = cc_lookup(thread_data, thread_data->code_cache_meta[source_index].branch_skipped_addr);
+        if (target == thread_data->cc->code_cache_meta[source_index].branch_taken_addr) {
+          other_target = cc_lookup(thread_data, thread_data->cc->code_cache_meta[source_index].branch_skipped_addr);
           other_target_in_cache = (other_target != UINT_MAX);
           thumb_encode_cond_imm_branch(thread_data, &branch_addr, 
                                       source_index,
                                       block_address,
-                                      (other_target_in_cache ? other_target : thread_data->code_cache_meta[source_index].branch_skipped_addr),
-                                      thread_data->code_cache_meta[source_index].branch_condition,
+                                      (other_target_in_cache ? other_target : thread_data->cc->code_cache_meta[source_index].branch_skipped_addr),
+                                      thread_data->cc->code_cache_meta[source_index].branch_condition,
                                       true,
                                       other_target_in_cache, true);
         } else {
-          other_target = cc_lookup(thread_data, thread_data->code_cache_meta[source_index].branch_taken_addr);
+          other_target = cc_lookup(thread_data, thread_data->cc->code_cache_meta[source_index].branch_taken_addr);
           other_target_in_cache = (other_target != UINT_MAX);
           thumb_encode_cond_imm_branch(thread_data, &branch_addr, 
                                       source_index,
-                                      (other_target_in_cache ? other_target : thread_data->code_cache_meta[source_index].branch_taken_addr),
+                                      (other_target_in_cache ? other_target : thread_data->cc->code_cache_meta[source_index].branch_taken_addr),
                                       block_address,
-                                      thread_data->code_cache_meta[source_index].branch_condition,
+                                      thread_data->cc->code_cache_meta[source_index].branch_condition,
                                       other_target_in_cache,
                                       true, true);
         }
@@ -296,30 +596,30 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
   #endif // DBM_LINK_COND_IMM
   #ifdef DBM_LINK_CBZ
     case cbz_thumb:
-      branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
+      branch_addr = thread_data->cc->code_cache_meta[source_index].exit_branch_addr;
       debug("Target is: 0x%x, b taken addr: 0x%x, b skipped addr: 0x%x\n",
-             target, thread_data->code_cache_meta[source_index].branch_taken_addr,
-             thread_data->code_cache_meta[source_index].branch_skipped_addr);
+             target, thread_data->cc->code_cache_meta[source_index].branch_taken_addr,
+             thread_data->cc->code_cache_meta[source_index].branch_skipped_addr);
       debug("Overwriting branches at %p\n", branch_addr);
-      if (target == thread_data->code_cache_meta[source_index].branch_taken_addr) {
-        other_target = cc_lookup(thread_data, thread_data->code_cache_meta[source_index].branch_skipped_addr);
+      if (target == thread_data->cc->code_cache_meta[source_index].branch_taken_addr) {
+        other_target = cc_lookup(thread_data, thread_data->cc->code_cache_meta[source_index].branch_skipped_addr);
         other_target_in_cache = (other_target != UINT_MAX);
         thumb_encode_cbz_branch(thread_data,
-                                thread_data->code_cache_meta[source_index].rn,
+                                thread_data->cc->code_cache_meta[source_index].rn,
                                 &branch_addr,
                                 source_index,
                                 block_address,
-                                (other_target_in_cache ? other_target : thread_data->code_cache_meta[source_index].branch_skipped_addr),
+                                (other_target_in_cache ? other_target : thread_data->cc->code_cache_meta[source_index].branch_skipped_addr),
                                 true,
                                 other_target_in_cache, true);
       } else {
-        other_target = cc_lookup(thread_data, thread_data->code_cache_meta[source_index].branch_taken_addr);
+        other_target = cc_lookup(thread_data, thread_data->cc->code_cache_meta[source_index].branch_taken_addr);
         other_target_in_cache = (other_target != UINT_MAX);
         thumb_encode_cbz_branch(thread_data,
-                                thread_data->code_cache_meta[source_index].rn,
+                                thread_data->cc->code_cache_meta[source_index].rn,
                                 &branch_addr,
                                 source_index,
-                                (other_target_in_cache ? other_target : thread_data->code_cache_meta[source_index].branch_taken_addr),
+                                (other_target_in_cache ? other_target : thread_data->cc->code_cache_meta[source_index].branch_taken_addr),
                                 block_address,
                                 other_target_in_cache,
                                 true, true);
@@ -331,7 +631,7 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
   #endif // DBM_LINK_CBZ
 
     case uncond_blxi_thumb:
-      branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
+      branch_addr = thread_data->cc->code_cache_meta[source_index].exit_branch_addr;
 
       thumb_ldrl32(&branch_addr, pc, ((uint32_t)branch_addr & 2) ? 4 : 0, 1);
 	    branch_addr += 2;
@@ -344,7 +644,7 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
       break;
 
     case uncond_blxi_arm:
-      branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
+      branch_addr = thread_data->cc->code_cache_meta[source_index].exit_branch_addr;
 
       arm_ldr((uint32_t **)&branch_addr, IMM_LDR, pc, pc, 4, 1, 0, 0);
       branch_addr += 2;
@@ -357,10 +657,10 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
 #ifdef __aarch64__
   #ifdef DBM_LINK_UNCOND_IMM
     case uncond_imm_a64:
-      branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
+      branch_addr = thread_data->cc->code_cache_meta[source_index].exit_branch_addr;
       a64_cc_branch(thread_data, branch_addr, block_address + 4);
       __clear_cache((void *)branch_addr, (void *)branch_addr + 4 + 1);
-      thread_data->code_cache_meta[source_index].branch_cache_status = BRANCH_LINKED;
+      thread_data->cc->code_cache_meta[source_index].branch_cache_status = BRANCH_LINKED;
       break;
   #endif
   #ifdef DBM_LINK_COND_IMM
@@ -373,30 +673,48 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
     case tbz_a64:
   #endif
   #if defined(DBM_LINK_COND_IMM) || defined(DBM_LINK_CBZ) || defined(DBM_LINK_TBZ)
-      branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
-      is_taken = target == thread_data->code_cache_meta[source_index].branch_taken_addr;
+      branch_addr = thread_data->cc->code_cache_meta[source_index].exit_branch_addr;
+      is_taken = target == thread_data->cc->code_cache_meta[source_index].branch_taken_addr;
+
+    #ifdef DBM_COMPACT_EXITS
+      if (is_compact_exit(source_index)) {
+        dbm_code_cache_meta *bb_meta = &thread_data->cc->code_cache_meta[source_index];
+        link_compact_exit(thread_data, bb_meta, is_taken, block_address);
+
+        if ((bb_meta->branch_cache_status & BOTH_LINKED) == 0) {
+          other_target = cc_lookup(thread_data, is_taken ? bb_meta->branch_skipped_addr
+                                                         : bb_meta->branch_taken_addr);
+          if (other_target != UINT_MAX) {
+            link_compact_exit(thread_data, bb_meta, !is_taken, other_target);
+          }
+        }
 
-      if (thread_data->code_cache_meta[source_index].branch_cache_status == 0) {
+        __clear_cache((void *)branch_addr, (void *)(branch_addr + 3));
+        break;
+      }
+    #endif
+
+      if (thread_data->cc->code_cache_meta[source_index].branch_cache_status == 0) {
         if (is_taken) {
-          other_target = thread_data->code_cache_meta[source_index].branch_skipped_addr;
+          other_target = thread_data->cc->code_cache_meta[source_index].branch_skipped_addr;
         } else {
-          other_target = thread_data->code_cache_meta[source_index].branch_taken_addr;
+          other_target = thread_data->cc->code_cache_meta[source_index].branch_taken_addr;
         }
         other_target = cc_lookup(thread_data, other_target);
         other_target_in_cache = (other_target != UINT_MAX);
 
-        cond = thread_data->code_cache_meta[source_index].branch_condition;
+        cond = thread_data->cc->code_cache_meta[source_index].branch_condition;
         if (is_taken) {
           cond = invert_cond(cond);
         }
-        insert_cond_exit_branch(&thread_data->code_cache_meta[source_index], (void **)&branch_addr, cond);
+        insert_cond_exit_branch(&thread_data->cc->code_cache_meta[source_index], (void **)&branch_addr, cond);
 
-        thread_data->code_cache_meta[source_index].branch_cache_status =
+        thread_data->cc->code_cache_meta[source_index].branch_cache_status =
                       (is_taken ? BRANCH_LINKED : FALLTHROUGH_LINKED);
       } else {
         branch_addr += 2;
         other_target_in_cache = false;
-        thread_data->code_cache_meta[source_index].branch_cache_status |= BOTH_LINKED;
+        thread_data->cc->code_cache_meta[source_index].branch_cache_status |= BOTH_LINKED;
       }
 
       a64_cc_branch(thread_data, branch_addr, block_address + 4);
@@ -405,13 +723,31 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
       if (other_target_in_cache) {
         a64_cc_branch(thread_data, branch_addr, other_target + 4);
         branch_addr++;
-        thread_data->code_cache_meta[source_index].branch_cache_status |= BOTH_LINKED;
+        thread_data->cc->code_cache_meta[source_index].branch_cache_status |= BOTH_LINKED;
       }
 
-      __clear_cache((void *)thread_data->code_cache_meta[source_index].exit_branch_addr,
+      __clear_cache((void *)thread_data->cc->code_cache_meta[source_index].exit_branch_addr,
                     (void *)branch_addr);
       break;
   #endif
+  #if defined(DBM_IBTC) || defined(DBM_TB_DIRECT)
+    case uncond_branch_reg:
+    #ifdef DBM_TB_DIRECT
+      if (jump_table_add(thread_data, source_index, target, block_address)) {
+        break;
+      }
+    #endif
+    #ifdef DBM_IBTC
+      ibtc_add(thread_data, source_index, target, block_address);
+    #endif
+      break;
+  #endif
 #endif // __arch64__
+    default:
+      // Later cache hits from this exit are handled by dispatcher_trampoline
+      thread_data->cc->code_cache_meta[source_index].no_linking = true;
+      break;
   }
+
+  cc_unlock(thread_data);
 }
@@ -25,8 +25,11 @@
   #define EM_MACHINE EM_ARM
   #define ELF_EHDR   Elf32_Ehdr
   #define ELF_PHDR   Elf32_Phdr
+  #define ELF_SHDR   Elf32_Shdr
+  #define ELF_NHDR   Elf32_Nhdr
   #define ELF_GETEHDR(...) elf32_getehdr(__VA_ARGS__)
   #define ELF_GETPHDR(...) elf32_getphdr(__VA_ARGS__)
+  #define ELF_GETSHDR(...) elf32_getshdr(__VA_ARGS__)
   #define ELF_AUXV_T Elf32_auxv_t
 #endif
 #ifdef __aarch64__
@@ -34,8 +37,11 @@
   #define EM_MACHINE EM_AARCH64
   #define ELF_EHDR   Elf64_Ehdr
   #define ELF_PHDR   Elf64_Phdr
+  #define ELF_SHDR   Elf64_Shdr
+  #define ELF_NHDR   Elf64_Nhdr
   #define ELF_GETEHDR(...) elf64_getehdr(__VA_ARGS__)
   #define ELF_GETPHDR(...) elf64_getphdr(__VA_ARGS__)
+  #define ELF_GETSHDR(...) elf64_getshdr(__VA_ARGS__)
   #define ELF_AUXV_T Elf64_auxv_t
 #endif
 
@@ -0,0 +1,724 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2013-2016 Cosmin Gorgovan <cosmin at linux-geek dot org>
+  Copyright 2017 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Persistent code cache
+
+  The translated code embeds the addresses of the code cache, of its metadata and,
+  for the TLS emulation, of the dbm_thread structure. Instead of relocating the
+  fragments, these are mapped at the addresses recorded in the cache file, which is
+  keyed by the build ID and load address of the application. The code cache, the
+  fragment metadata (including the exit branch addresses and link lists) and the
+  contents of the hash tables are saved on exit and restored before the first basic
+  block is scanned.
+
+  Code outside the image loaded by MAMBO is mapped later by the application, so the
+  file-backed executable mappings are also recorded. Restored fragments are only
+  valid as long as any mapping overlapping them is identical, the code cache is
+  flushed on the first mismatch.
+*/
+
+#ifdef DBM_PERSISTENT_CC
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/utsname.h>
+
+#include <libelf.h>
+
+#include "dbm.h"
+#include "common.h"
+#include "elf_loader/elf_loader.h"
+
+#ifdef DEBUG
+  #define debug(...) fprintf(stderr, __VA_ARGS__)
+  #ifndef VERBOSE
+    #define VERBOSE
+  #endif
+#else
+  #define debug(...)
+#endif
+
+#ifdef VERBOSE
+  #define info(...) fprintf(stderr, __VA_ARGS__)
+#else
+  #define info(...)
+#endif
+
+#ifndef MAP_FIXED_NOREPLACE
+  #define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define PCC_DIR_ENV "MAMBO_CC_DIR"
+#define PCC_MAGIC 0x4343424d // "MBCC"
+#define PCC_VERSION 1
+#define PCC_ID_LEN 72
+#define PCC_MAX_MAPPINGS 256
+// The hash tables are rebuilt when restoring, they can be placed anywhere
+#define PCC_MAP_NO DBM_MAP_HASH
+
+#define CC_LINKS_SIZE (sizeof(ll) + sizeof(ll_entry) * MAX_CC_LINKS)
+
+// Identifies the application, MAMBO and the kernel, the file is only used if they all match
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  char app_id[PCC_ID_LEN];
+  uintptr_t load_address;
+  uint64_t mambo_dev;
+  uint64_t mambo_ino;
+  int64_t mambo_size;
+  int64_t mambo_mtime;
+  char kernel[256];
+} pcc_key;
+
+typedef struct {
+  pcc_key key;
+  uintptr_t map_addr[PCC_MAP_NO];
+  int cc_region_count;
+  int mapping_count;
+} pcc_header;
+
+typedef struct {
+  uintptr_t addr;
+  uintptr_t len;
+} pcc_chunk;
+
+/* An executable mapping of the application. Anonymous mappings can't be
+   validated, they never match except for the special ones (e.g. [vdso]) */
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+  int64_t offset_delta; // file offset - start
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime;
+  char name[16];
+} pcc_mapping;
+
+static struct {
+  bool enabled;
+  int fd;
+  char path[PATH_MAX];
+  pcc_key key;
+  pcc_header header;
+  bool map_claimed[PCC_MAP_NO];
+  uintptr_t map_addr[PCC_MAP_NO];
+  dbm_cc_state *cc;
+  pthread_mutex_t mutex;
+  // The restored fragments are valid as long as these mappings don't change
+  int mapping_count;
+  pcc_mapping mappings[PCC_MAX_MAPPINGS];
+} pcc = { .enabled = false, .fd = -1 };
+
+static bool pcc_write(int fd, void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, buf, len);
+    if (ret <= 0) return false;
+    buf += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+static bool pcc_read(int fd, void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = read(fd, buf, len);
+    if (ret <= 0) return false;
+    buf += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+// Reads the GNU build ID of an ELF file as a hex string
+static bool pcc_build_id(char *path, char *id, size_t len) {
+  bool found = false;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
+  Elf_Scn *scn = NULL;
+  while (elf != NULL && !found && (scn = elf_nextscn(elf, scn)) != NULL) {
+    ELF_SHDR *shdr = ELF_GETSHDR(scn);
+    if (shdr == NULL || shdr->sh_type != SHT_NOTE) continue;
+
+    Elf_Data *data = elf_getdata(scn, NULL);
+    size_t off = 0;
+    while (data != NULL && off + sizeof(ELF_NHDR) <= data->d_size) {
+      ELF_NHDR *note = (ELF_NHDR *)(data->d_buf + off);
+      uint8_t *name = (uint8_t *)(note + 1);
+      uint8_t *desc = name + align_higher(note->n_namesz, 4);
+      off += sizeof(ELF_NHDR) + align_higher(note->n_namesz, 4) + align_higher(note->n_descsz, 4);
+      if (off > data->d_size) break;
+
+      if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0 && note->n_descsz * 2 < len) {
+        for (int i = 0; i < note->n_descsz; i++) {
+          sprintf(&id[i * 2], "%02x", desc[i]);
+        }
+        found = true;
+        break;
+      }
+    }
+  }
+
+  if (elf != NULL) elf_end(elf);
+  close(fd);
+  return found;
+}
+
+// Parses a line of /proc/self/maps
+static bool pcc_parse_mapping(char *line, pcc_mapping *m, bool *exec) {
+  unsigned long start, end, offset, ino;
+  unsigned int major, minor;
+  char perms[5];
+  int path_pos = 0;
+  struct stat st;
+
+  if (sscanf(line, "%lx-%lx %4s %lx %x:%x %lu %n", &start, &end, perms, &offset,
+             &major, &minor, &ino, &path_pos) < 7) {
+    return false;
+  }
+  char *path = &line[path_pos];
+  path[strcspn(path, "\n")] = '\0';
+
+  memset(m, 0, sizeof(*m));
+  m->start = start;
+  m->end = end;
+  m->offset_delta = (int64_t)offset - (int64_t)start;
+  *exec = perms[2] == 'x';
+
+  if (ino != 0 && stat(path, &st) == 0 && st.st_ino == ino &&
+      st.st_dev == makedev(major, minor)) {
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    m->size = st.st_size;
+    m->mtime = st.st_mtime;
+  } else if (path[0] == '[') {
+    strncpy(m->name, path, sizeof(m->name) - 1);
+  }
+
+  return true;
+}
+
+static bool pcc_same_mapping(pcc_mapping *a, pcc_mapping *b) {
+  if (a->ino != 0) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime == b->mtime && a->offset_delta == b->offset_delta;
+  }
+  return a->name[0] == '[' && strcmp(a->name, b->name) == 0 && a->start == b->start;
+}
+
+/* Checks the current mappings overlapping [start, end) against the recorded ones.
+   Called with pcc.mutex held or before any other threads are created. */
+static bool pcc_check_mappings(uintptr_t start, uintptr_t end) {
+  char line[PATH_MAX + 128];
+  pcc_mapping cur;
+  bool match = true;
+  bool exec;
+
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (maps == NULL) return false;
+
+  while (match && fgets(line, sizeof(line), maps) != NULL) {
+    if (!pcc_parse_mapping(line, &cur, &exec) || cur.end <= start || cur.start >= end) continue;
+
+    for (int i = 0; i < pcc.mapping_count; i++) {
+      pcc_mapping *rec = &pcc.mappings[i];
+      if (cur.start < rec->end && cur.end > rec->start && !pcc_same_mapping(rec, &cur)) {
+        debug("pcc: mapping %p-%p doesn't match %p-%p\n", (void *)cur.start, (void *)cur.end,
+              (void *)rec->start, (void *)rec->end);
+        match = false;
+        break;
+      }
+    }
+  }
+
+  fclose(maps);
+  return match;
+}
+
+/* Records the mappings backing the executable areas of the application, which
+   have the execute permission removed, and the other executable file-backed
+   or special (e.g. [vdso]) mappings */
+static bool pcc_record_mappings() {
+  char line[PATH_MAX + 128];
+  pcc_mapping cur;
+  interval_map *imap = &global_data.exec_allocs;
+  bool ok = true;
+  bool exec;
+
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (maps == NULL) return false;
+
+  pcc.mapping_count = 0;
+  while (ok && fgets(line, sizeof(line), maps) != NULL) {
+    if (!pcc_parse_mapping(line, &cur, &exec)) continue;
+    bool record = exec && (cur.ino != 0 || cur.name[0] == '[');
+    if (!record) {
+      record = interval_map_search(imap, cur.start, cur.end) > 0;
+    }
+    if (record) {
+      if (pcc.mapping_count >= PCC_MAX_MAPPINGS) {
+        ok = false;
+      } else {
+        pcc.mappings[pcc.mapping_count++] = cur;
+      }
+    }
+  }
+
+  fclose(maps);
+
+  return ok;
+}
+
+// Saves [start, start + len) as chunks, skipping the pages which are all zero
+static bool pcc_write_range(int fd, uintptr_t start, size_t len) {
+  uintptr_t end = start + len;
+  uintptr_t run_start = 0;
+  pcc_chunk chunk;
+
+  for (uintptr_t page = start; run_start != 0 || page < end; page += PAGE_SIZE) {
+    bool zero = true;
+    if (page < end) {
+      uintptr_t *words = (uintptr_t *)page;
+      for (int i = 0; i < min(PAGE_SIZE, end - page) / sizeof(uintptr_t); i++) {
+        if (words[i] != 0) {
+          zero = false;
+          break;
+        }
+      }
+    }
+
+    if (!zero && run_start == 0) {
+      run_start = page;
+    } else if (zero && run_start != 0) {
+      chunk.addr = run_start;
+      chunk.len = min(page, end) - run_start;
+      if (!pcc_write(fd, &chunk, sizeof(chunk)) ||
+          !pcc_write(fd, (void *)chunk.addr, chunk.len)) {
+        return false;
+      }
+      run_start = 0;
+    }
+  }
+
+  return true;
+}
+
+static bool pcc_write_hash(int fd, hash_table *table) {
+  int count = 0;
+  hash_entry entry;
+  for (int i = 0; i < table->size; i++) {
+    if (HASH_KEY(table, i) != 0) count++;
+  }
+  if (!pcc_write(fd, &count, sizeof(count))) return false;
+
+  for (int i = 0; i < table->size; i++) {
+    entry.key = HASH_KEY(table, i);
+    entry.value = HASH_VALUE(table, i);
+    if (entry.key != 0 && !pcc_write(fd, &entry, sizeof(entry))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The restored table struct is stale, its entries are reallocated
+static void pcc_reset_hash(hash_table *table) {
+  table->entries = NULL;
+  table->old_entries = NULL;
+  hash_init(table, CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+}
+
+static bool pcc_read_hash(int fd, hash_table *table) {
+  int count;
+  hash_entry entry;
+
+  if (!pcc_read(fd, &count, sizeof(count))) return false;
+  for (int i = 0; i < count; i++) {
+    if (!pcc_read(fd, &entry, sizeof(entry))) return false;
+    hash_add(table, entry.key, entry.value);
+  }
+  return true;
+}
+
+static void pcc_close() {
+  if (pcc.fd >= 0) {
+    close(pcc.fd);
+    pcc.fd = -1;
+  }
+}
+
+void pcc_init(char *app_path, uintptr_t load_address) {
+  char *dir = getenv(PCC_DIR_ENV);
+  struct stat st;
+  struct utsname uts;
+
+  int ret = pthread_mutex_init(&pcc.mutex, NULL);
+  assert(ret == 0);
+
+  if (dir == NULL || stat(app_path, &st) != 0) return;
+
+  memset(&pcc.key, 0, sizeof(pcc.key));
+  pcc.key.magic = PCC_MAGIC;
+  pcc.key.version = PCC_VERSION;
+  if (!pcc_build_id(app_path, pcc.key.app_id, sizeof(pcc.key.app_id))) {
+    snprintf(pcc.key.app_id, sizeof(pcc.key.app_id), "%lx-%lx-%lx", (unsigned long)st.st_ino,
+             (unsigned long)st.st_size, (unsigned long)st.st_mtime);
+  }
+  pcc.key.load_address = load_address;
+
+  if (stat("/proc/self/exe", &st) != 0 || uname(&uts) != 0) return;
+  pcc.key.mambo_dev = st.st_dev;
+  pcc.key.mambo_ino = st.st_ino;
+  pcc.key.mambo_size = st.st_size;
+  pcc.key.mambo_mtime = st.st_mtime;
+  snprintf(pcc.key.kernel, sizeof(pcc.key.kernel), "%s %s", uts.release, uts.version);
+
+  snprintf(pcc.path, sizeof(pcc.path), "%s/%s-%lx.cc", dir, pcc.key.app_id,
+           (unsigned long)load_address);
+  pcc.enabled = true;
+
+  pcc.fd = open(pcc.path, O_RDONLY);
+  if (pcc.fd < 0) return;
+
+  if (!pcc_read(pcc.fd, &pcc.header, sizeof(pcc.header)) ||
+      memcmp(&pcc.header.key, &pcc.key, sizeof(pcc.key)) != 0 ||
+      pcc.header.mapping_count > PCC_MAX_MAPPINGS ||
+      pcc.header.cc_region_count < 1 || pcc.header.cc_region_count > CC_MAX_REGIONS ||
+      !pcc_read(pcc.fd, pcc.mappings, sizeof(pcc_mapping) * pcc.header.mapping_count)) {
+    info("pcc: ignoring %s\n", pcc.path);
+    pcc_close();
+    return;
+  }
+  pcc.mapping_count = pcc.header.mapping_count;
+  info("pcc: using %s\n", pcc.path);
+}
+
+/* The first mapping of each type is placed at the address used by the saved code
+   cache. If that isn't possible, the saved code cache is discarded. */
+void *pcc_mmap(dbm_map map, size_t length, int prot, int flags) {
+  void *hint = NULL;
+  void *addr;
+
+  assert(map < PCC_MAP_NO);
+  bool claim = pcc.enabled && !pcc.map_claimed[map];
+  if (claim && pcc.fd >= 0) {
+    hint = (void *)pcc.header.map_addr[map];
+    addr = dbm_mmap(map, hint, length, prot, flags | MAP_FIXED_NOREPLACE);
+    if (addr != MAP_FAILED && addr != hint) {
+      munmap(addr, METADATA_SZ_ROUND(length));
+      addr = MAP_FAILED;
+    }
+    if (addr == MAP_FAILED) {
+      info("pcc: couldn't map at %p, discarding the saved code cache\n", hint);
+      pcc_close();
+      hint = NULL;
+    }
+  }
+
+  if (hint == NULL) {
+    addr = dbm_mmap(map, NULL, length, prot, flags);
+  }
+
+  if (claim && addr != MAP_FAILED) {
+    pcc.map_claimed[map] = true;
+    pcc.map_addr[map] = (uintptr_t)addr;
+  }
+  return addr;
+}
+
+/* Only the non-zero pages are saved. Discarding the pages avoids touching
+   the whole area, but it isn't supported for hugetlb mappings by older kernels. */
+static void pcc_zero(void *addr, size_t len) {
+  if (madvise(addr, METADATA_SZ_ROUND(len), MADV_DONTNEED) != 0) {
+    memset(addr, 0, len);
+  }
+}
+
+static bool pcc_in_range(pcc_chunk *chunk, uintptr_t start, size_t len) {
+  return chunk->addr >= start && chunk->len <= len && chunk->addr - start <= len - chunk->len;
+}
+
+// Reads the saved value of a dbm_cc_state field, the pages which weren't saved are zero
+static bool pcc_peek(int fd, pcc_chunk *chunk, off_t data, void *field, size_t len, void *value) {
+  pcc_chunk f = { (uintptr_t)field, len };
+  if (!pcc_in_range(&f, chunk->addr, chunk->len)) return true;
+  return pread(fd, value, len, data + (f.addr - chunk->addr)) == (ssize_t)len;
+}
+
+static bool pcc_skip_hash(int fd, off_t size) {
+  int count;
+  if (!pcc_read(fd, &count, sizeof(count)) || count < 0) return false;
+  off_t pos = lseek(fd, (off_t)count * sizeof(hash_entry), SEEK_CUR);
+  return pos >= 0 && pos <= size;
+}
+
+/* Checks the whole file before the current code cache is discarded,
+   leaving the offset at the first chunk */
+static bool pcc_validate(int fd, dbm_cc_state *cc, ll *cc_links,
+                         dbm_code_cache *code_cache, int region_count) {
+  dbm_code_cache *saved_code_cache = NULL;
+  ll *saved_cc_links = NULL;
+  int saved_region_count = 0;
+  pcc_chunk chunk;
+  struct stat st;
+
+  off_t start = lseek(fd, 0, SEEK_CUR);
+  if (start < 0 || fstat(fd, &st) != 0) return false;
+
+  while (pcc_read(fd, &chunk, sizeof(chunk))) {
+    if (chunk.len == 0) {
+      bool ok = pcc_skip_hash(fd, st.st_size);
+#ifdef DBM_TRACES
+      ok = ok && pcc_skip_hash(fd, st.st_size);
+#endif
+      ok = ok && lseek(fd, 0, SEEK_CUR) == st.st_size
+              && saved_code_cache == code_cache && saved_cc_links == cc_links
+              && saved_region_count == region_count;
+      return ok && lseek(fd, start, SEEK_SET) == start;
+    }
+
+    if (!pcc_in_range(&chunk, (uintptr_t)cc, sizeof(dbm_cc_state)) &&
+        !pcc_in_range(&chunk, (uintptr_t)cc_links, CC_LINKS_SIZE) &&
+        !pcc_in_range(&chunk, (uintptr_t)code_cache, sizeof(dbm_code_cache) * region_count)) {
+      return false;
+    }
+    off_t data = lseek(fd, 0, SEEK_CUR);
+    if (data < 0 || chunk.len > (uintptr_t)(st.st_size - data) ||
+        !pcc_peek(fd, &chunk, data, &cc->code_cache, sizeof(cc->code_cache), &saved_code_cache) ||
+        !pcc_peek(fd, &chunk, data, &cc->cc_links, sizeof(cc->cc_links), &saved_cc_links) ||
+        !pcc_peek(fd, &chunk, data, &cc->cc_region_count, sizeof(cc->cc_region_count), &saved_region_count) ||
+        lseek(fd, chunk.len, SEEK_CUR) < 0) {
+      return false;
+    }
+  }
+  return false;
+}
+
+/* Replaces the newly initialised code cache of the main thread with the saved one.
+   Called from main() before the first basic block is scanned. */
+bool pcc_restore(dbm_thread *thread_data) {
+  dbm_cc_state *cc = thread_data->cc;
+  dbm_code_cache *code_cache = cc->code_cache;
+  ll *cc_links = cc->cc_links;
+  int region_count = pcc.header.cc_region_count;
+  pcc_chunk chunk;
+  bool ok;
+
+  pcc.cc = cc;
+  if (pcc.fd < 0) {
+    pcc.mapping_count = 0;
+    return false;
+  }
+
+  for (int i = 0; i < PCC_MAP_NO; i++) {
+    assert(pcc.map_claimed[i] && pcc.map_addr[i] == pcc.header.map_addr[i]);
+  }
+  if (!pcc_check_mappings(0, UINTPTR_MAX)) {
+    info("pcc: the executable mappings have changed, discarding %s\n", pcc.path);
+    pcc_close();
+    pcc.mapping_count = 0;
+    return false;
+  }
+
+  if (!pcc_validate(pcc.fd, cc, cc_links, code_cache, region_count)) {
+    fprintf(stderr, "pcc: discarding the invalid file %s\n", pcc.path);
+    pcc_close();
+    pcc.mapping_count = 0;
+    return false;
+  }
+
+  for (int r = cc->cc_region_count; r < region_count; r++) {
+    cc_select_region(thread_data, r);
+  }
+
+  hash_free(&cc->entry_address);
+#ifdef DBM_TRACES
+  hash_free(&cc->trace_entry_address);
+#endif
+  pcc_zero(cc, sizeof(dbm_cc_state));
+  pcc_zero(cc_links, CC_LINKS_SIZE);
+  pcc_zero(code_cache, sizeof(dbm_code_cache) * region_count);
+
+  do {
+    ok = pcc_read(pcc.fd, &chunk, sizeof(chunk));
+    if (ok && chunk.len != 0) {
+      ok = (pcc_in_range(&chunk, (uintptr_t)cc, sizeof(dbm_cc_state)) ||
+            pcc_in_range(&chunk, (uintptr_t)cc_links, CC_LINKS_SIZE) ||
+            pcc_in_range(&chunk, (uintptr_t)code_cache, sizeof(dbm_code_cache) * region_count))
+           && pcc_read(pcc.fd, (void *)chunk.addr, chunk.len);
+    }
+  } while (ok && chunk.len != 0);
+
+  pcc_reset_hash(&cc->entry_address);
+  ok = ok && pcc_read_hash(pcc.fd, &cc->entry_address);
+#ifdef DBM_TRACES
+  pcc_reset_hash(&cc->trace_entry_address);
+  ok = ok && pcc_read_hash(pcc.fd, &cc->trace_entry_address);
+#endif
+  ok = ok && cc->code_cache == code_cache && cc->cc_links == cc_links
+          && cc->cc_region_count == region_count;
+  pcc_close();
+
+#ifdef DBM_SHARED_CC
+  int ret = pthread_mutex_init(&cc->lock, NULL);
+  assert(ret == 0);
+  ret = pthread_cond_init(&cc->stop_cond, NULL);
+  assert(ret == 0);
+  thread_data->stop_gen = cc->stop_gen;
+  cc->flush_pending = false;
+  #ifdef DBM_TRACES
+  cc->trace_builder = NULL;
+  #endif
+#endif
+
+  if (!ok) {
+    fprintf(stderr, "pcc: failed to restore %s\n", pcc.path);
+    cc->code_cache = code_cache;
+    cc->cc_links = cc_links;
+    cc->cc_region_count = region_count;
+    pcc.mapping_count = 0;
+    flush_code_cache(thread_data);
+  }
+#ifdef DBM_TRACES
+  if (ok) {
+    thread_data->active_trace.active = false;
+    thread_data->active_trace.id = cc->trace_id;
+  }
+#endif
+
+  // The trampolines were zeroed or restored with stale pointers
+  for (int r = 0; r < region_count; r++) {
+    install_trampolines(thread_data, &code_cache[r]);
+    __clear_cache((char *)&code_cache[r], (char *)&code_cache[r + 1]);
+  }
+  if (!ok) return false;
+
+  info("pcc: restored %d code cache regions\n", region_count);
+  return true;
+}
+
+void pcc_save(dbm_thread *thread_data) {
+  char tmp_path[PATH_MAX + 32];
+  pcc_header header;
+  pcc_chunk end = {0, 0};
+  dbm_cc_state *cc = thread_data->cc;
+  bool ok;
+
+  if (!pcc.enabled || cc != pcc.cc) return;
+#ifdef PLUGINS_NEW
+  // Plugins can embed pointers to their private data in the code cache
+  if (global_data.free_plugin > 0) return;
+#endif
+
+  cc_lock(thread_data);
+
+  ok = !cc->cc_evict_pending;
+#ifdef DBM_TRACES
+  ok = ok && !cc_trace_in_progress(thread_data);
+#endif
+  // Fragments are unlinked while delivering signals
+  for (dbm_thread *it = global_data.threads; it != NULL; it = it->next_thread) {
+    if (it->cc == cc && it->is_signal_pending != 0) ok = false;
+  }
+
+  int ret = pthread_mutex_lock(&pcc.mutex);
+  assert(ret == 0);
+  ok = ok && pcc_record_mappings();
+
+  memset(&header, 0, sizeof(header));
+  header.key = pcc.key;
+  for (int i = 0; i < PCC_MAP_NO; i++) {
+    header.map_addr[i] = pcc.map_addr[i];
+  }
+  header.cc_region_count = cc->cc_region_count;
+  header.mapping_count = pcc.mapping_count;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", pcc.path, getpid());
+  int fd = ok ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+  if (fd >= 0) {
+    ok = pcc_write(fd, &header, sizeof(header)) &&
+         pcc_write(fd, pcc.mappings, sizeof(pcc_mapping) * pcc.mapping_count) &&
+         pcc_write_range(fd, (uintptr_t)cc, sizeof(dbm_cc_state)) &&
+         pcc_write_range(fd, (uintptr_t)cc->cc_links, sizeof(ll) + sizeof(ll_entry) * cc->cc_links->used) &&
+         pcc_write_range(fd, (uintptr_t)cc->code_cache, sizeof(dbm_code_cache) * cc->cc_region_count) &&
+         pcc_write(fd, &end, sizeof(end)) &&
+         pcc_write_hash(fd, &cc->entry_address);
+#ifdef DBM_TRACES
+    ok = ok && pcc_write_hash(fd, &cc->trace_entry_address);
+#endif
+    ok = (close(fd) == 0) && ok;
+    if (ok && rename(tmp_path, pcc.path) == 0) {
+      info("pcc: saved %s\n", pcc.path);
+    } else {
+      unlink(tmp_path);
+    }
+  }
+
+  ret = pthread_mutex_unlock(&pcc.mutex);
+  assert(ret == 0);
+  cc_unlock(thread_data);
+}
+
+// Called when the code cache is flushed, the restored fragments are no longer used
+void pcc_invalidate(dbm_thread *thread_data) {
+  if (thread_data->cc == pcc.cc) {
+    pcc.mapping_count = 0;
+  }
+}
+
+// Called after [start, end) has been made executable by the application
+void pcc_exec_mapping(dbm_thread *thread_data, uintptr_t start, uintptr_t end) {
+  if (pcc.mapping_count == 0) return;
+
+  int ret = pthread_mutex_lock(&pcc.mutex);
+  assert(ret == 0);
+  bool match = pcc.mapping_count == 0 || pcc_check_mappings(start, end);
+  ret = pthread_mutex_unlock(&pcc.mutex);
+  assert(ret == 0);
+
+  if (!match) {
+    if (thread_data->cc == pcc.cc) {
+      info("pcc: %p-%p doesn't match the saved code cache, flushing\n", (void *)start, (void *)end);
+      cc_lock(thread_data);
+      flush_code_cache(thread_data);
+      cc_unlock(thread_data);
+    } else {
+      fprintf(stderr, "Warning: %p-%p doesn't match the saved code cache of another thread\n",
+              (void *)start, (void *)end);
+    }
+  }
+}
+
+#endif // DBM_PERSISTENT_CC
@@ -23,6 +23,8 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "dbm.h"
 #include "scanner_common.h"
@@ -33,8 +35,25 @@
 
 #include "api/helpers.h"
 
-#define NOP 0xD503201F /* NOP Instruction (A64) */
 #define MIN_FSPACE 60
+#ifdef DBM_RAS
+  #define RAS_PUSH_SPACE 100
+  #define RAS_POP_SPACE 56
+#else
+  #define RAS_POP_SPACE 0
+#endif
+#ifdef DBM_IBTC
+  #define IBTC_SPACE (IBTC_SLOTS * A64_IBTC_SLOT_SIZE)
+#else
+  #define IBTC_SPACE 0
+#endif
+#ifdef DBM_SIGNAL_POLLING
+  #define SIGNAL_POLL_SPACE 56
+  #define IHL_POLL_SPACE 24
+#else
+  #define IHL_POLL_SPACE 0
+#endif
+#define IHL_SPACE (88 + RAS_POP_SPACE + IBTC_SPACE + IHL_POLL_SPACE)
 
 //#define DEBUG
 #ifdef DEBUG
@@ -186,12 +205,70 @@ void a64_branch_jump(dbm_thread *thread_data, uint32_t **o_write_p,
 
   if (flags & INSERT_BRANCH) {
     a64_copy_to_reg_64bits(&write_p, x1, basic_block);
-    a64_b_helper(write_p, thread_data->dispatcher_addr);
+    a64_b_helper(write_p, thread_data->cc->dispatcher_addr);
     write_p++;
   }
   *o_write_p = write_p;
 }
 
+#ifdef DBM_COMPACT_EXITS
+/* Links the taken path of a compact exit: the conditional branch at exit_p[0] is pointed
+   at target if it's in range, otherwise at the B at exit_p[2], which is pointed at target */
+void a64_compact_exit_link_taken(uint32_t *exit_p, uintptr_t target) {
+  int bits = ((exit_p[0] & 0x7E000000) == 0x36000000) ? 14 : 19; // TB(N)Z or B.cond / CB(N)Z
+  uint32_t mask = ((1 << bits) - 1) << 5;
+  int64_t difference = target - (uintptr_t)exit_p;
+
+  if (difference < -(1 << (bits + 1)) || difference >= (1 << (bits + 1))) {
+    a64_b_helper(&exit_p[2], target);
+    difference = 8;
+  }
+  exit_p[0] = (exit_p[0] & ~mask) | (((difference >> 2) << 5) & mask);
+}
+
+static void a64_exit_stub(dbm_thread *thread_data, uint32_t *write_p, int basic_block, uint64_t target) {
+  a64_branch_save_context(&write_p);
+  a64_branch_jump(thread_data, &write_p, basic_block, target, REPLACE_TARGET | INSERT_BRANCH);
+}
+
+static void a64_compact_exit(dbm_thread *thread_data, uint32_t **o_write_p,
+                             int basic_block, uint64_t target, uint64_t skipped) {
+  /*
+   *                   +------------------------------+
+   * exit_branch_addr  |          B.cond    TAKEN     |  (or CB(N)Z, TB(N)Z)
+   *                   |          B         SKIPPED_S |
+   *                   | TAKEN:   B         TAKEN_S   |
+   *                   +------------------------------+
+   *
+   *   In the stub area of the region:
+   *                   +------------------------------+
+   *                   | TAKEN_S: STP                 |
+   *                   |          MOV       X0, TARGET|
+   *                   |          MOV       X1, BB_ID |
+   *                   |          B       DISPATCHER  |
+   *                   | SKIPPED_S:  (same, READ+4)   |
+   *                   +------------------------------+
+   *
+   * The conditional branch is written by the caller. The skipped path is linked
+   * by overwriting the B to SKIPPED_S, the taken path by a64_compact_exit_link_taken.
+   */
+  uint32_t *write_p = *o_write_p;
+  uint32_t *stubs = cc_exit_stubs(thread_data);
+
+  a64_exit_stub(thread_data, stubs, basic_block, target);
+  a64_exit_stub(thread_data, stubs + A64_EXIT_STUB_WORDS, basic_block, skipped);
+  __clear_cache((char *)stubs, (char *)(stubs + A64_EXIT_STUB_WORDS * 2));
+  thread_data->cc->code_cache_meta[basic_block].exit_stubs = stubs;
+
+  a64_b_helper(write_p, (uint64_t)(stubs + A64_EXIT_STUB_WORDS));
+  write_p++;
+  a64_b_helper(write_p, (uint64_t)stubs);
+  write_p++;
+
+  *o_write_p = write_p;
+}
+#endif
+
 void a64_branch_jump_cond(dbm_thread *thread_data, uint32_t **o_write_p, int basic_block,
                           uint64_t target, uint32_t *read_address, uint32_t cond) {
    /*
@@ -216,6 +293,16 @@ void a64_branch_jump_cond(dbm_thread *thread_data, uint32_t **o_write_p, int bas
 
   debug("A64 branch: read_addr: %p, target: 0x%lx\n", read_address, target);
 
+#ifdef DBM_COMPACT_EXITS
+  if (is_compact_exit(basic_block)) {
+    a64_b_cond_helper(write_p, (uint64_t)(write_p + 2), cond);
+    write_p++;
+    a64_compact_exit(thread_data, &write_p, basic_block, target, (uint64_t)read_address + 4);
+    *o_write_p = write_p;
+    return;
+  }
+#endif
+
   *write_p = NOP;
   write_p++;
   *write_p = NOP;
@@ -227,13 +314,13 @@ void a64_branch_jump_cond(dbm_thread *thread_data, uint32_t **o_write_p, int bas
   cond_branch = write_p++;
 
   a64_copy_to_reg_64bits(&write_p, x0, target);
-  a64_b_helper(write_p, thread_data->dispatcher_addr);
+  a64_b_helper(write_p, thread_data->cc->dispatcher_addr);
   write_p++;
 
   a64_b_cond_helper(cond_branch, (uint64_t)write_p, invert_cond(cond));
 
   a64_copy_to_reg_64bits(&write_p, x0, (uint64_t)read_address + 4);
-  a64_b_helper(write_p, thread_data->dispatcher_addr);
+  a64_b_helper(write_p, thread_data->cc->dispatcher_addr);
   write_p++;
 
   *o_write_p = write_p;
@@ -271,9 +358,9 @@ void a64_branch_imm_reg(dbm_thread *thread_data, uint32_t **o_write_p,
       a64_CBZ_CBNZ_decode_fields(read_address, &sf, &op, &imm, &rt);
       branch_offset = sign_extend64(19, imm) << 2;
 #ifdef DBM_LINK_CBZ
-      thread_data->code_cache_meta[basic_block].exit_branch_type = cbz_a64;
-      thread_data->code_cache_meta[basic_block].branch_condition = op;
-      thread_data->code_cache_meta[basic_block].rn = (sf << 5) | rt;
+      thread_data->cc->code_cache_meta[basic_block].exit_branch_type = cbz_a64;
+      thread_data->cc->code_cache_meta[basic_block].branch_condition = op;
+      thread_data->cc->code_cache_meta[basic_block].rn = (sf << 5) | rt;
 #endif
       break;
     case A64_TBZ_TBNZ:
@@ -281,17 +368,34 @@ void a64_branch_imm_reg(dbm_thread *thread_data, uint32_t **o_write_p,
       branch_offset = sign_extend64(14, imm) << 2;
       bit = (b5 << 5) | b40;
 #ifdef DBM_LINK_TBZ
-      thread_data->code_cache_meta[basic_block].exit_branch_type = tbz_a64;
-      thread_data->code_cache_meta[basic_block].branch_condition = op;
-      thread_data->code_cache_meta[basic_block].rn = (bit << 5) | rt ;
+      thread_data->cc->code_cache_meta[basic_block].exit_branch_type = tbz_a64;
+      thread_data->cc->code_cache_meta[basic_block].branch_condition = op;
+      thread_data->cc->code_cache_meta[basic_block].rn = (bit << 5) | rt ;
 #endif
       break;
   }
   target = (uint64_t)read_address + branch_offset;
 
-  thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
-  thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
-  thread_data->code_cache_meta[basic_block].branch_skipped_addr = (uint64_t)read_address + 4;
+  thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
+  thread_data->cc->code_cache_meta[basic_block].branch_taken_addr = target;
+  thread_data->cc->code_cache_meta[basic_block].branch_skipped_addr = (uint64_t)read_address + 4;
+
+#ifdef DBM_COMPACT_EXITS
+  if (is_compact_exit(basic_block)) {
+    switch(inst) {
+      case A64_CBZ_CBNZ:
+        a64_cbz_cbnz_helper(write_p, op, (uint64_t)(write_p + 2), sf, rt);
+        break;
+      case A64_TBZ_TBNZ:
+        a64_tbz_tbnz_helper(write_p, op, (uint64_t)(write_p + 2), rt, bit);
+        break;
+    }
+    write_p++;
+    a64_compact_exit(thread_data, &write_p, basic_block, target, (uint64_t)read_address + 4);
+    *o_write_p = write_p;
+    return;
+  }
+#endif
 
   *write_p = NOP;
   write_p++;
@@ -331,16 +435,376 @@ void a64_check_free_space(dbm_thread *thread_data, uint32_t **write_p,
 
   if ((((uint64_t)*write_p) + size) >= (uint64_t)*data_p) {
     basic_block = allocate_bb(thread_data);
-    thread_data->code_cache_meta[basic_block].actual_id = cur_block;
-    if ((uint32_t *)&thread_data->code_cache->blocks[basic_block] != *data_p) {
-      a64_b_helper(*write_p, (uint64_t)&thread_data->code_cache->blocks[basic_block]);
-      *write_p = (uint32_t *)&thread_data->code_cache->blocks[basic_block];
+    thread_data->cc->code_cache_meta[basic_block].actual_id = cur_block;
+    if ((uint32_t *)bb_addr(thread_data, basic_block) != *data_p) {
+      a64_b_helper(*write_p, (uint64_t)bb_addr(thread_data, basic_block));
+      *write_p = (uint32_t *)bb_addr(thread_data, basic_block);
     }
-    *data_p = (uint32_t *)&thread_data->code_cache->blocks[basic_block];
+    *data_p = (uint32_t *)bb_addr(thread_data, basic_block);
     *data_p += BASIC_BLOCK_SIZE;
   }
 }
 
+#ifdef DBM_PROFILE
+// Increments a 32-bit execution counter, preserving the flags and all registers
+void a64_profile_count(uint32_t **o_write_p, uint32_t *counter) {
+  uint32_t *write_p = *o_write_p;
+
+  a64_push_pair_reg(x0, x1);
+
+  a64_copy_to_reg_64bits(&write_p, x0, (uint64_t)counter);
+
+  // LDR W1, [X0]
+  a64_LDR_STR_unsigned_immed(&write_p, 2, 0, 1, 0, x0, x1);
+  write_p++;
+
+  // ADD W1, W1, #1
+  a64_ADD_SUB_immed(&write_p, 0, 0, 0, 0, 1, x1, x1);
+  write_p++;
+
+  // STR W1, [X0]
+  a64_LDR_STR_unsigned_immed(&write_p, 2, 0, 0, 0, x0, x1);
+  write_p++;
+
+  a64_pop_pair_reg(x0, x1);
+
+  *o_write_p = write_p;
+}
+#endif
+
+#ifdef DBM_SIGNAL_POLLING
+// True for B, BL, B.cond, CB(N)Z and TB(N)Z to the same or a lower address
+static bool a64_is_backward_branch(uint32_t *read_address, a64_instruction inst) {
+  uint32_t imm, op, cond, sf, rt, b5, b40;
+  int64_t offset;
+
+  switch(inst) {
+    case A64_B_BL:
+      a64_B_BL_decode_fields(read_address, &op, &imm);
+      offset = sign_extend64(26, imm);
+      break;
+    case A64_B_COND:
+      a64_B_cond_decode_fields(read_address, &imm, &cond);
+      offset = sign_extend64(19, imm);
+      break;
+    case A64_CBZ_CBNZ:
+      a64_CBZ_CBNZ_decode_fields(read_address, &sf, &op, &imm, &rt);
+      offset = sign_extend64(19, imm);
+      break;
+    case A64_TBZ_TBNZ:
+      a64_TBZ_TBNZ_decode_fields(read_address, &b5, &op, &b40, &imm, &rt);
+      offset = sign_extend64(14, imm);
+      break;
+    default:
+      return false;
+  }
+
+  return offset <= 0;
+}
+
+// Loads the signal_poll flag of the thread into Wreg, without changing the flags
+static void a64_load_signal_poll(dbm_thread *thread_data, uint32_t **o_write_p, enum reg reg) {
+  uint32_t *write_p = *o_write_p;
+
+  a64_copy_to_reg_64bits(&write_p, reg, (uint64_t)&thread_data->signal_poll);
+
+  a64_LDR_STR_unsigned_immed(&write_p, 2, 0, 1, 0, reg, reg);
+  write_p++;
+
+  *o_write_p = write_p;
+}
+
+/* Emitted before a backward direct branch at read_address, preserving the flags
+   and all registers. If a signal is pending, the dispatcher is entered at the
+   branch, without linking, and delivers the signal on its way back through
+   checked_cc_return:
+
+       STP  X0, X1, [SP, #-16]!
+       MOV  X0, #&signal_poll
+       LDR  W0, [X0]
+       CBZ  W0, no_signal
+       MOV  X0, #read_address
+       MOV  X1, #0
+       B    dispatcher
+   no_signal:
+       LDP  X0, X1, [SP], #16
+*/
+static void a64_signal_poll(dbm_thread *thread_data, uint32_t **o_write_p, uint32_t *read_address) {
+  uint32_t *write_p = *o_write_p;
+  uint32_t *no_signal;
+
+  a64_push_pair_reg(x0, x1);
+  a64_load_signal_poll(thread_data, &write_p, x0);
+  no_signal = write_p++;
+
+  a64_branch_jump(thread_data, &write_p, 0, (uint64_t)read_address, REPLACE_TARGET | INSERT_BRANCH);
+
+  a64_cbz_helper(no_signal, (uint64_t)write_p, 0, x0);
+  a64_pop_pair_reg(x0, x1);
+
+  *o_write_p = write_p;
+}
+#endif
+
+#ifdef DBM_RAS
+/* Pushes the return address of a call and the translation of the return site to
+   the shadow return address stack. The translation is loaded from a literal,
+   which is updated as a FULLADDR link. The flags are preserved. */
+void a64_ras_push(dbm_thread *thread_data, uint32_t **o_write_p, uint64_t ret_spc) {
+  uint32_t *write_p = *o_write_p;
+  uint64_t ret_tpc = lookup_or_stub(thread_data, ret_spc);
+  uint32_t *branch_over;
+  uint64_t *literal;
+
+  // B over_literal
+  branch_over = write_p++;
+  if ((uint64_t)write_p & 7) {
+    *write_p++ = NOP;
+  }
+  literal = (uint64_t *)write_p;
+  *literal = ret_tpc;
+  record_cc_link(thread_data, (uintptr_t)literal | FULLADDR, ret_tpc);
+  write_p += 2;
+  a64_b_helper(branch_over, (uint64_t)write_p);
+
+  a64_push_pair_reg(x0, x1);
+
+  // MOV X0, &ras
+  a64_copy_to_reg_64bits(&write_p, x0, (uint64_t)&thread_data->ras);
+
+  // LDR W1, [X0, #top]
+  a64_LDR_STR_unsigned_immed(&write_p, 2, 0, 1, offsetof(return_addr_stack, top) >> 2, x0, x1);
+  write_p++;
+
+  // ADD W1, W1, #RAS_TOP_INC
+  a64_ADD_SUB_immed(&write_p, 0, 0, 0, 1, RAS_TOP_INC >> 12, x1, x1);
+  write_p++;
+
+  // STR W1, [X0, #top]
+  a64_LDR_STR_unsigned_immed(&write_p, 2, 0, 0, offsetof(return_addr_stack, top) >> 2, x0, x1);
+  write_p++;
+
+  // ADD X0, X0, X1, LSR #RAS_TOP_SHIFT
+  a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, LSR, x1, RAS_TOP_SHIFT, x0, x0);
+  write_p++;
+
+  // MOV X1, ret_spc
+  a64_copy_to_reg_64bits(&write_p, x1, ret_spc);
+
+  // STR X1, [X0, #entries.spc]
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 0, (offsetof(return_addr_stack, entries)
+                             + offsetof(cc_addr_pair, spc)) >> 3, x0, x1);
+  write_p++;
+
+  // MOV X1, &literal
+  a64_copy_to_reg_64bits(&write_p, x1, (uint64_t)literal);
+
+  // LDR X1, [X1]
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, 0, x1, x1);
+  write_p++;
+
+  // STR X1, [X0, #entries.tpc]
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 0, (offsetof(return_addr_stack, entries)
+                             + offsetof(cc_addr_pair, tpc)) >> 3, x0, x1);
+  write_p++;
+
+  a64_pop_pair_reg(x0, x1);
+
+  *o_write_p = write_p;
+}
+#endif
+
+#ifdef DBM_IBTC
+/* Emits the inline target cache of an indirect branch, with X0, X1 (and X2 if
+   use_x2) pushed and the target in reg_spc. Slots are filled by ibtc_add:
+
+       NOP                       guard
+       MOVZ+MOVK+MOVK X0, #spc
+       SUB  X0, X0, reg_spc
+       CBNZ X0, next_slot
+       LDR  X2, [SP], #16        NOP if !use_x2
+       LDP  X0, X1, [SP], #16
+       B    tpc
+*/
+void a64_ibtc_chain(dbm_thread *thread_data, uint32_t **o_write_p, int basic_block,
+                    uint32_t reg_spc, bool use_x2) {
+  uint32_t *write_p = *o_write_p;
+
+  thread_data->cc->code_cache_meta[basic_block].ibtc = write_p;
+  thread_data->cc->code_cache_meta[basic_block].free_b = 0;
+
+  for (int i = 0; i < IBTC_SLOTS; i++) {
+    // guard and MOV X0, #spc
+    for (int j = 0; j < 4; j++) {
+      *write_p++ = NOP;
+    }
+
+    a64_ADD_SUB_shift_reg(&write_p, 1, 1, 0, 0, reg_spc, 0, x0, x0);
+    write_p++;
+
+    a64_cbnz_helper(write_p, (uint64_t)(write_p + 4), 1, x0);
+    write_p++;
+
+    if (use_x2) {
+      a64_pop_reg(x2);
+    } else {
+      *write_p++ = NOP;
+    }
+    a64_pop_pair_reg(x0, x1);
+
+    // B tpc
+    *write_p++ = NOP;
+  }
+
+  *o_write_p = write_p;
+}
+#endif
+
+#ifdef DBM_TB_DIRECT
+/* Recognises the jump table idioms ending in BR rn:
+       ADR  Xb, base
+       ADD  rn, Xb, Wm, <extend> #2     or     ADD rn, Xb, Xm, LSL #2
+   and returns the lowest target which can be linked by a64_jump_table, base - 128 * 4
+   for the signed extends, or 0 if there's no match. The targets aren't checked, so a
+   misidentified idiom only makes the jump table miss. */
+static uintptr_t a64_jump_table_base(uint32_t *read_address, uint32_t rn) {
+  uint32_t sf, op, S, shift, Rm, imm, Rn, Rd, immlo, immhi;
+  uintptr_t bias = 0;
+
+  // Don't read across the start of the page
+  if (((uintptr_t)read_address & (PAGE_SIZE - 1)) < 8) {
+    return 0;
+  }
+
+  switch (a64_decode(read_address - 1)) {
+    case A64_ADD_SUB_EXT_REG:
+      a64_ADD_SUB_ext_reg_decode_fields(read_address - 1, &sf, &op, &S, &Rm, &shift, &imm, &Rn, &Rd);
+      // SXTB, SXTH, SXTW, SXTX
+      if (shift & 4) {
+        bias = 128 * 4;
+      }
+      break;
+    case A64_ADD_SUB_SHIFT_REG:
+      a64_ADD_SUB_shift_reg_decode_fields(read_address - 1, &sf, &op, &S, &shift, &Rm, &imm, &Rn, &Rd);
+      if (shift != LSL) {
+        return 0;
+      }
+      break;
+    default:
+      return 0;
+  }
+  if (sf != 1 || op != 0 || S != 0 || imm != 2 || Rd != rn || Rn == sp) {
+    return 0;
+  }
+
+  if (a64_decode(read_address - 2) != A64_ADR) {
+    return 0;
+  }
+  a64_ADR_decode_fields(read_address - 2, &op, &immlo, &immhi, &Rd);
+  if (op != 0 || Rd != Rn) {
+    return 0;
+  }
+
+  return (uintptr_t)(read_address - 2) + sign_extend64(21, (immhi << 2) | immlo) - bias;
+}
+
+static void a64_adr_helper(uint32_t *write_p, uint64_t target, uint32_t rd) {
+  int64_t difference = target - (uint64_t)write_p;
+  assert(difference < 1024*1024 && difference >= -1024*1024);
+
+  a64_ADR(&write_p, 0, difference & 3, (difference >> 2) & 0x7FFFF, rd);
+}
+
+/* Emits the direct linking of a BR recognised as a jump table, with X0, X1 (and X2
+   if use_x2) pushed and the target in reg_spc. The word offset of the target from
+   base selects a slot through a map of byte indexes, filled by jump_table_add. Slot 0
+   and the targets out of the map continue to the inline target cache and the hash
+   lookup (miss):
+
+       MOV  X0, #base
+       SUB  X0, reg_spc, X0
+       ROR  X0, X0, #2              misaligned targets end up out of the map
+       LSR  reg_tmp, X0, #8
+       CBNZ reg_tmp, miss
+       ADR  reg_tmp, map
+       LDRB W0, [reg_tmp, X0]
+       ADR  reg_tmp, slots
+       ADD  X0, reg_tmp, X0, LSL #3
+       LDR  X2, [SP], #16           if use_x2
+       BR   X0
+   slots:
+       B    miss_x2                 A64_JT_SLOTS + 1 slots of 2 instructions
+       NOP
+   map:
+       A64_JT_MAP bytes of 0
+   miss_x2:
+       STR  X2, [SP, #-16]!         if use_x2
+   miss:
+*/
+void a64_jump_table(dbm_thread *thread_data, uint32_t **o_write_p, int basic_block, uintptr_t base,
+                    uint32_t reg_spc, uint32_t reg_tmp, bool use_x2) {
+  dbm_code_cache_meta *bb_meta = &thread_data->cc->code_cache_meta[basic_block];
+  uint32_t *write_p = *o_write_p;
+  uint32_t *branch_to_miss, *adr_map, *adr_slots;
+  uint32_t *slots, *map, *miss_x2;
+
+  a64_copy_to_reg_64bits(&write_p, x0, base);
+
+  a64_ADD_SUB_shift_reg(&write_p, 1, 1, 0, 0, x0, 0, reg_spc, x0);
+  write_p++;
+
+  // ROR X0, X0, #2 (EXTR)
+  a64_EXTR(&write_p, 1, 1, x0, 2, x0, x0);
+  write_p++;
+
+  // LSR reg_tmp, X0, #8 (UBFM)
+  a64_BFM(&write_p, 1, 2, 1, 8, 63, x0, reg_tmp);
+  write_p++;
+
+  branch_to_miss = write_p++;
+  adr_map = write_p++;
+
+  a64_LDR_STR_reg(&write_p, 0, 0, 1, x0, 3, 0, reg_tmp, x0);
+  write_p++;
+
+  adr_slots = write_p++;
+
+  a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, LSL, x0, 3, reg_tmp, x0);
+  write_p++;
+
+  if (use_x2) {
+    a64_pop_reg(x2);
+  }
+  a64_BR(&write_p, x0);
+  write_p++;
+
+  slots = write_p;
+  map = slots + (A64_JT_SLOTS + 1) * 2;
+  miss_x2 = map + A64_JT_MAP / 4;
+  for (int i = 0; i <= A64_JT_SLOTS; i++) {
+    a64_b_helper(write_p, (uint64_t)miss_x2);
+    write_p++;
+    *write_p++ = NOP;
+  }
+  memset(map, 0, A64_JT_MAP);
+
+  write_p = miss_x2;
+  if (use_x2) {
+    a64_push_reg(x2);
+  }
+
+  a64_cbnz_helper(branch_to_miss, (uint64_t)write_p, 1, reg_tmp);
+  a64_adr_helper(adr_map, (uint64_t)map, reg_tmp);
+  a64_adr_helper(adr_slots, (uint64_t)slots, reg_tmp);
+
+  bb_meta->jt_slots = slots;
+  bb_meta->jt_base = base;
+  bb_meta->jt_free = 1;
+
+  *o_write_p = write_p;
+}
+#endif
+
 void pass1_a64(uint32_t *read_address, branch_type *bb_type) {
 
   *bb_type = unknown;
@@ -448,7 +912,7 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
   bool TPIDR_EL0;
 
   if (write_p == NULL) {
-    write_p = (uint32_t *) &thread_data->code_cache->blocks[basic_block];
+    write_p = (uint32_t *)bb_addr(thread_data, basic_block);
   }
 
   start_address = write_p;
@@ -456,7 +920,7 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
   if (type == mambo_bb) {
     data_p = write_p + BASIC_BLOCK_SIZE;
   } else { // mambo_trace
-    data_p = (uint32_t *)&thread_data->code_cache->traces + (TRACE_CACHE_SIZE / 4);
+    data_p = (uint32_t *)trace_cache_end(&thread_data->cc->code_cache[cc_region_index(thread_data, (uintptr_t)write_p)]);
   }
 
   /*
@@ -478,15 +942,26 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
   if (type == mambo_bb && bb_type != uncond_branch_reg && bb_type != unknown) {
     a64_push_pair_reg(x0, x1);
 
-    a64_copy_to_reg_64bits(&write_p, x0, (int)basic_block);
+    // Fixed length, see A64_TRACE_HEAD_SIZE
+    a64_MOV_wide(&write_p, 1, 2, 0, basic_block & 0xFFFF, x0);
+    write_p++;
+    a64_MOV_wide(&write_p, 1, 3, 1, basic_block >> 16, x0);
+    write_p++;
 
     a64_ADR(&write_p, 0, 0, 2, x1);
     write_p++;
 
-    a64_b_helper(write_p, thread_data->trace_head_incr_addr);
+    a64_b_helper(write_p, thread_data->cc->trace_head_incr_addr);
     write_p++;
 
     a64_pop_pair_reg(x0, x1);
+    thread_data->cc->code_cache_meta[basic_block].trace_head = TRACE_HEAD_COUNTING;
+  }
+#endif
+
+#ifdef DBM_PROFILE
+  if (type != mambo_trace) {
+    a64_profile_count(&write_p, &thread_data->cc->profile_count[basic_block]);
   }
 #endif
 
@@ -499,9 +974,20 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
   while(!stop) {
     debug("A64 scan read_address: %p, w: : %p, bb: %d\n", read_address, write_p, basic_block);
     a64_instruction inst = a64_decode(read_address);
+#ifdef DBM_RANGE_INVALIDATION
+    cc_source_index_add(thread_data, basic_block, (uintptr_t)read_address);
+#endif
     debug("  instruction enum: %d\n", (inst == A64_INVALID) ? -1 : inst);
     debug("  instruction word: 0x%x\n", *read_address);
 
+#ifdef DBM_SIGNAL_POLLING
+    // Before the instrumentation of the branch, which runs again if the signal is delivered
+    if (a64_is_backward_branch(read_address, inst)) {
+      a64_check_free_space(thread_data, &write_p, &data_p, SIGNAL_POLL_SPACE + MIN_FSPACE, basic_block);
+      a64_signal_poll(thread_data, &write_p, read_address);
+    }
+#endif
+
 #ifdef PLUGINS_NEW
     bool skip_inst = a64_scanner_deliver_callbacks(thread_data, PRE_INST_C, read_address, inst,
                                                    &write_p, &data_p, basic_block, type, true);
@@ -522,12 +1008,12 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 
 #ifdef DBM_LINK_COND_IMM
         // Mark this as the beggining of code emulating B.cond
-        thread_data->code_cache_meta[basic_block].exit_branch_type = cond_imm_a64;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
-        thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
-        thread_data->code_cache_meta[basic_block].branch_skipped_addr = (uint64_t)read_address + 4;
-        thread_data->code_cache_meta[basic_block].branch_condition = cond;
-        thread_data->code_cache_meta[basic_block].branch_cache_status = 0;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = cond_imm_a64;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
+        thread_data->cc->code_cache_meta[basic_block].branch_taken_addr = target;
+        thread_data->cc->code_cache_meta[basic_block].branch_skipped_addr = (uint64_t)read_address + 4;
+        thread_data->cc->code_cache_meta[basic_block].branch_condition = cond;
+        thread_data->cc->code_cache_meta[basic_block].branch_cache_status = 0;
 #endif
         a64_branch_jump_cond(thread_data, &write_p, basic_block, target, read_address, cond);
         stop = true;
@@ -536,7 +1022,7 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
       case A64_SVC:
         a64_push_pair_reg(x29, x30);
         a64_copy_to_reg_64bits(&write_p, x29, (uint64_t)read_address + 4);
-        a64_bl_helper(write_p, thread_data->syscall_wrapper_addr);
+        a64_bl_helper(write_p, thread_data->cc->syscall_wrapper_addr);
         write_p++;
         a64_pop_pair_reg(x0, x1);
 
@@ -581,20 +1067,47 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
             spilled_reg = x0;
           }
 
+          int tls_offset = 0;
+#ifdef DBM_SHARED_CC
+          // The code cache is shared, so find this thread's dbm_thread via MAMBO's own TP
+          uint32_t spilled_reg2 = (Rt == x2) ? x1 : x2;
+
+          a64_push_pair_reg(spilled_reg, spilled_reg2);
+          // MRS spilled_reg, TPIDR_EL0
+          a64_MRS_MSR_reg(&write_p, 1, 1, 3, 13, 0, 2, spilled_reg);
+          write_p++;
+          a64_copy_to_reg_64bits(&write_p, spilled_reg2, current_thread_tp_offset());
+          a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, 0, spilled_reg2, 0, spilled_reg, spilled_reg);
+          write_p++;
+          a64_LDR_STR_immed(&write_p, 3, 0, 1, 0, 0, spilled_reg, spilled_reg);
+          write_p++;
+          tls_offset = offsetof(dbm_thread, tls);
+#else
           a64_push_reg(spilled_reg);
           a64_copy_to_reg_64bits(&write_p, spilled_reg, (uint64_t)&thread_data->tls);
+#endif
 
           if (R == 0) { // MSR
-            a64_LDR_STR_immed(&write_p, 3, 0, 0, 0, 0, spilled_reg, Rt);
+            a64_LDR_STR_immed(&write_p, 3, 0, 0, tls_offset, 0, spilled_reg, Rt);
             write_p++;
           } else { // MRS
-            a64_LDR_STR_immed(&write_p, 3, 0, 1, 0, 0, spilled_reg, Rt);
+            a64_LDR_STR_immed(&write_p, 3, 0, 1, tls_offset, 0, spilled_reg, Rt);
             write_p++;
           }
 
+#ifdef DBM_SHARED_CC
+          a64_pop_pair_reg(spilled_reg, spilled_reg2);
+#else
           a64_pop_reg(spilled_reg);
+#endif
           break;
         } else {
+#ifdef DBM_TRACE_PEEPHOLE
+          // MRS / MSR NZCV
+          if ((o0 == 1) && (op1 == 3) && (CRn == 4) && (CRm == 2) && (op2 == 0)) {
+            thread_data->cc->code_cache_meta[basic_block].app_flags = true;
+          }
+#endif
           a64_copy();
         }
         break;
@@ -608,16 +1121,23 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
         a64_B_BL_decode_fields(read_address, &op, &imm26);
 
         if (op == 1) { // Branch Link
+#ifdef DBM_TRACES
+          thread_data->cc->code_cache_meta[basic_block].call_exit = true;
+#endif
           a64_copy_to_reg_64bits(&write_p, lr, (uint64_t)read_address + 4);
+#ifdef DBM_RAS
+          a64_check_free_space(thread_data, &write_p, &data_p, RAS_PUSH_SPACE + MIN_FSPACE, basic_block);
+          a64_ras_push(thread_data, &write_p, (uint64_t)read_address + 4);
+#endif
         }
 
         branch_offset = sign_extend64(26, imm26) << 2;
         target = (uint64_t)read_address + branch_offset;
 
 #ifdef DBM_LINK_UNCOND_IMM
-        thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_imm_a64;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
-        thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_imm_a64;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
+        thread_data->cc->code_cache_meta[basic_block].branch_taken_addr = target;
         *write_p = NOP; // Reserves space for linking branch.
         write_p++;
 #endif
@@ -632,14 +1152,29 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
       case A64_BLR:
       case A64_RET:
         a64_BR_decode_fields(read_address, &Rn);
+#if defined(DBM_INLINE_HASH) && defined(DBM_TB_DIRECT)
+        uintptr_t jt_base = (inst == A64_BR) ? a64_jump_table_base(read_address, Rn) : 0;
+#endif
 
+#ifdef DBM_RAS
+        if (inst == A64_BLR) {
+          a64_check_free_space(thread_data, &write_p, &data_p, RAS_PUSH_SPACE, basic_block);
+          a64_ras_push(thread_data, &write_p, (uint64_t)read_address + 4);
+        }
+#endif
 #ifdef DBM_INLINE_HASH
-        a64_check_free_space(thread_data, &write_p, &data_p, 88, basic_block);
+        a64_check_free_space(thread_data, &write_p, &data_p, IHL_SPACE, basic_block);
+  #ifdef DBM_TB_DIRECT
+        // The jump table spans multiple consecutive blocks
+        while (jt_base != 0 && ((uint64_t)write_p + IHL_SPACE + A64_JT_SPACE) >= (uint64_t)data_p) {
+          a64_check_free_space(thread_data, &write_p, &data_p, IHL_SPACE + A64_JT_SPACE, basic_block);
+        }
+  #endif
 #endif
 
-        thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_branch_reg;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
-        thread_data->code_cache_meta[basic_block].rn = Rn;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_branch_reg;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
+        thread_data->cc->code_cache_meta[basic_block].rn = Rn;
 
 #ifndef DBM_INLINE_HASH
         a64_branch_save_context(&write_p);
@@ -663,15 +1198,34 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
              *                 STP  X2, [SP, #-16]!        **
              *                 MOV  X1, Rn                 ** Rn = X1
              *                 MOV  LR, read_address + 4   ##
+             *                 MOV  X0, #&signal_poll      %%
+             *                 LDR  W0, [X0]               %%
+             *                 CBNZ W0, not_found          %%
+             *                 MOV  X0, #ras               $$
+             *                 LDR  Wtmp, [X0, #top]       $$
+             *                 SUB  Wtmp, Wtmp, #inc       $$
+             *                 STR  Wtmp, [X0, #top]       $$
+             *                 ADD  Wtmp, Wtmp, #inc       $$
+             *                 ADD  X0, X0, Xtmp, LSR #s   $$
+             *                 LDR  Xtmp, [X0, #spc]       $$
+             *                 EOR  Xtmp, Xtmp, Rn         $$
+             *                 CBNZ Xtmp, ras_miss         $$
+             *                 LDR  X0, [X0, #tpc]         $$
+             *                 B    jump                   $$
+             *      ras_miss:
              *                 MOV  X0, #hash_table
-             *                 AND  Xtmp, Rn, #(hash_mask << 2)
-             *                 ADD  X0, X0, Xtmp, LSL #2
+             *                 LDR  Xtmp, [X0, #mask]
+             *                 ADD  X0, X0, Xtmp, LSR #63
+             *                 LDR  X0, [X0, #entries]
+             *                 AND  Xtmp, Rn, Xtmp, LSL #2
+             *                 ADD  X0, X0, Xtmp, LSL #(scale - 2)
              *          loop:
-             *                 LDR  Xtmp, [X0], #16
+             *                 LDR  Xtmp, [X0], #stride
              *                 CBZ  Xtmp, not_found
              *                 SUB  Xtmp, Xtmp, Rn
              *                 CBNZ Xtmp, loop
-             *                 LDR  X0, [X0,  #-8]
+             *                 LDR  X0, [X0,  #value]
+             *          jump:
              *                 LDR  X2, [SP], #16           **
              *                 BR   X0
              *     not_found:
@@ -682,12 +1236,28 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
              *
              * ** if Rn is X0, X1 or (BLR LR)
              * ## for BLR
+             * $$ for RET if DBM_RAS is enabled and Rn isn't X0 or X1
+             * %% if DBM_SIGNAL_POLLING is enabled, a pending signal is delivered
+             *    by the dispatcher
+             * scale, stride and value are HASH_SCALE_SHIFT, HASH_KEY_STRIDE and
+             * HASH_HIT_VALUE_OFFSET, which depend on the hash table layout
+             *
+             * If DBM_IBTC is enabled and the RAS isn't used, the inline target
+             * cache (see a64_ibtc_chain) is inserted before ras_miss. Its empty
+             * slots branch to not_found.
              */
 
             uint32_t *loop;
             uint32_t *branch_to_not_found;
             uint32_t reg_spc, reg_tmp;
             bool use_x2 = false;
+#ifdef DBM_SIGNAL_POLLING
+            uint32_t *branch_to_signal;
+#endif
+#ifdef DBM_RAS
+            uint32_t *ras_miss;
+            uint32_t *ras_hit = NULL;
+#endif
 
             if ((Rn == x0) || (Rn == x1) || (inst == A64_BLR && Rn == lr)) {
               reg_spc = x1;
@@ -697,7 +1267,7 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
               reg_spc = Rn;
               reg_tmp = x1;
             }
-            thread_data->code_cache_meta[basic_block].rn = reg_spc;
+            thread_data->cc->code_cache_meta[basic_block].rn = reg_spc;
 
             a64_push_pair_reg(x0, x1);
 
@@ -714,17 +1284,87 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
               a64_copy_to_reg_64bits(&write_p, lr, (uint64_t)read_address + 4);
             }
 
+#ifdef DBM_SIGNAL_POLLING
+            a64_load_signal_poll(thread_data, &write_p, x0);
+            branch_to_signal = write_p++;
+#endif
+
+#ifdef DBM_TB_DIRECT
+            if (jt_base != 0) {
+              a64_jump_table(thread_data, &write_p, basic_block, jt_base, reg_spc, reg_tmp, use_x2);
+            }
+#endif
+
+#ifdef DBM_RAS
+            bool ras_pop = (inst == A64_RET && !use_x2);
+#else
+            bool ras_pop = false;
+#endif
+#ifdef DBM_IBTC
+            if (!ras_pop) {
+              a64_ibtc_chain(thread_data, &write_p, basic_block, reg_spc, use_x2);
+            }
+#endif
+
+#ifdef DBM_RAS
+            if (ras_pop) {
+              a64_copy_to_reg_64bits(&write_p, x0, (uint64_t)&thread_data->ras);
+
+              a64_LDR_STR_unsigned_immed(&write_p, 2, 0, 1, offsetof(return_addr_stack, top) >> 2, x0, reg_tmp);
+              write_p++;
+
+              a64_ADD_SUB_immed(&write_p, 0, 1, 0, 1, RAS_TOP_INC >> 12, reg_tmp, reg_tmp);
+              write_p++;
+
+              a64_LDR_STR_unsigned_immed(&write_p, 2, 0, 0, offsetof(return_addr_stack, top) >> 2, x0, reg_tmp);
+              write_p++;
+
+              a64_ADD_SUB_immed(&write_p, 0, 0, 0, 1, RAS_TOP_INC >> 12, reg_tmp, reg_tmp);
+              write_p++;
+
+              a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, LSR, reg_tmp, RAS_TOP_SHIFT, x0, x0);
+              write_p++;
+
+              a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, (offsetof(return_addr_stack, entries)
+                                         + offsetof(cc_addr_pair, spc)) >> 3, x0, reg_tmp);
+              write_p++;
+
+              a64_logical_reg(&write_p, 1, 2, 0, 0, reg_spc, 0, reg_tmp, reg_tmp);
+              write_p++;
+
+              ras_miss = write_p++;
+
+              a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, (offsetof(return_addr_stack, entries)
+                                         + offsetof(cc_addr_pair, tpc)) >> 3, x0, x0);
+              write_p++;
+
+              ras_hit = write_p++;
+
+              a64_cbnz_helper(ras_miss, (uint64_t)write_p, 1, reg_tmp);
+            }
+#endif
+
             a64_copy_to_reg_64bits(&write_p, x0,
-                                    (uint64_t)&thread_data->entry_address.entries);
+                                    (uint64_t)&thread_data->cc->entry_address);
+
+            a64_LDR_STR_immed(&write_p, 3, 0, 1, offsetof(hash_table, mask), 0, x0, reg_tmp);
+            write_p++;
 
-            a64_logical_immed(&write_p, 1, 0, 1, 62, 18, reg_spc, reg_tmp);
+            // Adds 0, orders the entries load after the mask load, see hash_grow
+            a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, LSR, reg_tmp, 63, x0, x0);
             write_p++;
 
-            a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, 0, reg_tmp, 0x2, x0, x0);
+            a64_LDR_STR_immed(&write_p, 3, 0, 1, offsetof(hash_table, entries), 0, x0, x0);
+            write_p++;
+
+            a64_logical_reg(&write_p, 1, 0, 0, 0, reg_tmp, 2, reg_spc, reg_tmp);
+            write_p++;
+
+            a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, 0, reg_tmp, HASH_SCALE_SHIFT - HASH_INDEX_SHIFT, x0, x0);
             write_p++;
 
             loop = write_p;
-            a64_LDR_STR_immed(&write_p, 3, 0, 1, 16, 1, x0, reg_tmp);
+            a64_LDR_STR_immed(&write_p, 3, 0, 1, HASH_KEY_STRIDE, 1, x0, reg_tmp);
             write_p++;
 
             branch_to_not_found = write_p++;
@@ -735,9 +1375,14 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
             a64_cbnz_helper(write_p, (uint64_t)loop, 1, reg_tmp);
             write_p++;
 
-            a64_LDR_STR_immed(&write_p, 3, 0, 1, -8, 0, x0, x0);
+            a64_LDR_STR_immed(&write_p, 3, 0, 1, HASH_HIT_VALUE_OFFSET, 0, x0, x0);
             write_p++;
 
+#ifdef DBM_RAS
+            if (ras_hit != NULL) {
+              a64_b_helper(ras_hit, (uint64_t)write_p);
+            }
+#endif
             if (use_x2) {
               a64_pop_reg(x2);
             }
@@ -746,6 +1391,16 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
             write_p++;
 
             a64_cbz_helper(branch_to_not_found, (uint64_t)write_p, 1, reg_tmp);
+#ifdef DBM_SIGNAL_POLLING
+            a64_cbnz_helper(branch_to_signal, (uint64_t)write_p, 0, x0);
+#endif
+#ifdef DBM_IBTC
+            if (!ras_pop) {
+              for (int i = 0; i < IBTC_SLOTS; i++) {
+                ibtc_set_guard(&thread_data->cc->code_cache_meta[basic_block], i, write_p);
+              }
+            }
+#endif
 
             a64_logical_reg(&write_p, 1, 1, 0, 0, reg_spc, 0, xzr, x0);
             write_p++;
@@ -756,7 +1411,7 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
               a64_pop_reg(x2);
             }
 
-            a64_b_helper(write_p, (uint64_t)thread_data->dispatcher_addr);
+            a64_b_helper(write_p, (uint64_t)thread_data->cc->dispatcher_addr);
             write_p++;
 #endif
         stop = true;
@@ -965,4 +1620,18 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 
   return ((write_p - start_address + 1) * sizeof(*write_p));
 }
+
+size_t a64_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint64_t target) {
+  uint32_t *write_p = (uint32_t *)bb_addr(thread_data, basic_block);
+  uint32_t *start_address = write_p;
+
+  debug("A64 stub target: 0x%lx\n", target);
+
+  a64_pop_pair_reg(x0, x1);
+
+  a64_branch_save_context(&write_p);
+  a64_branch_jump(thread_data, &write_p, basic_block, target, REPLACE_TARGET | INSERT_BRANCH);
+
+  return ((write_p - start_address) * sizeof(*write_p));
+}
 #endif // __aarch64__
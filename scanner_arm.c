@@ -21,6 +21,7 @@
 #ifdef __arm__
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
@@ -44,7 +45,22 @@
 #define copy_arm() *(write_p++) = *read_address;
 
 #define ALLOWED_IHL_REGS (0x5FF8) // {R3 - R12, R14}
-#define IHL_SPACE (88)
+#ifdef DBM_RAS
+  #define RAS_PUSH_SPACE (72)
+  #define RAS_POP_SPACE (52)
+  #if RAS_TOP_INC != (1 << 24)
+    #error "RAS_TOP_INC_IMM must match RAS_TOP_INC"
+  #endif
+  #define RAS_TOP_INC_IMM ((4 << 8) | 1) // RAS_TOP_INC, rotated immediate
+#else
+  #define RAS_POP_SPACE (0)
+#endif
+#ifdef DBM_IBTC
+  #define IBTC_SPACE (IBTC_SLOTS * ARM_IBTC_SLOT_SIZE)
+#else
+  #define IBTC_SPACE (0)
+#endif
+#define IHL_SPACE (88 + RAS_POP_SPACE + IBTC_SPACE)
 
 void arm_copy_to_reg_16bit(uint32_t **write_p, enum reg reg, uint32_t value) {
   arm_movw(write_p, reg, (value >> 12) & 0xF, value & 0xFFF);
@@ -159,7 +175,7 @@ void arm_branch_jump(dbm_thread *thread_data, uint32_t **o_write_p, int basic_bl
     }
     arm_copy_to_reg_32bit(&write_p, r1, basic_block);
 
-    arm_b(&write_p, (thread_data->dispatcher_addr - (uint32_t)write_p - 8) >> 2);
+    arm_b(&write_p, (thread_data->cc->dispatcher_addr - (uint32_t)write_p - 8) >> 2);
     write_p++;
   }
   
@@ -172,15 +188,21 @@ void arm_check_free_space(dbm_thread *thread_data, uint32_t **write_p,
 
   if ((((uint32_t)*write_p)+size) >= (uint32_t)*data_p) {
     basic_block = allocate_bb(thread_data);
-    thread_data->code_cache_meta[basic_block].actual_id = cur_block;
-    arm_b(write_p, ((uint32_t)&thread_data->code_cache->blocks[basic_block] - (uint32_t)*write_p - 8) >> 2);
-    *write_p = (uint32_t *)&thread_data->code_cache->blocks[basic_block];
+    thread_data->cc->code_cache_meta[basic_block].actual_id = cur_block;
+    arm_b32_helper(*write_p, (uint32_t)bb_addr(thread_data, basic_block), AL);
+    *write_p = (uint32_t *)bb_addr(thread_data, basic_block);
     *data_p = (uint32_t *)*write_p;
     *data_p += BASIC_BLOCK_SIZE;
   }
 }
 
 void arm_branch_helper(uint32_t *write_p, uint32_t target, bool link, uint32_t cond) {
+  int difference = target - (uint32_t)write_p - 8;
+  if (difference < -(32*1024*1024) || difference >= (32*1024*1024)) {
+    // Branch to a different code cache region
+    target = cc_veneer(current_thread, (uint32_t)write_p, target, false);
+  }
+
   if ((target & 3) == 0) {
     if (link) {
       arm_bl_cond(&write_p, cond, (target - (uint32_t)write_p - 8)>>2);
@@ -281,7 +303,7 @@ bool inline_uncond_imm(dbm_thread *thread_data, bool insert_branch, uint32_t **w
                        uint32_t **data_p, uint32_t **read_addr, uint32_t target,
                        int *inlined_back_count, int basic_block, cc_type type) {
   if (target <= (uint32_t)*read_addr) {
-    if (*inlined_back_count >= MAX_BACK_INLINE) {
+    if (*inlined_back_count >= global_data.traces.max_back_inline) {
       if (insert_branch) {
         uint32_t cc_addr = lookup_or_stub(thread_data, target);
         arm_cc_branch(thread_data, *write_p, cc_addr, AL);
@@ -383,36 +405,245 @@ void pass1_arm(dbm_thread *thread_data, uint32_t *read_address, branch_type *bb_
   }
 }
 
-void arm_inline_hash_lookup(dbm_thread *thread_data, uint32_t **o_write_p, int basic_block, int r_target) {
+#ifdef DBM_PROFILE
+// Increments a 32-bit execution counter, preserving the flags and all registers
+void arm_profile_count(uint32_t **o_write_p, uint32_t *counter) {
+  uint32_t *write_p = *o_write_p;
+
+  arm_push_regs((1 << r0) | (1 << r1));
+
+  arm_copy_to_reg_32bit(&write_p, r0, (uint32_t)counter);
+
+  // LDR r1, [r0]
+  arm_ldr(&write_p, IMM_LDR, r1, r0, 0, 1, 1, 0);
+  write_p++;
+
+  // ADD r1, r1, #1
+  arm_add(&write_p, IMM_PROC, 0, r1, r1, 1);
+  write_p++;
+
+  // STR r1, [r0]
+  arm_str(&write_p, IMM_LDR, r1, r0, 0, 1, 1, 0);
+  write_p++;
+
+  arm_pop_regs((1 << r0) | (1 << r1));
+
+  *o_write_p = write_p;
+}
+#endif
+
+#ifdef DBM_RAS
+/* Pushes the return address of a call and the translation of the return site to
+   the shadow return address stack. The translation is loaded from a literal,
+   which is updated as a FULLADDR link. The flags are preserved. */
+void arm_ras_push(dbm_thread *thread_data, uint32_t **o_write_p, uint32_t ret_spc) {
+  uint32_t *write_p = *o_write_p;
+  uint32_t ret_tpc = lookup_or_stub(thread_data, ret_spc);
+  uint32_t *ldr_lit;
+
+  // PUSH {r0, r1}
+  arm_push_regs((1 << r0) | (1 << r1));
+
+  // MOVW+MOVT r0, &ras
+  arm_copy_to_reg_32bit(&write_p, r0, (uint32_t)&thread_data->ras);
+
+  // LDR r1, [r0, #top]
+  arm_ldr(&write_p, IMM_LDR, r1, r0, offsetof(return_addr_stack, top), 1, 1, 0);
+  write_p++;
+
+  // ADD r1, r1, #RAS_TOP_INC
+  arm_add(&write_p, IMM_PROC, 0, r1, r1, RAS_TOP_INC_IMM);
+  write_p++;
+
+  // STR r1, [r0, #top]
+  arm_str(&write_p, IMM_LDR, r1, r0, offsetof(return_addr_stack, top), 1, 1, 0);
+  write_p++;
+
+  // ADD r0, r0, r1, LSR #RAS_TOP_SHIFT
+  arm_add(&write_p, REG_PROC, 0, r0, r0, r1 | (LSR << 5) | (RAS_TOP_SHIFT << 7));
+  write_p++;
+
+  // MOVW+MOVT r1, ret_spc
+  arm_copy_to_reg_32bit(&write_p, r1, ret_spc);
+
+  // STR r1, [r0, #entries.spc]
+  arm_str(&write_p, IMM_LDR, r1, r0, offsetof(return_addr_stack, entries) + offsetof(cc_addr_pair, spc), 1, 1, 0);
+  write_p++;
+
+  // LDR r1, ret_tpc_literal
+  ldr_lit = write_p++;
+
+  // SUB r1, r1, #4 (literal holds the adjusted entry address)
+  arm_sub(&write_p, IMM_PROC, 0, r1, r1, 4);
+  write_p++;
+
+  // STR r1, [r0, #entries.tpc]
+  arm_str(&write_p, IMM_LDR, r1, r0, offsetof(return_addr_stack, entries) + offsetof(cc_addr_pair, tpc), 1, 1, 0);
+  write_p++;
+
+  // POP {r0, r1}
+  arm_pop_regs((1 << r0) | (1 << r1));
+
+  // B over_literal
+  arm_b(&write_p, 0);
+  write_p++;
+
+  arm_ldr(&ldr_lit, IMM_LDR, r1, pc, (uint32_t)write_p - (uint32_t)ldr_lit - 8, 1, 1, 0);
+  *write_p = ret_tpc;
+  record_cc_link(thread_data, (uint32_t)write_p | FULLADDR, ret_tpc);
+  write_p++;
+
+  *o_write_p = write_p;
+}
+#endif
+
+#ifdef DBM_IBTC
+/* Emits the inline target cache of an indirect branch, with {r4-r6} pushed and
+   the target in the target register. Slots are filled by ibtc_add:
+
+       NOP                   guard
+       MOVW+MOVT r6, #spc
+       CMP r6, target
+       BNE next_slot
+       POP {r4-r6}
+       B tpc
+*/
+void arm_ibtc_chain(dbm_thread *thread_data, uint32_t **o_write_p, int basic_block, int target) {
+  uint32_t *write_p = *o_write_p;
+
+  thread_data->cc->code_cache_meta[basic_block].ibtc = write_p;
+  thread_data->cc->code_cache_meta[basic_block].free_b = 0;
+
+  for (int i = 0; i < IBTC_SLOTS; i++) {
+    // guard and MOVW+MOVT r6, #spc
+    for (int j = 0; j < 3; j++) {
+      arm_nop(&write_p);
+      write_p++;
+    }
+
+    // CMP r6, target
+    arm_cmp(&write_p, REG_PROC, r6, target);
+    write_p++;
+
+    // BNE next_slot
+    arm_b32_helper(write_p, (uint32_t)(write_p + 3), NE);
+    write_p++;
+
+    // POP {r4-r6}
+    arm_pop_regs((1 << r4) | (1 << r5) | (1 << r6));
+
+    // B tpc
+    arm_nop(&write_p);
+    write_p++;
+  }
+
+  *o_write_p = write_p;
+}
+#endif
+
+void arm_inline_hash_lookup(dbm_thread *thread_data, uint32_t **o_write_p, int basic_block,
+                            int r_target, bool ras_pop) {
   uint32_t *write_p = *o_write_p;
   uint32_t *loop_start;
   uint32_t *branch_miss;
+#ifdef DBM_RAS
+  uint32_t *ras_miss;
+  uint32_t *ras_hit = NULL;
+#endif
 
   bool target_reg_clean = (r_target >= r0);
   int target = target_reg_clean ? r_target : r5;
   int r_tmp = target_reg_clean ? r5 : r4;
 
-  thread_data->code_cache_meta[basic_block].rn = target;
+  thread_data->cc->code_cache_meta[basic_block].rn = target;
+
+#ifdef DBM_IBTC
+  if (!ras_pop) {
+    arm_ibtc_chain(thread_data, &write_p, basic_block, target);
+  }
+#endif
+
+#ifdef DBM_RAS
+  if (ras_pop) {
+    // MOVW+MOVT r6, &ras
+    arm_copy_to_reg_32bit(&write_p, r6, (uint32_t)&thread_data->ras);
+
+    // LDR r_tmp, [r6, #top]
+    arm_ldr(&write_p, IMM_LDR, r_tmp, r6, offsetof(return_addr_stack, top), 1, 1, 0);
+    write_p++;
+
+    // SUB r_tmp, r_tmp, #RAS_TOP_INC
+    arm_sub(&write_p, IMM_PROC, 0, r_tmp, r_tmp, RAS_TOP_INC_IMM);
+    write_p++;
+
+    // STR r_tmp, [r6, #top]
+    arm_str(&write_p, IMM_LDR, r_tmp, r6, offsetof(return_addr_stack, top), 1, 1, 0);
+    write_p++;
+
+    // ADD r_tmp, r_tmp, #RAS_TOP_INC
+    arm_add(&write_p, IMM_PROC, 0, r_tmp, r_tmp, RAS_TOP_INC_IMM);
+    write_p++;
+
+    // ADD r6, r6, r_tmp, LSR #RAS_TOP_SHIFT
+    arm_add(&write_p, REG_PROC, 0, r6, r6, r_tmp | (LSR << 5) | (RAS_TOP_SHIFT << 7));
+    write_p++;
+
+    // LDR r_tmp, [r6, #entries.spc]
+    arm_ldr(&write_p, IMM_LDR, r_tmp, r6, offsetof(return_addr_stack, entries) + offsetof(cc_addr_pair, spc), 1, 1, 0);
+    write_p++;
 
-  // MOVW+MOVT r_tmp, hash_mask
-  arm_copy_to_reg_32bit(&write_p, r_tmp, CODE_CACHE_HASH_SIZE);
+    // CMP r_tmp, target
+    arm_cmp(&write_p, REG_PROC, r_tmp, target);
+    write_p++;
 
-  // MOVW+MOVT r6, hash_table
-  arm_copy_to_reg_32bit(&write_p, r6, (uint32_t)thread_data->entry_address.entries);
+    // BNE ras_miss
+    ras_miss = write_p++;
+
+    // LDR r6, [r6, #entries.tpc]
+    arm_ldr(&write_p, IMM_LDR, r6, r6, offsetof(return_addr_stack, entries) + offsetof(cc_addr_pair, tpc), 1, 1, 0);
+    write_p++;
+
+    // B jump
+    ras_hit = write_p++;
+
+    // ras_miss:
+    arm_b32_helper(ras_miss, (uint32_t)write_p, NE);
+  }
+#endif
 
+  // MOVW+MOVT r6, &hash_table
+  arm_copy_to_reg_32bit(&write_p, r6, (uint32_t)&thread_data->cc->entry_address);
+
+  // LDR r_tmp, [r6, #mask]
+  arm_ldr(&write_p, IMM_LDR, r_tmp, r6, offsetof(hash_table, mask), 1, 1, 0);
+  write_p++;
+
+  // ADD r6, r6, r_tmp, LSR #31, orders the entries load after the mask load, see hash_grow
+  arm_add(&write_p, REG_PROC, 0, r6, r6, r_tmp | (LSR << 5) | (31 << 7));
+  write_p++;
+
+  // LDR r6, [r6, #entries]
+  arm_ldr(&write_p, IMM_LDR, r6, r6, offsetof(hash_table, entries), 1, 1, 0);
+  write_p++;
+
+#if HASH_INDEX_SHIFT == 0
   // AND r_tmp, target, r_tmp
   arm_and(&write_p, REG_PROC, 0, r_tmp, target, r_tmp);
+#else
+  // AND r_tmp, r_tmp, target, LSR #HASH_INDEX_SHIFT
+  arm_and(&write_p, REG_PROC, 0, r_tmp, r_tmp, target | (LSR << 5) | (HASH_INDEX_SHIFT << 7));
+#endif
   write_p++;
 
-  // ADD r_tmp, r6, r_tmp, LSL #3
-  arm_add(&write_p, REG_PROC, 0, r_tmp, r6, r_tmp | (LSL << 5) | (3 << 7));
+  // ADD r_tmp, r6, r_tmp, LSL #HASH_SCALE_SHIFT
+  arm_add(&write_p, REG_PROC, 0, r_tmp, r6, r_tmp | (LSL << 5) | (HASH_SCALE_SHIFT << 7));
   write_p++;
 
   // loop:
   loop_start = write_p;
 
-  // LDR r6, [r_tmp], #8
-  arm_ldr(&write_p, IMM_LDR, r6, r_tmp, 8, 0, 1, 0);
+  // LDR r6, [r_tmp], #HASH_KEY_STRIDE
+  arm_ldr(&write_p, IMM_LDR, r6, r_tmp, HASH_KEY_STRIDE, 0, 1, 0);
   write_p++;
 
   // CMP r6, target
@@ -422,11 +653,17 @@ void arm_inline_hash_lookup(dbm_thread *thread_data, uint32_t **o_write_p, int b
   // BNE miss
   branch_miss = write_p++;
 
-  // jump:
-  // LDR r6, [r_tmp, #-4]
-  arm_ldr(&write_p, IMM_LDR, r6, r_tmp, 4, 1, 0, 0);
+  // LDR r6, [r_tmp, #HASH_HIT_VALUE_OFFSET]
+  arm_ldr(&write_p, IMM_LDR, r6, r_tmp, abs(HASH_HIT_VALUE_OFFSET), 1, HASH_HIT_VALUE_OFFSET >= 0, 0);
   write_p++;
 
+  // jump:
+#ifdef DBM_RAS
+  if (ras_hit != NULL) {
+    arm_b32_helper(ras_hit, (uint32_t)write_p, AL);
+  }
+#endif
+
   // POP {r4}
   arm_pop_reg(r4);
 
@@ -445,6 +682,15 @@ void arm_inline_hash_lookup(dbm_thread *thread_data, uint32_t **o_write_p, int b
   arm_b32_helper(write_p, (uint32_t)loop_start, NE);
   write_p++;
 
+  // not_found:
+#ifdef DBM_IBTC
+  if (!ras_pop) {
+    for (int i = 0; i < IBTC_SLOTS; i++) {
+      ibtc_set_guard(&thread_data->cc->code_cache_meta[basic_block], i, write_p);
+    }
+  }
+#endif
+
   // SUB sp, sp, #8
   arm_sub(&write_p, IMM_PROC, 0, sp, sp, DISP_RES_WORDS*4);
   write_p++;
@@ -468,7 +714,7 @@ void arm_inline_hash_lookup(dbm_thread *thread_data, uint32_t **o_write_p, int b
   write_p++;
 
   // B dispatcher
-  arm_b32_helper(write_p, thread_data->dispatcher_addr, AL);
+  arm_b32_helper(write_p, thread_data->cc->dispatcher_addr, AL);
   write_p++;
 
   *o_write_p = write_p;
@@ -517,7 +763,7 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
   int inlined_back_count = 0;
   
   if (write_p == NULL) {
-    write_p = (uint32_t *)&thread_data->code_cache->blocks[basic_block];
+    write_p = (uint32_t *)bb_addr(thread_data, basic_block);
   }
   uint32_t start_address = (uint32_t)write_p;
 
@@ -525,7 +771,7 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
   if (type == mambo_bb) {
     data_p = write_p + BASIC_BLOCK_SIZE;
   } else {
-    data_p = (uint32_t *)&thread_data->code_cache->traces + (TRACE_CACHE_SIZE/4);
+    data_p = (uint32_t *)trace_cache_end(&thread_data->cc->code_cache[cc_region_index(thread_data, (uintptr_t)write_p)]);
   }
   
   debug("write_p: %p\n", write_p);
@@ -546,8 +792,15 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
 
     arm_copy_to_reg_32bit(&write_p, r0, basic_block);
 
-    arm_bl32_helper(write_p, thread_data->trace_head_incr_addr-5, AL);
+    arm_bl32_helper(write_p, thread_data->cc->trace_head_incr_addr-5, AL);
     write_p++;
+    thread_data->cc->code_cache_meta[basic_block].trace_head = TRACE_HEAD_COUNTING;
+  }
+#endif
+
+#ifdef DBM_PROFILE
+  if (type != mambo_trace) {
+    arm_profile_count(&write_p, &thread_data->cc->profile_count[basic_block]);
   }
 #endif
 
@@ -559,6 +812,9 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
   while(!stop) {
     debug("arm scan read_address: %p\n", read_address);
     arm_instruction inst = arm_decode(read_address);
+#ifdef DBM_RANGE_INVALIDATION
+    cc_source_index_add(thread_data, basic_block, (uintptr_t)read_address);
+#endif
     debug("Instruction enum: %d\n", (inst == ARM_INVALID) ? -1 : inst);
     
     debug("instruction word: 0x%x\n", *read_address); 
@@ -599,8 +855,8 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
             }
 #endif
 
-            thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_reg_arm;
-            thread_data->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
+            thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_reg_arm;
+            thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
 
 #ifdef DBM_INLINE_HASH
   #ifndef LINK_BX_ALT
@@ -614,7 +870,7 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
             write_p++;
 
             arm_check_free_space(thread_data, &write_p, &data_p, IHL_SPACE, basic_block);
-            arm_inline_hash_lookup(thread_data, &write_p, basic_block, -1);
+            arm_inline_hash_lookup(thread_data, &write_p, basic_block, -1, false);
 
             stop = true;
             break;
@@ -679,26 +935,38 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
 
         if (inst == ARM_BL) {
           arm_copy_to_reg_32bit(&write_p, lr, (uint32_t)read_address + 4);
+#ifdef DBM_RAS
+          if (condition_code == AL) {
+            arm_check_free_space(thread_data, &write_p, &data_p, RAS_PUSH_SPACE + MIN_FSPACE, basic_block);
+            arm_ras_push(thread_data, &write_p, (uint32_t)read_address + 4);
+          }
+#endif
         }
 
 #ifdef DBM_INLINE_UNCOND_IMM
         if (condition_code == AL) {
-          thread_data->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
           if (!inline_uncond_imm(thread_data, true, &write_p, &data_p, &read_address,
                                  target, &inlined_back_count, basic_block, type)) {
-            thread_data->code_cache_meta[basic_block].exit_branch_type = trace_inline_max;
-            thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
+            thread_data->cc->code_cache_meta[basic_block].exit_branch_type = trace_inline_max;
+            thread_data->cc->code_cache_meta[basic_block].branch_taken_addr = target;
+#ifdef DBM_TRACES
+            thread_data->cc->code_cache_meta[basic_block].call_exit = (inst == ARM_BL);
+#endif
             stop = true;
           }
           break;
         }
 #endif
 
-        thread_data->code_cache_meta[basic_block].exit_branch_type = (condition_code == AL) ? uncond_imm_arm : cond_imm_arm;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
-        thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
-        thread_data->code_cache_meta[basic_block].branch_skipped_addr = (uint32_t)read_address + 4;
-        thread_data->code_cache_meta[basic_block].branch_condition = condition_code;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = (condition_code == AL) ? uncond_imm_arm : cond_imm_arm;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
+        thread_data->cc->code_cache_meta[basic_block].branch_taken_addr = target;
+        thread_data->cc->code_cache_meta[basic_block].branch_skipped_addr = (uint32_t)read_address + 4;
+        thread_data->cc->code_cache_meta[basic_block].branch_condition = condition_code;
+#ifdef DBM_TRACES
+        thread_data->cc->code_cache_meta[basic_block].call_exit = (inst == ARM_BL && condition_code == AL);
+#endif
 
         if (condition_code != AL) {
           // Reserve space for the conditional branch instruction
@@ -732,9 +1000,13 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
 
         if (inst == ARM_BLX) {
           arm_copy_to_reg_32bit(&write_p, lr, (uint32_t)read_address + 4);
+#ifdef DBM_RAS
+          arm_check_free_space(thread_data, &write_p, &data_p, RAS_PUSH_SPACE, basic_block);
+          arm_ras_push(thread_data, &write_p, (uint32_t)read_address + 4);
+#endif
         }
-        thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_reg_arm;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_reg_arm;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
         
 #ifdef DBM_INLINE_HASH
   #ifndef LINK_BX_ALT
@@ -748,7 +1020,7 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
         }
 
         arm_check_free_space(thread_data, &write_p, &data_p, IHL_SPACE, basic_block);
-        arm_inline_hash_lookup(thread_data, &write_p, basic_block, -1);
+        arm_inline_hash_lookup(thread_data, &write_p, basic_block, -1, inst == ARM_BX && rn == lr);
 #else
         arm_branch_save_context(thread_data, &write_p, true);
         arm_branch_jump(thread_data, &write_p, basic_block, 0, read_address, (*read_address >> 28), SETUP);
@@ -772,9 +1044,13 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
         if (branch_offset & 0x2000000) { branch_offset |= 0xFC000000; }
 
         arm_copy_to_reg_32bit(&write_p, lr, (uint32_t)read_address + 4);
+#ifdef DBM_RAS
+        arm_check_free_space(thread_data, &write_p, &data_p, RAS_PUSH_SPACE + MIN_FSPACE, basic_block);
+        arm_ras_push(thread_data, &write_p, (uint32_t)read_address + 4);
+#endif
         
-        thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_blxi_arm;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_blxi_arm;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
         
         arm_branch_save_context(thread_data, &write_p, false);
         arm_branch_jump(thread_data, &write_p, basic_block, 0, read_address, (*read_address >> 28), SETUP);
@@ -814,8 +1090,8 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
             write_p++;
           }
 
-          thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_reg_arm;
-          thread_data->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_reg_arm;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
 
 #ifdef DBM_INLINE_HASH
           if (rn == sp) {
@@ -833,7 +1109,7 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
           }
 
           arm_check_free_space(thread_data, &write_p, &data_p, IHL_SPACE, basic_block);
-          arm_inline_hash_lookup(thread_data, &write_p, basic_block, -1);
+          arm_inline_hash_lookup(thread_data, &write_p, basic_block, -1, rn == sp);
 #else
           arm_branch_save_context(thread_data, &write_p, false);
           arm_branch_jump(thread_data, &write_p, basic_block, 0, read_address, (*read_address >> 28), SETUP);
@@ -884,16 +1160,17 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
         if (rd == pc || rn == pc) {
           if (rd == pc) {
             assert(inst == ARM_LDR);
-            thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_reg_arm;
-            thread_data->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
+            thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_reg_arm;
+            thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
 
 #ifdef DBM_INLINE_HASH
   #ifndef LINK_BX_ALT
             assert(0);
   #endif
             uint32_t saved_regs;
+            bool is_pop = (rn == sp && (writeback || !prepostindex));
             assert(rm != pc);
-            if (rn == sp && (writeback || !prepostindex)) {
+            if (is_pop) {
               // POP {PC}
               assert(immediate == IMM_LDR && !prepostindex && updown
                        && !writeback && (offset & 3) == 0 && offset >= 4);
@@ -932,7 +1209,7 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
               write_p++;
             }
             arm_check_free_space(thread_data, &write_p, &data_p, IHL_SPACE, basic_block);
-            arm_inline_hash_lookup(thread_data, &write_p, basic_block, -1);
+            arm_inline_hash_lookup(thread_data, &write_p, basic_block, -1, is_pop);
 
             stop = true;
             break;
@@ -1130,9 +1407,25 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
           if (condition_code != AL) {
             tr_start = write_p++;
           }
+#ifdef DBM_SHARED_CC
+          // The code cache is shared, so find this thread's dbm_thread via MAMBO's own TP
+          uint32_t tmp = (rd == r0) ? r1 : r0;
+          arm_coproc_trans(&write_p, 0, 1, 13, rd, 15, 3, 0);
+          write_p++;
+          arm_push_reg(tmp);
+          arm_copy_to_reg_32bit(&write_p, tmp, (uint32_t)current_thread_tp_offset());
+          arm_add(&write_p, REG_PROC, 0, rd, rd, tmp);
+          write_p++;
+          arm_pop_reg(tmp);
+          arm_ldr(&write_p, IMM_LDR, rd, rd, 0, 1, 1, 0);
+          write_p++;
+          arm_ldr(&write_p, IMM_LDR, rd, rd, offsetof(dbm_thread, tls), 1, 1, 0);
+          write_p++;
+#else
           arm_copy_to_reg_32bit(&write_p, rd, (uint32_t)(&thread_data->tls));
           arm_ldr(&write_p, IMM_LDR, rd, rd, 0, 1, 1, 0);
           write_p++;
+#endif
           if (condition_code != AL) {
             arm_b32_helper(tr_start, (uint32_t)write_p, condition_code ^ 1);
           }
@@ -1167,7 +1460,7 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
 
         arm_copy_to_reg_32bit(&write_p, r8, (uint32_t)read_address + 4);
 
-        arm_bl(&write_p, (thread_data->syscall_wrapper_addr - (uint32_t)write_p - 8) >> 2);
+        arm_bl(&write_p, (thread_data->cc->syscall_wrapper_addr - (uint32_t)write_p - 8) >> 2);
         write_p++;
 
         if (condition_code != AL) {
@@ -1341,6 +1634,9 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
         uint32_t rd;
         arm_mrs_decode_fields(read_address, &rd);
         assert(rd != pc);
+#ifdef DBM_TRACE_PEEPHOLE
+        thread_data->cc->code_cache_meta[basic_block].app_flags = true;
+#endif
         copy_arm();
         break;
       }
@@ -1349,6 +1645,9 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
         uint32_t rn, mask;
         arm_msr_decode_fields(read_address, &rn, &mask);
         assert(rn != pc);
+#ifdef DBM_TRACE_PEEPHOLE
+        thread_data->cc->code_cache_meta[basic_block].app_flags = true;
+#endif
         copy_arm();
         break;
       }
@@ -1538,9 +1837,9 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
         if (start_scan == read_address) {
           copy_arm();
         } else {
-          thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_imm_arm;
-          thread_data->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
-          thread_data->code_cache_meta[basic_block].branch_taken_addr = (uint32_t)read_address;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_imm_arm;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = (uint16_t *)write_p;
+          thread_data->cc->code_cache_meta[basic_block].branch_taken_addr = (uint32_t)read_address;
 
           arm_branch_save_context(thread_data, &write_p, false);
           arm_branch_jump(thread_data, &write_p, basic_block, -2, read_address,
@@ -1804,8 +2103,9 @@ size_t scan_arm(dbm_thread *thread_data, uint32_t *read_address, int basic_block
   return ((uint32_t)write_p - start_address + 4);
 }
 
-void arm_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target) {
-  uint32_t *write_p = (uint32_t *)&thread_data->code_cache->blocks[basic_block];
+size_t arm_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target) {
+  uint32_t *write_p = (uint32_t *)bb_addr(thread_data, basic_block);
+  uint32_t start_address = (uint32_t)write_p;
   uint32_t *data_p = (uint32_t *)write_p;
   data_p += BASIC_BLOCK_SIZE;
 
@@ -1816,6 +2116,8 @@ void arm_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t targe
 
   arm_branch_save_context(thread_data, &write_p, false);
   arm_branch_jump(thread_data, &write_p, basic_block, 0, (uint32_t *)(target - 8), AL, SETUP|REPLACE_TARGET|INSERT_BRANCH);
+
+  return ((uint32_t)write_p - start_address);
 }
 
 #endif // __arm__
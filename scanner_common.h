@@ -27,6 +27,13 @@
 #define INSERT_BRANCH (1 << 2)
 #define LATE_APP_SP (1 << 3)
 
+#ifdef __aarch64__
+  #define NOP 0xD503201F /* NOP Instruction (A64) */
+#endif
+
+// Offset of the value of a matching key from the post-incremented key pointer
+#define HASH_HIT_VALUE_OFFSET ((int)HASH_VALUE_OFFSET - (int)HASH_KEY_STRIDE)
+
 #ifdef __arm__
   #define APP_SP (r3)
   #define DISP_SP_OFFSET (28)
@@ -80,6 +87,62 @@ void a64_tbnz_helper(uint32_t *write_p, uint64_t target, enum reg reg, uint32_t
 void a64_cc_branch(dbm_thread *thread_data, uint32_t *write_p, uint64_t target);
 #endif
 
+#ifdef DBM_IBTC
+#ifdef __arm__
+  #define ARM_IBTC_SLOT_SIZE (7 * 4)
+  #define THUMB_IBTC_SLOT_SIZE (11 * 2)
+#elif __aarch64__
+  #define A64_IBTC_SLOT_SIZE (9 * 4)
+#endif
+void ibtc_set_guard(dbm_code_cache_meta *bb_meta, int slot, void *target);
+void ibtc_add(dbm_thread *thread_data, int fragment_id, uintptr_t target, uintptr_t block_address);
+bool ibtc_add_fragment(dbm_thread *thread_data, int fragment_id, uintptr_t target, uintptr_t tpc);
+void ibtc_unlink(dbm_code_cache_meta *bb_meta);
+void ibtc_relink(dbm_code_cache_meta *bb_meta);
+#endif
+
+#if defined(__aarch64__) && defined(DBM_TB_DIRECT)
+// Slot 0 is the miss path, each slot is LDP X0, X1 + B tpc
+#define A64_JT_SLOT_SIZE (2 * 4)
+#define A64_JT_SPACE (16 * 4 + (A64_JT_SLOTS + 1) * A64_JT_SLOT_SIZE + A64_JT_MAP)
+bool jump_table_add(dbm_thread *thread_data, int fragment_id, uintptr_t target, uintptr_t tpc);
+void jump_table_unlink(dbm_code_cache_meta *bb_meta);
+void jump_table_relink(dbm_code_cache_meta *bb_meta);
+#endif
+
+#if defined(__arm__) && defined(DBM_TB_DIRECT)
+/* The index table of a translated TBB/TBH holds byte offsets if they can reach the
+   target slots after it, otherwise halfword offsets (the table is used by a TBH) */
+static inline bool tb_halfword_table(int entries, int slots) {
+  return ((entries + 1) / 2 + slots * 2 + 1) > 0xFF;
+}
+
+// Size of the index table in halfwords
+static inline int tb_table_size(int entries, int slots) {
+  return tb_halfword_table(entries, slots) ? entries : (entries + 1) / 2;
+}
+#endif
+
+#ifdef DBM_PROFILE
+#ifdef __arm__
+void arm_profile_count(uint32_t **o_write_p, uint32_t *counter);
+void thumb_profile_count(uint16_t **o_write_p, uint32_t *counter);
+#elif __aarch64__
+void a64_profile_count(uint32_t **o_write_p, uint32_t *counter);
+#endif
+#endif
+
+#ifdef DBM_TRACES
+/* The trace head counter code at the start of basic blocks, after the entry pop.
+   Its first instruction is replaced by a branch over it by trace_head_disable() */
+#ifdef __arm__
+  #define ARM_TRACE_HEAD_SIZE (5 * 4)
+  #define THUMB_TRACE_HEAD_SIZE (8 * 2)
+#elif __aarch64__
+  #define A64_TRACE_HEAD_SIZE (6 * 4)
+#endif
+#endif
+
 extern void inline_hash_lookup();
 extern void end_of_inline_hash_lookup();
 extern void inline_hash_lookup_get_addr();
@@ -21,6 +21,7 @@
 #ifdef __arm__
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
@@ -46,7 +47,21 @@
 #endif
 
 #define MIN_FSPACE (60)
-#define IHL_FSPACE (76)
+#ifdef DBM_RAS
+  #define RAS_PUSH_SPACE (64)
+  #define RAS_POP_SPACE (44)
+  #if RAS_TOP_INC != (1 << 24)
+    #error "The encoding of RAS_TOP_INC assumes RAS_BITS == 8"
+  #endif
+#else
+  #define RAS_POP_SPACE (0)
+#endif
+#ifdef DBM_IBTC
+  #define IBTC_SPACE (IBTC_SLOTS * THUMB_IBTC_SLOT_SIZE)
+#else
+  #define IBTC_SPACE (0)
+#endif
+#define IHL_FSPACE (76 + RAS_POP_SPACE + IBTC_SPACE)
 
 #define copy_thumb_16() *(write_p++) = *read_address;
 #define copy_thumb_32() *(write_p++) = *read_address;\
@@ -221,22 +236,22 @@ void thumb_check_free_space(dbm_thread *thread_data, uint16_t **o_write_p, uint3
   }
   if ((((uint32_t)write_p + size) >= (uint32_t)data_p)) {
     int new_block = allocate_bb(thread_data);
-    thread_data->code_cache_meta[new_block].actual_id = cur_block;
+    thread_data->cc->code_cache_meta[new_block].actual_id = cur_block;
 
-    if ((uint32_t *)&thread_data->code_cache->blocks[new_block] != data_p) {
+    if ((uint32_t *)bb_addr(thread_data, new_block) != data_p) {
       if (handle_it && it_state->cond_inst_after_it > 0) {
         create_it_gap(&write_p, it_state);
       }
 
-      thumb_b32_helper(write_p, (uint32_t)&thread_data->code_cache->blocks[new_block]);
-      write_p = (uint16_t *)&thread_data->code_cache->blocks[new_block];
+      thumb_b32_helper(write_p, (uint32_t)bb_addr(thread_data, new_block));
+      write_p = (uint16_t *)bb_addr(thread_data, new_block);
 
       if (handle_it && it_state->cond_inst_after_it > 0) {
         close_it_gap(&write_p, it_state);
       }
     }
     *addr_prev_block = (uint32_t)write_p;
-    data_p = (uint32_t *)&thread_data->code_cache->blocks[new_block + 1];
+    data_p = (uint32_t *)(bb_addr(thread_data, new_block) + 1);
   }
 
   *o_write_p = write_p;
@@ -295,8 +310,13 @@ void thumb_b_bl_helper(uint16_t *write_p, uint32_t dest_addr, bool link, bool to
   int difference = dest_addr - ((uint32_t)write_p & (to_arm ? ~2 : ~0)) - 4;
 
   if (difference < -(16*1024*1024) || difference >= (16*1024*1024)) {
-    fprintf(stderr, "Branch out of range\n");
-    while(1);
+    if (to_arm) {
+      fprintf(stderr, "Branch out of range\n");
+      while(1);
+    }
+    // Branch to a different code cache region
+    dest_addr = cc_veneer(current_thread, (uint32_t)write_p, dest_addr, true);
+    difference = dest_addr - (uint32_t)write_p - 4;
   }
   uint32_t sign_bit = (difference & 0x80000000) ? 1 : 0;
   uint32_t i1 = ~((difference >> 23) ^ sign_bit) & 0x1;
@@ -432,7 +452,7 @@ void branch_jump(dbm_thread *thread_data, uint16_t **o_write_p, int bb_index, ui
       thumb_addi32(&write_p, 0, 0, sp, 0, r3, DISP_SP_OFFSET);
       write_p += 2;
     }
-    thumb_b32_helper(write_p, (uint32_t)thread_data->dispatcher_addr-4);
+    thumb_b32_helper(write_p, (uint32_t)thread_data->cc->dispatcher_addr-4);
     write_p += 2;
   }
   
@@ -450,8 +470,8 @@ void set_cc_imm_links(dbm_thread *thread_data,
   uint32_t offset;
 
   if ((taken_in_cache || skipped_in_cache) &&
-      thread_data->code_cache_meta[basic_block].branch_cache_status == 0) {
-    thread_data->code_cache_meta[basic_block].branch_cache_status = taken_in_cache ? BRANCH_LINKED : FALLTHROUGH_LINKED;
+      thread_data->cc->code_cache_meta[basic_block].branch_cache_status == 0) {
+    thread_data->cc->code_cache_meta[basic_block].branch_cache_status = taken_in_cache ? BRANCH_LINKED : FALLTHROUGH_LINKED;
     offset = ((uint32_t)write_p + 2) | THUMB;
     if (taken_in_cache) {
       record_cc_link(thread_data, offset, address_taken);
@@ -461,10 +481,10 @@ void set_cc_imm_links(dbm_thread *thread_data,
   }
 
   if (taken_in_cache && skipped_in_cache &&
-      (thread_data->code_cache_meta[basic_block].branch_cache_status & BOTH_LINKED) == 0) {
-    thread_data->code_cache_meta[basic_block].branch_cache_status |= BOTH_LINKED;
+      (thread_data->cc->code_cache_meta[basic_block].branch_cache_status & BOTH_LINKED) == 0) {
+    thread_data->cc->code_cache_meta[basic_block].branch_cache_status |= BOTH_LINKED;
     offset = ((uint32_t)write_p + 4 + 2) | THUMB;
-    if (thread_data->code_cache_meta[basic_block].branch_cache_status & BRANCH_LINKED) {
+    if (thread_data->cc->code_cache_meta[basic_block].branch_cache_status & BRANCH_LINKED) {
       record_cc_link(thread_data, offset, address_skipped);
     } else {
       record_cc_link(thread_data, offset, address_taken);
@@ -485,7 +505,7 @@ void thumb_encode_cond_imm_branch(dbm_thread *thread_data,
   uint16_t *write_p = *o_write_p;
 
   if (taken_in_cache && skipped_in_cache) {
-    if (update && (thread_data->code_cache_meta[basic_block].branch_cache_status & FALLTHROUGH_LINKED)) {
+    if (update && (thread_data->cc->code_cache_meta[basic_block].branch_cache_status & FALLTHROUGH_LINKED)) {
       thumb_it16(&write_p, arm_inverse_cond_code[condition], 0x8);
       write_p++;
       thumb_b32_helper(write_p, address_skipped);
@@ -563,7 +583,7 @@ void thumb_encode_cbz_branch(dbm_thread *thread_data,
   uint16_t *write_p = *o_write_p;
               
   if (taken_in_cache && skipped_in_cache) {
-    if (update && (thread_data->code_cache_meta[basic_block].branch_cache_status & FALLTHROUGH_LINKED)) {
+    if (update && (thread_data->cc->code_cache_meta[basic_block].branch_cache_status & FALLTHROUGH_LINKED)) {
       thumb_cbz16(&write_p, 0, 0x01, rn);
       write_p++;
       thumb_b32_helper(write_p, address_skipped);
@@ -629,36 +649,300 @@ void thumb_encode_cbz_branch(dbm_thread *thread_data,
   *o_write_p = write_p;
 }
 
-void thumb_inline_hash_lookup(dbm_thread *thread_data, uint16_t **o_write_p, int basic_block, int r_target) {
+#if defined(DBM_TB_DIRECT) && !defined(FAST_BT)
+/* Returns the number of entries of the table of a TBB/TBH from the bounds check
+   which usually precedes it (CMP rm, #n; BHI default), or 0 if there isn't one.
+   It's only used to size the translated table, larger indexes still go to the
+   slow path, so a misidentified check is harmless. */
+static int thumb_tb_entries(uint16_t *read_address, uint32_t rm) {
+  uint16_t *p = read_address;
+
+  // Don't read across the start of the page
+  if (((uint32_t)read_address & (PAGE_SIZE - 1)) < 8) {
+    return 0;
+  }
+
+  // BHI.N or BHI.W
+  if ((p[-1] & 0xFF00) == 0xD800) {
+    p -= 1;
+  } else if ((p[-2] & 0xFBC0) == 0xF200 && (p[-1] & 0xD000) == 0x8000) {
+    p -= 2;
+  } else {
+    return 0;
+  }
+
+  // CMP rm, #imm8 or CMP.W rm, #imm8
+  if (rm < 8 && (p[-1] & 0xFF00) == (0x2800 | (rm << 8))) {
+    return (p[-1] & 0xFF) + 1;
+  }
+  if (p[-2] == (0xF1B0 | rm) && (p[-1] & 0xFF00) == 0x0F00) {
+    return (p[-1] & 0xFF) + 1;
+  }
+
+  return 0;
+}
+#endif
+
+#ifdef DBM_PROFILE
+// Increments a 32-bit execution counter, preserving the flags and all registers
+void thumb_profile_count(uint16_t **o_write_p, uint32_t *counter) {
+  uint16_t *write_p = *o_write_p;
+
+  // PUSH {r0, r1}
+  thumb_push16(&write_p, (1 << r0) | (1 << r1));
+  write_p++;
+
+  // MOVW+MOVT r0, counter
+  copy_to_reg_32bit(&write_p, r0, (uint32_t)counter);
+
+  // LDR r1, [r0]
+  thumb_ldrwi32(&write_p, r1, r0, 0);
+  write_p += 2;
+
+  // ADD.W r1, r1, #1
+  thumb_addi32(&write_p, 0, 0, r1, 0, r1, 1);
+  write_p += 2;
+
+  // STR r1, [r0]
+  thumb_strwi32(&write_p, r1, r0, 0);
+  write_p += 2;
+
+  // POP {r0, r1}
+  thumb_pop16(&write_p, (1 << r0) | (1 << r1));
+  write_p++;
+
+  *o_write_p = write_p;
+}
+#endif
+
+#ifdef DBM_RAS
+/* Pushes the return address of a call and the translation of the return site to
+   the shadow return address stack. The translation is loaded from a literal,
+   which is updated as a FULLADDR link. The flags are preserved. */
+void thumb_ras_push(dbm_thread *thread_data, uint16_t **o_write_p, uint32_t ret_spc) {
+  uint16_t *write_p = *o_write_p;
+  uint32_t ret_tpc = lookup_or_stub(thread_data, ret_spc);
+  uint16_t *ldr_lit;
+  uint16_t *branch_over;
+  uint32_t lit_base;
+
+  // PUSH {r0, r1}
+  thumb_push16(&write_p, (1 << r0) | (1 << r1));
+  write_p++;
+
+  // MOVW+MOVT r0, &ras
+  copy_to_reg_32bit(&write_p, r0, (uint32_t)&thread_data->ras);
+
+  // LDR r1, [r0, #top]
+  thumb_ldrwi32(&write_p, r1, r0, offsetof(return_addr_stack, top));
+  write_p += 2;
+
+  // ADD r1, r1, #RAS_TOP_INC
+  thumb_addi32(&write_p, 0, 0, r1, 7, r1, 0x80);
+  write_p += 2;
+
+  // STR r1, [r0, #top]
+  thumb_strwi32(&write_p, r1, r0, offsetof(return_addr_stack, top));
+  write_p += 2;
+
+  // ADD r0, r0, r1, LSR #RAS_TOP_SHIFT
+  thumb_add32(&write_p, 0, r0, RAS_TOP_SHIFT >> 2, r0, RAS_TOP_SHIFT & 3, LSR, r1);
+  write_p += 2;
+
+  // MOVW+MOVT r1, ret_spc
+  copy_to_reg_32bit(&write_p, r1, ret_spc);
+
+  // STR r1, [r0, #entries.spc]
+  thumb_strwi32(&write_p, r1, r0, offsetof(return_addr_stack, entries) + offsetof(cc_addr_pair, spc));
+  write_p += 2;
+
+  // LDR r1, ret_tpc_literal
+  ldr_lit = write_p;
+  write_p += 2;
+
+  // SUBW r1, r1, #2 (literal holds the adjusted entry address)
+  thumb_subwi32(&write_p, 0, r1, 0, r1, 2);
+  write_p += 2;
+
+  // STR r1, [r0, #entries.tpc]
+  thumb_strwi32(&write_p, r1, r0, offsetof(return_addr_stack, entries) + offsetof(cc_addr_pair, tpc));
+  write_p += 2;
+
+  // POP {r0, r1}
+  thumb_pop16(&write_p, (1 << r0) | (1 << r1));
+  write_p++;
+
+  // B over_literal
+  branch_over = write_p++;
+
+  if ((uint32_t)write_p & 2) {
+    thumb_nop16(&write_p);
+    write_p++;
+  }
+
+  lit_base = ((uint32_t)ldr_lit + 4) & 0xFFFFFFFC;
+  thumb_ldrl32(&ldr_lit, r1, (uint32_t)write_p - lit_base, 1);
+  *(uint32_t *)write_p = ret_tpc;
+  record_cc_link(thread_data, (uint32_t)write_p | FULLADDR, ret_tpc);
+  write_p += 2;
+
+  thumb_b16(&branch_over, (((uint32_t)write_p - (uint32_t)branch_over - 4) >> 1) & 0x7FF);
+
+  *o_write_p = write_p;
+}
+#endif
+
+#ifdef DBM_IBTC
+/* Emits the inline target cache of an indirect branch, with {r5, r6} (and r4 if
+   the target register isn't clean) pushed. Slots are filled by ibtc_add:
+
+       NOP                   guard
+       MOVW+MOVT r6, #spc
+       CMP.W r6, target
+       BNE next_slot
+       POP {(r4,) r5, r6}
+       B.W tpc
+*/
+void thumb_ibtc_chain(dbm_thread *thread_data, uint16_t **o_write_p, int basic_block,
+                      int target, bool target_reg_clean) {
+  uint16_t *write_p = *o_write_p;
+
+  thread_data->cc->code_cache_meta[basic_block].ibtc = write_p;
+  thread_data->cc->code_cache_meta[basic_block].free_b = 0;
+
+  for (int i = 0; i < IBTC_SLOTS; i++) {
+    // guard and MOVW+MOVT r6, #spc
+    for (int j = 0; j < 5; j++) {
+      thumb_nop16(&write_p);
+      write_p++;
+    }
+
+    // CMP.W r6, target
+    thumb_cmp32(&write_p, r6, 0, 0, 0, target);
+    write_p += 2;
+
+    // BNE next_slot
+    thumb_b16_helper(write_p, (uint32_t)(write_p + 4), NE);
+    write_p++;
+
+    // POP {(r4,) r5, r6}
+    thumb_pop16(&write_p, (target_reg_clean ? 0 : (1 << r4)) | (1 << r5) | (1 << r6));
+    write_p++;
+
+    // B.W tpc
+    thumb_nop16(&write_p);
+    write_p++;
+    thumb_nop16(&write_p);
+    write_p++;
+  }
+
+  *o_write_p = write_p;
+}
+#endif
+
+void thumb_inline_hash_lookup(dbm_thread *thread_data, uint16_t **o_write_p, int basic_block,
+                              int r_target, bool ras_pop) {
   uint16_t *loop_start;
   uint16_t *branch_miss;
   uint16_t *write_p = *o_write_p;
+#ifdef DBM_RAS
+  uint16_t *ras_miss;
+  uint16_t *ras_hit = NULL;
+#endif
 
   bool target_reg_clean = (r_target >= r0);
   int target = target_reg_clean ? r_target : r5;
   int r_tmp = target_reg_clean ? r5 : r4;
 
-  thread_data->code_cache_meta[basic_block].rn = target;
+  thread_data->cc->code_cache_meta[basic_block].rn = target;
+
+#ifdef DBM_IBTC
+  if (!ras_pop) {
+    thumb_ibtc_chain(thread_data, &write_p, basic_block, target, target_reg_clean);
+  }
+#endif
+
+#ifdef DBM_RAS
+  if (ras_pop) {
+    // MOVW+MOVT r6, &ras
+    copy_to_reg_32bit(&write_p, r6, (uint32_t)&thread_data->ras);
 
-  // MOVW+MOVT r_tmp, hash_mask
-  copy_to_reg_32bit(&write_p, r_tmp, CODE_CACHE_HASH_SIZE);
+    // LDR r_tmp, [r6, #top]
+    thumb_ldrwi32(&write_p, r_tmp, r6, offsetof(return_addr_stack, top));
+    write_p += 2;
+
+    // ADD r_tmp, r_tmp, #-RAS_TOP_INC
+    thumb_addi32(&write_p, 0, 0, r_tmp, 4, r_tmp, 0x7F);
+    write_p += 2;
 
-  // MOVW+MOVT r6, hash_table
-  copy_to_reg_32bit(&write_p, r6, (uint32_t)thread_data->entry_address.entries);
+    // STR r_tmp, [r6, #top]
+    thumb_strwi32(&write_p, r_tmp, r6, offsetof(return_addr_stack, top));
+    write_p += 2;
+
+    // ADD r_tmp, r_tmp, #RAS_TOP_INC
+    thumb_addi32(&write_p, 0, 0, r_tmp, 7, r_tmp, 0x80);
+    write_p += 2;
+
+    // ADD r6, r6, r_tmp, LSR #RAS_TOP_SHIFT
+    thumb_add32(&write_p, 0, r6, RAS_TOP_SHIFT >> 2, r6, RAS_TOP_SHIFT & 3, LSR, r_tmp);
+    write_p += 2;
 
+    // LDR r_tmp, [r6, #entries.spc]
+    thumb_ldrwi32(&write_p, r_tmp, r6, offsetof(return_addr_stack, entries) + offsetof(cc_addr_pair, spc));
+    write_p += 2;
+
+    // CMP r_tmp, target
+    thumb_cmp32(&write_p, r_tmp, 0, 0, 0, target);
+    write_p += 2;
+
+    // BNE ras_miss
+    ras_miss = write_p++;
+
+    // LDR r6, [r6, #entries.tpc]
+    thumb_ldrwi32(&write_p, r6, r6, offsetof(return_addr_stack, entries) + offsetof(cc_addr_pair, tpc));
+    write_p += 2;
+
+    // B jump
+    ras_hit = write_p++;
+
+    // ras_miss:
+    thumb_b16_helper(ras_miss, (uint32_t)write_p, NE);
+  }
+#endif
+
+  // MOVW+MOVT r6, &hash_table
+  copy_to_reg_32bit(&write_p, r6, (uint32_t)&thread_data->cc->entry_address);
+
+  // LDR r_tmp, [r6, #mask]
+  thumb_ldri32(&write_p, r_tmp, r6, offsetof(hash_table, mask), 1, 1, 0);
+  write_p += 2;
+
+  // ADD r6, r6, r_tmp, LSR #31, orders the entries load after the mask load, see hash_grow
+  thumb_add32(&write_p, 0, r6, 31 >> 2, r6, 31 & 3, LSR, r_tmp);
+  write_p += 2;
+
+  // LDR r6, [r6, #entries]
+  thumb_ldri32(&write_p, r6, r6, offsetof(hash_table, entries), 1, 1, 0);
+  write_p += 2;
+
+#if HASH_INDEX_SHIFT == 0
   // AND r_tmp, target, r_tmp
   thumb_and32(&write_p, 0, target, 0, r_tmp, 0, 0, r_tmp);
+#else
+  // AND r_tmp, r_tmp, target, LSR #HASH_INDEX_SHIFT
+  thumb_and32(&write_p, 0, r_tmp, HASH_INDEX_SHIFT >> 2, r_tmp, HASH_INDEX_SHIFT & 3, LSR, target);
+#endif
   write_p += 2;
 
-  // ADD r_tmp, r6, r_tmp, LSL #3
-  thumb_add32(&write_p, 0, r6, 0, r_tmp, 3, 0, r_tmp);
+  // ADD r_tmp, r6, r_tmp, LSL #HASH_SCALE_SHIFT
+  thumb_add32(&write_p, 0, r6, HASH_SCALE_SHIFT >> 2, r_tmp, HASH_SCALE_SHIFT & 3, LSL, r_tmp);
   write_p += 2;
 
   // loop:
   loop_start = write_p;
 
-  // LDR r6, [r_tmp], #8
-  thumb_ldri32(&write_p, r6, r_tmp, 8, 0, 1, 1);
+  // LDR r6, [r_tmp], #HASH_KEY_STRIDE
+  thumb_ldri32(&write_p, r6, r_tmp, HASH_KEY_STRIDE, 0, 1, 1);
   write_p += 2;
 
   // CMP r6, target
@@ -668,11 +952,17 @@ void thumb_inline_hash_lookup(dbm_thread *thread_data, uint16_t **o_write_p, int
   // BNE miss
   branch_miss = write_p++;
 
-  // jump:
-  // LDR r6, [r_tmp, #-4]
-  thumb_ldri32(&write_p, r6, r_tmp, 4, 1, 0, 0);
+  // LDR r6, [r_tmp, #HASH_HIT_VALUE_OFFSET]
+  thumb_ldri32(&write_p, r6, r_tmp, abs(HASH_HIT_VALUE_OFFSET), 1, HASH_HIT_VALUE_OFFSET >= 0, 0);
   write_p += 2;
 
+  // jump:
+#ifdef DBM_RAS
+  if (ras_hit != NULL) {
+    thumb_b16(&ras_hit, (((uint32_t)write_p - (uint32_t)ras_hit - 4) >> 1) & 0x7FF);
+  }
+#endif
+
   if (!target_reg_clean) {
     // POP {R4}
     thumb_pop16(&write_p, (1 << r4));
@@ -694,6 +984,15 @@ void thumb_inline_hash_lookup(dbm_thread *thread_data, uint16_t **o_write_p, int
   thumb_b16_helper(write_p, (uint32_t)loop_start, NE);
   write_p++;
 
+  // not_found:
+#ifdef DBM_IBTC
+  if (!ras_pop) {
+    for (int i = 0; i < IBTC_SLOTS; i++) {
+      ibtc_set_guard(&thread_data->cc->code_cache_meta[basic_block], i, write_p);
+    }
+  }
+#endif
+
   // SUB sp, sp, #8
   // PUSH {R0 - R3}
   branch_save_context(thread_data, &write_p, true);
@@ -950,14 +1249,14 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
   uint16_t *start_scan = read_address;
   if (write_p == NULL) {
-    write_p = (uint16_t *)&thread_data->code_cache->blocks[basic_block];
+    write_p = (uint16_t *)bb_addr(thread_data, basic_block);
   }
   uint32_t start_address = (uint32_t)write_p;
   uint32_t *data_p;
   if (type == mambo_bb) {
     data_p = (uint32_t *)write_p + BASIC_BLOCK_SIZE;
   } else {
-    data_p = (uint32_t *)&thread_data->code_cache->traces + (TRACE_CACHE_SIZE/4);
+    data_p = (uint32_t *)trace_cache_end(&thread_data->cc->code_cache[cc_region_index(thread_data, (uintptr_t)write_p)]);
   }
   
   debug("write_p: %p\n", write_p);
@@ -1093,8 +1392,15 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
     copy_to_reg_32bit(&write_p, r0, basic_block);
 
-    thumb_bl32_helper(write_p, thread_data->trace_head_incr_addr);
+    thumb_bl32_helper(write_p, thread_data->cc->trace_head_incr_addr);
     write_p += 2;
+    thread_data->cc->code_cache_meta[basic_block].trace_head = TRACE_HEAD_COUNTING;
+  }
+#endif
+
+#ifdef DBM_PROFILE
+  if (type != mambo_trace) {
+    thumb_profile_count(&write_p, &thread_data->cc->profile_count[basic_block]);
   }
 #endif
 
@@ -1106,6 +1412,9 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
   while(!stop) {
     debug("thumb scan read_address: %p\n", read_address);
     thumb_instruction inst = thumb_decode(read_address);
+#ifdef DBM_RANGE_INVALIDATION
+    cc_source_index_add(thread_data, basic_block, (uintptr_t)read_address);
+#endif
     debug("Instruction enum: %d\n", (inst == THUMB_INVALID) ? -1 : inst);
     
     debug("instruction word: 0x%x\n", (inst < THUMB_ADC32) ? *read_address : ((*read_address) << 16) |*(read_address+1));
@@ -1213,8 +1522,8 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
         if (rdn == pc) {
           assert(rm != sp);
-          thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
-          thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
 
           uint32_t r_target = r0;
 
@@ -1244,7 +1553,7 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 #ifdef DBM_INLINE_HASH
           thumb_check_free_space(thread_data, &write_p, &data_p, &it_state,
                                &set_addr_prev_block, true, IHL_FSPACE, basic_block);
-          thumb_inline_hash_lookup(thread_data, &write_p, basic_block, -1);
+          thumb_inline_hash_lookup(thread_data, &write_p, basic_block, -1, false);
 #else
           branch_jump(thread_data, &write_p, basic_block, 0, SETUP|INSERT_BRANCH|LATE_APP_SP);
 #endif
@@ -1283,8 +1592,8 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
         assert(rm != sp && (rm != pc || inst == THUMB_BX16));
         /* Handle conditional execution: either a direct branch to the basic block for
            read_address + 2 or a call to the dispatcher */
-        thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
         if (it_state.cond_inst_after_it == 1) {
 #ifdef LINK_BX_ALT
           /* If the previous instruction was POP, we'll overwrite it and place a copy:
@@ -1366,6 +1675,15 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
 #ifdef DBM_INLINE_HASH
         assert(rm != sp && rm != pc);
+#ifdef DBM_RAS
+        if (inst == THUMB_BLX16) {
+          thumb_check_free_space(thread_data, &write_p, &data_p, &it_state,
+                                 &set_addr_prev_block, true, RAS_PUSH_SPACE, basic_block);
+          thumb_ras_push(thread_data, &write_p, ((uint32_t)read_address) + 2 + 1);
+          // The literal in the push sequence must not be scanned when unlinking
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
+        }
+#endif
         int r_target = -1;
         if (rm != r5 && rm != r6 && (inst != THUMB_BLX16 || rm != lr)) {
           r_target = rm;
@@ -1385,7 +1703,7 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
         thumb_check_free_space(thread_data, &write_p, &data_p, &it_state,
                                &set_addr_prev_block, true, IHL_FSPACE, basic_block);
-        thumb_inline_hash_lookup(thread_data, &write_p, basic_block, r_target);
+        thumb_inline_hash_lookup(thread_data, &write_p, basic_block, r_target, inst == THUMB_BX16 && rm == lr);
 #else
         branch_save_context(thread_data, &write_p, true);
 
@@ -1522,22 +1840,22 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
                                &set_addr_prev_block, true, CBZ_SIZE, basic_block);
 
         // Mark this as the beggining of code emulating B
-        thread_data->code_cache_meta[basic_block].exit_branch_type = cbz_thumb;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
-        thread_data->code_cache_meta[basic_block].branch_taken_addr = (inst == THUMB_CBZ16) ? target : ((uint32_t)read_address + 2 + 1);
-        thread_data->code_cache_meta[basic_block].branch_skipped_addr = (inst == THUMB_CBZ16) ? ((uint32_t)read_address + 2 + 1) : target;
-        thread_data->code_cache_meta[basic_block].rn = rn;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = cbz_thumb;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
+        thread_data->cc->code_cache_meta[basic_block].branch_taken_addr = (inst == THUMB_CBZ16) ? target : ((uint32_t)read_address + 2 + 1);
+        thread_data->cc->code_cache_meta[basic_block].branch_skipped_addr = (inst == THUMB_CBZ16) ? ((uint32_t)read_address + 2 + 1) : target;
+        thread_data->cc->code_cache_meta[basic_block].rn = rn;
 
 #ifdef DBM_LINK_CBZ
         if (type == mambo_bb) {
-          branch_taken_address = cc_lookup(thread_data, thread_data->code_cache_meta[basic_block].branch_taken_addr);
+          branch_taken_address = cc_lookup(thread_data, thread_data->cc->code_cache_meta[basic_block].branch_taken_addr);
           branch_taken_cached = (branch_taken_address != UINT_MAX);
-          branch_skipped_address = cc_lookup(thread_data, thread_data->code_cache_meta[basic_block].branch_skipped_addr);
+          branch_skipped_address = cc_lookup(thread_data, thread_data->cc->code_cache_meta[basic_block].branch_skipped_addr);
           branch_skipped_cached = (branch_skipped_address != UINT_MAX);
 
           thumb_encode_cbz_branch(thread_data, rn, &write_p, basic_block,
-                                  (branch_taken_cached) ? branch_taken_address : thread_data->code_cache_meta[basic_block].branch_taken_addr,
-                                  (branch_skipped_cached) ? branch_skipped_address : thread_data->code_cache_meta[basic_block].branch_skipped_addr,
+                                  (branch_taken_cached) ? branch_taken_address : thread_data->cc->code_cache_meta[basic_block].branch_taken_addr,
+                                  (branch_skipped_cached) ? branch_skipped_address : thread_data->cc->code_cache_meta[basic_block].branch_skipped_addr,
                                   branch_taken_cached,
                                   branch_skipped_cached,
                                   false);
@@ -1569,8 +1887,8 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
           copy_thumb_16();
         } else { // PC is POPed
-          thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
-          thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
 
           if (link_bx_alt(thread_data, &write_p, it_state.cond_inst_after_it, (uint32_t)read_address + 3)) {
             it_cond_handled = true;
@@ -1591,7 +1909,7 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
           thumb_check_free_space(thread_data, &write_p, &data_p, &it_state,
                                &set_addr_prev_block, true, IHL_FSPACE, basic_block);
-          thumb_inline_hash_lookup(thread_data, &write_p, basic_block, -1);
+          thumb_inline_hash_lookup(thread_data, &write_p, basic_block, -1, true);
 #else
           thumb_pop16(&write_p, reglist & 0xFF);
           write_p++;
@@ -1664,11 +1982,11 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
                                &set_addr_prev_block, true, IMM_SIZE, basic_block);
 
         // Mark this as the beggining of code emulating B
-        thread_data->code_cache_meta[basic_block].exit_branch_type = cond_imm_thumb;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
-        thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
-        thread_data->code_cache_meta[basic_block].branch_skipped_addr = (uint32_t)read_address + 2 + 1;
-        thread_data->code_cache_meta[basic_block].branch_condition = condition;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = cond_imm_thumb;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
+        thread_data->cc->code_cache_meta[basic_block].branch_taken_addr = target;
+        thread_data->cc->code_cache_meta[basic_block].branch_skipped_addr = (uint32_t)read_address + 2 + 1;
+        thread_data->cc->code_cache_meta[basic_block].branch_condition = condition;
 
 #ifdef DBM_LINK_COND_IMM
         if (type == mambo_bb) {
@@ -1703,7 +2021,7 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
         
         copy_to_reg_32bit(&write_p, r8, (uint32_t)read_address + 2 + 1);
         
-        thumb_blx32_helper(write_p, thread_data->syscall_wrapper_addr);
+        thumb_blx32_helper(write_p, thread_data->cc->syscall_wrapper_addr);
         write_p += 2;
 
         thumb_scanner_deliver_callbacks(thread_data, POST_BB_C, &it_state, read_address, -1,
@@ -1723,12 +2041,12 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
         debug("target : 0x%x\n", target);
 #ifdef DBM_INLINE_UNCOND_IMM
         if ((target - 1) <= (uint32_t)read_address) {
-          if (inline_back_count >= MAX_BACK_INLINE) {
+          if (inline_back_count >= global_data.traces.max_back_inline) {
             block_address = lookup_or_stub(thread_data, target);
             thumb_cc_branch(thread_data, write_p, block_address);
             write_p += 2;
 
-            thread_data->code_cache_meta[basic_block].exit_branch_type = trace_inline_max;
+            thread_data->cc->code_cache_meta[basic_block].exit_branch_type = trace_inline_max;
 
             stop = true;
             break;
@@ -1749,8 +2067,8 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
         }
 #endif
         // Mark this as the beggining of code emulating B
-        thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_imm_thumb;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_imm_thumb;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
 #ifdef DBM_LINK_UNCOND_IMM
         block_address = cc_lookup(thread_data, target);
 
@@ -1912,8 +2230,8 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
         assert(rn != pc);
 
         if (rdn == pc) {
-          thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
-          thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
         }
 
         if (rdn != pc) {
@@ -1972,7 +2290,7 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
             thumb_check_free_space(thread_data, &write_p, &data_p, &it_state,
                                &set_addr_prev_block, true, IHL_FSPACE, basic_block);
-            thumb_inline_hash_lookup(thread_data, &write_p, basic_block, -1);
+            thumb_inline_hash_lookup(thread_data, &write_p, basic_block, -1, rn == sp && writeback);
 #else
             scratch_reg = (rn == r0) ? 1 : 0;
             branch_save_context(thread_data, &write_p, false);
@@ -2068,8 +2386,8 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
             while(1);
           }
 
-          thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
-          thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
 
           assert(rn != sp && rm != sp);
           uint32_t r_target = r0;
@@ -2086,7 +2404,7 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 #ifdef DBM_INLINE_HASH
         thumb_check_free_space(thread_data, &write_p, &data_p, &it_state,
                                &set_addr_prev_block, true, IHL_FSPACE, basic_block);
-          thumb_inline_hash_lookup(thread_data, &write_p, basic_block, -1);
+          thumb_inline_hash_lookup(thread_data, &write_p, basic_block, -1, false);
 #else
           branch_jump(thread_data, &write_p, basic_block, target, SETUP|INSERT_BRANCH|LATE_APP_SP);
 #endif
@@ -2372,17 +2690,22 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
         // Set the link register
         if (inst != THUMB_B32) {
           copy_to_reg_32bit(&write_p, lr, ((uint32_t)read_address) + 4 + 1);
+#ifdef DBM_RAS
+          thumb_check_free_space(thread_data, &write_p, &data_p, &it_state,
+                                 &set_addr_prev_block, true, RAS_PUSH_SPACE, basic_block);
+          thumb_ras_push(thread_data, &write_p, ((uint32_t)read_address) + 4 + 1);
+#endif
         }
 
 #ifdef DBM_INLINE_UNCOND_IMM
         if (inst != THUMB_BL_ARM32 && (type == mambo_trace || type == mambo_trace_entry)) {
           if ((target - 1) <= (uint32_t)read_address) {
-            if (inline_back_count >= MAX_BACK_INLINE) {
+            if (inline_back_count >= global_data.traces.max_back_inline) {
               block_address = lookup_or_stub(thread_data, target);
               thumb_cc_branch(thread_data, write_p, block_address);
               write_p += 2;
 
-              thread_data->code_cache_meta[basic_block].exit_branch_type = trace_inline_max;
+              thread_data->cc->code_cache_meta[basic_block].exit_branch_type = trace_inline_max;
 
               stop = true;
               break;
@@ -2403,12 +2726,15 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
                                  &set_addr_prev_block, true, DISP_CALL_SIZE, basic_block);
 
           if (inst == THUMB_BL_ARM32) {
-            thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_blxi_thumb;
+            thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_blxi_thumb;
           } else {
-            thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_imm_thumb;
+            thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_imm_thumb;
           }
-          thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
-          thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
+          thread_data->cc->code_cache_meta[basic_block].branch_taken_addr = target;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
+#ifdef DBM_TRACES
+          thread_data->cc->code_cache_meta[basic_block].call_exit = (inst != THUMB_B32);
+#endif
 #ifdef DBM_LINK_UNCOND_IMM
           block_address = cc_lookup(thread_data, target);
           if (type == mambo_bb && block_address != UINT_MAX && (target & 0x1)) {
@@ -2447,11 +2773,11 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
                                &set_addr_prev_block, true, IMM_SIZE, basic_block);
 
         // Mark this as the beggining of code emulating B
-        thread_data->code_cache_meta[basic_block].exit_branch_type = cond_imm_thumb;
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
-        thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
-        thread_data->code_cache_meta[basic_block].branch_skipped_addr = (uint32_t)read_address + 4 + 1;
-        thread_data->code_cache_meta[basic_block].branch_condition = condition;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_type = cond_imm_thumb;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
+        thread_data->cc->code_cache_meta[basic_block].branch_taken_addr = target;
+        thread_data->cc->code_cache_meta[basic_block].branch_skipped_addr = (uint32_t)read_address + 4 + 1;
+        thread_data->cc->code_cache_meta[basic_block].branch_condition = condition;
 
 #ifdef DBM_LINK_COND_IMM
         if (type == mambo_bb) {
@@ -2598,35 +2924,62 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 #ifdef DBM_TRACES
         if (type == mambo_trace || type == mambo_trace_entry) {
 #endif
-          thread_data->code_cache_meta[basic_block].exit_branch_type = (inst == THUMB_TBB32) ? tbb : tbh;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_type = (inst == THUMB_TBB32) ? tbb : tbh;
 #ifdef DBM_TRACES
         } else {
-          thread_data->code_cache_meta[basic_block].exit_branch_type = tb_indirect;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_type = tb_indirect;
         }
 #endif
-        thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
+        thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
 
 #ifdef DBM_TB_DIRECT
         if (rn == pc) {
           debug("TB: w: %p r: %p, BB: %d\n", write_p, read_address, basic_block);
 
+  #ifndef FAST_BT
+          /* The table is sized from the bounds check of the index, if there is one.
+             Otherwise, indexes up to MAX_TB_INDEX and TB_CACHE_SIZE targets are linked */
+          int tb_entries = thumb_tb_entries(read_address, rm);
+          int tb_slots = TB_CACHE_SIZE;
+          if (tb_entries == 0 || tb_entries > TB_MAX_INDEX) {
+            tb_entries = MAX_TB_INDEX;
+          } else {
+            tb_slots = (tb_entries < TB_MAX_CACHE_SIZE) ? tb_entries : TB_MAX_CACHE_SIZE;
+          }
+          int tb_size = tb_table_size(tb_entries, tb_slots);
+          bool tb_half = tb_halfword_table(tb_entries, tb_slots);
+  #endif
+
   #ifndef DBM_TRACES
           // At least two consecutive BBs are needed
-          assert(thread_data->free_block == basic_block+1);
-          /*basic_block = */thread_data->free_block++;
+          int next_block = allocate_bb(thread_data);
+          assert((uint32_t *)bb_addr(thread_data, next_block) == data_p);
+          thread_data->cc->code_cache_meta[next_block].actual_id = basic_block;
           data_p += BASIC_BLOCK_SIZE;
+    #ifndef FAST_BT
+          // More for the larger tables
+          while ((uint32_t)write_p + tb_size * 2 + tb_slots * 4 + 192 >= (uint32_t)data_p) {
+            next_block = allocate_bb(thread_data);
+            assert((uint32_t *)bb_addr(thread_data, next_block) == data_p);
+            thread_data->cc->code_cache_meta[next_block].actual_id = basic_block;
+            data_p += BASIC_BLOCK_SIZE;
+          }
+    #endif
           thumb_check_free_space(thread_data, &write_p, &data_p, &it_state,
                                  &set_addr_prev_block, true, 472, basic_block);
   #else
           if (type == mambo_trace || type == mambo_trace_entry) {
   #endif
-            thread_data->code_cache_meta[basic_block].rn = INT_MAX;
-            thread_data->code_cache_meta[basic_block].free_b = 0;
+            thread_data->cc->code_cache_meta[basic_block].rn = INT_MAX;
+            thread_data->cc->code_cache_meta[basic_block].free_b = 0;
 
   #ifdef FAST_BT
             thumb_cmpi32 (&write_p, 0, rm, 0, TB_CACHE_SIZE-1);
   #else
-            thumb_cmpi32 (&write_p, 0, rm, 0, MAX_TB_INDEX-1);
+            thread_data->cc->code_cache_meta[basic_block].tb_entries = tb_entries;
+            thread_data->cc->code_cache_meta[basic_block].tb_slots = tb_slots;
+
+            thumb_cmpi32 (&write_p, 0, rm, 0, tb_entries-1);
   #endif
             write_p += 2;
             thumb_it16(&write_p, HI, 8);
@@ -2635,13 +2988,13 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
     #ifdef FAST_BT
             thumb_b32_helper(write_p, (uint32_t)write_p + TB_CACHE_SIZE*4 + 16 + (((uint32_t)write_p & 2) ? 0 : 2));
     #else
-            thumb_b32_helper(write_p, (uint32_t)write_p + MAX_TB_INDEX + TB_CACHE_SIZE*4 + 10);
+            thumb_b32_helper(write_p, (uint32_t)write_p + tb_size*2 + tb_slots*4 + 10);
     #endif
   #else
     #ifdef FAST_BT
             thumb_b32_helper(write_p, (uint32_t)write_p + TB_CACHE_SIZE*4 + 14 + (((uint32_t)write_p & 2) ? 0 : 2));
     #else
-            thumb_b32_helper(write_p, (uint32_t)write_p + MAX_TB_INDEX + TB_CACHE_SIZE*4 + 8);
+            thumb_b32_helper(write_p, (uint32_t)write_p + tb_size*2 + tb_slots*4 + 8);
     #endif
   #endif
             write_p += 2;
@@ -2656,7 +3009,11 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
             arm_ldr((uint32_t **)&write_p, LDR_REG, pc, pc, (LSL << 5) | (2 << 7) | rm, 1, 1, 0);
             write_p += 2;
   #else
-            thumb_tbb32(&write_p, pc, rm);
+            if (tb_half) {
+              thumb_tbh32(&write_p, pc, rm);
+            } else {
+              thumb_tbb32(&write_p, pc, rm);
+            }
             write_p += 2;
   #endif
 
@@ -2671,14 +3028,16 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
             }
   #else
             // Initially all indexes go to the slow dispatcher
-            for (int i = 0; i < MAX_TB_INDEX/2; i++) {
-              *write_p = (MAX_TB_INDEX/2 + TB_CACHE_SIZE*2);
-              *write_p |= *write_p << 8;
+            for (int i = 0; i < tb_size; i++) {
+              *write_p = (tb_size + tb_slots*2);
+              if (!tb_half) {
+                *write_p |= *write_p << 8;
+              }
               write_p++;
             }
             
-            for (int i = 0; i < TB_CACHE_SIZE; i++) {
-              thumb_b32_helper(write_p, (uint32_t)write_p + (TB_CACHE_SIZE -i) * 4);
+            for (int i = 0; i < tb_slots; i++) {
+              thumb_b32_helper(write_p, (uint32_t)write_p + (tb_slots -i) * 4);
               write_p += 2;
             }
   #endif
@@ -2751,7 +3110,7 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
         branch_save_context(thread_data, &write_p, true);
 
         // Save the index for use by the TB linker
-        copy_to_reg_32bit(&write_p, scratch_reg, (uint32_t)&thread_data->code_cache_meta[basic_block].rn);
+        copy_to_reg_32bit(&write_p, scratch_reg, (uint32_t)&thread_data->cc->code_cache_meta[basic_block].rn);
         thumb_strwi32(&write_p, rm, scratch_reg, 0);
         write_p += 2;
  
@@ -2805,8 +3164,8 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
             write_p += 2;
           }
 
-          thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
-          thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_type = uncond_reg_thumb;
+          thread_data->cc->code_cache_meta[basic_block].exit_branch_addr = write_p;
 
 #ifdef DBM_INLINE_HASH
           if (rn == sp) {
@@ -2827,7 +3186,7 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
           }
           thumb_check_free_space(thread_data, &write_p, &data_p, &it_state,
                                &set_addr_prev_block, true, IHL_FSPACE, basic_block);
-          thumb_inline_hash_lookup(thread_data, &write_p, basic_block, -1);
+          thumb_inline_hash_lookup(thread_data, &write_p, basic_block, -1, rn == sp);
 #else
           branch_save_context(thread_data, &write_p, false);
           assert(rn != r3);
@@ -2866,11 +3225,29 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
           //fprintf(stderr, "Read TPIDRURO into R%d\n", rt);
           assert(rt != pc);
 
+#ifdef DBM_SHARED_CC
+          // The code cache is shared, so find this thread's dbm_thread via MAMBO's own TP
+          uint32_t tmp = (rt == r0) ? r1 : r0;
+          modify_in_it_pre(13);
+          thumb_mrc32(&write_p, 0, 13, rt, 15, 3, 0);
+          write_p+=2;
+          thumb_push_regs(&write_p, 1 << tmp);
+          copy_to_reg_32bit(&write_p, tmp, (uint32_t)current_thread_tp_offset());
+          thumb_add32(&write_p, 0, rt, 0, rt, 0, 0, tmp);
+          write_p+=2;
+          thumb_pop_regs(&write_p, 1 << tmp);
+          thumb_ldrwi32(&write_p, rt, rt, 0);
+          write_p+=2;
+          thumb_ldrwi32(&write_p, rt, rt, offsetof(dbm_thread, tls));
+          write_p+=2;
+          modify_in_it_post();
+#else
           modify_in_it_pre(5);
           copy_to_reg_32bit(&write_p, rt, (uint32_t)(&thread_data->tls));
           thumb_ldrwi32(&write_p, rt, rt, 0);
           write_p+=2;
           modify_in_it_post();
+#endif
         } else if (opc1 == 0b111 && crn == 0b0001 && coproc == 0b1010) {
           // This instruction transfers the FPSCR.{N, Z, C, V} condition flags to the APSR.{N, Z, C, V} condition flags.
           copy_thumb_32();
@@ -3111,9 +3488,9 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
   }
 
   if (ldrex) {
-    if (thread_data->code_cache_meta[basic_block].exit_branch_type != uncond_imm_thumb
-        && thread_data->code_cache_meta[basic_block].exit_branch_type != cond_imm_thumb
-        && thread_data->code_cache_meta[basic_block].exit_branch_type != cbz_thumb) {
+    if (thread_data->cc->code_cache_meta[basic_block].exit_branch_type != uncond_imm_thumb
+        && thread_data->cc->code_cache_meta[basic_block].exit_branch_type != cond_imm_thumb
+        && thread_data->cc->code_cache_meta[basic_block].exit_branch_type != cbz_thumb) {
       fprintf(stderr, "WARN: Basic block containing LDREX and no matching STREX "
                       "ends with branch type that can not be directly linked\n");
     }
@@ -3123,8 +3500,9 @@ size_t scan_thumb(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
   return ((uint32_t)write_p - start_address + 4);
 }
 
-void thumb_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target) {
-  uint16_t *write_p = (uint16_t *)&thread_data->code_cache->blocks[basic_block];
+size_t thumb_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target) {
+  uint16_t *write_p = (uint16_t *)bb_addr(thread_data, basic_block);
+  uint32_t start_address = (uint32_t)write_p;
   uint32_t *data_p = (uint32_t *)write_p;
   data_p += BASIC_BLOCK_SIZE;
 
@@ -3133,6 +3511,8 @@ void thumb_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t tar
 
   branch_save_context(thread_data, &write_p, false);
   branch_jump(thread_data, &write_p, basic_block, target, SETUP|REPLACE_TARGET|INSERT_BRANCH);
+
+  return ((uint32_t)write_p - start_address);
 }
 
 #endif // __arm__
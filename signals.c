@@ -67,6 +67,11 @@ void install_system_sig_handlers() {
   act.sa_flags = SA_SIGINFO;
   int ret = sigaction(UNLINK_SIGNAL, &act, NULL);
   assert(ret == 0);
+#ifdef DBM_SMC_WRITE_PROTECT
+  // Writes to write-protected code, see smc_write_fault
+  ret = sigaction(SIGSEGV, &act, NULL);
+  assert(ret == 0);
+#endif
 }
 
 int deliver_signals(uintptr_t spc, self_signal *s) {
@@ -76,6 +81,11 @@ int deliver_signals(uintptr_t spc, self_signal *s) {
     thread_abort(current_thread);
   }
 
+#ifdef DBM_SIGNAL_POLLING
+  // Signals which are blocked now are delivered on later returns from the dispatcher
+  current_thread->signal_poll = 0;
+#endif
+
   int ret = syscall(__NR_rt_sigprocmask, 0, NULL, &sigmask, sizeof(sigmask));
   assert (ret == 0);
 
@@ -168,6 +178,12 @@ bool unlink_direct_branch(dbm_code_cache_meta *bb_meta, void **o_write_p, int fr
     case cbz_a64:
     case tbz_a64:
       offset = (bb_meta->branch_cache_status & BOTH_LINKED) ? 12 : 8;
+  #ifdef DBM_COMPACT_EXITS
+      // The three branches of a compact exit, the rest is in the stub area
+      if (is_compact_exit(fragment_id)) {
+        offset = 12;
+      }
+  #endif
       break;
 #endif
     default:
@@ -212,9 +228,12 @@ void unlink_fragment(int fragment_id, uintptr_t pc) {
 #ifdef DBM_TRACES
   // Skip over trace fragments ending in unlinked unconditional branches
   branch_type type;
+  // With a shared code cache, the last trace might have been built by another thread
+  int trace_limit = current_thread->active_trace.active ? current_thread->active_trace.id
+                                                         : current_thread->cc->trace_id;
 
   do {
-    bb_meta = &current_thread->code_cache_meta[fragment_id];
+    bb_meta = &current_thread->cc->code_cache_meta[fragment_id];
     type = bb_meta->exit_branch_type;
     fragment_id++;
   }
@@ -225,10 +244,10 @@ void unlink_fragment(int fragment_id, uintptr_t pc) {
   while (type == uncond_imm_a64 &&
   #endif
          (bb_meta->branch_cache_status & BOTH_LINKED) == 0 &&
-         fragment_id >= CODE_CACHE_SIZE &&
-         fragment_id < current_thread->active_trace.id);
+         fragment_id >= TRACE_ID_BASE &&
+         fragment_id < trace_limit);
 
-  if (fragment_id >= current_thread->active_trace.id) {
+  if (fragment_id >= trace_limit) {
     if (bb_meta->branch_cache_status == 0) {
       assert(current_thread->active_trace.active);
       return;
@@ -237,7 +256,7 @@ void unlink_fragment(int fragment_id, uintptr_t pc) {
 
   fragment_id--;
 #else
-  bb_meta = &current_thread->code_cache_meta[fragment_id];
+  bb_meta = &current_thread->cc->code_cache_meta[fragment_id];
 #endif
 
   void *write_p = bb_meta->exit_branch_addr;
@@ -248,10 +267,17 @@ void unlink_fragment(int fragment_id, uintptr_t pc) {
       bb_meta->exit_branch_type == uncond_reg_arm) {
 #elif __aarch64__
   if (bb_meta->exit_branch_type == uncond_branch_reg) {
+  #ifdef DBM_TB_DIRECT
+    // Makes the BR of the hash lookup the first one after the exit
+    jump_table_unlink(bb_meta);
+  #endif
 #endif
     if (!unlink_indirect_branch(bb_meta, &write_p)) {
       return;
     }
+#ifdef DBM_IBTC
+    ibtc_unlink(bb_meta);
+#endif
   } else if (bb_meta->branch_cache_status != 0) {
     if (!unlink_direct_branch(bb_meta, &write_p, fragment_id, pc)) {
       return;
@@ -418,9 +444,34 @@ void restore_exit(dbm_thread *thread_data, int fragment_id, void **o_write_p) {
   uintptr_t target;
   uintptr_t other_target;
   void *write_p = *o_write_p;
-  dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment_id];
+  dbm_code_cache_meta *bb_meta = &thread_data->cc->code_cache_meta[fragment_id];
   int cond = bb_meta->branch_condition;
 
+#ifdef DBM_COMPACT_EXITS
+  if (is_compact_exit(fragment_id) && bb_meta->exit_branch_type != uncond_imm_a64) {
+    uint32_t *exit_p = write_p;
+
+    // Unlinked exit, then the linked paths
+    insert_cond_exit_branch(bb_meta, &write_p, cond);
+    a64_b_helper(&exit_p[1], (uint64_t)(bb_meta->exit_stubs + A64_EXIT_STUB_WORDS));
+    a64_b_helper(&exit_p[2], (uint64_t)bb_meta->exit_stubs);
+
+    if (bb_meta->branch_cache_status & BRANCH_LINKED) {
+      target = cc_lookup(thread_data, bb_meta->branch_taken_addr);
+      assert(target != UINT_MAX);
+      a64_compact_exit_link_taken(exit_p, target + 4);
+    }
+    if (bb_meta->branch_cache_status & FALLTHROUGH_LINKED) {
+      target = cc_lookup(thread_data, bb_meta->branch_skipped_addr);
+      assert(target != UINT_MAX);
+      a64_b_helper(&exit_p[1], target + 4);
+    }
+
+    *o_write_p = &exit_p[3];
+    return;
+  }
+#endif
+
 #ifdef __arm__
   if (bb_meta->branch_cache_status & FALLTHROUGH_LINKED) {
 #elif __aarch64__
@@ -492,7 +543,7 @@ void sigret_dispatcher_call(dbm_thread *thread_data, ucontext_t *cont, uintptr_t
 #endif
   cont->context_reg(0) = target;
   cont->context_reg(1) = 0;
-  cont->context_pc = thread_data->dispatcher_addr;
+  cont->context_pc = thread_data->cc->dispatcher_addr;
 #ifdef __arm__
   cont->context_reg(3) = cont->context_sp;
   cont->uc_mcontext.arm_cpsr &= ~CPSR_T;
@@ -517,7 +568,7 @@ void sigret_dispatcher_call(dbm_thread *thread_data, ucontext_t *cont, uintptr_t
 
 /* If type == indirect && pc >= exit, read the pc and deliver the signal */
 /* If pc < <type specific>, unlink the fragment and resume execution */
-uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
+static uintptr_t signal_dispatcher_locked(int i, siginfo_t *info, void *context) {
   uintptr_t handler = 0;
   bool deliver_now = false;
 
@@ -525,26 +576,46 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
   ucontext_t *cont = (ucontext_t *)context;
 
   uintptr_t pc = (uintptr_t)cont->pc_field;
-  uintptr_t cc_start = (uintptr_t)&current_thread->code_cache->blocks[trampolines_size_bbs];
-  uintptr_t cc_end = cc_start + MAX_BRANCH_RANGE;
+  int fragment_id = addr_to_fragment_id(current_thread, pc);
+  // Offset of the PC in its code cache region, used to identify trampolines
+  uintptr_t cc_offset = UINTPTR_MAX;
+  if (cc_region_index(current_thread, pc) >= 0) {
+    cc_offset = (pc - (uintptr_t)current_thread->cc->code_cache) % sizeof(dbm_code_cache);
+  }
 
   if (global_data.exit_group > 0) {
-    if (pc >= cc_start && pc < cc_end) {
-      int fragment_id = addr_to_fragment_id(current_thread, (uintptr_t)pc);
-      dbm_code_cache_meta *bb_meta = &current_thread->code_cache_meta[fragment_id];
+#ifndef DBM_SIGNAL_POLLING
+    if (fragment_id >= 0) {
+      dbm_code_cache_meta *bb_meta = &current_thread->cc->code_cache_meta[fragment_id];
       if (pc >= (uintptr_t)bb_meta->exit_branch_addr) {
+        cc_unlock(current_thread);
         thread_abort(current_thread);
       }
       unlink_fragment(fragment_id, pc);
     }
+#endif
     atomic_increment_u32(&current_thread->is_signal_pending, 1);
+#ifdef DBM_SIGNAL_POLLING
+    current_thread->signal_poll = 1;
+#endif
+    return 0;
+  }
+
+#ifdef DBM_SHARED_CC
+  // Sent by cc_stop_world, the thread stops when it reaches the dispatcher
+  if (i == UNLINK_SIGNAL && info->si_code == SI_TKILL &&
+      atomic_decrement_if_positive_i32(&current_thread->stop_kicks, 1) >= 0) {
+    if (fragment_id >= 0) {
+      unlink_fragment(fragment_id, pc);
+    }
     return 0;
   }
+#endif
 
-  if (pc == ((uintptr_t)current_thread->code_cache + self_send_signal_offset)) {
+  if (cc_offset == self_send_signal_offset) {
     translate_delayed_signal_frame(cont);
     deliver_now = true;
-  } else if (pc == ((uintptr_t)current_thread->code_cache + syscall_wrapper_svc_offset)) {
+  } else if (cc_offset == syscall_wrapper_svc_offset) {
     translate_svc_frame(cont);
     deliver_now = true;
   }
@@ -554,9 +625,9 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
     return handler;
   }
 
-  if (pc >= cc_start && pc < cc_end) {
-    int fragment_id = addr_to_fragment_id(current_thread, (uintptr_t)pc);
-    dbm_code_cache_meta *bb_meta = &current_thread->code_cache_meta[fragment_id];
+#ifndef DBM_SIGNAL_POLLING
+  if (fragment_id >= 0) {
+    dbm_code_cache_meta *bb_meta = &current_thread->cc->code_cache_meta[fragment_id];
 
     if (pc >= (uintptr_t)bb_meta->exit_branch_addr) {
       void *write_p;
@@ -577,8 +648,14 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
 #endif
         if (imm == SIGNAL_TRAP_IB) {
           restore_ihl_inst(pc);
+#ifdef DBM_IBTC
+          ibtc_relink(&current_thread->cc->code_cache_meta[fragment_id]);
+#endif
+#if defined(__aarch64__) && defined(DBM_TB_DIRECT)
+          jump_table_relink(&current_thread->cc->code_cache_meta[fragment_id]);
+#endif
 
-          int rn = current_thread->code_cache_meta[fragment_id].rn;
+          int rn = current_thread->cc->code_cache_meta[fragment_id].rn;
           uintptr_t target;
 #ifdef __arm__
           unsigned long *regs = &cont->uc_mcontext.arm_r0;
@@ -642,6 +719,7 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
     } // if (pc >= (uintptr_t)bb_meta->exit_branch_addr)
     unlink_fragment(fragment_id, pc);
   }
+#endif // DBM_SIGNAL_POLLING
 
   /* Call the handlers of synchronous signals immediately
      The SPC of the instruction is unknown, so sigreturning to addresses derived
@@ -651,14 +729,30 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
   if (i == SIGSEGV || i == SIGBUS || i == SIGFPE || i == SIGTRAP || i == SIGILL || i == SIGSYS) {
     handler = global_data.signal_handlers[i];
 
-    if (pc < cc_start || pc >= cc_end) {
+    if (fragment_id < 0) {
       fprintf(stderr, "Synchronous signal outside the code cache\n");
+#ifdef DBM_SMC_WRITE_PROTECT
+      // SIGSEGV is always caught by MAMBO, raise it again with the default action
+      if (i == SIGSEGV) {
+        struct sigaction act;
+        act.sa_handler = SIG_DFL;
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = 0;
+        int ret = sigaction(i, &act, NULL);
+        assert(ret == 0);
+        return 0;
+      }
+#endif
       while(1);
     }
 
     // Check if the application actually has a handler installed for the signal used by MAMBO
     if (handler == (uintptr_t)SIG_IGN || handler == (uintptr_t)SIG_DFL) {
+#ifdef DBM_SMC_WRITE_PROTECT
+      assert(i == UNLINK_SIGNAL || i == SIGSEGV);
+#else
       assert(i == UNLINK_SIGNAL);
+#endif
 
       // Remove this handler
       struct sigaction act;
@@ -678,6 +772,42 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
 
   atomic_increment_int(&current_thread->pending_signals[i], 1);
   atomic_increment_u32(&current_thread->is_signal_pending, 1);
+#ifdef DBM_SIGNAL_POLLING
+  // The translated code reaches a check within a loop iteration
+  current_thread->signal_poll = 1;
+#endif
+
+  return handler;
+}
+
+uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
+  uintptr_t pc = (uintptr_t)((ucontext_t *)context)->pc_field;
+  uintptr_t handler;
+
+  /* The code cache is only accessed if the signal interrupted translated code
+     or the trampolines, in which case this thread isn't holding the lock */
+  bool in_cc = cc_region_index(current_thread, pc) >= 0;
+#ifdef DBM_SMC_WRITE_PROTECT
+  // The write is retried once the page is writable
+  if (i == SIGSEGV && info->si_code == SEGV_ACCERR
+      && smc_write_fault(current_thread, (uintptr_t)info->si_addr)) {
+#ifndef DBM_SIGNAL_POLLING
+    // The fragment exits to the dispatcher, which discards the stale translations
+    int fragment_id = addr_to_fragment_id(current_thread, pc);
+    if (fragment_id >= 0) {
+      unlink_fragment(fragment_id, pc);
+    }
+#endif
+    return 0;
+  }
+#endif
+  if (in_cc) {
+    cc_lock(current_thread);
+  }
+  handler = signal_dispatcher_locked(i, info, context);
+  if (in_cc) {
+    cc_unlock(current_thread);
+  }
 
   return handler;
 }
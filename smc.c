@@ -0,0 +1,368 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Self-modifying code detection
+
+  The writable and executable mappings created by the application are recorded in
+  global_data.wx_allocs. When code is first translated from one of their pages, the
+  page is write-protected. A write to it raises a SIGSEGV, whose handler makes the
+  page writable again, until code is translated from it again, and records it in a
+  per-thread set. The fragments translated from the page are discarded in all
+  threads (see cc_invalidate) once the writer reaches the dispatcher.
+
+  After SMC_WRITE_LIMIT writes, a page is left writable. The basic blocks translated
+  from it are recorded in smc_fragments instead of the entry_address table, which
+  holds a stub for them. Links, inline hash lookups and traces only ever reach the
+  stub, so they are always entered through the dispatcher, which checks them against
+  a checksum of their source code, see smc_lookup_or_scan.
+
+  The pages written by the read system calls are made writable before the system
+  call, see smc_syscall_write. Writes to protected pages by other system calls
+  fail with EFAULT.
+*/
+
+#ifdef DBM_SMC_WRITE_PROTECT
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "dbm.h"
+#include "common.h"
+
+#ifdef DEBUG
+  #define debug(...) fprintf(stderr, __VA_ARGS__)
+#else
+  #define debug(...)
+#endif
+
+// State of the pages in global_data.smc_pages
+#define SMC_PROTECTED    (1 << 0) // write-protected by MAMBO
+#define SMC_CHECKED      (1 << 1) // written SMC_WRITE_LIMIT times, left writable
+#define SMC_WRITES_SHIFT 2
+
+// smc_size of a fragment whose source code isn't contiguous
+#define SMC_NOT_CONTIGUOUS UINT32_MAX
+
+void smc_init() {
+  int ret = interval_map_init(&global_data.wx_allocs, 512);
+  assert(ret == 0);
+  ret = pthread_mutex_init(&global_data.smc_mutex, NULL);
+  assert(ret == 0);
+  hash_init(&global_data.smc_pages, SMC_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+}
+
+static void smc_lock() {
+  int ret = pthread_mutex_lock(&global_data.smc_mutex);
+  assert(ret == 0);
+}
+
+static void smc_unlock() {
+  int ret = pthread_mutex_unlock(&global_data.smc_mutex);
+  assert(ret == 0);
+}
+
+static uint32_t smc_checksum(dbm_code_cache_meta *meta) {
+  uint16_t *p = (uint16_t *)((uintptr_t)meta->source_addr & ~THUMB);
+  uint32_t sum = 2166136261u;
+
+  // FNV-1a over halfwords, the smallest Thumb instructions
+  for (uint32_t i = 0; i < meta->smc_size / 2; i++) {
+    sum = (sum ^ p[i]) * 16777619u;
+  }
+  return sum;
+}
+
+/* Called for each instruction scanned into fragment_id, records the extent of the
+   source code of the fragment while it's contiguous */
+void smc_fragment_extend(dbm_thread *thread_data, int fragment_id, uintptr_t addr) {
+  dbm_code_cache_meta *meta = &thread_data->cc->code_cache_meta[fragment_id];
+  uintptr_t start = (uintptr_t)meta->source_addr & ~THUMB;
+
+  if (meta->smc_size == SMC_NOT_CONTIGUOUS) return;
+  if (addr < start || addr > start + meta->smc_size) {
+    meta->smc_size = SMC_NOT_CONTIGUOUS;
+    return;
+  }
+  meta->smc_size = max(meta->smc_size, addr + 4 - start);
+}
+
+/* Called for each page fragment_id is translated from. Writable pages are
+   protected, unless they have been written too often. */
+void smc_page_translated(dbm_thread *thread_data, int fragment_id, uintptr_t page) {
+  uintptr_t state;
+
+  smc_lock();
+  state = hash_lookup(&global_data.smc_pages, page);
+  if (state == UINT_MAX) {
+    if (interval_map_search(&global_data.wx_allocs, page, page + PAGE_SIZE) <= 0) {
+      smc_unlock();
+      return;
+    }
+    state = 0;
+  }
+
+  if (state & SMC_CHECKED) {
+    thread_data->cc->code_cache_meta[fragment_id].smc_checked = true;
+  } else if ((state & SMC_PROTECTED) == 0) {
+    int ret = mprotect((void *)page, PAGE_SIZE, PROT_READ);
+    assert(ret == 0);
+    state |= SMC_PROTECTED;
+    hash_add(&global_data.smc_pages, page, state);
+  }
+  smc_unlock();
+}
+
+bool smc_page_checked(uintptr_t addr) {
+  uintptr_t state;
+
+  smc_lock();
+  state = hash_lookup(&global_data.smc_pages, align_lower(addr, PAGE_SIZE));
+  smc_unlock();
+
+  return state != UINT_MAX && (state & SMC_CHECKED);
+}
+
+// True if the translations of spc must only be entered through the dispatcher
+bool smc_is_checked(dbm_thread *thread_data, uintptr_t spc) {
+  return hash_lookup(&thread_data->cc->smc_fragments, spc) != UINT_MAX || smc_page_checked(spc);
+}
+
+/* Handles a SIGSEGV caused by a write to addr. Returns false if addr isn't in a
+   page protected by MAMBO, otherwise the write can be retried. This runs in the
+   signal handler, so it doesn't take any locks: the page is made writable and
+   recorded in the pending set of the thread. Its fragments are discarded by
+   smc_apply_pending on the next entry to the dispatcher or to the syscall handler. */
+bool smc_write_fault(dbm_thread *thread_data, uintptr_t addr) {
+  uintptr_t page = align_lower(addr, PAGE_SIZE);
+  uintptr_t state = hash_lookup(&global_data.smc_pages, page);
+  uint32_t count;
+
+  /* The page could have been protected by a translation racing with
+     smc_mapping_changed. interval_map_search only waits for writers on
+     other threads, which never fault while holding the map. */
+  if (state == UINT_MAX && interval_map_search(&global_data.wx_allocs, page, page + PAGE_SIZE) <= 0) {
+    return false;
+  }
+
+  int ret = mprotect((void *)page, PAGE_SIZE, PROT_READ | PROT_WRITE);
+  assert(ret == 0);
+
+  // Only this thread appends, smc_apply_pending retries if it's interrupted
+  count = thread_data->smc_pending_count;
+  if (count < SMC_PENDING_SIZE) {
+    thread_data->smc_pending[count] = page;
+  }
+  __asm__ volatile("" ::: "memory");
+  thread_data->smc_pending_count = count + 1;
+
+  return true;
+}
+
+// Updates the state of a page which has been made writable and discards its fragments
+static void smc_page_written(dbm_thread *thread_data, uintptr_t page) {
+  uintptr_t state, writes;
+
+  smc_lock();
+  state = hash_lookup(&global_data.smc_pages, page);
+  if (state == UINT_MAX && interval_map_search(&global_data.wx_allocs, page, page + PAGE_SIZE) > 0) {
+    state = SMC_PROTECTED;
+  }
+  // Otherwise, another thread has already handled a write to the page
+  if (state != UINT_MAX && (state & SMC_PROTECTED)) {
+    writes = (state >> SMC_WRITES_SHIFT) + 1;
+    state = writes << SMC_WRITES_SHIFT;
+    if (writes >= SMC_WRITE_LIMIT) {
+      state |= SMC_CHECKED;
+    }
+    hash_add(&global_data.smc_pages, page, state);
+    debug("SMC: write %lu to page 0x%lx\n", writes, page);
+  }
+  smc_unlock();
+
+  cc_invalidate(thread_data, page, page + PAGE_SIZE);
+}
+
+/* Called when more than SMC_PENDING_SIZE pages were written before reaching the
+   dispatcher. All the protected pages are handled as written. */
+static void smc_all_pages_written(dbm_thread *thread_data) {
+  hash_table *pages = &global_data.smc_pages;
+  uintptr_t state, writes;
+
+  smc_lock();
+  for (int i = 0; i < pages->size; i++) {
+    state = HASH_VALUE(pages, i);
+    if (HASH_KEY(pages, i) == 0 || (state & SMC_PROTECTED) == 0) continue;
+
+    writes = (state >> SMC_WRITES_SHIFT) + 1;
+    state = writes << SMC_WRITES_SHIFT;
+    if (writes >= SMC_WRITE_LIMIT) {
+      state |= SMC_CHECKED;
+    }
+    HASH_VALUE(pages, i) = state;
+    int ret = mprotect((void *)HASH_KEY(pages, i), PAGE_SIZE, PROT_READ | PROT_WRITE);
+    assert(ret == 0);
+  }
+  smc_unlock();
+
+  cc_invalidate(thread_data, 0, UINTPTR_MAX);
+}
+
+/* Called by cc_check_invalidations when the SIGSEGV handler has recorded writes.
+   The set is copied before it's emptied, in case the handler runs again. */
+void smc_apply_pending(dbm_thread *thread_data) {
+  uintptr_t pages[SMC_PENDING_SIZE];
+  uint32_t count;
+
+  do {
+    count = thread_data->smc_pending_count;
+    for (uint32_t i = 0; i < count && i < SMC_PENDING_SIZE; i++) {
+      pages[i] = thread_data->smc_pending[i];
+    }
+  } while (!__sync_bool_compare_and_swap(&thread_data->smc_pending_count, count, 0));
+
+  if (count > SMC_PENDING_SIZE) {
+    smc_all_pages_written(thread_data);
+    return;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    smc_page_written(thread_data, pages[i]);
+  }
+}
+
+/* Called before a system call which writes to [addr, addr + len). The kernel
+   doesn't raise SIGSEGV for protected pages, so they are made writable first. */
+void smc_syscall_write(dbm_thread *thread_data, uintptr_t addr, size_t len) {
+  uintptr_t end = addr + len;
+  uintptr_t state;
+
+  if (len == 0 || end < addr) return;
+  if (interval_map_search(&global_data.wx_allocs, addr, end) <= 0) return;
+
+  for (uintptr_t page = align_lower(addr, PAGE_SIZE); page < end; page += PAGE_SIZE) {
+    smc_lock();
+    state = hash_lookup(&global_data.smc_pages, page);
+    smc_unlock();
+    if (state != UINT_MAX && (state & SMC_PROTECTED)) {
+      int ret = mprotect((void *)page, PAGE_SIZE, PROT_READ | PROT_WRITE);
+      assert(ret == 0);
+      smc_page_written(thread_data, page);
+    }
+  }
+}
+
+/* Called after mmap, mprotect (with the new permissions) and munmap (with prot 0)
+   have changed the mapping of [start, end). The permissions set by the application
+   apply to the whole range, so the state of its pages is discarded. */
+void smc_mapping_changed(uintptr_t start, uintptr_t end, int prot) {
+  hash_table *pages = &global_data.smc_pages;
+  bool tracked;
+  int ret;
+
+  smc_lock();
+  tracked = interval_map_search(&global_data.wx_allocs, start, end) > 0;
+  if ((prot & PROT_WRITE) && (prot & PROT_EXEC)) {
+    ret = interval_map_add(&global_data.wx_allocs, start, end);
+    assert(ret == 0);
+  } else if (tracked) {
+    ret = interval_map_delete(&global_data.wx_allocs, start, end);
+    assert(ret >= 0);
+  }
+
+  if (tracked) {
+    // A deletion can shift a later entry into slot i
+    for (int i = 0; i < pages->size;) {
+      uintptr_t key = HASH_KEY(pages, i);
+      if (key >= start && key < end) {
+        hash_delete(pages, key);
+      } else {
+        i++;
+      }
+    }
+  }
+  smc_unlock();
+}
+
+/* Called by scan() after a basic block translated from a checked page has been
+   scanned. Its entry in the entry_address table is replaced by a stub, which is
+   returned as the address to link to. */
+uintptr_t smc_add_checked(dbm_thread *thread_data, int basic_block) {
+  dbm_code_cache_meta *meta = &thread_data->cc->code_cache_meta[basic_block];
+  uintptr_t spc = (uintptr_t)meta->source_addr;
+  uintptr_t tpc = meta->tpc | (spc & THUMB);
+  bool was_flushed = thread_data->was_flushed;
+  uintptr_t stub;
+
+  if (hash_lookup(&thread_data->cc->entry_address, spc) == tpc) {
+    hash_delete(&thread_data->cc->entry_address, spc);
+  }
+#ifdef DBM_TRACES
+  if (meta->trace_head == TRACE_HEAD_COUNTING) {
+    trace_head_set(thread_data, basic_block, false);
+  }
+#endif
+
+  // Allocating the stub can flush the code cache, which discards the block
+  thread_data->was_flushed = false;
+  stub = lookup_or_stub(thread_data, spc);
+  if (!thread_data->was_flushed) {
+    if (meta->smc_size != SMC_NOT_CONTIGUOUS) {
+      meta->smc_checksum = smc_checksum(meta);
+    }
+    hash_add(&thread_data->cc->smc_fragments, spc, basic_block);
+  }
+  thread_data->was_flushed |= was_flushed;
+
+  return stub;
+}
+
+/* Called by the dispatcher before looking up target. Returns the translation of
+   target if it's from a checked page, after checking that its source code hasn't
+   changed, or UINT_MAX. Blocks with non-contiguous source code are translated
+   again on every entry. The result must not be linked. */
+uintptr_t smc_lookup_or_scan(dbm_thread *thread_data, uintptr_t target) {
+  hash_table *fragments = &thread_data->cc->smc_fragments;
+  uintptr_t bb = hash_lookup(fragments, target);
+  uintptr_t addr;
+
+  if (bb != UINT_MAX) {
+    dbm_code_cache_meta *meta = &thread_data->cc->code_cache_meta[bb];
+    if (meta->smc_size != SMC_NOT_CONTIGUOUS && meta->smc_checksum == smc_checksum(meta)) {
+      return adjust_cc_entry(meta->tpc | (target & THUMB));
+    }
+    debug("SMC: 0x%lx modified\n", target);
+    hash_delete(fragments, target);
+  } else if (!smc_page_checked(target)) {
+    return UINT_MAX;
+  }
+
+  addr = scan(thread_data, (uint16_t *)target, ALLOCATE_BB);
+  bb = hash_lookup(fragments, target);
+  if (bb != UINT_MAX) {
+    addr = adjust_cc_entry(thread_data->cc->code_cache_meta[bb].tpc | (target & THUMB));
+  }
+
+  return addr;
+}
+
+#endif // DBM_SMC_WRITE_PROTECT
@@ -22,6 +22,7 @@
 #include <asm/unistd.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <linux/sched.h>
 #include <assert.h>
@@ -87,7 +88,9 @@ void *dbm_start_thread_pth(void *ptr) {
 
   assert(register_thread(thread_data, false) == 0);
 
-  uintptr_t addr = scan(thread_data, thread_data->clone_ret_addr, ALLOCATE_BB);
+  cc_lock(thread_data);
+  uintptr_t addr = lookup_or_scan(thread_data, (uintptr_t)thread_data->clone_ret_addr, NULL);
+  cc_unlock(thread_data);
   th_enter(child_stack, addr);
 
   return NULL;
@@ -153,6 +156,8 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
   sys_clone_args *clone_args;
   debug("syscall pre %d\n", syscall_no);
 
+  cc_check_invalidations(thread_data);
+
 #ifdef PLUGINS_NEW
   mambo_context ctx;
   int cont;
@@ -169,6 +174,12 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
   }
 #endif
 
+#ifdef DBM_SHARED_CC
+  // The code cache can be flushed by this thread or evicted while it's in the system call
+  thread_data->syscall_tpc = &args[SYSCALL_WRAPPER_TPC];
+  thread_data->syscall_spc = (uintptr_t)next_inst;
+#endif
+
   switch(syscall_no) {
     case __NR_brk:
       args[0] = emulate_brk(args[0]);
@@ -234,7 +245,11 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
       if (act != NULL) {
         handler = (uintptr_t)act->k_sa_handler;
         // Never remove the UNLINK_SIGNAL handler, which is used internally by MAMBO
-        if (args[0] == UNLINK_SIGNAL || (act->k_sa_handler != SIG_IGN && act->k_sa_handler != SIG_DFL)) {
+        if (args[0] == UNLINK_SIGNAL || (act->k_sa_handler != SIG_IGN && act->k_sa_handler != SIG_DFL)
+#ifdef DBM_SMC_WRITE_PROTECT
+            || args[0] == SIGSEGV
+#endif
+           ) {
           act->k_sa_handler = (__sighandler_t)signal_trampoline;
           act->sa_flags |= SA_SIGINFO;
         }
@@ -273,6 +288,22 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
         do_syscall = 0;
       }
       break;
+#ifdef DBM_SMC_WRITE_PROTECT
+    // The kernel's writes to write-protected pages would fail with EFAULT
+    case __NR_read:
+    case __NR_pread64:
+    case __NR_recvfrom:
+      smc_syscall_write(thread_data, args[1], args[2]);
+      break;
+    case __NR_readv:
+    case __NR_preadv: {
+      struct iovec *iov = (struct iovec *)args[1];
+      for (int i = 0; i < args[2] && i < IOV_MAX; i++) {
+        smc_syscall_write(thread_data, (uintptr_t)iov[i].iov_base, iov[i].iov_len);
+      }
+      break;
+    }
+#endif
     case __NR_readlinkat: {
       const int proc_buflen = 100;
       char buf[proc_buflen];
@@ -318,7 +349,16 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
         uintptr_t end = align_higher(syscall_ret + args[1], PAGE_SIZE);
         int ret = interval_map_add(&global_data.exec_allocs, start, end);
         assert(ret == 0);
+#ifdef DBM_PERSISTENT_CC
+        pcc_exec_mapping(thread_data, start, end);
+#endif
+      }
+#ifdef DBM_SMC_WRITE_PROTECT
+      if (syscall_ret <= -ERANGE) {
+        smc_mapping_changed(align_lower(syscall_ret, PAGE_SIZE),
+                            align_higher(syscall_ret + args[1], PAGE_SIZE), prot);
       }
+#endif
 
       args[0] = syscall_ret;
       do_syscall = 0;
@@ -334,12 +374,27 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
       }
       syscall_ret = raw_syscall(syscall_no, args[0], args[1], args[2]);
       if (syscall_ret == 0) {
+        uintptr_t start = align_lower(args[0], PAGE_SIZE);
+        uintptr_t end = align_higher(args[0] + args[1], PAGE_SIZE);
+#ifdef DBM_RANGE_INVALIDATION
+        /* JITs typically make code writable to update it and then executable again,
+           the translations of the old code are discarded */
+        if (interval_map_search(&global_data.exec_allocs, start, end) > 0) {
+          cc_lock(thread_data);
+          cc_invalidate(thread_data, start, end);
+          cc_unlock(thread_data);
+        }
+#endif
         if (prot & PROT_EXEC) {
-          uintptr_t start = align_lower(args[0], PAGE_SIZE);
-          uintptr_t end = align_higher(args[0] + args[1], PAGE_SIZE);
           ret = interval_map_add(&global_data.exec_allocs, start, end);
           assert(ret == 0);
+#ifdef DBM_PERSISTENT_CC
+          pcc_exec_mapping(thread_data, start, end);
+#endif
         }
+#ifdef DBM_SMC_WRITE_PROTECT
+        smc_mapping_changed(start, end, prot);
+#endif
       } // if syscall_ret == 0
 
       args[0] = syscall_ret;
@@ -354,8 +409,13 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
         uintptr_t end = align_higher(args[0] + args[1], PAGE_SIZE);
         ssize_t ret = interval_map_delete(&global_data.exec_allocs, start, end);
         assert(ret >= 0);
+#ifdef DBM_SMC_WRITE_PROTECT
+        smc_mapping_changed(start, end, 0);
+#endif
         if (ret >= 1) {
-          flush_code_cache(thread_data);
+          cc_lock(thread_data);
+          cc_invalidate(thread_data, start, end);
+          cc_unlock(thread_data);
         }
       }
 
@@ -385,6 +445,9 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
       sigret_dispatcher_call(thread_data, cont, cont->context_pc);
 
       // Don't mark the thread as executing a syscall
+#ifdef DBM_SHARED_CC
+      thread_data->syscall_tpc = NULL;
+#endif
       return 1;
     }
 
@@ -401,7 +464,9 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
       fprintf(stderr, "cache flush\n");
       /* Returning to the calling BB is potentially unsafe because the remaining
          contents of the BB or other basic blocks it is linked against could be stale */
-      flush_code_cache(thread_data);
+      cc_lock(thread_data);
+      cc_invalidate(thread_data, args[0], args[1]);
+      cc_unlock(thread_data);
       break;
     case __ARM_NR_set_tls:
       debug("set tls to %x\n", args[0]);
@@ -424,7 +489,18 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
   }
 #endif
 
-  thread_data->status = THREAD_SYSCALL;
+  if (do_syscall) {
+#ifdef DBM_SHARED_CC
+    // syscall_tpc is published before the status, which lets cc_stop_world evict
+    __sync_synchronize();
+#endif
+    thread_data->status = THREAD_SYSCALL;
+  }
+#ifdef DBM_SHARED_CC
+  if (!do_syscall) {
+    thread_data->syscall_tpc = NULL;
+  }
+#endif
 
   return do_syscall;
 }
@@ -437,7 +513,15 @@ void syscall_handler_post(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_
   if (global_data.exit_group) {
     thread_abort(thread_data);
   }
+#ifdef DBM_SHARED_CC
+  // Waits for an eviction in progress to finish
+  cc_lock(thread_data);
   thread_data->status = THREAD_RUNNING;
+  cc_syscall_resume(thread_data);
+  cc_unlock(thread_data);
+#else
+  thread_data->status = THREAD_RUNNING;
+#endif
 
   switch(syscall_no) {
     case __NR_clone:
@@ -25,6 +25,8 @@
      14 regs pushed by the SVC translation
   */
   #define SYSCALL_WRAPPER_STACK_OFFSET (2 + 14)
+  // Index of the saved TPC in the args array passed to the syscall handlers
+  #define SYSCALL_WRAPPER_TPC 14
 #elif __aarch64__
   /* 2  regs(x29, x30) pushed by the SVC translation
      2  (TPC, SVC) +
@@ -32,4 +34,5 @@
      (32*2) NEON/FP registers saved in the wrapper
   */
   #define SYSCALL_WRAPPER_STACK_OFFSET (2 + 2 + 22 + 32*2)
+  #define SYSCALL_WRAPPER_TPC 22
 #endif
@@ -0,0 +1,321 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Compares the two layouts of the code cache hash table (see common.h): linearly
+  probed hash_entry pairs and cache line sized buckets (DBM_HASH_BUCKETS). The
+  tables are filled with synthetic basic block addresses at the load factor used
+  by hash_add, then probed the same way as the lookups generated by the scanners.
+
+  The bucketed table is sized by hash_add's rule, which for most key counts uses
+  about twice the memory of the linear one, and again with the same memory as the
+  linear table (same mem), to separate the effect of the layout from the size.
+
+  For each layout it reports the average number of keys compared and of cache
+  lines touched per lookup, for keys in the table (hits) and not in the table
+  (misses), the fraction of hits not found by the inline lookup, which fall
+  through to the dispatcher, and the time per lookup.
+
+  Usage: hash_bench [max_keys]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define OVERP 10
+#define LOAD 2
+#define LINE 64
+
+#define SLOTS (LINE / (2 * sizeof(uintptr_t)))
+#define KEYS (SLOTS - 1)
+
+typedef struct {
+  uintptr_t key;
+  uintptr_t value;
+} hash_entry;
+
+typedef struct {
+  uintptr_t keys[SLOTS];
+  uintptr_t values[SLOTS];
+} hash_bucket;
+
+typedef struct {
+  bool buckets;
+  uintptr_t mask;
+  size_t size;
+  void *mem;
+  size_t mem_size;
+} table_t;
+
+typedef struct {
+  double keys;
+  double lines;
+  double slow;
+  double ns;
+} result_t;
+
+static inline size_t home(table_t *t, uintptr_t key) {
+  if (t->buckets) {
+    return ((key >> 2) & t->mask) * KEYS;
+  }
+#ifdef __arm__
+  return key & t->mask;
+#else
+  return (key >> 2) & t->mask;
+#endif
+}
+
+static inline uintptr_t *key_p(table_t *t, size_t i) {
+  if (t->buckets) {
+    return &((hash_bucket *)t->mem)[i / KEYS].keys[i % KEYS];
+  }
+  return &((hash_entry *)t->mem)[i].key;
+}
+
+static inline uintptr_t *value_p(table_t *t, size_t i) {
+  if (t->buckets) {
+    return &((hash_bucket *)t->mem)[i / KEYS].values[i % KEYS];
+  }
+  return &((hash_entry *)t->mem)[i].value;
+}
+
+static bool table_insert(table_t *t, uintptr_t key, uintptr_t value) {
+  size_t index = home(t, key);
+  while (*key_p(t, index) != 0) {
+    index++;
+    if (index >= t->size - 1) {
+      return false;
+    }
+  }
+  *value_p(t, index) = value;
+  *key_p(t, index) = key;
+  return true;
+}
+
+/* Same sizing as hash_init and hash_add unless home_slots is set, grown if a
+   probe runs into the end */
+static void table_build(table_t *t, bool buckets, uintptr_t *keys, size_t count, size_t home_slots) {
+  size_t per_mask = buckets ? KEYS : 1;
+  bool done;
+
+  if (home_slots == 0) {
+    home_slots = 1;
+    while (home_slots * per_mask < count * LOAD) {
+      home_slots <<= 1;
+    }
+  }
+
+  do {
+    t->buckets = buckets;
+    t->mask = home_slots - 1;
+    t->size = (home_slots + OVERP) * per_mask;
+    t->mem_size = buckets ? (t->size / KEYS) * sizeof(hash_bucket) : t->size * sizeof(hash_entry);
+    int ret = posix_memalign(&t->mem, LINE, t->mem_size);
+    assert(ret == 0);
+    memset(t->mem, 0, t->mem_size);
+
+    done = true;
+    for (size_t i = 0; i < count && done; i++) {
+      done = table_insert(t, keys[i], keys[i] + 1);
+    }
+    if (!done) {
+      free(t->mem);
+      home_slots <<= 1;
+    }
+  } while (!done);
+}
+
+/* The inline lookups: keys are compared from the home slot up to the first empty
+   key, which for buckets is at the latest the reserved last key of the bucket.
+   Returns 0 if the key wasn't found. */
+static inline uintptr_t inline_lookup(table_t *t, uintptr_t key, int *keys, int *lines) {
+  uintptr_t *p;
+  uintptr_t c_key;
+  uintptr_t line = UINTPTR_MAX;
+  size_t stride = t->buckets ? sizeof(uintptr_t) : sizeof(hash_entry);
+  ptrdiff_t value_offset = t->buckets ? SLOTS * sizeof(uintptr_t) : sizeof(uintptr_t);
+
+  if (t->buckets) {
+    p = &((hash_bucket *)t->mem)[(key >> 2) & t->mask].keys[0];
+  } else {
+    p = key_p(t, home(t, key));
+  }
+
+  do {
+    if (lines != NULL && ((uintptr_t)p / LINE) != line) {
+      line = (uintptr_t)p / LINE;
+      (*lines)++;
+    }
+    if (keys != NULL) {
+      (*keys)++;
+    }
+    c_key = *p;
+    if (c_key == key) {
+      p = (uintptr_t *)((uint8_t *)p + value_offset);
+      if (lines != NULL && ((uintptr_t)p / LINE) != line) {
+        (*lines)++;
+      }
+      return *p;
+    }
+    p = (uintptr_t *)((uint8_t *)p + stride);
+  } while (c_key != 0);
+
+  return 0;
+}
+
+// Synthetic basic block start addresses, in the same order as they are translated
+static void gen_keys(uintptr_t *keys, size_t count, unsigned seed) {
+  uintptr_t addr = 0x10000;
+  srand(seed);
+  for (size_t i = 0; i < count; i++) {
+    addr += 4 + 4 * (rand() % 16);
+    // occasional jumps to a different function or library
+    if (rand() % 64 == 0) {
+      addr += 4 * (rand() % 0x10000);
+    }
+#ifdef __arm__
+    // Thumb code
+    keys[i] = (i & 1) ? (addr | 1) : addr;
+#else
+    keys[i] = addr;
+#endif
+  }
+}
+
+static void shuffle(uintptr_t *keys, size_t count) {
+  for (size_t i = count - 1; i > 0; i--) {
+    size_t j = rand() % (i + 1);
+    uintptr_t tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(table_t *t, uintptr_t *keys, uintptr_t *absent, size_t count,
+                  result_t *hit, result_t *miss) {
+  int nkeys = 0, nlines = 0, slow = 0;
+  volatile uintptr_t sink = 0;
+  int reps = 1 + (1 << 22) / count;
+  double start;
+
+  for (size_t i = 0; i < count; i++) {
+    if (inline_lookup(t, keys[i], &nkeys, &nlines) != keys[i] + 1) {
+      slow++;
+    }
+  }
+  hit->keys = (double)nkeys / count;
+  hit->lines = (double)nlines / count;
+  hit->slow = (double)slow / count;
+
+  nkeys = nlines = 0;
+  for (size_t i = 0; i < count; i++) {
+    inline_lookup(t, absent[i], &nkeys, &nlines);
+  }
+  miss->keys = (double)nkeys / count;
+  miss->lines = (double)nlines / count;
+  miss->slow = 0;
+
+  start = now_ns();
+  for (int r = 0; r < reps; r++) {
+    for (size_t i = 0; i < count; i++) {
+      sink += inline_lookup(t, keys[i], NULL, NULL);
+    }
+  }
+  hit->ns = (now_ns() - start) / ((double)reps * count);
+
+  start = now_ns();
+  for (int r = 0; r < reps; r++) {
+    for (size_t i = 0; i < count; i++) {
+      sink += inline_lookup(t, absent[i], NULL, NULL);
+    }
+  }
+  miss->ns = (now_ns() - start) / ((double)reps * count);
+}
+
+int main(int argc, char **argv) {
+  size_t max_keys = (argc > 1) ? strtoul(argv[1], NULL, 0) : (1 << 20);
+  const char *names[] = {"entries", "buckets", "same mem"};
+  // Number of hash_entry pairs in the memory of a bucket
+  const size_t per_bucket = sizeof(hash_bucket) / sizeof(hash_entry);
+  double slow_sum[3] = {0};
+  int rows = 0;
+
+  printf("%d keys of %zu bytes per bucket\n\n", (int)KEYS, sizeof(uintptr_t));
+  printf("%9s %8s %10s | %7s %7s %7s %8s | %7s %7s %8s\n", "keys", "layout", "size (KiB)",
+         "hit k", "hit l", "slow %", "hit ns", "miss k", "miss l", "miss ns");
+
+  for (size_t count = 1 << 10; count <= max_keys; count <<= 2) {
+    uintptr_t *keys = malloc(count * sizeof(uintptr_t));
+    uintptr_t *absent = malloc(count * sizeof(uintptr_t));
+    assert(keys != NULL && absent != NULL);
+
+    size_t entries_home = 0;
+    for (int layout = 0; layout < 3; layout++) {
+      table_t t;
+      result_t hit, miss;
+
+      gen_keys(keys, count, 1);
+      for (size_t i = 0; i < count; i++) {
+        // between existing blocks, never a key
+        absent[i] = keys[i] + 2;
+      }
+      // The buckets of the same memory size as the linear table
+      table_build(&t, layout != 0, keys, count, (layout == 2) ? entries_home / per_bucket : 0);
+      if (layout == 0) {
+        entries_home = t.mask + 1;
+      }
+
+      shuffle(keys, count);
+      shuffle(absent, count);
+      bench(&t, keys, absent, count, &hit, &miss);
+
+      printf("%9zu %8s %10zu | %7.2f %7.2f %7.2f %8.2f | %7.2f %7.2f %8.2f\n",
+             count, names[layout], t.mem_size / 1024,
+             hit.keys, hit.lines, hit.slow * 100, hit.ns, miss.keys, miss.lines, miss.ns);
+      slow_sum[layout] += hit.slow;
+      free(t.mem);
+    }
+    rows++;
+
+    free(keys);
+    free(absent);
+  }
+
+  printf("\nk: keys compared, l: cache lines touched per lookup\n"
+         "slow: hits not found by the inline lookup, handled by the dispatcher\n"
+         "same mem: buckets in the memory of the linear table\n\n");
+  for (int layout = 0; layout < 3; layout++) {
+    printf("%8s: %.2f%% of the hits fall through to the dispatcher on average\n",
+           names[layout], slow_sum[layout] / rows * 100);
+  }
+
+  return 0;
+}
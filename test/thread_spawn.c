@@ -0,0 +1,74 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/* Measures the thread creation latency, run with and without MAMBO to
+   estimate the cost of setting up the per-thread state */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#define THREADS 200
+
+void *thread_fn(void *arg) {
+  *(int *)arg += 1;
+  return NULL;
+}
+
+double now() {
+  struct timespec ts;
+  int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+  assert(ret == 0);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  pthread_t thread;
+  int count = 0;
+  int ret;
+  double start, total = 0;
+  double latency[THREADS];
+
+  for (int i = 0; i < THREADS; i++) {
+    start = now();
+    ret = pthread_create(&thread, NULL, thread_fn, &count);
+    assert(ret == 0);
+    ret = pthread_join(thread, NULL);
+    assert(ret == 0);
+    latency[i] = now() - start;
+    total += latency[i];
+  }
+  assert(count == THREADS);
+
+  /* Under MAMBO, the first thread also pays for translating the thread
+     creation code, the median excludes it */
+  printf("%d threads, create + join: first %.1f us, average %.1f us",
+         THREADS, latency[0] * 1e6, total / THREADS * 1e6);
+  qsort(latency, THREADS, sizeof(latency[0]), compare_double);
+  printf(", median %.1f us\n", latency[THREADS / 2] * 1e6);
+
+  return 0;
+}
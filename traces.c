@@ -22,12 +22,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <limits.h>
 #include <assert.h>
 
 #include "dbm.h"
 #include "common.h"
 #include "scanner_common.h"
+#include "util.h"
 
 #ifdef __arm__
 #include "pie/pie-thumb-decoder.h"
@@ -46,10 +48,97 @@
   #define debug(...)
 #endif
 
+static int trace_option(char *name, int def, int min, int max) {
+  char *value = getenv(name);
+  char *end;
+
+  if (value == NULL) return def;
+
+  long opt = strtol(value, &end, 0);
+  if (*value == '\0' || *end != '\0' || opt < min || opt > max) {
+    fprintf(stderr, "MAMBO: ignoring %s=%s, expected a value between %d and %d\n",
+            name, value, min, max);
+    return def;
+  }
+  return (int)opt;
+}
+
+/* MAMBO_TRACE_HEADS is a comma separated list of any, backward, exit and call,
+   see trace_head_selected() */
+static int trace_heads_option(void) {
+  const struct {
+    char *name;
+    int flag;
+  } names[] = {
+    {"any", TRACE_HEAD_ANY},
+    {"backward", TRACE_HEAD_BACKWARD},
+    {"exit", TRACE_HEAD_EXIT},
+    {"call", TRACE_HEAD_CALL},
+  };
+  char *value = getenv(TRACE_HEADS_ENV);
+  int heads = 0;
+
+  if (value == NULL) return TRACE_HEAD_ANY;
+
+  while (*value != '\0') {
+    size_t len = strcspn(value, ",");
+    int i;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      if (strlen(names[i].name) == len && strncmp(value, names[i].name, len) == 0) {
+        heads |= names[i].flag;
+        break;
+      }
+    }
+    if (i == sizeof(names) / sizeof(names[0])) {
+      fprintf(stderr, "MAMBO: unknown trace head type in %s: %.*s\n", TRACE_HEADS_ENV, (int)len, value);
+    }
+    value += len;
+    if (*value == ',') value++;
+  }
+
+  return (heads != 0) ? heads : TRACE_HEAD_ANY;
+}
+
+void trace_config_init(void) {
+  trace_options *opts = &global_data.traces;
+
+  opts->threshold = trace_option(TRACE_THRESHOLD_ENV, TRACE_THRESHOLD, 1, 256);
+  opts->max_fragments = trace_option(TRACE_LENGTH_ENV, MAX_TRACE_FRAGMENTS, 1, MAX_TRACE_FRAGMENTS);
+  opts->max_back_inline = trace_option(BACK_INLINE_ENV, MAX_BACK_INLINE, 0, INT_MAX);
+  opts->heads = trace_heads_option();
+  opts->stats = getenv(TRACE_STATS_ENV) != NULL;
+}
+
+void trace_print_stats(void) {
+#ifdef DBM_TRACES
+  trace_statistics *stats = &global_data.trace_stats;
+  if (!global_data.traces.stats) return;
+
+  uint32_t completed = stats->ended[TRACE_END_INDIRECT] + stats->ended[TRACE_END_TRACE]
+                       + stats->ended[TRACE_END_LENGTH];
+  fprintf(stderr, "Traces (threshold %d, max length %d, heads 0x%x):\n",
+          global_data.traces.threshold, global_data.traces.max_fragments, global_data.traces.heads);
+  fprintf(stderr, "  hot trace heads: %u, not selected: %u\n", stats->hot_heads, stats->rejected_heads);
+  fprintf(stderr, "  started: %u, completed: %u (%.1f%%), aborted: %u\n", stats->started, completed,
+          stats->started ? (100.0 * completed) / stats->started : 0.0, stats->aborted);
+  fprintf(stderr, "  ended at an indirect branch: %u, at a trace: %u, at the length limit: %u\n",
+          stats->ended[TRACE_END_INDIRECT], stats->ended[TRACE_END_TRACE], stats->ended[TRACE_END_LENGTH]);
+  fprintf(stderr, "  average length: %.1f fragments\n",
+          completed ? (double)stats->fragments / completed : 0.0);
+  fprintf(stderr, "  trace cache flushes: %u\n", stats->flushes);
+#ifdef DBM_TRACE_INDIRECT
+  fprintf(stderr, "  extended through indirect branches: %u\n", stats->indirect_extended);
+#endif
+#ifdef DBM_TRACE_PEEPHOLE
+  fprintf(stderr, "  save/restore pairs removed between fragments: %u\n", stats->peephole_pairs);
+#endif
+#endif
+}
+
 #ifdef DBM_TRACES
 uintptr_t get_active_trace_spc(dbm_thread *thread_data) {
   int bb_id = thread_data->active_trace.source_bb;
-  return (uintptr_t)thread_data->code_cache_meta[bb_id].source_addr;
+  return (uintptr_t)thread_data->cc->code_cache_meta[bb_id].source_addr;
 }
 
 uintptr_t active_trace_lookup(dbm_thread *thread_data, uintptr_t target) {
@@ -57,7 +146,7 @@ uintptr_t active_trace_lookup(dbm_thread *thread_data, uintptr_t target) {
   if (target == spc) {
     return adjust_cc_entry(thread_data->active_trace.entry_addr);
   }
-  return adjust_cc_entry(hash_lookup(&thread_data->trace_entry_address, target));
+  return adjust_cc_entry(hash_lookup(&thread_data->cc->trace_entry_address, target));
 }
 
 uintptr_t active_trace_lookup_or_scan(dbm_thread *thread_data, uintptr_t target) {
@@ -81,14 +170,37 @@ uint32_t scan_trace(dbm_thread *thread_data, void *address, cc_type type, int *s
   uint8_t *write_p = thread_data->active_trace.write_p;
   unsigned long thumb = (unsigned long)address & THUMB;
   int trace_id = thread_data->active_trace.id++;
+  thread_data->cc->cc_regions[trace_id_region(trace_id)].trace_id = thread_data->active_trace.id;
   if (set_trace_id != NULL) {
     *set_trace_id = trace_id;
   }
 
   debug("Trace scan: %p to %p, id %d\n", address, write_p, trace_id);
 
-  thread_data->code_cache_meta[trace_id].source_addr = address;
-  thread_data->code_cache_meta[trace_id].tpc = (uintptr_t)write_p;
+  thread_data->cc->code_cache_meta[trace_id].linked_from = NULL;
+  thread_data->cc->code_cache_meta[trace_id].no_linking = false;
+  thread_data->cc->code_cache_meta[trace_id].call_exit = false;
+  thread_data->cc->code_cache_meta[trace_id].trace_head = NO_TRACE_HEAD;
+  thread_data->cc->code_cache_meta[trace_id].trace_source_bb = -1;
+#ifdef DBM_TRACE_PEEPHOLE
+  thread_data->cc->code_cache_meta[trace_id].app_flags = false;
+#endif
+#ifdef DBM_IBTC
+  thread_data->cc->code_cache_meta[trace_id].ibtc = NULL;
+#endif
+#if defined(__aarch64__) && defined(DBM_TB_DIRECT)
+  thread_data->cc->code_cache_meta[trace_id].jt_slots = NULL;
+#endif
+#ifdef DBM_SMC_WRITE_PROTECT
+  thread_data->cc->code_cache_meta[trace_id].smc_checked = false;
+  thread_data->cc->code_cache_meta[trace_id].smc_size = 0;
+#endif
+#ifdef DBM_PROFILE
+  thread_data->cc->profile_count[trace_id] = 0;
+  thread_data->cc->profile_exit_count[trace_id - TRACE_ID_BASE] = 0;
+#endif
+  thread_data->cc->code_cache_meta[trace_id].source_addr = address;
+  thread_data->cc->code_cache_meta[trace_id].tpc = (uintptr_t)write_p;
 
 #ifdef __arm__
   if (thumb) {
@@ -118,51 +230,375 @@ uint32_t scan_trace(dbm_thread *thread_data, void *address, cc_type type, int *s
   return fragment_len;
 }
 
-void install_trace(dbm_thread *thread_data) {
+/* Replaces the first instruction of the trace head counter code of a basic
+   block with a branch over it, or restores it */
+void trace_head_set(dbm_thread *thread_data, int bb, bool enable) {
+  dbm_code_cache_meta *bb_meta = &thread_data->cc->code_cache_meta[bb];
+#ifdef __arm__
+  uintptr_t thumb = (uintptr_t)bb_meta->source_addr & THUMB;
+  void *write_p = (void *)adjust_cc_entry(bb_meta->tpc | thumb);
+  if (thumb) {
+    uint16_t *p = (uint16_t *)write_p;
+    if (enable) {
+      thumb_sub_sp_i16(&p, 2);
+    } else {
+      thumb_b16(&p, ((THUMB_TRACE_HEAD_SIZE - 4) >> 1) & 0x7FF);
+    }
+  } else {
+    uint32_t *p = (uint32_t *)write_p;
+    if (enable) {
+      arm_sub(&p, IMM_PROC, 0, sp, sp, 8);
+    } else {
+      arm_b32_helper(p, (uintptr_t)p + ARM_TRACE_HEAD_SIZE, AL);
+    }
+  }
+  __clear_cache(write_p, write_p + 4);
+#elif __aarch64__
+  uint32_t *write_p = (uint32_t *)bb_meta->tpc + 1; // after POP X0, X1
+  if (enable) {
+    a64_push_pair_reg(x0, x1);
+    write_p--;
+  } else {
+    a64_b_helper(write_p, (uintptr_t)write_p + A64_TRACE_HEAD_SIZE);
+  }
+  __clear_cache(write_p, write_p + 1);
+#endif
+  bb_meta->trace_head = enable ? TRACE_HEAD_COUNTING : TRACE_HEAD_DISABLED;
+}
+
+/* NET style trace head selection: a hot block is recorded if it's the target of one
+   of the direct branches linked to it that matches the enabled TRACE_HEAD_* types */
+static bool trace_head_selected(dbm_thread *thread_data, int bb) {
+  int heads = global_data.traces.heads;
+  uintptr_t spc = (uintptr_t)thread_data->cc->code_cache_meta[bb].source_addr;
+
+  if (heads & TRACE_HEAD_ANY) return true;
+
+  for (ll_entry *link = thread_data->cc->code_cache_meta[bb].linked_from; link != NULL; link = link->next) {
+    int source = addr_to_fragment_id(thread_data, link->data & ~3);
+    if (source < 0) continue;
+    dbm_code_cache_meta *source_meta = &thread_data->cc->code_cache_meta[source];
+
+    if ((heads & TRACE_HEAD_EXIT) && source >= TRACE_ID_BASE) return true;
+    if ((heads & TRACE_HEAD_BACKWARD) && (uintptr_t)source_meta->source_addr >= spc) return true;
+    if ((heads & TRACE_HEAD_CALL) && source_meta->call_exit && source_meta->branch_taken_addr == spc) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#ifdef DBM_TRACE_PEEPHOLE
+/* Peephole pass over the boundaries between the fragments of a trace.
+
+   The instrumentation at the end of a fragment often restores the registers and
+   flags which the instrumentation at the start of the next fragment saves again.
+   Restores before the boundary are matched with saves after it in mirrored order:
+   a pop with a push of the same registers and a flags restore (MSR) with a flags
+   save (MRS) to the same register. The matched pops are replaced with loads which
+   don't update the stack pointer and the matched pushes and flags saves with NOPs.
+   This assumes that the saved flags are only used to restore them, so flags
+   accesses aren't matched in fragments which copy such instructions of the
+   application, see app_flags.
+
+   At a conditional trace exit, the flags restores are kept. Boundaries where pops
+   would have to be matched are skipped, because the exit path would have to
+   release the stack space and signals.c relinks exits with their original layout.
+   Thumb fragments are not handled, the instruction boundaries can't be found by
+   decoding backwards. */
+#define PEEPHOLE_MAX_OPS 8
+
+enum peephole_op {
+  PH_OTHER,
+  PH_POP,
+  PH_PUSH,
+  PH_FLAGS_RESTORE,
+  PH_FLAGS_SAVE,
+};
+
+typedef struct {
+  enum peephole_op op;
+  uint32_t regs;
+  int size;
+} peephole_inst;
+
+/* For A64, regs is the Rt2:Rt field of LDP/STP, or PH_SINGLE | Rt for LDR/STR */
+#define PH_SINGLE (1U << 31)
+
+static void peephole_decode(uint32_t inst, peephole_inst *d) {
+  d->op = PH_OTHER;
+  d->size = 0;
+#ifdef __arm__
+  if ((inst & 0xFFFF0000) == 0xE8BD0000 || (inst & 0xFFFF0000) == 0xE92D0000) {
+    // LDMIA SP!, {regs} / STMDB SP!, {regs}
+    d->regs = inst & 0xFFFF;
+    if (d->regs == 0 || (d->regs & ((1 << sp) | (1 << pc)))) return;
+    d->op = (inst & (1 << 20)) ? PH_POP : PH_PUSH;
+    d->size = count_bits(d->regs) * 4;
+  } else if ((inst & 0xFFFF0FFF) == 0xE49D0004 || (inst & 0xFFFF0FFF) == 0xE52D0004) {
+    // LDR Rt, [SP], #4 / STR Rt, [SP, #-4]!
+    if (((inst >> 12) & 0xF) >= sp) return;
+    d->regs = 1 << ((inst >> 12) & 0xF);
+    d->op = (inst & (1 << 20)) ? PH_POP : PH_PUSH;
+    d->size = 4;
+  } else if ((inst & 0xFFF0FFF0) == 0xE120F000) {
+    // MSR CPSR_<fields>, Rn
+    d->regs = inst & 0xF;
+    d->op = PH_FLAGS_RESTORE;
+  } else if ((inst & 0xFFFF0FFF) == 0xE10F0000) {
+    // MRS Rd, CPSR
+    d->regs = (inst >> 12) & 0xF;
+    d->op = PH_FLAGS_SAVE;
+  }
+#elif __aarch64__
+  if ((inst & 0xFFFF83E0) == 0xA8C103E0 || (inst & 0xFFFF83E0) == 0xA9BF03E0) {
+    // LDP Xt, Xt2, [SP], #16 / STP Xt, Xt2, [SP, #-16]!
+    d->regs = inst & 0x7C1F;
+    d->op = (inst & (1 << 22)) ? PH_POP : PH_PUSH;
+    d->size = 16;
+  } else if ((inst & 0xFFFFFFE0) == 0xF84107E0 || (inst & 0xFFFFFFE0) == 0xF81F0FE0) {
+    // LDR Xt, [SP], #16 / STR Xt, [SP, #-16]!
+    d->regs = PH_SINGLE | (inst & 0x1F);
+    d->op = (inst & (1 << 22)) ? PH_POP : PH_PUSH;
+    d->size = 16;
+  } else if ((inst & 0xFFFFFFE0) == 0xD51B4200) {
+    // MSR NZCV, Xt
+    d->regs = inst & 0x1F;
+    d->op = PH_FLAGS_RESTORE;
+  } else if ((inst & 0xFFFFFFE0) == 0xD53B4200) {
+    // MRS Xt, NZCV
+    d->regs = inst & 0x1F;
+    d->op = PH_FLAGS_SAVE;
+  }
+#endif
+}
+
+static bool peephole_match(peephole_inst *restore, peephole_inst *save, bool flags) {
+  if (!flags && restore->op == PH_FLAGS_RESTORE) return false;
+  return restore->regs == save->regs &&
+         ((restore->op == PH_POP && save->op == PH_PUSH) ||
+          (restore->op == PH_FLAGS_RESTORE && save->op == PH_FLAGS_SAVE));
+}
+
+/* Encodes a load of the registers of a pop from SP + offset, without updating SP.
+   Returns false if the offset can't be encoded, in which case nothing is written. */
+static bool peephole_load(uint32_t *write_p, peephole_inst *pop, int offset, bool write) {
+#ifdef __arm__
+  if (offset == 0 || offset == 4) {
+    // LDMIA / LDMIB SP, {regs}
+    if (write) arm_ldm(&write_p, sp, pop->regs, offset == 4, 1, 0, 0);
+    return true;
+  }
+  if (count_bits(pop->regs) == 1 && offset < 4096) {
+    // LDR Rt, [SP, #offset]
+    if (write) arm_ldr(&write_p, IMM_LDR, __builtin_ctz(pop->regs), sp, offset, 1, 1, 0);
+    return true;
+  }
+#elif __aarch64__
+  if (pop->regs & PH_SINGLE) {
+    if (write) a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, offset >> 3, sp, pop->regs & 0x1F);
+    return true;
+  }
+  if ((offset >> 3) <= 63) {
+    if (write) a64_LDP_STP(&write_p, 2, 0, 2, 1, offset >> 3, (pop->regs >> 10) & 0x1F, sp, pop->regs & 0x1F);
+    return true;
+  }
+#endif
+  return false;
+}
+
+/* Matches the restores ending at end with the saves starting at next and checks
+   that the matched pops can be replaced with loads. Flags accesses are only matched
+   if flags is true. Returns the number of matched pairs and sets *popped to the
+   stack space they use */
+static int peephole_match_boundary(uint32_t *start, uint32_t *end, uint32_t *next, uint32_t *limit,
+                                   bool flags, peephole_inst *restores, peephole_inst *saves,
+                                   int *popped) {
+  int count = 0;
+  while (count < PEEPHOLE_MAX_OPS && end - count > start && next + count < limit) {
+    peephole_decode(end[-count - 1], &restores[count]);
+    peephole_decode(next[count], &saves[count]);
+    if (!peephole_match(&restores[count], &saves[count], flags)) break;
+    count++;
+  }
+
+  // restores[0] is the last restore, the offsets of the loads depend on the outer pops
+  for (; count > 0; count--) {
+    int offset = 0;
+    bool ok = true;
+    for (int i = count - 1; i >= 0 && ok; i--) {
+      if (restores[i].op == PH_POP) {
+        ok = peephole_load(NULL, &restores[i], offset, false);
+        offset += restores[i].size;
+      }
+    }
+    if (ok) {
+      *popped = offset;
+      return count;
+    }
+  }
+
+  *popped = 0;
+  return 0;
+}
+
+static int peephole_rewrite(uint32_t *end, uint32_t *next, peephole_inst *restores, int count, bool cond_exit) {
+  int offset = 0;
+  for (int i = count - 1; i >= 0; i--) {
+    uint32_t *write_p = &end[-i - 1];
+    if (restores[i].op == PH_POP) {
+      peephole_load(write_p, &restores[i], offset, true);
+      offset += restores[i].size;
+    } else if (!cond_exit) {
+      // The flags are restored by the instrumentation which saved them
+#ifdef __arm__
+      arm_nop(&write_p);
+#elif __aarch64__
+      *write_p = NOP;
+#endif
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    uint32_t *write_p = &next[i];
+#ifdef __arm__
+    arm_nop(&write_p);
+#elif __aarch64__
+    *write_p = NOP;
+#endif
+  }
+  return offset;
+}
+
+static int trace_peephole_boundary(dbm_thread *thread_data, int fragment) {
+  dbm_code_cache_meta *meta = &thread_data->cc->code_cache_meta[fragment];
+  dbm_code_cache_meta *next_meta = &thread_data->cc->code_cache_meta[fragment + 1];
+  peephole_inst restores[PEEPHOLE_MAX_OPS];
+  peephole_inst saves[PEEPHOLE_MAX_OPS];
+  uint32_t *start = (uint32_t *)meta->tpc;
+  uint32_t *end = (uint32_t *)meta->exit_branch_addr;
+  uint32_t *next = (uint32_t *)next_meta->tpc;
+  uint32_t *limit = (uint32_t *)thread_data->active_trace.write_p;
+  bool flags = !meta->app_flags && !next_meta->app_flags;
+  int count, popped;
+  bool cond_exit;
+
+#ifdef __arm__
+  if (((uintptr_t)meta->source_addr & THUMB) || ((uintptr_t)next_meta->source_addr & THUMB)) return 0;
+#endif
+
+  switch (meta->exit_branch_type) {
+#ifdef __arm__
+    case uncond_imm_arm:
+#elif __aarch64__
+    case uncond_imm_a64:
+#endif
+      if (next != end) return 0;
+      cond_exit = false;
+      break;
+#ifdef __arm__
+    // B<c> exit
+    case cond_imm_arm:
+      if (next != end + 1 || (*end & 0x0F000000) != 0x0A000000) return 0;
+      cond_exit = true;
+      break;
+#elif __aarch64__
+    // B.cond / CB(N)Z / TB(N)Z over the B exit
+    case cond_imm_a64:
+    case cbz_a64:
+    case tbz_a64:
+      if (next != end + 2) return 0;
+      cond_exit = true;
+      break;
+#endif
+    default:
+      return 0;
+  }
+
+  count = peephole_match_boundary(start, end, next, limit, flags, restores, saves, &popped);
+  // The pops of a conditional exit would have to be undone on its exit path
+  if (count == 0 || (cond_exit && popped > 0)) return 0;
+
+  peephole_rewrite(end, next, restores, count, cond_exit);
+
+  return count;
+}
+
+static void trace_peephole(dbm_thread *thread_data, enum trace_end reason) {
+  int first = thread_data->cc->trace_id;
+  int last = thread_data->active_trace.id - 1;
+  int removed = 0;
+
+  /* The thread resumes at the start of the last fragment of a trace ended by an
+     indirect branch, after it executed the restores at the end of the previous one */
+  if (reason == TRACE_END_INDIRECT) {
+    last--;
+  }
+
+  for (int fragment = first; fragment < last; fragment++) {
+    removed += trace_peephole_boundary(thread_data, fragment);
+  }
+
+  if (removed > 0) {
+    __clear_cache((void *)thread_data->cc->code_cache_meta[first].tpc, thread_data->active_trace.write_p);
+    atomic_increment_u32(&global_data.trace_stats.peephole_pairs, removed);
+  }
+}
+#endif // DBM_TRACE_PEEPHOLE
+
+void install_trace(dbm_thread *thread_data, enum trace_end reason) {
   ll_entry *cc_link;
-  uintptr_t orig_branch;
   int bb_source = thread_data->active_trace.source_bb;
-  uintptr_t spc = (uintptr_t)thread_data->code_cache_meta[bb_source].source_addr;
+  uintptr_t spc = (uintptr_t)thread_data->cc->code_cache_meta[bb_source].source_addr;
   uintptr_t tpc = thread_data->active_trace.entry_addr;
-  uintptr_t tpc_direct = adjust_cc_entry(tpc);
   assert(thread_data->active_trace.active);
   thread_data->active_trace.active = false;
+#ifdef DBM_SHARED_CC
+  thread_data->cc->trace_builder = NULL;
+#endif
 
-  cc_link = thread_data->code_cache_meta[bb_source].linked_from;
-  while(cc_link != NULL) {
-    debug("Link from: 0x%lx, update to: 0x%lx\n", cc_link->data, tpc);
-    orig_branch = cc_link->data;
-#ifdef __arm__
-    orig_branch &= 0xFFFFFFFE;
-    if (cc_link->data & THUMB) {
-      thumb_adjust_b_bl_target(thread_data, (uint16_t *)orig_branch, tpc_direct);
-    } else if ((cc_link->data & 3) == FULLADDR) {
-      *(uint32_t *)(orig_branch & (~FULLADDR)) = tpc_direct;
-    } else {
-      arm_adjust_b_bl_target((uintptr_t *)orig_branch, tpc_direct);
-    }
-#elif __aarch64__
-    a64_b_helper((uint32_t *)orig_branch, tpc + 4);
+#ifdef DBM_TRACE_PEEPHOLE
+  trace_peephole(thread_data, reason);
 #endif
-    cc_link = cc_link->next;
-    __clear_cache((void *)orig_branch, (void *)orig_branch + 4);
-  }
 
-  hash_add(&thread_data->trace_entry_address, spc, tpc);
-  hash_add(&thread_data->entry_address, spc, tpc);
+  hash_add(&thread_data->cc->trace_entry_address, spc, tpc);
+  hash_add(&thread_data->cc->entry_address, spc, tpc);
 
-  thread_data->trace_id = thread_data->active_trace.id;
-  thread_data->trace_cache_next = thread_data->active_trace.write_p;
+  thread_data->cc->trace_id = thread_data->active_trace.id;
+  thread_data->cc->trace_cache_next = thread_data->active_trace.write_p;
+  thread_data->cc->cc_regions[trace_id_region(thread_data->cc->trace_id - 1)].trace_id = thread_data->cc->trace_id;
+
+  // Move the links to the source basic block to the trace
+  cc_link = thread_data->cc->code_cache_meta[bb_source].linked_from;
+  thread_data->cc->code_cache_meta[bb_source].linked_from = NULL;
+  cc_move_links(thread_data, cc_link, tpc);
+#ifdef DBM_RAS
+  ras_retarget(thread_data, thread_data->cc->code_cache_meta[bb_source].tpc | (spc & THUMB), tpc);
+#endif
 
   // Record the trace exits
   for (int i = 0; i < thread_data->active_trace.free_exit_rec; i++) {
     record_cc_link(thread_data, thread_data->active_trace.exits[i].from,
                    thread_data->active_trace.exits[i].to);
+
+    // Previously rejected trace heads become eligible again as targets of trace exits
+    if (global_data.traces.heads & TRACE_HEAD_EXIT) {
+      int bb = addr_to_bb_id(thread_data, thread_data->active_trace.exits[i].to);
+      if (bb >= 0 && thread_data->cc->code_cache_meta[bb].trace_head == TRACE_HEAD_DISABLED) {
+        trace_head_set(thread_data, bb, true);
+      }
+    }
   }
 
-  /* Add traps to the source basic block to detect if it remains reachable */
+  atomic_increment_u32(&global_data.trace_stats.ended[reason], 1);
+  atomic_increment_u32(&global_data.trace_stats.fragments, thread_data->trace_fragment_count);
+  // The trace head counter is overwritten below
+  thread_data->cc->code_cache_meta[bb_source].trace_head = NO_TRACE_HEAD;
+
+  /* Add traps to the source basic block to detect if it remains reachable. The
+     first instruction of the trace head counter is replaced, see cc_flush_traces */
 #ifdef __arm__
-  void *write_p = (void *)adjust_cc_entry(thread_data->code_cache_meta[bb_source].tpc);
+  void *write_p = (void *)adjust_cc_entry(thread_data->cc->code_cache_meta[bb_source].tpc | (spc & THUMB));
   if (spc & THUMB) {
     thumb_bkpt16((uint16_t **)&write_p, 0);
   } else {
@@ -170,7 +606,7 @@ void install_trace(dbm_thread *thread_data) {
   }
   __clear_cache(write_p, write_p + 4);
 #elif __aarch64__
-  uint32_t *write_p = (uint32_t*)thread_data->code_cache_meta[bb_source].tpc;
+  uint32_t *write_p = (uint32_t*)thread_data->cc->code_cache_meta[bb_source].tpc;
   write_p++; // Jumps the first instruction (POP X0, X1)
   a64_BRK(&write_p, 0); // BRK trap
   __clear_cache(write_p, write_p + 1);
@@ -205,28 +641,34 @@ void arm_trace_exit_branch(dbm_thread *thread_data, uint32_t *write_p, uint32_t
 
 #ifdef __aarch64__
 void generate_trace_exit(dbm_thread *thread_data, uint32_t **o_write_p, int fragment_id, bool is_taken) {
-  dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment_id];
+  dbm_code_cache_meta *bb_meta = &thread_data->cc->code_cache_meta[fragment_id];
   uint32_t *write_p = *o_write_p;
+  uint32_t *cond_p = write_p++;
+
+#ifdef DBM_PROFILE
+  a64_profile_count(&write_p, &thread_data->cc->profile_exit_count[fragment_id - TRACE_ID_BASE]);
+#endif
+  // Skips the side exit
+  int skip = write_p - cond_p + 1;
 
   switch (bb_meta->exit_branch_type) {
     case cbz_a64:
-      a64_CBZ_CBNZ(&write_p, bb_meta->rn >> 5,
+      a64_CBZ_CBNZ(&cond_p, bb_meta->rn >> 5,
                    is_taken ? (bb_meta->branch_condition) : (bb_meta->branch_condition ^ 1),
-                   2, bb_meta->rn);
+                   skip, bb_meta->rn);
       break;
     case cond_imm_a64:
-      a64_B_cond(&write_p, 2, is_taken ? bb_meta->branch_condition : (bb_meta->branch_condition ^ 1));
+      a64_B_cond(&cond_p, skip, is_taken ? bb_meta->branch_condition : (bb_meta->branch_condition ^ 1));
       break;
     case tbz_a64:
-      a64_TBZ_TBNZ(&write_p, bb_meta->rn >> 10,
+      a64_TBZ_TBNZ(&cond_p, bb_meta->rn >> 10,
                    is_taken ? (bb_meta->branch_condition) : (bb_meta->branch_condition ^ 1),
-                   bb_meta->rn >> 5, 2, bb_meta->rn);
+                   bb_meta->rn >> 5, skip, bb_meta->rn);
       break;
     default:
       fprintf(stderr, "Unknown branch type\n");
       while(1);
   }
-  write_p++;
 
   uintptr_t addr = is_taken ? bb_meta->branch_skipped_addr : bb_meta->branch_taken_addr;
   uintptr_t tpc = active_trace_lookup_or_scan(thread_data, addr) + 4;
@@ -240,8 +682,56 @@ void generate_trace_exit(dbm_thread *thread_data, uint32_t **o_write_p, int frag
 #endif
 #endif
 
+/* Called when the last scanned fragment of the active trace ends with an indirect
+   branch. If the branch has a dominant target, the trace is left open and it's
+   extended along that target when the branch is taken, see trace_indirect_extend.
+   Otherwise the trace is installed. */
+static void trace_end_indirect(dbm_thread *thread_data, int fragment_id) {
+#ifdef DBM_TRACE_INDIRECT
+  dbm_code_cache_meta *bb_meta = &thread_data->cc->code_cache_meta[fragment_id];
+  uintptr_t tpc;
+  int profile_id;
+
+  /* The dominant target is the target cached by the basic block (or trace)
+     translating the same code, if it's the only one it has seen */
+  tpc = hash_lookup(&thread_data->cc->entry_address, (uintptr_t)bb_meta->source_addr);
+  profile_id = (tpc != UINT_MAX) ? addr_to_fragment_id(thread_data, tpc & ~THUMB) : -1;
+  if (bb_meta->ibtc != NULL && profile_id >= 0) {
+    dbm_code_cache_meta *profile = &thread_data->cc->code_cache_meta[profile_id];
+    if (profile->ibtc != NULL && profile->free_b == 1 && !profile->no_linking) {
+      thread_data->active_trace.indirect_target = profile->ibtc_spc;
+      return;
+    }
+  }
+#endif
+  install_trace(thread_data, TRACE_END_INDIRECT);
+}
+
+#ifdef DBM_TRACE_INDIRECT
+/* Called by the trace dispatcher when an indirect branch of a trace fragment misses
+   its inline target cache. If the fragment is the last one of the active trace and
+   the target is the dominant one, the first slot of the cache is set to branch to
+   the next fragment, which the caller scans at the end of the trace. Otherwise the
+   trace is installed, if it's still open. Returns true if the trace is extended. */
+static bool trace_indirect_extend(dbm_thread *thread_data, int fragment_id, uintptr_t target) {
+  if (!thread_data->active_trace.active || fragment_id != thread_data->active_trace.id - 1) {
+    return false;
+  }
+
+  if (target == thread_data->active_trace.indirect_target &&
+      ibtc_add_fragment(thread_data, fragment_id, target,
+                        (uintptr_t)thread_data->active_trace.write_p | (target & THUMB))) {
+    thread_data->active_trace.indirect_target = 0;
+    atomic_increment_u32(&global_data.trace_stats.indirect_extended, 1);
+    return true;
+  }
+
+  install_trace(thread_data, TRACE_END_INDIRECT);
+  return false;
+}
+#endif
+
 /* This is called from trace_head_incr, which is called by trace heads */
-int hot_bb_cnt = 0;
 void create_trace(dbm_thread *thread_data, uint32_t bb_source, cc_addr_pair *ret_addr) {
 #ifdef DBM_TRACES
   uint16_t *source_addr;
@@ -252,60 +742,107 @@ void create_trace(dbm_thread *thread_data, uint32_t bb_source, cc_addr_pair *ret
   uintptr_t trace_entry;
 
 #ifdef __arm__
-  uint16_t *bb_addr = (uint16_t *)&thread_data->code_cache->blocks[bb_source];
   bool is_thumb;
 #endif
-#ifdef __aarch64__
-  uint32_t  *bb_addr = (uint32_t *)&thread_data->code_cache->blocks[bb_source];
-#endif
 
+  cc_lock(thread_data);
   thread_data->trace_fragment_count = 0;
+
+  atomic_increment_u32(&global_data.trace_stats.hot_heads, 1);
+  if (!trace_head_selected(thread_data, bb_source)) {
+    atomic_increment_u32(&global_data.trace_stats.rejected_heads, 1);
+    trace_head_set(thread_data, bb_source, false);
+    ret_addr->spc = (uintptr_t)thread_data->cc->code_cache_meta[bb_source].source_addr;
+    ret_addr->tpc = cc_lookup(thread_data, ret_addr->spc);
+    cc_unlock(thread_data);
+    return;
+  }
 #ifdef __arm__
-  if (thread_data->code_cache_meta[bb_source].exit_branch_type == cbz_thumb ||
-      thread_data->code_cache_meta[bb_source].exit_branch_type == cond_imm_thumb ||
-      thread_data->code_cache_meta[bb_source].exit_branch_type == uncond_imm_thumb ||
-      thread_data->code_cache_meta[bb_source].exit_branch_type == uncond_b_to_bl_thumb ||
-      thread_data->code_cache_meta[bb_source].exit_branch_type == tb_indirect ||
-      thread_data->code_cache_meta[bb_source].exit_branch_type == uncond_reg_thumb ||
-      thread_data->code_cache_meta[bb_source].exit_branch_type == cond_imm_arm ||
-      thread_data->code_cache_meta[bb_source].exit_branch_type == uncond_imm_arm ||
-      thread_data->code_cache_meta[bb_source].exit_branch_type == uncond_reg_arm) {
+  if (thread_data->cc->code_cache_meta[bb_source].exit_branch_type == cbz_thumb ||
+      thread_data->cc->code_cache_meta[bb_source].exit_branch_type == cond_imm_thumb ||
+      thread_data->cc->code_cache_meta[bb_source].exit_branch_type == uncond_imm_thumb ||
+      thread_data->cc->code_cache_meta[bb_source].exit_branch_type == uncond_b_to_bl_thumb ||
+      thread_data->cc->code_cache_meta[bb_source].exit_branch_type == tb_indirect ||
+      thread_data->cc->code_cache_meta[bb_source].exit_branch_type == uncond_reg_thumb ||
+      thread_data->cc->code_cache_meta[bb_source].exit_branch_type == cond_imm_arm ||
+      thread_data->cc->code_cache_meta[bb_source].exit_branch_type == uncond_imm_arm ||
+      thread_data->cc->code_cache_meta[bb_source].exit_branch_type == uncond_reg_arm) {
 #endif
 #ifdef __aarch64__
-  if (thread_data->code_cache_meta[bb_source].exit_branch_type == cbz_a64
-      || thread_data->code_cache_meta[bb_source].exit_branch_type == tbz_a64
-      || thread_data->code_cache_meta[bb_source].exit_branch_type == cond_imm_a64
-      || thread_data->code_cache_meta[bb_source].exit_branch_type == uncond_imm_a64) {
+  if (thread_data->cc->code_cache_meta[bb_source].exit_branch_type == cbz_a64
+      || thread_data->cc->code_cache_meta[bb_source].exit_branch_type == tbz_a64
+      || thread_data->cc->code_cache_meta[bb_source].exit_branch_type == cond_imm_a64
+      || thread_data->cc->code_cache_meta[bb_source].exit_branch_type == uncond_imm_a64) {
 #endif
-    source_addr = thread_data->code_cache_meta[bb_source].source_addr;
+    source_addr = thread_data->cc->code_cache_meta[bb_source].source_addr;
     ret_addr->spc = (uintptr_t)source_addr;
 #ifdef __arm__
     is_thumb = (uintptr_t)source_addr & THUMB;
 #endif
 
+#ifdef DBM_SHARED_CC
+    // Only one trace is recorded at a time and another thread might have already built this one
+    if (thread_data->cc->trace_builder != NULL && thread_data->cc->trace_builder != thread_data) {
+      cc_unlock(thread_data);
+      return;
+    }
+    trace_entry = hash_lookup(&thread_data->cc->trace_entry_address, (uintptr_t)source_addr);
+    if (trace_entry != UINT_MAX) {
+      ret_addr->tpc = adjust_cc_entry(trace_entry);
+      cc_unlock(thread_data);
+      return;
+    }
+#endif
+
+    thread_data->was_flushed = false;
+    if (thread_data->cc->cc_evict_pending) {
+      cc_next_region(thread_data, true);
+    }
+
+    /* Keep the traces in the same region as the basic blocks, so that
+       the trampolines are in range */
+    if (trace_id_region(thread_data->cc->trace_id) != thread_data->cc->cc_region) {
+      cc_select_trace_region(thread_data, thread_data->cc->cc_region);
+    }
+
     /* Alignment doesn't seem to make much of a difference */
-    thread_data->trace_cache_next += (TRACE_ALIGN -
-                                     ((uintptr_t)thread_data->trace_cache_next & TRACE_ALIGN_MASK))
+    thread_data->cc->trace_cache_next += (TRACE_ALIGN -
+                                     ((uintptr_t)thread_data->cc->trace_cache_next & TRACE_ALIGN_MASK))
                                      & TRACE_ALIGN_MASK;
-    if ((uintptr_t)thread_data->trace_cache_next >= (uintptr_t)thread_data->code_cache + MAX_BRANCH_RANGE - TRACE_LIMIT_OFFSET) {
-      fprintf(stderr, "trace cache full, flushing the CC\n");
-      flush_code_cache(thread_data);
+    if ((uintptr_t)thread_data->cc->trace_cache_next >=
+        (uintptr_t)trace_cache_end(&thread_data->cc->code_cache[thread_data->cc->cc_region]) - TRACE_LIMIT_OFFSET) {
+#ifdef DBM_SHARED_CC
+      // Other threads could be executing the traces
+      cc_next_region(thread_data, true);
+      cc_select_trace_region(thread_data, thread_data->cc->cc_region);
+#else
+      cc_flush_traces(thread_data, thread_data->cc->cc_region);
+#endif
+    }
+
+    // The trace head might have been evicted
+    if (thread_data->was_flushed) {
       ret_addr->tpc = lookup_or_scan(thread_data, (uintptr_t)source_addr, NULL);
+      cc_unlock(thread_data);
       return;
     }
 
     debug("bb: %d, source: %p, ret to: 0x%x\n", bb_source, source_addr, ret_addr->tpc);
-    hot_bb_cnt++;
+    atomic_increment_u32(&global_data.trace_stats.started, 1);
 
-    trace_entry = (uintptr_t)thread_data->trace_cache_next;
+    trace_entry = (uintptr_t)thread_data->cc->trace_cache_next;
     trace_entry |= ((uintptr_t)source_addr) & THUMB;
 
     thread_data->active_trace.active = true;
-    thread_data->active_trace.id = thread_data->trace_id;
+#ifdef DBM_SHARED_CC
+    thread_data->cc->trace_builder = thread_data;
+#endif
+    thread_data->active_trace.id = thread_data->cc->trace_id;
     thread_data->active_trace.source_bb = bb_source;
-    thread_data->active_trace.write_p = thread_data->trace_cache_next;
+    thread_data->active_trace.write_p = thread_data->cc->trace_cache_next;
     thread_data->active_trace.entry_addr = trace_entry;
     thread_data->active_trace.free_exit_rec = 0;
+    thread_data->active_trace.indirect_target = 0;
 
     debug("Create trace: %d (%p), source_bb: %d, entry: %lx\n",
           thread_data->active_trace.id, thread_data->active_trace.write_p,
@@ -314,19 +851,23 @@ void create_trace(dbm_thread *thread_data, uint32_t bb_source, cc_addr_pair *ret
 
     ret_addr->tpc = adjust_cc_entry(trace_entry);
     fragment_len = scan_trace(thread_data, source_addr, mambo_trace_entry, &trace_id);
+    thread_data->cc->code_cache_meta[trace_id].trace_source_bb = bb_source;
     debug("len: %d\n\n", fragment_len);
 
     // this could be used to detect bugs if first fragment is unlinkable
-    switch(thread_data->code_cache_meta[trace_id].exit_branch_type) {
+    switch(thread_data->cc->code_cache_meta[trace_id].exit_branch_type) {
 #ifdef __arm__
       case uncond_reg_thumb:
+      case uncond_reg_arm:
+        thread_data->active_trace.write_p += fragment_len;
+        trace_end_indirect(thread_data, trace_id);
+        break;
       case cond_reg_thumb:
       case trace_inline_max:
       case tbb:
       case tbh:
-      case uncond_reg_arm:
         thread_data->active_trace.write_p += fragment_len;
-        install_trace(thread_data);
+        install_trace(thread_data, TRACE_END_INDIRECT);
         break;
 #endif
 #ifdef __aarch64__
@@ -338,18 +879,19 @@ void create_trace(dbm_thread *thread_data, uint32_t bb_source, cc_addr_pair *ret
         break;
       default:
         fprintf(stderr, "Disallowed type of exit in the first trace fragment: %d\n",
-                thread_data->code_cache_meta[trace_id].exit_branch_type);
+                thread_data->cc->code_cache_meta[trace_id].exit_branch_type);
         while(1);
 #endif
     }
   } else {
-    fprintf(stderr, "\nUnknown exit branch type in trace head: %d\n", thread_data->code_cache_meta[bb_source].exit_branch_type);
+    fprintf(stderr, "\nUnknown exit branch type in trace head: %d\n", thread_data->cc->code_cache_meta[bb_source].exit_branch_type);
     while(1);
   }
+  cc_unlock(thread_data);
 }
 
 void early_trace_exit(dbm_thread *thread_data, dbm_code_cache_meta* bb_meta,
-                      void *write_p, uintptr_t spc, uintptr_t tpc) {
+                      void *write_p, uintptr_t spc, uintptr_t tpc, enum trace_end reason) {
 #ifdef __arm__
   if (spc & THUMB) {
     thumb_cc_branch(thread_data, (uint16_t *)write_p, tpc);
@@ -363,7 +905,7 @@ void early_trace_exit(dbm_thread *thread_data, dbm_code_cache_meta* bb_meta,
   __clear_cache(write_p, write_p+4);
   write_p += 4;
   thread_data->active_trace.write_p = (uint8_t *)write_p;
-  install_trace(thread_data);
+  install_trace(thread_data, reason);
 
   bb_meta->branch_cache_status |= BOTH_LINKED;
 }
@@ -371,7 +913,7 @@ void early_trace_exit(dbm_thread *thread_data, dbm_code_cache_meta* bb_meta,
 /* Handles dispatcher calls from traces */
 void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_index, dbm_thread *thread_data) {
   uintptr_t addr;
-  dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[source_index];
+  dbm_code_cache_meta *bb_meta = &thread_data->cc->code_cache_meta[source_index];
   bool is_taken = (bb_meta->branch_taken_addr == target);
 #ifdef __arm__
   uint16_t *write_p = (uint16_t *)bb_meta->exit_branch_addr;
@@ -380,26 +922,52 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
   uint32_t *write_p = (uint32_t *) bb_meta->exit_branch_addr;
 #endif
   size_t fragment_len;
-  thread_data->was_flushed = false;
 
   debug("Trace dispatcher (target: 0x%x)\n", target);
 
+  // The active trace is abandoned when a code cache region is evicted
+  if (thread_data->was_flushed) {
+    *next_addr = lookup_or_scan(thread_data, target, NULL);
+    return;
+  }
+
   switch(bb_meta->exit_branch_type) {
 #ifdef __arm__
-    case cbz_thumb:
-      thumb_misc_cbz_16(&write_p, (bb_meta->branch_skipped_addr == target) ? 1: 0, 0, 1, bb_meta->rn);
-      write_p++;
+    case cbz_thumb: {
+      uint16_t *cond_p = write_p++;
+#ifdef DBM_PROFILE
+      thumb_profile_count(&write_p, &thread_data->cc->profile_exit_count[source_index - TRACE_ID_BASE]);
+#endif
 
       addr = (bb_meta->branch_skipped_addr == target) ? bb_meta->branch_taken_addr : bb_meta->branch_skipped_addr;
       debug("other addr: %x %d\n", addr, bb_meta->branch_skipped_addr == target);
       thumb_trace_exit_branch(thread_data, write_p, active_trace_lookup_or_stub(thread_data, addr));
       write_p += 2;
-      __clear_cache(write_p - 4, write_p);
+
+      // CB(N)Z over the side exit
+      thumb_misc_cbz_16(&cond_p, (bb_meta->branch_skipped_addr == target) ? 1: 0, 0, write_p - cond_p - 2, bb_meta->rn);
+      __clear_cache((void *)bb_meta->exit_branch_addr, write_p);
 
       bb_meta->branch_cache_status = is_taken ? FALLTHROUGH_LINKED : BRANCH_LINKED;
 
       break;
+    }
     case cond_imm_thumb:
+#ifdef DBM_PROFILE
+    {
+      // B<c> over the exit counter and the side exit
+      uint16_t *cond_p = write_p++;
+      thumb_profile_count(&write_p, &thread_data->cc->profile_exit_count[source_index - TRACE_ID_BASE]);
+
+      addr = is_taken ? bb_meta->branch_skipped_addr : bb_meta->branch_taken_addr;
+      thumb_trace_exit_branch(thread_data, write_p, active_trace_lookup_or_stub(thread_data, addr));
+      write_p += 2;
+
+      thumb_b16_cond_helper(cond_p, (uint32_t)write_p,
+                            is_taken ? bb_meta->branch_condition : arm_inverse_cond_code[bb_meta->branch_condition]);
+      __clear_cache((void *)bb_meta->exit_branch_addr, write_p);
+    }
+#else
       thumb_it16(&write_p, (bb_meta->branch_taken_addr == target) ? arm_inverse_cond_code[bb_meta->branch_condition] : bb_meta->branch_condition, 0x8);
       write_p++;
 
@@ -408,6 +976,7 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
       thumb_trace_exit_branch(thread_data, write_p, active_trace_lookup_or_stub(thread_data, addr));
       write_p += 2;
       __clear_cache(write_p - 4, write_p);
+#endif
 
       bb_meta->branch_cache_status = is_taken ? FALLTHROUGH_LINKED : BRANCH_LINKED;
 
@@ -459,21 +1028,49 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
 
     /* This is a new target for an indirect branch from the trace cache, generate a trace head */
     case uncond_reg_thumb:
-    case tbh:
-    case tbb:
     case uncond_reg_arm:
+  #ifdef DBM_TRACE_INDIRECT
+      if (trace_indirect_extend(thread_data, source_index, target)) {
+        write_p = (uint16_t *)thread_data->active_trace.write_p;
+        break;
+      }
+  #endif
       *next_addr = lookup_or_scan(thread_data, target, NULL);
+  #ifdef DBM_IBTC
+      if (!thread_data->was_flushed) {
+        ibtc_add(thread_data, source_index, target, *next_addr);
+      }
+  #endif
       return;
 
-      break;
+    case tbh:
+    case tbb:
+      *next_addr = lookup_or_scan(thread_data, target, NULL);
+      return;
 
     case cond_imm_arm:
       addr = (bb_meta->branch_taken_addr == target) ? bb_meta->branch_skipped_addr : bb_meta->branch_taken_addr;
 
+#ifdef DBM_PROFILE
+    {
+      // B<c> over the exit counter and the side exit
+      uint32_t *cond_p = (uint32_t *)write_p;
+      write_p += 2;
+      arm_profile_count((uint32_t **)&write_p, &thread_data->cc->profile_exit_count[source_index - TRACE_ID_BASE]);
+
+      arm_trace_exit_branch(thread_data, (uint32_t *)write_p, active_trace_lookup_or_stub(thread_data, addr), AL);
+      write_p += 2;
+
+      arm_b32_helper(cond_p, (uint32_t)write_p,
+                     is_taken ? bb_meta->branch_condition : invert_cond(bb_meta->branch_condition));
+      __clear_cache((void *)bb_meta->exit_branch_addr, write_p);
+    }
+#else
       arm_trace_exit_branch(thread_data, (uint32_t *)write_p, active_trace_lookup_or_stub(thread_data, addr),
                             is_taken ? invert_cond(bb_meta->branch_condition) : bb_meta->branch_condition);
       write_p += 2;
       __clear_cache(write_p-4, write_p);
+#endif
 
       bb_meta->branch_cache_status = is_taken ? FALLTHROUGH_LINKED : BRANCH_LINKED;
 
@@ -485,14 +1082,30 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
     case cond_imm_a64:
     case tbz_a64:
       generate_trace_exit(thread_data, &write_p, source_index, is_taken);
-      __clear_cache(write_p - 2, write_p);
+      __clear_cache((void *)bb_meta->exit_branch_addr, write_p);
       bb_meta->branch_cache_status = is_taken ? FALLTHROUGH_LINKED : BRANCH_LINKED;
       break;
     case uncond_imm_a64:
       bb_meta->branch_cache_status = BRANCH_LINKED;
       break;
     case uncond_branch_reg:
+  #ifdef DBM_TRACE_INDIRECT
+      if (trace_indirect_extend(thread_data, source_index, target)) {
+        write_p = (uint32_t *)thread_data->active_trace.write_p;
+        break;
+      }
+  #endif
       *next_addr = lookup_or_scan(thread_data, target, NULL);
+  #ifdef DBM_TB_DIRECT
+      if (!thread_data->was_flushed && jump_table_add(thread_data, source_index, target, *next_addr)) {
+        return;
+      }
+  #endif
+  #ifdef DBM_IBTC
+      if (!thread_data->was_flushed) {
+        ibtc_add(thread_data, source_index, target, *next_addr);
+      }
+  #endif
       return;
       break;
 #endif
@@ -511,10 +1124,10 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
   }
 
   // Check if the fragment count has reached the max limit
-  if (thread_data->trace_fragment_count > MAX_TRACE_FRAGMENTS) {
+  if (thread_data->trace_fragment_count > global_data.traces.max_fragments) {
     debug("Trace fragment count limit, branch to: 0x%x, written at: %p\n", target, write_p);
     addr = active_trace_lookup_or_scan(thread_data, target);
-    early_trace_exit(thread_data, bb_meta, write_p, target, addr);
+    early_trace_exit(thread_data, bb_meta, write_p, target, addr, TRACE_END_LENGTH);
     *next_addr = addr;
     return;
   }
@@ -523,11 +1136,21 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
   addr = active_trace_lookup(thread_data, target);
   debug("Hash lookup for 0x%x: 0x%x\n", target, addr);
   if (addr != UINT_MAX) {
-    early_trace_exit(thread_data, bb_meta, write_p, target, addr);
+    early_trace_exit(thread_data, bb_meta, write_p, target, addr, TRACE_END_TRACE);
     *next_addr = addr;
     return;
   }
 
+#ifdef DBM_SMC_WRITE_PROTECT
+  // Code from pages which are written often isn't copied, the trace exits to its stub
+  if (smc_is_checked(thread_data, target)) {
+    addr = lookup_or_stub(thread_data, target);
+    early_trace_exit(thread_data, bb_meta, write_p, target, addr, TRACE_END_TRACE);
+    *next_addr = addr;
+    return;
+  }
+#endif
+
   debug("\n   Trace fragment: 0x%x\n", target);
   int fragment_id;
 #ifdef __arm__
@@ -539,21 +1162,25 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
   debug("len: %d\n\n", fragment_len);
 
   thread_data->active_trace.write_p += fragment_len;
-  switch(thread_data->code_cache_meta[fragment_id].exit_branch_type) {
+  switch(thread_data->cc->code_cache_meta[fragment_id].exit_branch_type) {
 #ifdef __arm__
     case uncond_reg_thumb:
-    case cond_reg_thumb:
     case uncond_reg_arm:
+#elif __aarch64__
+    case uncond_branch_reg:
+#endif
+      trace_end_indirect(thread_data, fragment_id);
+      break;
+#ifdef __arm__
+    case cond_reg_thumb:
     case cond_reg_arm:
     case tbb:
     case tbh:
     case tb_indirect:
     case trace_inline_max:
-#elif __aarch64__
-    case uncond_branch_reg:
-#endif
-      install_trace(thread_data);
+      install_trace(thread_data, TRACE_END_INDIRECT);
       break;
+#endif
   }
 
 #ifdef __aarch64__